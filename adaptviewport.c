@@ -5,10 +5,17 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include "headless.h"
+#include "progcache.h"
 
 int gl_width = 640;
 int gl_height = 480;
 
+void render(void);
+
+GLuint shader_program = 0; // shader program to set render pipeline
+GLuint vao = 0; // Vertext Array Object to set input data
+
 // Callback function to track window size and update viewport
 void glfw_window_size_callback(GLFWwindow* window, int width, int height) {
   gl_width = width;
@@ -16,30 +23,41 @@ void glfw_window_size_callback(GLFWwindow* window, int width, int height) {
   printf("New viewport: (width: %d, height: %d)\n", width, height);
 }
 
-int main() {
-  // start GL context and O/S window using the GLFW helper library
-  if (!glfwInit()) {
-    fprintf(stderr, "ERROR: could not start GLFW3\n");
+int main(int argc, char *argv[]) {
+  headless_t hl;
+  if (!headless_args(&hl, argc, argv))
     return 1;
-  }
 
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-  //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
-
-  GLFWwindow* window = glfwCreateWindow(gl_width, gl_height, "Adaptable Viewport", NULL, NULL);
-  if (!window) {
-    fprintf(stderr, "ERROR: could not open window with GLFW3\n");
-    glfwTerminate();
-    return 1;
+  GLFWwindow* window = NULL;
+  if (hl.frames) {
+    // start GL context on an offscreen framebuffer, no window at all
+    if (!headless_init(&hl, gl_width, gl_height))
+      return 1;
+  } else {
+    // start GL context and O/S window using the GLFW helper library
+    if (!glfwInit()) {
+      fprintf(stderr, "ERROR: could not start GLFW3\n");
+      return 1;
+    }
+
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+    window = glfwCreateWindow(gl_width, gl_height, "Adaptable Viewport", NULL, NULL);
+    if (!window) {
+      fprintf(stderr, "ERROR: could not open window with GLFW3\n");
+      glfwTerminate();
+      return 1;
+    }
+    glfwSetWindowSizeCallback(window, glfw_window_size_callback);
+    glfwMakeContextCurrent(window);
+
+    // start GLEW extension handler (headless_init() does it headless)
+    // glewExperimental = GL_TRUE;
+    glewInit();
   }
-  glfwSetWindowSizeCallback(window, glfw_window_size_callback);
-  glfwMakeContextCurrent(window);
-
-  // start GLEW extension handler
-  // glewExperimental = GL_TRUE;
-  glewInit();
 
   // get version info
   const GLubyte* vendor = glGetString(GL_VENDOR); // get vendor string
@@ -68,26 +86,10 @@ int main() {
     "  frag_col = vec4(0.54, 0.73, 0.1, 1.0);"
     "}";
 
-  // Shaders compilation
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vs, 1, &vertex_shader, NULL);
-  glCompileShader(vs);
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fs, 1, &fragment_shader, NULL);
-  glCompileShader(fs);
-
-  // Create program, attach shaders to it and link it
-  GLuint shader_program = glCreateProgram();
-  glAttachShader(shader_program, fs);
-  glAttachShader(shader_program, vs);
-  glLinkProgram(shader_program);
-
-  // Release shader objects
-  glDeleteShader(vs);
-  glDeleteShader(fs);
+  // Shader program, from the on-disk binary cache when possible
+  shader_program = progcache_program(vertex_shader, fragment_shader, NULL);
 
   // Vertex Array Object
-  GLuint vao = 0;
   glGenVertexArrays(1, &vao);
   glBindVertexArray(vao);
 
@@ -115,18 +117,19 @@ int main() {
   // Unbind vao
   glBindVertexArray(0);
 
+  // Headless render loop: a fixed number of frames, each one saved to disk
+  if (hl.frames) {
+    while (headless_next_frame(&hl)) {
+      render();
+      headless_save_frame(&hl);
+    }
+    headless_terminate(&hl);
+    return 0;
+  }
+
   // Render loop
   while(!glfwWindowShouldClose(window)) {
-    // wipe the drawing surface clear
-    glClear(GL_COLOR_BUFFER_BIT);
-
-    glViewport(0, 0, gl_width, gl_height);
-
-    glUseProgram(shader_program);
-    glBindVertexArray(vao);
-    // use 3 points to render a triangle from the currently bound VAO
-    // with current in-use shader
-    glDrawArrays(GL_TRIANGLES, 0, 3);
+    render();
 
     // put the stuff we've been drawing onto the display
     glfwSwapBuffers(window);
@@ -140,3 +143,16 @@ int main() {
 
   return 0;
 }
+
+void render(void) {
+  // wipe the drawing surface clear
+  glClear(GL_COLOR_BUFFER_BIT);
+
+  glViewport(0, 0, gl_width, gl_height);
+
+  glUseProgram(shader_program);
+  glBindVertexArray(vao);
+  // use 3 points to render a triangle from the currently bound VAO
+  // with current in-use shader
+  glDrawArrays(GL_TRIANGLES, 0, 3);
+}
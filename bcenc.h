@@ -0,0 +1,628 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// BC1/BC3 (S3TC, DXT1/DXT5) block compression on the CPU.
+//
+// Uncompressed RGB and RGBA textures take 3 and 4 bytes per texel of video
+// memory and upload bandwidth; BC1 takes half a byte and BC3 one. Every 4x4
+// block gets two RGB565 endpoints and a 2-bit index per texel into the 4
+// colors they span; BC3 adds an alpha block with two 8-bit endpoints and
+// 3-bit indices. RGB images are compressed to BC1, RGBA ones to BC3. Blocks
+// past the right or bottom edge repeat the edge texels.
+//
+// Two modes:
+//
+//   BCENC_FAST     color endpoints from the block's bounding box, inset a
+//                  bit and along the diagonal its colors correlate with.
+//   BCENC_QUALITY  endpoints at the extremes of the colors' principal axis,
+//                  then refined by least squares for the chosen indices;
+//                  alpha also tries the mode with exact 0 and 255.
+//
+// Both pick every index as the nearest palette entry, which is where most
+// of the time goes: the SSE2 paths measure 4 texels per register for color
+// and 16 for alpha (generic C otherwise, or after bcenc_set_simd(0), with
+// the same results). Rows of blocks are split in bands compressed on
+// separate threads.
+//
+//   unsigned char *blocks = malloc(bcenc_size(width, height, channels));
+//   bcenc_compress(pixels, width, height, channels, width * channels, blocks,
+//                  BCENC_QUALITY, 0);  // 0: one thread per CPU
+//   printf("PSNR %.2f dB\n", bcenc_psnr(pixels, width, height, channels,
+//                                       width * channels, blocks));
+//   glCompressedTexImage2D(GL_TEXTURE_2D, 0, bcenc_format(channels), width,
+//                          height, 0, bcenc_size(width, height, channels), blocks);
+//
+// Needs GL_EXT_texture_compression_s3tc (bcenc_supported()) to upload them.
+
+#ifndef BCENC_H
+#define BCENC_H
+
+#include <GL/glew.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define BCENC_MAX_THREADS 64
+#define BCENC_BAND_BLOCKS 1024 // min blocks per thread
+#define BCENC_REFINE 2         // least squares passes in BCENC_QUALITY
+
+typedef enum {
+  BCENC_NONE,   // no compression, for texloader
+  BCENC_FAST,
+  BCENC_QUALITY,
+} bcenc_mode_t;
+
+// Rows of blocks of an image to compress
+typedef struct {
+  const unsigned char *pixels;
+  int width, height, channels, stride;
+  unsigned char *blocks;
+  bcenc_mode_t mode;
+  int y0, y1;
+} bcenc_band_t;
+
+static int bcenc_simd = 1;
+
+// Uses the SSE2 index selection (the default, when compiled in) or generic C
+static inline void bcenc_set_simd(int enable) {
+  bcenc_simd = enable;
+}
+
+static inline void bcenc_usage(void) {
+  fprintf(stderr, "  -bc mode    texture compression: off, fast or quality (default fast)\n");
+}
+
+// Consumes a -bc option at argv[*i], if any. Returns 1 when consumed
+static inline int bcenc_arg(bcenc_mode_t *mode, int argc, char *argv[], int *i) {
+  if (strcmp(argv[*i], "-bc") || *i + 1 >= argc)
+    return 0;
+  const char *name = argv[*i + 1];
+  if (!strcmp(name, "off"))
+    *mode = BCENC_NONE;
+  else if (!strcmp(name, "fast"))
+    *mode = BCENC_FAST;
+  else if (!strcmp(name, "quality"))
+    *mode = BCENC_QUALITY;
+  else
+    return 0;
+  ++*i;
+  return 1;
+}
+
+// The driver takes S3TC textures
+static inline int bcenc_supported(void) {
+  return GLEW_EXT_texture_compression_s3tc;
+}
+
+// GL internal format of an image of 3 (BC1) or 4 (BC3) channels
+static inline GLenum bcenc_format(int channels) {
+  return channels == 4 ? GL_COMPRESSED_RGBA_S3TC_DXT5_EXT : GL_COMPRESSED_RGB_S3TC_DXT1_EXT;
+}
+
+// Bytes of the blocks of an image of 3 or 4 channels
+static inline size_t bcenc_size(int width, int height, int channels) {
+  return (size_t) ((width + 3) / 4) * ((height + 3) / 4) * (channels == 4 ? 16 : 8);
+}
+
+// 4x4 block with its top left corner at (x0, y0), as RGBA
+static inline void bcenc_fetch(const bcenc_band_t *band, int x0, int y0, unsigned char block[64]) {
+  int n = band->channels;
+
+  for (int y = 0; y < 4; y++) {
+    int sy = y0 + y < band->height ? y0 + y : band->height - 1;
+    const unsigned char *row = band->pixels + (size_t) sy * band->stride;
+    for (int x = 0; x < 4; x++) {
+      int sx = x0 + x < band->width ? x0 + x : band->width - 1;
+      const unsigned char *p = row + sx * n;
+      unsigned char *q = block + (y * 4 + x) * 4;
+      q[0] = p[0];
+      q[1] = p[1];
+      q[2] = p[2];
+      q[3] = n == 4 ? p[3] : 255;
+    }
+  }
+}
+
+// a * b / 255, rounded
+static inline int bcenc_mul8bit(int a, int b) {
+  int t = a * b + 128;
+  return (t + (t >> 8)) >> 8;
+}
+
+static inline int bcenc_pack565(const int rgb[3]) {
+  return (bcenc_mul8bit(rgb[0], 31) << 11) | (bcenc_mul8bit(rgb[1], 63) << 5) |
+         bcenc_mul8bit(rgb[2], 31);
+}
+
+// The 4 colors of endpoints c0 > c1, as the decoder sees them
+static inline void bcenc_palette(int c0, int c1, int palette[4][3]) {
+  int r0 = c0 >> 11, g0 = (c0 >> 5) & 63, b0 = c0 & 31;
+  int r1 = c1 >> 11, g1 = (c1 >> 5) & 63, b1 = c1 & 31;
+
+  palette[0][0] = (r0 << 3) | (r0 >> 2);
+  palette[0][1] = (g0 << 2) | (g0 >> 4);
+  palette[0][2] = (b0 << 3) | (b0 >> 2);
+  palette[1][0] = (r1 << 3) | (r1 >> 2);
+  palette[1][1] = (g1 << 2) | (g1 >> 4);
+  palette[1][2] = (b1 << 3) | (b1 >> 2);
+  for (int c = 0; c < 3; c++) {
+    palette[2][c] = (2 * palette[0][c] + palette[1][c]) / 3;
+    palette[3][c] = (palette[0][c] + 2 * palette[1][c]) / 3;
+  }
+}
+
+// Nearest palette color of every texel (the first one on ties), as 2-bit
+// indices. Returns the squared error
+static inline unsigned int bcenc_color_indices(const unsigned char block[64],
+                                               const int palette[4][3], unsigned int *indices) {
+  int best_i[16], best_d[16];
+
+#ifdef __SSE2__
+  if (bcenc_simd) {
+    const __m128i zero = _mm_setzero_si128(), rgb = _mm_set1_epi32(0x00ffffff);
+    __m128i p16[8], best[4], index[4];
+
+    // 2 texels per register, 16-bit RGB0
+    for (int r = 0; r < 4; r++) {
+      __m128i p = _mm_and_si128(_mm_loadu_si128((const __m128i *) (block + r * 16)), rgb);
+      p16[r * 2] = _mm_unpacklo_epi8(p, zero);
+      p16[r * 2 + 1] = _mm_unpackhi_epi8(p, zero);
+    }
+    for (int k = 0; k < 4; k++) {
+      __m128i color = _mm_setr_epi16(palette[k][0], palette[k][1], palette[k][2], 0,
+                                     palette[k][0], palette[k][1], palette[k][2], 0);
+      for (int r = 0; r < 4; r++) {
+        // (r^2 + g^2, b^2) per texel, then 4 texels per register
+        __m128i d0 = _mm_sub_epi16(p16[r * 2], color), d1 = _mm_sub_epi16(p16[r * 2 + 1], color);
+        __m128 s0 = _mm_castsi128_ps(_mm_madd_epi16(d0, d0));
+        __m128 s1 = _mm_castsi128_ps(_mm_madd_epi16(d1, d1));
+        __m128i d = _mm_add_epi32(_mm_castps_si128(_mm_shuffle_ps(s0, s1, _MM_SHUFFLE(2, 0, 2, 0))),
+                                  _mm_castps_si128(_mm_shuffle_ps(s0, s1, _MM_SHUFFLE(3, 1, 3, 1))));
+        if (k == 0) {
+          best[r] = d;
+          index[r] = zero;
+          continue;
+        }
+        __m128i less = _mm_cmplt_epi32(d, best[r]);
+        best[r] = _mm_or_si128(_mm_and_si128(less, d), _mm_andnot_si128(less, best[r]));
+        index[r] = _mm_or_si128(_mm_and_si128(less, _mm_set1_epi32(k)),
+                                _mm_andnot_si128(less, index[r]));
+      }
+    }
+    for (int r = 0; r < 4; r++) {
+      _mm_storeu_si128((__m128i *) (best_d + r * 4), best[r]);
+      _mm_storeu_si128((__m128i *) (best_i + r * 4), index[r]);
+    }
+  } else
+#endif
+  {
+    for (int i = 0; i < 16; i++) {
+      const unsigned char *p = block + i * 4;
+      for (int k = 0; k < 4; k++) {
+        int dr = p[0] - palette[k][0], dg = p[1] - palette[k][1], db = p[2] - palette[k][2];
+        int d = dr * dr + dg * dg + db * db;
+        if (k == 0 || d < best_d[i]) {
+          best_d[i] = d;
+          best_i[i] = k;
+        }
+      }
+    }
+  }
+
+  unsigned int error = 0, bits = 0;
+  for (int i = 0; i < 16; i++) {
+    error += best_d[i];
+    bits |= (unsigned int) best_i[i] << (2 * i);
+  }
+  *indices = bits;
+  return error;
+}
+
+// Color endpoints c0, c1 (texel colors, or least squares ones) quantized
+// into the block: c0 > c1, the 4 color mode. Returns the squared error
+static inline unsigned int bcenc_color_try(const unsigned char block[64], const int e0[3],
+                                           const int e1[3], unsigned char out[8]) {
+  int c0 = bcenc_pack565(e0), c1 = bcenc_pack565(e1), palette[4][3];
+  unsigned int indices = 0, error;
+
+  if (c0 < c1) {
+    int t = c0;
+    c0 = c1;
+    c1 = t;
+  }
+  bcenc_palette(c0, c1, palette);
+  error = bcenc_color_indices(block, palette, &indices);
+  // c0 == c1 is the 3 color mode, index 3 black. Ties already pick index 0
+  // then, as the 4 entries are the same color
+  if (c0 == c1)
+    indices = 0;
+
+  out[0] = c0 & 255;
+  out[1] = c0 >> 8;
+  out[2] = c1 & 255;
+  out[3] = c1 >> 8;
+  out[4] = indices & 255;
+  out[5] = (indices >> 8) & 255;
+  out[6] = (indices >> 16) & 255;
+  out[7] = indices >> 24;
+  return error;
+}
+
+// Endpoints minimizing the squared error for the indices of a block, by
+// least squares. Returns 0 if they're all the same index
+static inline int bcenc_least_squares(const unsigned char block[64], const unsigned char in[8],
+                                      int e0[3], int e1[3]) {
+  static const float weights[4] = { 1.0f, 0.0f, 2.0f / 3, 1.0f / 3 };
+  unsigned int indices = in[4] | in[5] << 8 | in[6] << 16 | (unsigned int) in[7] << 24;
+  float aa = 0.0f, ab = 0.0f, bb = 0.0f, ax[3] = { 0.0f }, bx[3] = { 0.0f };
+
+  for (int i = 0; i < 16; i++) {
+    float a = weights[(indices >> (2 * i)) & 3], b = 1.0f - a;
+    aa += a * a;
+    ab += a * b;
+    bb += b * b;
+    for (int c = 0; c < 3; c++) {
+      ax[c] += a * block[i * 4 + c];
+      bx[c] += b * block[i * 4 + c];
+    }
+  }
+  float det = aa * bb - ab * ab;
+  if (fabsf(det) < 1e-6f)
+    return 0;
+
+  for (int c = 0; c < 3; c++) {
+    float v0 = (bb * ax[c] - ab * bx[c]) / det, v1 = (aa * bx[c] - ab * ax[c]) / det;
+    e0[c] = v0 < 0.0f ? 0 : v0 > 255.0f ? 255 : (int) (v0 + 0.5f);
+    e1[c] = v1 < 0.0f ? 0 : v1 > 255.0f ? 255 : (int) (v1 + 0.5f);
+  }
+  return 1;
+}
+
+// Color part of a block, 8 bytes
+static inline void bcenc_color_block(const unsigned char block[64], bcenc_mode_t mode,
+                                     unsigned char out[8]) {
+  int lo[3] = { 255, 255, 255 }, hi[3] = { 0, 0, 0 };
+  for (int i = 0; i < 16; i++)
+    for (int c = 0; c < 3; c++) {
+      if (block[i * 4 + c] < lo[c])
+        lo[c] = block[i * 4 + c];
+      if (block[i * 4 + c] > hi[c])
+        hi[c] = block[i * 4 + c];
+    }
+
+  int e0[3], e1[3];
+  if (mode == BCENC_FAST || (lo[0] == hi[0] && lo[1] == hi[1] && lo[2] == hi[2])) {
+    // Bounding box, inset by 1/16 of its size, along the diagonal where
+    // red and blue correlate with green as the texels do
+    float mean[3] = { (lo[0] + hi[0]) * 0.5f, (lo[1] + hi[1]) * 0.5f, (lo[2] + hi[2]) * 0.5f };
+    float rg = 0.0f, bg = 0.0f;
+    for (int i = 0; i < 16; i++) {
+      float g = block[i * 4 + 1] - mean[1];
+      rg += (block[i * 4] - mean[0]) * g;
+      bg += (block[i * 4 + 2] - mean[2]) * g;
+    }
+    for (int c = 0; c < 3; c++) {
+      int inset = (hi[c] - lo[c]) >> 4;
+      e0[c] = hi[c] - inset;
+      e1[c] = lo[c] + inset;
+    }
+    if (rg < 0.0f) {
+      int t = e0[0];
+      e0[0] = e1[0];
+      e1[0] = t;
+    }
+    if (bg < 0.0f) {
+      int t = e0[2];
+      e0[2] = e1[2];
+      e1[2] = t;
+    }
+    bcenc_color_try(block, e0, e1, out);
+    return;
+  }
+
+  // Principal axis of the colors, by power iteration on their covariance
+  float mean[3] = { 0.0f }, cov[6] = { 0.0f };
+  for (int i = 0; i < 16; i++)
+    for (int c = 0; c < 3; c++)
+      mean[c] += block[i * 4 + c] * (1.0f / 16);
+  for (int i = 0; i < 16; i++) {
+    float r = block[i * 4] - mean[0], g = block[i * 4 + 1] - mean[1], b = block[i * 4 + 2] - mean[2];
+    cov[0] += r * r;
+    cov[1] += r * g;
+    cov[2] += r * b;
+    cov[3] += g * g;
+    cov[4] += g * b;
+    cov[5] += b * b;
+  }
+  float axis[3] = { (float) (hi[0] - lo[0]), (float) (hi[1] - lo[1]), (float) (hi[2] - lo[2]) };
+  for (int iter = 0; iter < 8; iter++) {
+    float x = cov[0] * axis[0] + cov[1] * axis[1] + cov[2] * axis[2];
+    float y = cov[1] * axis[0] + cov[3] * axis[1] + cov[4] * axis[2];
+    float z = cov[2] * axis[0] + cov[4] * axis[1] + cov[5] * axis[2];
+    float m = fabsf(x) > fabsf(y) ? fabsf(x) : fabsf(y);
+    if (fabsf(z) > m)
+      m = fabsf(z);
+    if (m < 1e-6f)
+      break;
+    axis[0] = x / m;
+    axis[1] = y / m;
+    axis[2] = z / m;
+  }
+
+  // Texels at both ends of the axis
+  float min_t = 1e30f, max_t = -1e30f;
+  for (int i = 0; i < 16; i++) {
+    float t = block[i * 4] * axis[0] + block[i * 4 + 1] * axis[1] + block[i * 4 + 2] * axis[2];
+    if (t < min_t) {
+      min_t = t;
+      for (int c = 0; c < 3; c++)
+        e1[c] = block[i * 4 + c];
+    }
+    if (t > max_t) {
+      max_t = t;
+      for (int c = 0; c < 3; c++)
+        e0[c] = block[i * 4 + c];
+    }
+  }
+  unsigned int error = bcenc_color_try(block, e0, e1, out);
+
+  for (int pass = 0; pass < BCENC_REFINE && error > 0; pass++) {
+    unsigned char refined[8];
+    if (!bcenc_least_squares(block, out, e0, e1))
+      break;
+    unsigned int refined_error = bcenc_color_try(block, e0, e1, refined);
+    if (refined_error >= error)
+      break;
+    error = refined_error;
+    memcpy(out, refined, 8);
+  }
+}
+
+// The 8 alpha values of endpoints a0, a1: interpolated if a0 > a1, 6 of
+// them plus 0 and 255 otherwise
+static inline void bcenc_alpha_palette(int a0, int a1, int palette[8]) {
+  palette[0] = a0;
+  palette[1] = a1;
+  if (a0 > a1) {
+    for (int i = 1; i < 7; i++)
+      palette[i + 1] = ((7 - i) * a0 + i * a1) / 7;
+  } else {
+    for (int i = 1; i < 5; i++)
+      palette[i + 1] = ((5 - i) * a0 + i * a1) / 5;
+    palette[6] = 0;
+    palette[7] = 255;
+  }
+}
+
+// Nearest palette alpha of every texel (the first one on ties). Returns
+// the squared error
+static inline unsigned int bcenc_alpha_indices(const unsigned char alpha[16], const int palette[8],
+                                               unsigned char indices[16]) {
+  unsigned char best[16];
+
+#ifdef __SSE2__
+  if (bcenc_simd) {
+    const __m128i ones = _mm_set1_epi8(-1), zero = _mm_setzero_si128();
+    __m128i a = _mm_loadu_si128((const __m128i *) alpha), d_best = zero, index = zero;
+    for (int k = 0; k < 8; k++) {
+      __m128i p = _mm_set1_epi8((char) palette[k]);
+      __m128i d = _mm_or_si128(_mm_subs_epu8(a, p), _mm_subs_epu8(p, a));
+      if (k == 0) {
+        d_best = d;
+        continue;
+      }
+      __m128i nearest = _mm_min_epu8(d_best, d);
+      __m128i less = _mm_andnot_si128(_mm_cmpeq_epi8(nearest, d_best), ones);
+      d_best = nearest;
+      index = _mm_or_si128(_mm_and_si128(less, _mm_set1_epi8((char) k)),
+                           _mm_andnot_si128(less, index));
+    }
+    _mm_storeu_si128((__m128i *) best, d_best);
+    _mm_storeu_si128((__m128i *) indices, index);
+  } else
+#endif
+  {
+    for (int i = 0; i < 16; i++) {
+      for (int k = 0; k < 8; k++) {
+        int d = alpha[i] > palette[k] ? alpha[i] - palette[k] : palette[k] - alpha[i];
+        if (k == 0 || d < best[i]) {
+          best[i] = (unsigned char) d;
+          indices[i] = (unsigned char) k;
+        }
+      }
+    }
+  }
+
+  unsigned int error = 0;
+  for (int i = 0; i < 16; i++)
+    error += best[i] * best[i];
+  return error;
+}
+
+// Alpha endpoints into an alpha block. Returns the squared error
+static inline unsigned int bcenc_alpha_try(const unsigned char alpha[16], int a0, int a1,
+                                           unsigned char out[8]) {
+  int palette[8];
+  unsigned char indices[16];
+
+  bcenc_alpha_palette(a0, a1, palette);
+  unsigned int error = bcenc_alpha_indices(alpha, palette, indices);
+
+  unsigned long long bits = 0;
+  for (int i = 0; i < 16; i++)
+    bits |= (unsigned long long) indices[i] << (3 * i);
+  out[0] = (unsigned char) a0;
+  out[1] = (unsigned char) a1;
+  for (int i = 0; i < 6; i++)
+    out[2 + i] = (unsigned char) (bits >> (8 * i));
+  return error;
+}
+
+// Alpha part of a BC3 block, 8 bytes
+static inline void bcenc_alpha_block(const unsigned char block[64], bcenc_mode_t mode,
+                                     unsigned char out[8]) {
+  unsigned char alpha[16];
+  int lo = 255, hi = 0, inner_lo = 255, inner_hi = 0;
+
+  for (int i = 0; i < 16; i++) {
+    int a = alpha[i] = block[i * 4 + 3];
+    lo = a < lo ? a : lo;
+    hi = a > hi ? a : hi;
+    if (a > 0 && a < 255) {
+      inner_lo = a < inner_lo ? a : inner_lo;
+      inner_hi = a > inner_hi ? a : inner_hi;
+    }
+  }
+
+  unsigned int error = bcenc_alpha_try(alpha, hi, lo, out);
+  if (mode == BCENC_QUALITY && error > 0) {
+    // Exact 0 and 255, the 6 values between the rest
+    unsigned char other[8];
+    if (inner_lo > inner_hi)
+      inner_lo = inner_hi = 0;
+    if (bcenc_alpha_try(alpha, inner_lo, inner_hi, other) < error)
+      memcpy(out, other, 8);
+  }
+}
+
+static inline void bcenc_rows(const bcenc_band_t *band) {
+  int blocks_x = (band->width + 3) / 4, alpha = band->channels == 4;
+  size_t block_size = alpha ? 16 : 8;
+  unsigned char block[64];
+
+  for (int by = band->y0; by < band->y1; by++) {
+    unsigned char *out = band->blocks + (size_t) by * blocks_x * block_size;
+    for (int bx = 0; bx < blocks_x; bx++, out += block_size) {
+      bcenc_fetch(band, bx * 4, by * 4, block);
+      if (alpha)
+        bcenc_alpha_block(block, band->mode, out);
+      bcenc_color_block(block, band->mode, out + block_size - 8);
+    }
+  }
+}
+
+static inline void *bcenc_band_thread(void *arg) {
+  bcenc_rows((const bcenc_band_t *) arg);
+  return NULL;
+}
+
+// Compresses an image of 3 (to BC1) or 4 (to BC3) 8-bit channels, rows
+// stride bytes apart, into blocks, bcenc_size() bytes: rows of blocks top
+// to bottom, as glCompressedTexImage2D wants them. threads <= 0 uses one
+// per online CPU
+static inline void bcenc_compress(const unsigned char *pixels, int width, int height,
+                                  int channels, int stride, unsigned char *blocks,
+                                  bcenc_mode_t mode, int threads) {
+  pthread_t tids[BCENC_MAX_THREADS];
+  bcenc_band_t bands[BCENC_MAX_THREADS];
+  int started[BCENC_MAX_THREADS] = { 0 };
+  int rows = (height + 3) / 4;
+
+  if (threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  long bands_max = (long) ((width + 3) / 4) * rows / BCENC_BAND_BLOCKS;
+  if (threads > bands_max)
+    threads = (int) bands_max;
+  if (threads > BCENC_MAX_THREADS)
+    threads = BCENC_MAX_THREADS;
+  if (threads < 1)
+    threads = 1;
+
+  for (int i = 0; i < threads; i++) {
+    bands[i].pixels = pixels;
+    bands[i].width = width;
+    bands[i].height = height;
+    bands[i].channels = channels;
+    bands[i].stride = stride;
+    bands[i].blocks = blocks;
+    bands[i].mode = mode;
+    bands[i].y0 = (int) ((long) rows * i / threads);
+    bands[i].y1 = (int) ((long) rows * (i + 1) / threads);
+    if (i > 0)
+      started[i] = pthread_create(&tids[i], NULL, bcenc_band_thread, &bands[i]) == 0;
+  }
+
+  // Band 0, and any whose thread couldn't start, on this one
+  for (int i = 0; i < threads; i++)
+    if (!started[i])
+      bcenc_rows(&bands[i]);
+  for (int i = 1; i < threads; i++)
+    if (started[i])
+      pthread_join(tids[i], NULL);
+}
+
+// Decodes blocks back to RGBA, width * height * 4 bytes, as a GPU would
+static inline void bcenc_decompress(const unsigned char *blocks, int width, int height,
+                                    int channels, unsigned char *rgba) {
+  int blocks_x = (width + 3) / 4, blocks_y = (height + 3) / 4, alpha = channels == 4;
+
+  for (int by = 0; by < blocks_y; by++) {
+    for (int bx = 0; bx < blocks_x; bx++, blocks += alpha ? 16 : 8) {
+      const unsigned char *color = blocks + (alpha ? 8 : 0);
+      int c0 = color[0] | color[1] << 8, c1 = color[2] | color[3] << 8, palette[4][3];
+      unsigned int indices = color[4] | color[5] << 8 | color[6] << 16 |
+                             (unsigned int) color[7] << 24;
+      int alphas[8];
+      unsigned long long alpha_bits = 0;
+
+      bcenc_palette(c0, c1, palette);
+      if (alpha) {
+        bcenc_alpha_palette(blocks[0], blocks[1], alphas);
+        for (int i = 0; i < 6; i++)
+          alpha_bits |= (unsigned long long) blocks[2 + i] << (8 * i);
+      }
+
+      for (int i = 0; i < 16; i++) {
+        int x = bx * 4 + (i & 3), y = by * 4 + (i >> 2);
+        if (x >= width || y >= height)
+          continue;
+        unsigned char *p = rgba + ((size_t) y * width + x) * 4;
+        int k = (indices >> (2 * i)) & 3;
+        if (!alpha && c0 <= c1 && k == 3) {
+          p[0] = p[1] = p[2] = p[3] = 0;
+          continue;
+        }
+        if (!alpha && c0 <= c1 && k == 2) {
+          for (int c = 0; c < 3; c++)
+            p[c] = (unsigned char) ((palette[0][c] + palette[1][c]) / 2);
+        } else {
+          for (int c = 0; c < 3; c++)
+            p[c] = (unsigned char) palette[k][c];
+        }
+        p[3] = alpha ? (unsigned char) alphas[(alpha_bits >> (3 * i)) & 7] : 255;
+      }
+    }
+  }
+}
+
+// PSNR of the compressed image against the original one, over all its
+// channels. 0 if out of memory
+static inline double bcenc_psnr(const unsigned char *pixels, int width, int height, int channels,
+                                int stride, const unsigned char *blocks) {
+  unsigned char *rgba = (unsigned char *) malloc((size_t) width * height * 4);
+  double error = 0.0;
+
+  if (!rgba)
+    return 0.0;
+  bcenc_decompress(blocks, width, height, channels, rgba);
+  for (int y = 0; y < height; y++) {
+    const unsigned char *p = pixels + (size_t) y * stride, *q = rgba + (size_t) y * width * 4;
+    for (int x = 0; x < width; x++, p += channels, q += 4)
+      for (int c = 0; c < channels; c++)
+        error += (double) (p[c] - q[c]) * (p[c] - q[c]);
+  }
+  free(rgba);
+
+  error /= (double) width * height * channels;
+  return error > 0.0 ? 10.0 * log10(255.0 * 255.0 / error) : 99.0;
+}
+
+#endif // BCENC_H
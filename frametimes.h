@@ -0,0 +1,255 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// Frame-time instrumentation for the render loops.
+//
+// Every frame records:
+// - cpu:   time spent issuing the frame (render() on the CPU side)
+// - gpu:   GPU execution time of the frame, from a GL_TIME_ELAPSED query
+// - swap:  time in glfwSwapBuffers() (or the headless readback)
+// - frame: time from the start of this frame to the start of the next one
+//
+// Queries are read back a few frames later, when their result is already
+// available, so measuring never stalls the pipeline. Finished samples go
+// into a single-producer ring buffer: the render thread only ever does an
+// atomic store of the head index, never blocks or locks, and the most recent
+// FRAMETIMES_CAPACITY frames can be snapshot from any thread.
+//
+// frametimes_report() prints p50/p95/p99/max for each metric and dumps every
+// retained sample to a CSV file.
+//
+//   frametimes_t ft;
+//   frametimes_init(&ft, "frames.csv");  // NULL: instrumentation disabled
+//   while (...) {
+//     frametimes_begin_frame(&ft);
+//     render(...);
+//     frametimes_end_render(&ft);
+//     glfwSwapBuffers(window);
+//     frametimes_end_frame(&ft);
+//   }
+//   frametimes_report(&ft);
+
+#ifndef FRAMETIMES_H
+#define FRAMETIMES_H
+
+#include <GL/glew.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FRAMETIMES_CAPACITY 65536 // samples kept (power of two)
+#define FRAMETIMES_QUERIES 4      // GPU queries in flight
+
+typedef struct {
+  int frame;
+  float cpu_ms, gpu_ms, swap_ms, frame_ms; // gpu_ms < 0: not measured
+} frame_sample_t;
+
+typedef struct {
+  frame_sample_t *samples;      // ring buffer storage
+  unsigned long long head;      // samples pushed so far (atomic)
+  GLuint queries[FRAMETIMES_QUERIES];
+  frame_sample_t pending[FRAMETIMES_QUERIES]; // waiting for their GPU time
+  int pending_count, pending_first;
+  int gpu_timer;                // GL_TIME_ELAPSED queries available
+  int frame;
+  double frame_start, render_end;
+  frame_sample_t *last;         // previous frame, still missing frame_ms
+  const char *csv;              // CSV dump file
+} frametimes_t;
+
+static inline double frametimes_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline void frametimes_usage(void) {
+  fprintf(stderr, "  -stats file  frame time percentiles on exit, every frame dumped to CSV file\n");
+}
+
+// Consumes a -stats option at argv[*i], if any. Returns 1 when consumed
+static inline int frametimes_arg(const char **csv, int argc, char *argv[], int *i) {
+  if (!strcmp(argv[*i], "-stats") && *i + 1 < argc) {
+    *csv = argv[++*i];
+    return 1;
+  }
+  return 0;
+}
+
+// Needs a current GL context. Without a CSV file name every other call
+// is a no-op
+static inline void frametimes_init(frametimes_t *ft, const char *csv) {
+  memset(ft, 0, sizeof(*ft));
+  if (!csv)
+    return;
+  ft->samples = (frame_sample_t *) calloc(FRAMETIMES_CAPACITY, sizeof(frame_sample_t));
+  ft->csv = csv;
+  ft->gpu_timer = GLEW_ARB_timer_query;
+  if (ft->gpu_timer)
+    glGenQueries(FRAMETIMES_QUERIES, ft->queries);
+}
+
+// Producer side of the ring: write the slot, then publish it
+static inline void frametimes_push(frametimes_t *ft, const frame_sample_t *sample) {
+  unsigned long long head = ft->head;
+  ft->samples[head & (FRAMETIMES_CAPACITY - 1)] = *sample;
+  __atomic_store_n(&ft->head, head + 1, __ATOMIC_RELEASE);
+}
+
+// Pushes the oldest pending frame once its GPU time is known. Returns 0 if
+// it isn't available yet (and wait is 0)
+static inline int frametimes_collect(frametimes_t *ft, int wait) {
+  int q = ft->pending_first;
+  frame_sample_t *sample = &ft->pending[q];
+
+  if (ft->gpu_timer) {
+    GLuint available = 0;
+    if (!wait) {
+      glGetQueryObjectuiv(ft->queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+      if (!available)
+        return 0;
+    }
+    GLuint64 ns = 0;
+    glGetQueryObjectui64v(ft->queries[q], GL_QUERY_RESULT, &ns);
+    sample->gpu_ms = (float) (ns * 1e-6);
+  } else {
+    sample->gpu_ms = -1.0f;
+  }
+
+  frametimes_push(ft, sample);
+  ft->pending_first = (q + 1) % FRAMETIMES_QUERIES;
+  ft->pending_count--;
+  return 1;
+}
+
+static inline void frametimes_begin_frame(frametimes_t *ft) {
+  if (!ft->samples)
+    return;
+
+  double now = frametimes_clock();
+
+  // The previous frame ends here
+  if (ft->last)
+    ft->last->frame_ms = (float) ((now - ft->frame_start) * 1e3);
+
+  // Make room for this frame's query
+  if (ft->pending_count == FRAMETIMES_QUERIES)
+    frametimes_collect(ft, 1);
+
+  int q = (ft->pending_first + ft->pending_count) % FRAMETIMES_QUERIES;
+  ft->last = &ft->pending[q];
+  memset(ft->last, 0, sizeof(*ft->last));
+  ft->last->frame = ft->frame;
+
+  ft->frame_start = now;
+  if (ft->gpu_timer)
+    glBeginQuery(GL_TIME_ELAPSED, ft->queries[q]);
+}
+
+static inline void frametimes_end_render(frametimes_t *ft) {
+  if (!ft->samples)
+    return;
+  if (ft->gpu_timer)
+    glEndQuery(GL_TIME_ELAPSED);
+  ft->render_end = frametimes_clock();
+  ft->last->cpu_ms = (float) ((ft->render_end - ft->frame_start) * 1e3);
+}
+
+static inline void frametimes_end_frame(frametimes_t *ft) {
+  if (!ft->samples)
+    return;
+  ft->last->swap_ms = (float) ((frametimes_clock() - ft->render_end) * 1e3);
+  ft->pending_count++;
+  ft->frame++;
+
+  // Push every finished frame but the last one, still missing its frame_ms
+  while (ft->pending_count > 1 && frametimes_collect(ft, 0))
+    ;
+}
+
+// Consumer side: copies the retained samples, oldest first. Returns how many
+static inline int frametimes_snapshot(const frametimes_t *ft, frame_sample_t *out) {
+  unsigned long long head = __atomic_load_n(&ft->head, __ATOMIC_ACQUIRE);
+  unsigned long long first = head > FRAMETIMES_CAPACITY ? head - FRAMETIMES_CAPACITY : 0;
+  int n = 0;
+
+  for (unsigned long long i = first; i < head; i++)
+    out[n++] = ft->samples[i & (FRAMETIMES_CAPACITY - 1)];
+  return n;
+}
+
+static inline int frametimes_cmp(const void *a, const void *b) {
+  float x = *(const float *) a, y = *(const float *) b;
+  return (x > y) - (x < y);
+}
+
+// cpu, gpu, swap, frame
+static inline float frametimes_metric(const frame_sample_t *sample, int m) {
+  switch (m) {
+  case 0: return sample->cpu_ms;
+  case 1: return sample->gpu_ms;
+  case 2: return sample->swap_ms;
+  default: return sample->frame_ms;
+  }
+}
+
+// Nearest-rank percentile of a sorted array
+static inline float frametimes_percentile(const float *sorted, int n, double p) {
+  int rank = (int) (p / 100.0 * n + 0.999999);
+  if (rank < 1)
+    rank = 1;
+  return sorted[rank - 1];
+}
+
+// Flushes pending queries, prints the percentile table and writes the CSV
+static inline void frametimes_report(frametimes_t *ft) {
+  if (!ft->samples)
+    return;
+  if (ft->last && ft->pending_count)
+    ft->last->frame_ms = (float) ((frametimes_clock() - ft->frame_start) * 1e3);
+  while (ft->pending_count)
+    frametimes_collect(ft, 1);
+
+  frame_sample_t *samples = (frame_sample_t *) malloc(FRAMETIMES_CAPACITY * sizeof(frame_sample_t));
+  float *values = (float *) malloc(FRAMETIMES_CAPACITY * sizeof(float));
+  int n = frametimes_snapshot(ft, samples);
+
+  const char *names[4] = { "cpu", "gpu", "swap", "frame" };
+  printf("Frame times over the last %d frames (ms):\n", n);
+  printf("           p50       p95       p99       max\n");
+  for (int m = 0; m < 4 && n > 0; m++) {
+    if (m == 1 && !ft->gpu_timer) {
+      printf("  %-5s  (no GL_TIME_ELAPSED queries)\n", names[m]);
+      continue;
+    }
+    for (int i = 0; i < n; i++)
+      values[i] = frametimes_metric(&samples[i], m);
+    qsort(values, n, sizeof(float), frametimes_cmp);
+    printf("  %-5s %8.3f  %8.3f  %8.3f  %8.3f\n", names[m],
+           frametimes_percentile(values, n, 50.0), frametimes_percentile(values, n, 95.0),
+           frametimes_percentile(values, n, 99.0), values[n - 1]);
+  }
+
+  FILE *f = fopen(ft->csv, "w");
+  if (f) {
+    fprintf(f, "frame,cpu_ms,gpu_ms,swap_ms,frame_ms\n");
+    for (int i = 0; i < n; i++)
+      fprintf(f, "%d,%.4f,%.4f,%.4f,%.4f\n", samples[i].frame, samples[i].cpu_ms,
+              samples[i].gpu_ms, samples[i].swap_ms, samples[i].frame_ms);
+    fclose(f);
+    printf("Frame times written to %s\n", ft->csv);
+  } else {
+    fprintf(stderr, "ERROR: could not write %s\n", ft->csv);
+  }
+
+  free(values);
+  free(samples);
+  if (ft->gpu_timer)
+    glDeleteQueries(FRAMETIMES_QUERIES, ft->queries);
+  free(ft->samples);
+}
+
+#endif // FRAMETIMES_H
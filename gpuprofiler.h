@@ -0,0 +1,162 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// Lightweight GPU profiler with named scopes.
+//
+// Each scope is bracketed by a pair of GL_TIMESTAMP queries (glQueryCounter),
+// so scopes may nest or overlap freely. Query objects come in a ring of
+// sets, one per frame: while frame N records into one, the ones of earlier
+// frames are read only once GL_QUERY_RESULT_AVAILABLE says the GPU is done
+// with them, so collecting them never stalls the pipeline. A set still
+// pending when the ring comes back to it (the driver more than
+// GPUPROF_BUFFERS - 1 frames ahead) is dropped, not waited for. Per-scope
+// timings are aggregated (average, min, max) and printed by gpuprof_report().
+//
+//   gpuprof_t prof;
+//   gpuprof_init(&prof, 1);
+//   int draw = gpuprof_scope(&prof, "draw");
+//   ...
+//   gpuprof_begin(&prof, draw);
+//   glDrawArrays(...);
+//   gpuprof_end(&prof, draw);
+//   ...
+//   gpuprof_frame(&prof);  // once per frame, after the last scope
+//   ...
+//   gpuprof_report(&prof);
+
+#ifndef GPUPROFILER_H
+#define GPUPROFILER_H
+
+#include <GL/glew.h>
+#include <stdio.h>
+#include <string.h>
+
+#define GPUPROF_MAX_SCOPES 16
+#define GPUPROF_BUFFERS 4 // query sets: one recording, the rest in flight
+
+typedef struct {
+  const char *name;
+  GLuint queries[GPUPROF_BUFFERS][2]; // begin/end timestamps per set
+  int recorded[GPUPROF_BUFFERS];      // set holds a begin/end pair
+  double total_ms, min_ms, max_ms;
+  long samples;
+} gpuprof_scope_t;
+
+typedef struct {
+  int enabled;  // everything is a no-op when disabled
+  int buffer;   // query set recording this frame
+  int frames;
+  long dropped; // samples overwritten before their results were available
+  int num_scopes;
+  gpuprof_scope_t scopes[GPUPROF_MAX_SCOPES];
+} gpuprof_t;
+
+// Needs a current GL context. Profiling needs GL_TIMESTAMP queries
+// (ARB_timer_query), otherwise it stays disabled
+static inline void gpuprof_init(gpuprof_t *prof, int enabled) {
+  memset(prof, 0, sizeof(*prof));
+  prof->enabled = enabled && GLEW_ARB_timer_query;
+  if (enabled && !prof->enabled)
+    fprintf(stderr, "WARNING: no timer queries, GPU profiling disabled\n");
+}
+
+// Registers a named scope. Returns its id, for gpuprof_begin()/gpuprof_end()
+static inline int gpuprof_scope(gpuprof_t *prof, const char *name) {
+  if (!prof->enabled || prof->num_scopes == GPUPROF_MAX_SCOPES)
+    return -1;
+
+  gpuprof_scope_t *scope = &prof->scopes[prof->num_scopes];
+  scope->name = name;
+  scope->min_ms = 1e30;
+  glGenQueries(2 * GPUPROF_BUFFERS, &scope->queries[0][0]);
+  return prof->num_scopes++;
+}
+
+static inline void gpuprof_begin(gpuprof_t *prof, int id) {
+  if (id < 0)
+    return;
+  glQueryCounter(prof->scopes[id].queries[prof->buffer][0], GL_TIMESTAMP);
+}
+
+static inline void gpuprof_end(gpuprof_t *prof, int id) {
+  if (id < 0)
+    return;
+  glQueryCounter(prof->scopes[id].queries[prof->buffer][1], GL_TIMESTAMP);
+  prof->scopes[id].recorded[prof->buffer] = 1;
+}
+
+// Accumulates the timings recorded in a query set, those whose results
+// are available or, with wait, all of them
+static inline void gpuprof_collect(gpuprof_t *prof, int set, int wait) {
+  for (int i = 0; i < prof->num_scopes; i++) {
+    gpuprof_scope_t *scope = &prof->scopes[i];
+    if (!scope->recorded[set])
+      continue;
+
+    if (!wait) {
+      GLuint available[2] = { 0, 0 };
+      glGetQueryObjectuiv(scope->queries[set][1], GL_QUERY_RESULT_AVAILABLE, &available[1]);
+      if (available[1])
+        glGetQueryObjectuiv(scope->queries[set][0], GL_QUERY_RESULT_AVAILABLE, &available[0]);
+      if (!available[0] || !available[1])
+        continue;
+    }
+    GLuint64 begin, end;
+    glGetQueryObjectui64v(scope->queries[set][0], GL_QUERY_RESULT, &begin);
+    glGetQueryObjectui64v(scope->queries[set][1], GL_QUERY_RESULT, &end);
+    scope->recorded[set] = 0;
+
+    double ms = (end - begin) * 1e-6;
+    scope->total_ms += ms;
+    if (ms < scope->min_ms)
+      scope->min_ms = ms;
+    if (ms > scope->max_ms)
+      scope->max_ms = ms;
+    scope->samples++;
+  }
+}
+
+// Ends the frame: collects whatever earlier frames' results are ready,
+// oldest first, and moves on to the next query set
+static inline void gpuprof_frame(gpuprof_t *prof) {
+  if (!prof->enabled)
+    return;
+
+  prof->frames++;
+  for (int i = 1; i < GPUPROF_BUFFERS; i++)
+    gpuprof_collect(prof, (prof->buffer + i) % GPUPROF_BUFFERS, 0);
+  prof->buffer = (prof->buffer + 1) % GPUPROF_BUFFERS;
+
+  // Still pending after GPUPROF_BUFFERS - 1 frames: recorded over
+  for (int i = 0; i < prof->num_scopes; i++) {
+    if (prof->scopes[i].recorded[prof->buffer]) {
+      prof->scopes[i].recorded[prof->buffer] = 0;
+      prof->dropped++;
+    }
+  }
+}
+
+// Prints per-scope GPU timings and releases the query objects
+static inline void gpuprof_report(gpuprof_t *prof) {
+  if (!prof->enabled)
+    return;
+
+  // Pick up the frames still in flight, oldest first
+  for (int i = 1; i <= GPUPROF_BUFFERS; i++)
+    gpuprof_collect(prof, (prof->buffer + i) % GPUPROF_BUFFERS, 1);
+
+  printf("GPU profile over %d frames (ms):\n", prof->frames);
+  if (prof->dropped)
+    printf("  (%ld samples dropped, not ready in time)\n", prof->dropped);
+  printf("  %-12s %9s %9s %9s\n", "scope", "avg", "min", "max");
+  for (int i = 0; i < prof->num_scopes; i++) {
+    gpuprof_scope_t *scope = &prof->scopes[i];
+    if (scope->samples)
+      printf("  %-12s %9.4f %9.4f %9.4f\n", scope->name,
+             scope->total_ms / scope->samples, scope->min_ms, scope->max_ms);
+    glDeleteQueries(2 * GPUPROF_BUFFERS, &scope->queries[0][0]);
+  }
+}
+
+#endif // GPUPROFILER_H
@@ -0,0 +1,321 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// Headless (offscreen) rendering for the demos: no window, no display.
+//
+// An OpenGL context is created through EGL on Mesa's surfaceless platform
+// (falling back to the default EGL display), so it runs on render nodes
+// without X11/Wayland and with llvmpipe when there's no GPU at all. Frames
+// are rendered into a framebuffer object, read back with glReadPixels and
+// written to disk as binary PPM files, one per frame, ready to be diffed.
+//
+// Readback is asynchronous by default: glReadPixels goes into a ring of pixel
+// buffer objects, each one guarded by a fence, and a frame is only mapped and
+// written out when its PBO is needed again, -ring frames later. Meanwhile the
+// GPU keeps rendering, so a deeper ring trades latency (frames in flight,
+// memory) for throughput. -ring 0 reads synchronously, stalling every frame.
+//
+// Usage from a demo:
+//
+//   headless_t hl;
+//   if (!headless_args(&hl, argc, argv)) return 1;  // -headless N, -o, -ring
+//   if (hl.frames) {
+//     if (!headless_init(&hl, gl_width, gl_height)) return 1;
+//   } else {
+//     ... GLFW window as usual ...
+//   }
+//   ...
+//   while (headless_next_frame(&hl)) {
+//     render(headless_time(&hl));
+//     headless_save_frame(&hl);
+//   }
+//   headless_terminate(&hl);
+
+#ifndef HEADLESS_H
+#define HEADLESS_H
+
+#include <GL/glew.h>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define HEADLESS_MAX_RING 16
+
+typedef struct {
+  int frames;            // frames to render offscreen (0: windowed demo)
+  int frame;             // current frame, -1 before the first one
+  const char *prefix;    // output files are <prefix><frame>.ppm
+  int width, height;     // framebuffer size
+  EGLDisplay display;
+  EGLContext context;
+  GLuint fbo, color_rbo, depth_rbo;
+  unsigned char *pixels; // readback buffer (RGB, bottom-up as GL returns it)
+  int ring;              // PBO ring depth (0: synchronous glReadPixels)
+  GLuint pbo[HEADLESS_MAX_RING];
+  GLsync fence[HEADLESS_MAX_RING];
+  int pbo_frame[HEADLESS_MAX_RING]; // frame waiting in each PBO, -1 if none
+  double start_time;     // for the throughput report
+  double wait_time;      // time blocked on readback
+} headless_t;
+
+static inline double headless_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static inline void headless_usage(void) {
+  fprintf(stderr, "  -headless N  render N frames offscreen (no window) and save them\n");
+  fprintf(stderr, "  -o prefix    output file prefix for headless frames (default: frame_)\n");
+  fprintf(stderr, "  -ring D      frames in flight for async PBO readback, 0 to %d (default 2)\n",
+          HEADLESS_MAX_RING);
+}
+
+// Consumes a headless option at argv[*i], if any (advancing *i past its
+// argument). Returns 1 when argv[*i] was a headless option
+static inline int headless_arg(headless_t *hl, int argc, char *argv[], int *i) {
+  if (!strcmp(argv[*i], "-headless") && *i + 1 < argc) {
+    hl->frames = atoi(argv[++*i]);
+    return 1;
+  }
+  if (!strcmp(argv[*i], "-o") && *i + 1 < argc) {
+    hl->prefix = argv[++*i];
+    return 1;
+  }
+  if (!strcmp(argv[*i], "-ring") && *i + 1 < argc) {
+    hl->ring = atoi(argv[++*i]);
+    if (hl->ring < 0)
+      hl->ring = 0;
+    if (hl->ring > HEADLESS_MAX_RING)
+      hl->ring = HEADLESS_MAX_RING;
+    return 1;
+  }
+  return 0;
+}
+
+// Windowed mode by default
+static inline void headless_defaults(headless_t *hl) {
+  memset(hl, 0, sizeof(*hl));
+  hl->frame = -1;
+  hl->prefix = "frame_";
+  hl->ring = 2;
+}
+
+// Command line parsing for demos with no options of their own.
+// Returns 0 (after printing usage) on unknown options
+static inline int headless_args(headless_t *hl, int argc, char *argv[]) {
+  headless_defaults(hl);
+
+  for (int i = 1; i < argc; i++) {
+    if (!headless_arg(hl, argc, argv, &i)) {
+      fprintf(stderr, "Usage: %s [-headless N] [-o prefix] [-ring D]\n", argv[0]);
+      headless_usage();
+      return 0;
+    }
+  }
+  return 1;
+}
+
+// Creates an offscreen GL context and makes a width x height FBO the
+// current framebuffer. GLEW is initialized here, as the FBO needs it
+static inline int headless_init(headless_t *hl, int width, int height) {
+  hl->width = width;
+  hl->height = height;
+
+  hl->display = EGL_NO_DISPLAY;
+  PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+    (PFNEGLGETPLATFORMDISPLAYEXTPROC) eglGetProcAddress("eglGetPlatformDisplayEXT");
+  if (get_platform_display)
+    hl->display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+  if (hl->display == EGL_NO_DISPLAY)
+    hl->display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+
+  EGLint major, minor;
+  if (hl->display == EGL_NO_DISPLAY || !eglInitialize(hl->display, &major, &minor)) {
+    fprintf(stderr, "ERROR: could not initialize EGL display\n");
+    return 0;
+  }
+
+  // Desktop OpenGL, no config and no surface: we only render into the FBO
+  eglBindAPI(EGL_OPENGL_API);
+  hl->context = eglCreateContext(hl->display, EGL_NO_CONFIG_KHR, EGL_NO_CONTEXT, NULL);
+  if (hl->context == EGL_NO_CONTEXT ||
+      !eglMakeCurrent(hl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, hl->context)) {
+    fprintf(stderr, "ERROR: could not create headless OpenGL context (EGL error 0x%x)\n",
+            eglGetError());
+    if (hl->context != EGL_NO_CONTEXT)
+      eglDestroyContext(hl->display, hl->context);
+    eglTerminate(hl->display);
+    return 0;
+  }
+
+  // GLEW only reports a missing GLX display here: GL entry points are loaded
+  glewInit();
+
+  glGenRenderbuffers(1, &hl->color_rbo);
+  glBindRenderbuffer(GL_RENDERBUFFER, hl->color_rbo);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+  glGenRenderbuffers(1, &hl->depth_rbo);
+  glBindRenderbuffer(GL_RENDERBUFFER, hl->depth_rbo);
+  glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+  glBindRenderbuffer(GL_RENDERBUFFER, 0);
+
+  glGenFramebuffers(1, &hl->fbo);
+  glBindFramebuffer(GL_FRAMEBUFFER, hl->fbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_RENDERBUFFER, hl->color_rbo);
+  glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_RENDERBUFFER, hl->depth_rbo);
+  if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) {
+    fprintf(stderr, "ERROR: incomplete headless framebuffer\n");
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    glDeleteFramebuffers(1, &hl->fbo);
+    glDeleteRenderbuffers(1, &hl->color_rbo);
+    glDeleteRenderbuffers(1, &hl->depth_rbo);
+    eglMakeCurrent(hl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(hl->display, hl->context);
+    eglTerminate(hl->display);
+    return 0;
+  }
+
+  hl->pixels = (unsigned char *) malloc((size_t) width * height * 3);
+
+  // Readback ring: GL_STREAM_READ PBOs, the driver copies into them later
+  glGenBuffers(hl->ring, hl->pbo);
+  for (int i = 0; i < hl->ring; i++) {
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, hl->pbo[i]);
+    glBufferData(GL_PIXEL_PACK_BUFFER, (size_t) width * height * 3, NULL, GL_STREAM_READ);
+    hl->fence[i] = 0;
+    hl->pbo_frame[i] = -1;
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  hl->start_time = headless_clock();
+
+  printf("Headless rendering: %d frames of %dx%d (EGL %d.%d), ", hl->frames,
+         width, height, major, minor);
+  if (hl->ring)
+    printf("async readback, %d frames in flight\n", hl->ring);
+  else
+    printf("synchronous readback\n");
+  return 1;
+}
+
+// Advances to the next frame. Returns 0 once all frames have been rendered
+static inline int headless_next_frame(headless_t *hl) {
+  return ++hl->frame < hl->frames;
+}
+
+// Animation time for the current frame: fixed 60 Hz steps, so that every
+// run renders exactly the same images
+static inline double headless_time(const headless_t *hl) {
+  return hl->frame / 60.0;
+}
+
+// Writes a bottom-up RGB image as a (top-down) binary PPM file
+static inline int headless_write_ppm(const char *filename, const unsigned char *pixels,
+                                     int width, int height) {
+  FILE *f = fopen(filename, "wb");
+  if (!f) {
+    fprintf(stderr, "ERROR: could not write %s\n", filename);
+    return 0;
+  }
+  fprintf(f, "P6\n%d %d\n255\n", width, height);
+  for (int y = height - 1; y >= 0; y--)
+    fwrite(pixels + (size_t) y * width * 3, 3, width, f);
+  fclose(f);
+  return 1;
+}
+
+static inline int headless_write_frame(const headless_t *hl, int frame,
+                                       const unsigned char *pixels) {
+  char filename[1024];
+
+  snprintf(filename, sizeof(filename), "%s%04d.ppm", hl->prefix, frame);
+  return headless_write_ppm(filename, pixels, hl->width, hl->height);
+}
+
+// Waits for the readback pending in a PBO of the ring and writes it out
+static inline int headless_retire(headless_t *hl, int slot) {
+  double t0 = headless_clock();
+  GLenum status;
+  int ok = 0;
+
+  do {
+    status = glClientWaitSync(hl->fence[slot], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+  } while (status == GL_TIMEOUT_EXPIRED);
+  glDeleteSync(hl->fence[slot]);
+  hl->fence[slot] = 0;
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, hl->pbo[slot]);
+  const unsigned char *pixels = (const unsigned char *)
+    glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, (size_t) hl->width * hl->height * 3, GL_MAP_READ_BIT);
+  hl->wait_time += headless_clock() - t0;
+
+  if (pixels) {
+    ok = headless_write_frame(hl, hl->pbo_frame[slot], pixels);
+    glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+  } else {
+    fprintf(stderr, "ERROR: could not map readback buffer for frame %d\n", hl->pbo_frame[slot]);
+  }
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+  hl->pbo_frame[slot] = -1;
+  return ok;
+}
+
+// Reads the current frame back from the FBO and saves it to disk. With a
+// PBO ring, this only queues the readback: the frame is written out once
+// its PBO comes around again (or at headless_terminate())
+static inline int headless_save_frame(headless_t *hl) {
+  int ok = 1;
+
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+
+  if (!hl->ring) {
+    double t0 = headless_clock();
+    glReadPixels(0, 0, hl->width, hl->height, GL_RGB, GL_UNSIGNED_BYTE, hl->pixels);
+    hl->wait_time += headless_clock() - t0;
+    return headless_write_frame(hl, hl->frame, hl->pixels);
+  }
+
+  int slot = hl->frame % hl->ring;
+  if (hl->pbo_frame[slot] >= 0)
+    ok = headless_retire(hl, slot);
+
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, hl->pbo[slot]);
+  glReadPixels(0, 0, hl->width, hl->height, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+  glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+  hl->fence[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+  hl->pbo_frame[slot] = hl->frame;
+
+  return ok;
+}
+
+// Writes out the frames still in flight (oldest first), prints the
+// throughput report and releases the offscreen context
+static inline void headless_terminate(headless_t *hl) {
+  for (int i = 0; i < hl->ring; i++) {
+    int slot = (hl->frame + i) % hl->ring;
+    if (hl->pbo_frame[slot] >= 0)
+      headless_retire(hl, slot);
+  }
+
+  double elapsed = headless_clock() - hl->start_time;
+  printf("Rendered %d frames in %.3f s (%.1f fps), %.3f s waiting on readback\n",
+         hl->frames, elapsed, elapsed > 0.0 ? hl->frames / elapsed : 0.0, hl->wait_time);
+
+  glDeleteFramebuffers(1, &hl->fbo);
+  glDeleteRenderbuffers(1, &hl->color_rbo);
+  glDeleteRenderbuffers(1, &hl->depth_rbo);
+  glDeleteBuffers(hl->ring, hl->pbo);
+  free(hl->pixels);
+
+  eglMakeCurrent(hl->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(hl->display, hl->context);
+  eglTerminate(hl->display);
+}
+
+#endif // HEADLESS_H
@@ -8,8 +8,12 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include "headless.h"
+#include "progcache.h"
+#define STBI_THREADS // multithreaded decoding of big JPEGs
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "texloader.h"
 
 int gl_width = 640;
 int gl_height = 480;
@@ -22,30 +26,50 @@ GLuint shader_program = 0; // shader program to set render pipeline
 GLuint vao = 0; // Vertext Array Object to set input data
 GLuint texture = 0; // Texture to paste on polygon
 
-int main() {
-  // start GL context and O/S window using the GLFW helper library
-  if (!glfwInit()) {
-    fprintf(stderr, "ERROR: could not start GLFW3\n");
-    return 1;
+int main(int argc, char *argv[]) {
+  headless_t hl;
+  headless_defaults(&hl);
+  bcenc_mode_t compress = BCENC_FAST; // texture compression (-bc)
+
+  for (int i = 1; i < argc; i++) {
+    if (!headless_arg(&hl, argc, argv, &i) && !bcenc_arg(&compress, argc, argv, &i)) {
+      fprintf(stderr, "Usage: %s [-headless N] [-o prefix] [-ring D] [-bc mode]\n", argv[0]);
+      headless_usage();
+      bcenc_usage();
+      return 1;
+    }
   }
 
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-  //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  GLFWwindow* window = NULL;
+  if (hl.frames) {
+    // start GL context on an offscreen framebuffer, no window at all
+    if (!headless_init(&hl, gl_width, gl_height))
+      return 1;
+  } else {
+    // start GL context and O/S window using the GLFW helper library
+    if (!glfwInit()) {
+      fprintf(stderr, "ERROR: could not start GLFW3\n");
+      return 1;
+    }
 
-  GLFWwindow* window = glfwCreateWindow(gl_width, gl_height, "Hello Texture", NULL, NULL);
-  if (!window) {
-    fprintf(stderr, "ERROR: could not open window with GLFW3\n");
-    glfwTerminate();
-    return 1;
-  }
-  glfwSetWindowSizeCallback(window, glfw_window_size_callback);
-  glfwMakeContextCurrent(window);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+    window = glfwCreateWindow(gl_width, gl_height, "Hello Texture", NULL, NULL);
+    if (!window) {
+      fprintf(stderr, "ERROR: could not open window with GLFW3\n");
+      glfwTerminate();
+      return 1;
+    }
+    glfwSetWindowSizeCallback(window, glfw_window_size_callback);
+    glfwMakeContextCurrent(window);
 
-  // start GLEW extension handler
-  // glewExperimental = GL_TRUE;
-  glewInit();
+    // start GLEW extension handler (headless_init() does it headless)
+    // glewExperimental = GL_TRUE;
+    glewInit();
+  }
 
   // get version info
   const GLubyte* vendor = glGetString(GL_VENDOR); // get vendor string
@@ -79,23 +103,23 @@ int main() {
     "  frag_col = texture(theTexture, vs_tex_coord);"
     "}";
 
-  // Shaders compilation
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vs, 1, &vertex_shader, NULL);
-  glCompileShader(vs);
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fs, 1, &fragment_shader, NULL);
-  glCompileShader(fs);
-
-  // Create program, attach shaders to it and link it
-  shader_program = glCreateProgram();
-  glAttachShader(shader_program, fs);
-  glAttachShader(shader_program, vs);
-  glLinkProgram(shader_program);
+  // Load image for texture on a worker thread, while we set up the rest,
+  // straight into a mapped pixel unpack buffer glTexImage2D reads from.
+  // Before loading the image, we flip it vertically because
+  // Images: 0.0 top of y-axis  OpenGL: 0.0 bottom of y-axis
+  texloader_pool_t loader;
+  texloader_image_t image;
+  texloader_pool_init(&loader, 1);
+  texloader_pool_mipmaps(&loader, MIPMAP_BOX); // mip levels built on the worker too
+  // and compressed there to BC1, the blocks written to the buffer instead
+  if (!texloader_pool_compress(&loader, compress))
+    printf("S3TC texture compression not supported, texture left uncompressed\n");
+  texloader_pool_submit_pbo(&loader, &image, "texture.jpg", 0, 0, 1);
+  // Image from http://www.flickr.com/photos/seier/4364156221
+  // CC-BY-SA 2.0
 
-  // Release shader objects
-  glDeleteShader(vs);
-  glDeleteShader(fs);
+  // Shader program, from the on-disk binary cache when possible
+  shader_program = progcache_program(vertex_shader, fragment_shader, NULL);
 
   // Triangle to be rendered (NDC)
   float points[] = {
@@ -147,24 +171,30 @@ int main() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  // Load image for texture
-  int width, height, nrChannels;
-  // Before loading the image, we flip it vertically because
-  // Images: 0.0 top of y-axis  OpenGL: 0.0 bottom of y-axis
-  stbi_set_flip_vertically_on_load(1);
-  unsigned char *data = stbi_load("texture.jpg", &width, &height, &nrChannels, 0);
-  // Image from http://www.flickr.com/photos/seier/4364156221
-  // CC-BY-SA 2.0
-  if (data) {
-    // Generate texture from image
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-  } else {
+  // Wait for the image, then generate texture from it, every mip level
+  // included (which frees the pixel buffer once the texture is generated)
+  texloader_pool_next(&loader, 1);
+  texloader_pool_destroy(&loader);
+  if (image.compressed_levels) {
+    size_t pixel_size = (size_t) image.width * image.height * image.channels;
+    if (image.compressed_levels > 1)
+      pixel_size += mipmap_chain_size(image.width, image.height, image.channels);
+    printf("Texture: %zu -> %zu bytes compressed at %.1f MB/s, PSNR %.2f dB\n", pixel_size,
+           image.compressed_size, pixel_size / (image.compress_ms * 1e3), image.psnr);
+  }
+  if (!texloader_tex_image(&image)) {
     printf("Failed to load texture\n");
   }
 
-  // Free image once texture is generated
-  stbi_image_free(data);
+  // Headless render loop: a fixed number of frames, each one saved to disk
+  if (hl.frames) {
+    while (headless_next_frame(&hl)) {
+      render();
+      headless_save_frame(&hl);
+    }
+    headless_terminate(&hl);
+    return 0;
+  }
 
   // Render loop
   while(!glfwWindowShouldClose(window)) {
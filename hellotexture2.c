@@ -8,6 +8,8 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include "headless.h"
+#include "progcache.h"
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
@@ -22,30 +24,41 @@ GLuint shader_program = 0; // shader program to set render pipeline
 GLuint vao = 0; // Vertext Array Object to set input data
 GLuint texture = 0; // Texture to paste on polygon
 
-int main() {
-  // start GL context and O/S window using the GLFW helper library
-  if (!glfwInit()) {
-    fprintf(stderr, "ERROR: could not start GLFW3\n");
+int main(int argc, char *argv[]) {
+  headless_t hl;
+  if (!headless_args(&hl, argc, argv))
     return 1;
-  }
 
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-  //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  GLFWwindow* window = NULL;
+  if (hl.frames) {
+    // start GL context on an offscreen framebuffer, no window at all
+    if (!headless_init(&hl, gl_width, gl_height))
+      return 1;
+  } else {
+    // start GL context and O/S window using the GLFW helper library
+    if (!glfwInit()) {
+      fprintf(stderr, "ERROR: could not start GLFW3\n");
+      return 1;
+    }
 
-  GLFWwindow* window = glfwCreateWindow(gl_width, gl_height, "Hello Texture", NULL, NULL);
-  if (!window) {
-    fprintf(stderr, "ERROR: could not open window with GLFW3\n");
-    glfwTerminate();
-    return 1;
-  }
-  glfwSetWindowSizeCallback(window, glfw_window_size_callback);
-  glfwMakeContextCurrent(window);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-  // start GLEW extension handler
-  // glewExperimental = GL_TRUE;
-  glewInit();
+    window = glfwCreateWindow(gl_width, gl_height, "Hello Texture", NULL, NULL);
+    if (!window) {
+      fprintf(stderr, "ERROR: could not open window with GLFW3\n");
+      glfwTerminate();
+      return 1;
+    }
+    glfwSetWindowSizeCallback(window, glfw_window_size_callback);
+    glfwMakeContextCurrent(window);
+
+    // start GLEW extension handler (headless_init() does it headless)
+    // glewExperimental = GL_TRUE;
+    glewInit();
+  }
 
   // get version info
   const GLubyte* vendor = glGetString(GL_VENDOR); // get vendor string
@@ -79,23 +92,8 @@ int main() {
     "  frag_col = texture(theTexture, vs_tex_coord);"
     "}";
 
-  // Shaders compilation
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vs, 1, &vertex_shader, NULL);
-  glCompileShader(vs);
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fs, 1, &fragment_shader, NULL);
-  glCompileShader(fs);
-
-  // Create program, attach shaders to it and link it
-  shader_program = glCreateProgram();
-  glAttachShader(shader_program, fs);
-  glAttachShader(shader_program, vs);
-  glLinkProgram(shader_program);
-
-  // Release shader objects
-  glDeleteShader(vs);
-  glDeleteShader(fs);
+  // Shader program, from the on-disk binary cache when possible
+  shader_program = progcache_program(vertex_shader, fragment_shader, NULL);
 
   // Triangle to be rendered (NDC)
   float points[] = {
@@ -166,6 +164,16 @@ int main() {
   // Free image once texture is generated
   stbi_image_free(data);
 
+  // Headless render loop: a fixed number of frames, each one saved to disk
+  if (hl.frames) {
+    while (headless_next_frame(&hl)) {
+      render();
+      headless_save_frame(&hl);
+    }
+    headless_terminate(&hl);
+    return 0;
+  }
+
   // Render loop
   while(!glfwWindowShouldClose(window)) {
 
@@ -0,0 +1,1785 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// Image decoding benchmarks for the stb_image.h kernels used by the demos.
+//
+//   imgbench jpeg-simd [file.jpg ...]
+//     IDCT and YCbCr->RGB kernels on their own (generic C, SSE2, AVX2),
+//     checked against each other, then full JPEG decodes at every SIMD
+//     level the CPU supports. Reports MB/s of decoded pixels.
+//
+//   imgbench jpeg-threads [file.jpg ...]
+//     Full JPEG decodes on 1, 2, 4... threads, up to twice the CPUs, checked
+//     against the single-threaded result. Only JPEGs with restart markers
+//     decode the scan in parallel; color conversion goes parallel for any.
+//
+//   imgbench jpeg-scaled [file ...]
+//     Downscaled decodes at 1/2, 1/4 and 1/8 (reduced IDCTs for JPEG, box
+//     filter for the rest) against a full decode, with the PSNR of each one
+//     compared to box filtering the full decode.
+//
+//   imgbench region [file ...]
+//     Decodes of a few 256x256 tiles and of the top and bottom halves
+//     against a full decode, checked against cropping the full image. Tiles
+//     near the top gain the most: JPEG and PNG stop after the tile's last row.
+//
+//   imgbench rows [file ...]
+//     Streaming decodes handing rows out to a callback, which copies them
+//     into place like glTexSubImage2D would, against a full decode. Reports
+//     the time and stb_image's peak heap use of each.
+//
+//   imgbench inflate [file.png ...]
+//     Inflate of the PNG's image data on its own and full PNG decodes, with
+//     the fast inflater and with the original one. Reports MB/s of inflated
+//     data and of decoded pixels. Files default to the demos' PNGs.
+//
+//   imgbench png-unfilter [file.png ...]
+//     PNG unfiltering kernels on their own, Sub, Up, Avg and Paeth at 3 and
+//     4 bytes per pixel, generic C and SSE2 checked against each other,
+//     then full PNG decodes at every SIMD level the CPU supports. Reports MB/s
+//     of unfiltered bytes and of decoded pixels.
+//
+//   imgbench mmap [directory]
+//     stbi_load() of every file in a directory, reading files with stdio
+//     and through memory mappings, with the files in the page cache and
+//     evicted from it first. Reports files/s and MB/s of decoded pixels.
+//     Without a directory, 3000 copies of the demos' textures are written
+//     to a temporary one, along with a few BMP, TGA, GIF and PNM files made
+//     from them. Fails if any file decodes differently through stdio and
+//     through a mapping.
+//
+//   imgbench arena [file ...]
+//     Decodes of each file over and over with the temporary buffers from
+//     malloc and from an arena kept from one decode to the next, taking
+//     turns. Reports the median ms/decode and the mallocs per decode. Files default to the demos'
+//     textures.
+//
+//   imgbench convert [file.png ...]
+//     Channel conversions of an 8192 pixels wide strip of random pixels, 8
+//     and 16 bits per component, generic C against the SIMD kernels, checked
+//     against each other, then PNG decodes to RGBA at every SIMD level.
+//     Reports MB/s of converted pixels. Files default to the demos' PNGs.
+//
+//   imgbench flip [file ...]
+//     Decodes to 3 and 4 channels with vertical flipping off and on, checked
+//     against flipping the unflipped image, next to the separate flip pass
+//     that decoders writing rows bottom-up save, and the flipped decode at
+//     every SIMD level the CPU supports. Files default to the demos'
+//     textures.
+//
+//   imgbench mipmap [file ...]
+//     Mip chains built by mipmap.h, box and Kaiser filters, generic C and
+//     SSE2 on 1, 2, 4... threads, checked against generic C on 1 thread.
+//     Then, on a headless GL context (llvmpipe without a GPU), glTexImage2D
+//     plus glGenerateMipmap() against building the chain on the CPU and
+//     uploading every level, with the PSNR of the CPU levels against the
+//     driver's. Files default to the demos' textures.
+//
+//   imgbench bc [file ...]
+//     BC1 (RGB) and BC3 (RGBA) compression by bcenc.h, fast and quality
+//     modes, generic C and SSE2 on 1, 2, 4... threads, checked against
+//     generic C on 1 thread. Reports MB/s of compressed pixels and the PSNR
+//     of each mode. Then, on a headless GL context, glTexImage2D against
+//     glCompressedTexImage2D of the blocks, which must read back as
+//     bcenc_decompress() decodes them. Files default to the demos' textures
+//     with alpha and without.
+//
+// Files default to the demos' texture.jpg.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// stb_image's heap use, for the rows and arena tests
+static size_t heap_used, heap_peak, heap_mallocs;
+
+void *bench_malloc(size_t size) {
+  size_t *p = (size_t *) malloc(size + 16);
+  if (!p)
+    return NULL;
+  p[0] = size;
+  heap_mallocs++;
+  heap_used += size;
+  if (heap_used > heap_peak)
+    heap_peak = heap_used;
+  return p + 2;
+}
+
+void bench_free(void *ptr) {
+  if (!ptr)
+    return;
+  size_t *p = (size_t *) ptr - 2;
+  heap_used -= p[0];
+  free(p);
+}
+
+void *bench_realloc(void *ptr, size_t size) {
+  void *q = bench_malloc(size);
+  if (q && ptr) {
+    size_t old = ((size_t *) ptr - 2)[0];
+    memcpy(q, ptr, old < size ? old : size);
+  }
+  if (q || !size)
+    bench_free(ptr);
+  return q;
+}
+
+#define STBI_MALLOC bench_malloc
+#define STBI_FREE bench_free
+#define STBI_REALLOC bench_realloc
+#define STBI_THREADS
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+#include "headless.h"
+#include "bcenc.h"
+#include "mipmap.h"
+
+#define BENCH_SECONDS 0.5 // minimum time measured per case
+
+static const char *level_names[] = { "C", "SSE2", "AVX2" };
+
+double bench_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Whole file in memory, so that decodes don't measure the disk
+unsigned char *read_file(const char *filename, int *len) {
+  FILE *f = fopen(filename, "rb");
+  if (!f) {
+    fprintf(stderr, "ERROR: could not open %s\n", filename);
+    return NULL;
+  }
+  fseek(f, 0, SEEK_END);
+  *len = (int) ftell(f);
+  fseek(f, 0, SEEK_SET);
+  unsigned char *data = (unsigned char *) malloc(*len);
+  if (fread(data, 1, *len, f) != (size_t) *len) {
+    fprintf(stderr, "ERROR: could not read %s\n", filename);
+    free(data);
+    data = NULL;
+  }
+  fclose(f);
+  return data;
+}
+
+// Random coefficients shaped like real ones: a large DC term, a few small AC
+// terms in the low frequencies, mostly zeros
+void random_block(short *block) {
+  memset(block, 0, 64 * sizeof(short));
+  block[0] = (short) (rand() % 2048 - 1024);
+  for (int i = 1; i < 64; i++)
+    if (rand() % (2 + i / 4) == 0)
+      block[i] = (short) (rand() % (256 / (1 + i / 8)) - 128 / (1 + i / 8));
+}
+
+typedef void (*idct_kernel_t)(stbi_uc *out, int out_stride, short data[64]);
+typedef void (*ycbcr_kernel_t)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb,
+                               const stbi_uc *pcr, int count, int step);
+
+#define IDCT_BLOCKS 4096
+
+void bench_idct(const char *name, idct_kernel_t kernel, short *blocks,
+                const stbi_uc *reference) {
+  stbi_uc out[IDCT_BLOCKS * 64];
+  STBI_SIMD_ALIGN(short, data[64]);
+  long long done = 0;
+
+  // Kernels may write to data: work on a copy
+  double t0 = bench_clock(), elapsed;
+  do {
+    for (int b = 0; b < IDCT_BLOCKS; b++) {
+      memcpy(data, blocks + b * 64, sizeof(data));
+      kernel(out + b * 64, 8, data);
+    }
+    done += IDCT_BLOCKS;
+  } while ((elapsed = bench_clock() - t0) < BENCH_SECONDS);
+
+  int mismatches = 0;
+  if (reference)
+    for (int i = 0; i < IDCT_BLOCKS * 64; i++)
+      mismatches += out[i] != reference[i];
+
+  printf("  idct   %-5s %8.1f Mblocks/s %8.1f MB/s", name, done / elapsed * 1e-6,
+         done * 64 / elapsed * 1e-6);
+  if (reference)
+    printf("   %s", mismatches ? "MISMATCH" : "bit-exact");
+  printf("\n");
+}
+
+#define YCBCR_PIXELS 4096
+
+void bench_ycbcr(const char *name, ycbcr_kernel_t kernel, int step, const stbi_uc *y,
+                 const stbi_uc *cb, const stbi_uc *cr, stbi_uc *out, const stbi_uc *reference) {
+  long long done = 0;
+
+  double t0 = bench_clock(), elapsed;
+  do {
+    kernel(out, y, cb, cr, YCBCR_PIXELS, step);
+    done += YCBCR_PIXELS;
+  } while ((elapsed = bench_clock() - t0) < BENCH_SECONDS);
+
+  printf("  ycbcr  %-5s step %d %8.1f Mpixels/s %8.1f MB/s", name, step, done / elapsed * 1e-6,
+         done * step / elapsed * 1e-6);
+  if (reference) {
+    int max_diff = 0;
+    for (int i = 0; i < YCBCR_PIXELS * step; i++) {
+      int d = abs(out[i] - reference[i]);
+      if (d > max_diff)
+        max_diff = d;
+    }
+    printf("   max diff vs C %d", max_diff);
+  }
+  printf("\n");
+}
+
+void bench_kernels(void) {
+  int level = stbi_simd_level();
+  printf("SIMD level: %s\n", level_names[level]);
+
+  short *blocks = (short *) malloc(IDCT_BLOCKS * 64 * sizeof(short));
+  stbi_uc *reference = (stbi_uc *) malloc(IDCT_BLOCKS * 64);
+  STBI_SIMD_ALIGN(short, data[64]);
+  srand(1);
+  for (int b = 0; b < IDCT_BLOCKS; b++)
+    random_block(blocks + b * 64);
+  for (int b = 0; b < IDCT_BLOCKS; b++) {
+    memcpy(data, blocks + b * 64, sizeof(data));
+    stbi__idct_block(reference + b * 64, 8, data);
+  }
+
+  bench_idct(level_names[0], stbi__idct_block, blocks, NULL);
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+  if (level >= STBI_SIMD_SSE2)
+    bench_idct(level_names[1], stbi__idct_simd, blocks, reference);
+#endif
+#ifdef STBI_AVX2
+  if (level >= STBI_SIMD_AVX2)
+    bench_idct(level_names[2], stbi__idct_avx2, blocks, reference);
+#endif
+
+  stbi_uc *y = (stbi_uc *) malloc(YCBCR_PIXELS * 3);
+  stbi_uc *cb = y + YCBCR_PIXELS, *cr = cb + YCBCR_PIXELS;
+  stbi_uc *out = (stbi_uc *) malloc(YCBCR_PIXELS * 4);
+  stbi_uc *ycbcr_reference = (stbi_uc *) malloc(YCBCR_PIXELS * 4);
+  for (int i = 0; i < YCBCR_PIXELS * 3; i++)
+    y[i] = (stbi_uc) rand();
+
+  for (int step = 3; step <= 4; step++) {
+    stbi__YCbCr_to_RGB_row(ycbcr_reference, y, cb, cr, YCBCR_PIXELS, step);
+    bench_ycbcr(level_names[0], stbi__YCbCr_to_RGB_row, step, y, cb, cr, out, NULL);
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+    if (level >= STBI_SIMD_SSE2)
+      bench_ycbcr(level_names[1], stbi__YCbCr_to_RGB_simd, step, y, cb, cr, out, ycbcr_reference);
+#endif
+#ifdef STBI_AVX2
+    if (level >= STBI_SIMD_AVX2)
+      bench_ycbcr(level_names[2], stbi__YCbCr_to_RGB_avx2, step, y, cb, cr, out, ycbcr_reference);
+#endif
+  }
+
+  free(ycbcr_reference);
+  free(out);
+  free(y);
+  free(reference);
+  free(blocks);
+}
+
+// Decodes a file in memory over and over. Returns the last result, and the
+// time per decode in ms if ms isn't NULL
+stbi_uc *bench_decode(const char *label, const unsigned char *file, int len, int channels,
+                      int *w, int *h, double *ms) {
+  stbi_uc *pixels = NULL;
+  int n, decodes = 0;
+
+  double t0 = bench_clock(), elapsed;
+  do {
+    stbi_image_free(pixels);
+    pixels = stbi_load_from_memory(file, len, w, h, &n, channels);
+    decodes++;
+  } while (pixels && (elapsed = bench_clock() - t0) < BENCH_SECONDS);
+
+  if (!pixels) {
+    fprintf(stderr, "ERROR: %s\n", stbi_failure_reason());
+    return NULL;
+  }
+  double bytes = (double) *w * *h * channels;
+  printf("  %-12s %7.2f ms/decode %8.1f MB/s", label, elapsed / decodes * 1e3,
+         bytes * decodes / elapsed * 1e-6);
+  if (ms)
+    *ms = elapsed / decodes * 1e3;
+  else
+    printf("\n");
+  return pixels;
+}
+
+int bench_jpeg_simd(int argc, char *argv[]) {
+  bench_kernels();
+
+  const char *default_files[] = { "texture.jpg" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 1;
+  int best = stbi_simd_level();
+
+  for (int f = 0; f < num_files; f++) {
+    int len, w, h;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file)
+      return 1;
+
+    for (int channels = 3; channels <= 4; channels++) {
+      stbi_uc *reference = NULL;
+      printf("%s, %d channels:\n", files[f], channels);
+      for (int level = STBI_SIMD_NONE; level <= best; level++) {
+        char label[32];
+        snprintf(label, sizeof(label), "decode %s", level_names[level]);
+        stbi_set_simd_limit(level);
+        stbi_uc *pixels = bench_decode(label, file, len, channels, &w, &h, NULL);
+        if (!pixels)
+          return 1;
+
+        // Color conversion differs by rounding between the C and SIMD kernels
+        if (reference) {
+          int max_diff = 0;
+          for (size_t i = 0; i < (size_t) w * h * channels; i++) {
+            int d = abs(pixels[i] - reference[i]);
+            if (d > max_diff)
+              max_diff = d;
+          }
+          if (max_diff)
+            printf("    (max diff vs %s: %d)\n", level_names[level - 1], max_diff);
+        }
+        stbi_image_free(reference);
+        reference = pixels;
+      }
+      stbi_image_free(reference);
+    }
+    stbi_set_simd_limit(STBI_SIMD_AVX2);
+    free(file);
+  }
+  return 0;
+}
+
+// Restart interval of a JPEG in memory (DRI marker), 0 if none
+int jpeg_restart_interval(const unsigned char *file, int len) {
+  for (int i = 2; i + 4 <= len && file[i] == 0xff; i += 2 + (file[i + 2] << 8 | file[i + 3])) {
+    if (file[i + 1] == 0xdd)
+      return file[i + 4] << 8 | file[i + 5];
+    if (file[i + 1] == 0xda) // start of scan: no more tables
+      break;
+  }
+  return 0;
+}
+
+int bench_jpeg_threads(int argc, char *argv[]) {
+  const char *default_files[] = { "texture.jpg" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 1;
+  int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  printf("%d CPUs online\n", cpus);
+
+  for (int f = 0; f < num_files; f++) {
+    int len, w, h;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file)
+      return 1;
+
+    stbi_uc *reference = NULL;
+    double serial_ms = 0.0, ms;
+    printf("%s, restart interval %d:\n", files[f], jpeg_restart_interval(file, len));
+    for (int threads = 1; threads <= 2 * cpus || threads <= 4; threads *= 2) {
+      char label[32];
+      snprintf(label, sizeof(label), "%d thread%s", threads, threads > 1 ? "s" : "");
+      stbi_set_jpeg_threads(threads);
+      stbi_uc *pixels = bench_decode(label, file, len, 4, &w, &h, &ms);
+      if (!pixels)
+        return 1;
+
+      if (!reference) {
+        printf("\n");
+        reference = pixels;
+        serial_ms = ms;
+        continue;
+      }
+      printf("   x%.2f%s\n", serial_ms / ms,
+             memcmp(pixels, reference, (size_t) w * h * 4) ? "   MISMATCH vs 1 thread" : "");
+      stbi_image_free(pixels);
+    }
+    stbi_image_free(reference);
+    stbi_set_jpeg_threads(0);
+    free(file);
+  }
+  return 0;
+}
+
+// Decodes at 1/scale over and over, like bench_decode(). Returns the last
+// result and the time per decode in ms
+stbi_uc *bench_decode_scaled(const char *label, const unsigned char *file, int len, int scale,
+                             int *w, int *h, double *ms) {
+  stbi_uc *pixels = NULL;
+  int n, decodes = 0;
+
+  double t0 = bench_clock(), elapsed;
+  do {
+    stbi_image_free(pixels);
+    pixels = stbi_load_scaled_from_memory(file, len, w, h, &n, 4, scale);
+    decodes++;
+  } while (pixels && (elapsed = bench_clock() - t0) < BENCH_SECONDS);
+
+  if (!pixels) {
+    fprintf(stderr, "ERROR: %s\n", stbi_failure_reason());
+    return NULL;
+  }
+  *ms = elapsed / decodes * 1e3;
+  printf("  %-12s %4dx%-4d %7.2f ms/decode", label, *w, *h, *ms);
+  return pixels;
+}
+
+// PSNR of an RGBA image at 1/scale against a box filtered full size one
+double psnr_vs_box(const stbi_uc *full, int w, int h, const stbi_uc *scaled, int scale) {
+  int sw = (w + scale - 1) / scale, sh = (h + scale - 1) / scale;
+  double error = 0.0;
+  for (int j = 0; j < sh; j++)
+    for (int i = 0; i < sw; i++)
+      for (int c = 0; c < 4; c++) {
+        int sum = 0, count = 0;
+        for (int y = j * scale; y < (j + 1) * scale && y < h; y++)
+          for (int x = i * scale; x < (i + 1) * scale && x < w; x++, count++)
+            sum += full[((size_t) y * w + x) * 4 + c];
+        double d = (double) sum / count - scaled[((size_t) j * sw + i) * 4 + c];
+        error += d * d;
+      }
+  error /= (double) sw * sh * 4;
+  return error > 0.0 ? 10.0 * log10(255.0 * 255.0 / error) : 99.0;
+}
+
+int bench_jpeg_scaled(int argc, char *argv[]) {
+  const char *default_files[] = { "texture.jpg" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 1;
+
+  for (int f = 0; f < num_files; f++) {
+    int len, w, h, sw, sh;
+    double full_ms, ms;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file)
+      return 1;
+
+    printf("%s:\n", files[f]);
+    stbi_uc *full = bench_decode_scaled("full size", file, len, 1, &w, &h, &full_ms);
+    if (!full)
+      return 1;
+    printf("\n");
+    for (int scale = 2; scale <= 8; scale *= 2) {
+      char label[32];
+      snprintf(label, sizeof(label), "1/%d", scale);
+      stbi_uc *pixels = bench_decode_scaled(label, file, len, scale, &sw, &sh, &ms);
+      if (!pixels)
+        return 1;
+      printf("   x%.2f   PSNR vs box filter %.1f dB\n", full_ms / ms,
+             psnr_vs_box(full, w, h, pixels, scale));
+      stbi_image_free(pixels);
+    }
+    stbi_image_free(full);
+    free(file);
+  }
+  return 0;
+}
+
+// Decodes the rw x rh region at (rx,ry) over and over, like bench_decode().
+// Returns the last result and the time per decode in ms
+stbi_uc *bench_decode_region(const char *label, const unsigned char *file, int len,
+                             int rx, int ry, int rw, int rh, int *w, int *h, double *ms) {
+  stbi_uc *pixels = NULL;
+  int n, decodes = 0;
+
+  double t0 = bench_clock(), elapsed;
+  do {
+    stbi_image_free(pixels);
+    pixels = stbi_load_region_from_memory(file, len, rx, ry, rw, rh, w, h, &n, 4);
+    decodes++;
+  } while (pixels && (elapsed = bench_clock() - t0) < BENCH_SECONDS);
+
+  if (!pixels) {
+    fprintf(stderr, "ERROR: %s\n", stbi_failure_reason());
+    return NULL;
+  }
+  *ms = elapsed / decodes * 1e3;
+  printf("  %-14s %4dx%-4d %7.2f ms/decode", label, *w, *h, *ms);
+  return pixels;
+}
+
+int bench_region(int argc, char *argv[]) {
+  const char *default_files[] = { "texture.jpg" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 1;
+
+  for (int f = 0; f < num_files; f++) {
+    int len, w, h, rw, rh;
+    double full_ms, ms;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file)
+      return 1;
+
+    printf("%s:\n", files[f]);
+    stbi_uc *full = bench_decode_region("full image", file, len, 0, 0, 1 << 30, 1 << 30, &w, &h,
+                                        &full_ms);
+    if (!full)
+      return 1;
+    printf("\n");
+
+    struct { const char *label; int x, y, w, h; } regions[] = {
+      { "tile top-left", 0, 0, 256, 256 },
+      { "tile center", w / 2 - 128, h / 2 - 128, 256, 256 },
+      { "tile bottom", w - 256, h - 256, 256, 256 },
+      { "top half", 0, 0, w, h / 2 },
+      { "bottom half", 0, h / 2, w, h - h / 2 },
+    };
+    for (size_t r = 0; r < sizeof(regions) / sizeof(regions[0]); r++) {
+      int x0 = regions[r].x < 0 ? 0 : regions[r].x, y0 = regions[r].y < 0 ? 0 : regions[r].y;
+      stbi_uc *pixels = bench_decode_region(regions[r].label, file, len, x0, y0, regions[r].w,
+                                            regions[r].h, &rw, &rh, &ms);
+      if (!pixels)
+        return 1;
+
+      int mismatch = 0;
+      for (int j = 0; j < rh && !mismatch; j++)
+        mismatch = memcmp(pixels + (size_t) j * rw * 4, full + ((size_t) (y0 + j) * w + x0) * 4,
+                          (size_t) rw * 4) != 0;
+      printf("   x%.2f%s\n", full_ms / ms, mismatch ? "   MISMATCH vs cropped full image" : "");
+      stbi_image_free(pixels);
+    }
+    stbi_image_free(full);
+    free(file);
+  }
+  return 0;
+}
+
+// Destination of streamed rows: an RGBA image in memory, standing in for
+// a texture filled with glTexSubImage2D
+typedef struct {
+  stbi_uc *pixels;
+  int w, h, batches, max_rows;
+} bench_rows_t;
+
+int bench_rows_begin(void *user, int x, int y, int channels) {
+  bench_rows_t *dst = (bench_rows_t *) user;
+  (void) channels;
+  dst->w = x;
+  dst->h = y;
+  dst->batches = dst->max_rows = 0;
+  if (!dst->pixels)
+    dst->pixels = (stbi_uc *) malloc((size_t) x * y * 4);
+  return dst->pixels != NULL;
+}
+
+int bench_rows_rows(void *user, const stbi_uc *pixels, int y, int n) {
+  bench_rows_t *dst = (bench_rows_t *) user;
+  memcpy(dst->pixels + (size_t) y * dst->w * 4, pixels, (size_t) n * dst->w * 4);
+  dst->batches++;
+  if (n > dst->max_rows)
+    dst->max_rows = n;
+  return 1;
+}
+
+int bench_rows(int argc, char *argv[]) {
+  const char *default_files[] = { "texture.jpg" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 1;
+  stbi_row_callbacks callbacks = { bench_rows_begin, bench_rows_rows };
+
+  for (int f = 0; f < num_files; f++) {
+    int len, w, h, n, decodes;
+    double t0, elapsed;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file)
+      return 1;
+
+    printf("%s:\n", files[f]);
+    stbi_uc *full = NULL;
+    size_t heap_base = heap_peak = heap_used;
+    decodes = 0;
+    t0 = bench_clock();
+    do {
+      stbi_image_free(full);
+      full = stbi_load_from_memory(file, len, &w, &h, &n, 4);
+      decodes++;
+    } while (full && (elapsed = bench_clock() - t0) < BENCH_SECONDS);
+    if (!full) {
+      fprintf(stderr, "ERROR: %s\n", stbi_failure_reason());
+      return 1;
+    }
+    double full_ms = elapsed / decodes * 1e3;
+    printf("  %-10s %4dx%-4d %7.2f ms/decode %8.1f KB peak\n", "full image", w, h, full_ms,
+           (heap_peak - heap_base) / 1024.0);
+
+    bench_rows_t dst = { NULL, 0, 0, 0, 0 };
+    int ok;
+    heap_base = heap_peak = heap_used;
+    decodes = 0;
+    t0 = bench_clock();
+    do {
+      ok = stbi_load_rows_from_memory(file, len, &callbacks, &dst, &w, &h, &n, 4);
+      decodes++;
+    } while (ok && (elapsed = bench_clock() - t0) < BENCH_SECONDS);
+    if (!ok) {
+      fprintf(stderr, "ERROR: %s\n", stbi_failure_reason());
+      return 1;
+    }
+    double ms = elapsed / decodes * 1e3;
+    printf("  %-10s %4dx%-4d %7.2f ms/decode %8.1f KB peak   x%.2f, %d batches of up to %d rows%s\n",
+           "rows", w, h, ms, (heap_peak - heap_base) / 1024.0, full_ms / ms, dst.batches,
+           dst.max_rows,
+           memcmp(dst.pixels, full, (size_t) w * h * 4) ? "   MISMATCH vs full image" : "");
+    free(dst.pixels);
+    stbi_image_free(full);
+    free(file);
+  }
+  return 0;
+}
+
+// Image data of a PNG in memory: its IDAT chunks put together, NULL if none
+unsigned char *png_idat(const unsigned char *file, int len, int *idat_len) {
+  unsigned char *idat = NULL;
+  *idat_len = 0;
+  for (int i = 8; i + 12 <= len;) {
+    int size = file[i] << 24 | file[i + 1] << 16 | file[i + 2] << 8 | file[i + 3];
+    if (size < 0 || size > len - i - 12)
+      break;
+    if (!memcmp(file + i + 4, "IDAT", 4)) {
+      idat = (unsigned char *) realloc(idat, *idat_len + size);
+      memcpy(idat + *idat_len, file + i + 8, size);
+      *idat_len += size;
+    }
+    i += size + 12;
+  }
+  return idat;
+}
+
+int bench_inflate(int argc, char *argv[]) {
+  const char *default_files[] = { "watchmen_smiley.png", "watchmen_smiley_trans.png" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 2;
+  const char *labels[] = { "original", "fast" };
+
+  for (int f = 0; f < num_files; f++) {
+    int len, idat_len, w, h;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file)
+      return 1;
+    unsigned char *idat = png_idat(file, len, &idat_len);
+    if (!idat) {
+      fprintf(stderr, "ERROR: no image data in %s\n", files[f]);
+      return 1;
+    }
+
+    printf("%s, %d bytes of image data:\n", files[f], idat_len);
+    char *reference = NULL;
+    int reference_len = 0;
+    double original_ms = 0.0;
+    for (int fast = 0; fast < 2; fast++) {
+      char *out = NULL;
+      int out_len = 0, decodes = 0;
+      stbi_set_fast_inflate(fast);
+      double t0 = bench_clock(), elapsed;
+      do {
+        stbi_image_free(out);
+        out = stbi_zlib_decode_malloc((const char *) idat, idat_len, &out_len);
+        decodes++;
+      } while (out && (elapsed = bench_clock() - t0) < BENCH_SECONDS);
+      if (!out) {
+        fprintf(stderr, "ERROR: %s\n", stbi_failure_reason());
+        return 1;
+      }
+      double ms = elapsed / decodes * 1e3;
+      printf("  inflate %-8s %7.2f ms %8.1f MB/s", labels[fast], ms,
+             (double) out_len * decodes / elapsed * 1e-6);
+      if (!reference) {
+        printf("\n");
+        reference = out;
+        reference_len = out_len;
+        original_ms = ms;
+        continue;
+      }
+      printf("   x%.2f%s\n", original_ms / ms,
+             out_len != reference_len || memcmp(out, reference, out_len) ? "   MISMATCH vs original"
+                                                                          : "");
+      stbi_image_free(out);
+    }
+    stbi_image_free(reference);
+
+    stbi_uc *pixels = NULL;
+    for (int fast = 0; fast < 2; fast++) {
+      char label[32];
+      double ms;
+      snprintf(label, sizeof(label), "PNG %s", labels[fast]);
+      stbi_set_fast_inflate(fast);
+      stbi_uc *decoded = bench_decode(label, file, len, 4, &w, &h, &ms);
+      if (!decoded)
+        return 1;
+      if (!pixels) {
+        printf("\n");
+        pixels = decoded;
+        original_ms = ms;
+        continue;
+      }
+      printf("   x%.2f%s\n", original_ms / ms,
+             memcmp(decoded, pixels, (size_t) w * h * 4) ? "   MISMATCH vs original" : "");
+      stbi_image_free(decoded);
+    }
+    stbi_image_free(pixels);
+    free(idat);
+    free(file);
+  }
+  stbi_set_fast_inflate(1);
+  return 0;
+}
+
+#define UNFILTER_ROW 8192 // bytes per scanline
+#define UNFILTER_ROWS 256
+
+// Unfilters rows of random bytes, each one against the last one unfiltered as
+// its prior row, over and over. Leaves the result in out
+void bench_unfilter(const char *label, stbi__unfilter_kernel kernel, int bpp,
+                    const stbi_uc *raw, stbi_uc *out, const stbi_uc *reference) {
+  int runs = 0;
+  double t0 = bench_clock(), elapsed;
+  do {
+    for (int j = 1; j < UNFILTER_ROWS; j++) {
+      stbi_uc *cur = out + j * UNFILTER_ROW;
+      memcpy(cur, raw + j * UNFILTER_ROW, bpp); // first pixel, as the decoder does
+      kernel(cur + bpp, raw + j * UNFILTER_ROW + bpp, cur - UNFILTER_ROW + bpp,
+             UNFILTER_ROW - bpp, bpp);
+    }
+    runs++;
+  } while ((elapsed = bench_clock() - t0) < BENCH_SECONDS);
+
+  printf("    %-6s %8.1f MB/s", label,
+         (double) (UNFILTER_ROWS - 1) * UNFILTER_ROW * runs / elapsed * 1e-6);
+  if (reference)
+    printf("%s", memcmp(out, reference, UNFILTER_ROWS * UNFILTER_ROW) ? "   MISMATCH vs C" : "");
+  printf("\n");
+}
+
+int bench_png_unfilter(int argc, char *argv[]) {
+  const char *default_files[] = { "watchmen_smiley.png", "watchmen_smiley_trans.png" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 2;
+  const char *filter_names[] = { "none", "Sub", "Up", "Avg", "Paeth" };
+  int best = stbi_simd_level();
+  printf("SIMD level: %s\n", level_names[best]);
+
+  stbi_uc *raw = (stbi_uc *) malloc(UNFILTER_ROWS * UNFILTER_ROW);
+  stbi_uc *out = (stbi_uc *) malloc(UNFILTER_ROWS * UNFILTER_ROW);
+  stbi_uc *reference = (stbi_uc *) malloc(UNFILTER_ROWS * UNFILTER_ROW);
+  srand(1);
+  for (int i = 0; i < UNFILTER_ROWS * UNFILTER_ROW; i++)
+    raw[i] = (stbi_uc) rand();
+
+  for (int bpp = 3; bpp <= 4; bpp++) {
+    for (int filter = STBI__F_sub; filter <= STBI__F_paeth; filter++) {
+      printf("  %s, %d bytes/pixel:\n", filter_names[filter], bpp);
+      // No AVX2 kernels, the SSE2 ones are used there
+      for (int level = STBI_SIMD_NONE; level <= best && level <= STBI_SIMD_SSE2; level++) {
+        stbi__unfilter_kernel kernels[5];
+        stbi_set_simd_limit(level);
+        stbi__png_unfilter_kernels(kernels, bpp);
+        memcpy(out, raw, UNFILTER_ROW); // taken as the first row, unfiltered
+        bench_unfilter(level_names[level], kernels[filter], bpp, raw, out,
+                       level ? reference : NULL);
+        if (!level)
+          memcpy(reference, out, UNFILTER_ROWS * UNFILTER_ROW);
+      }
+    }
+  }
+  free(reference);
+  free(out);
+  free(raw);
+
+  for (int f = 0; f < num_files; f++) {
+    int len, w, h, n;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file || !stbi_info_from_memory(file, len, &w, &h, &n))
+      return 1;
+
+    printf("%s, %d channels:\n", files[f], n);
+    stbi_uc *pixels = NULL;
+    for (int level = STBI_SIMD_NONE; level <= best; level++) {
+      char label[32];
+      snprintf(label, sizeof(label), "decode %s", level_names[level]);
+      stbi_set_simd_limit(level);
+      stbi_uc *decoded = bench_decode(label, file, len, n, &w, &h, NULL);
+      if (!decoded)
+        return 1;
+      if (!pixels) {
+        pixels = decoded;
+        continue;
+      }
+      if (memcmp(decoded, pixels, (size_t) w * h * n))
+        printf("    (MISMATCH vs C)\n");
+      stbi_image_free(decoded);
+    }
+    stbi_image_free(pixels);
+    free(file);
+  }
+  stbi_set_simd_limit(STBI_SIMD_AVX2);
+  return 0;
+}
+
+#define MMAP_COPIES 1000 // of each demo texture, without a directory
+#define MMAP_OTHER_COPIES 10 // of each file in other formats made from them
+
+static void put16le(FILE *f, int v) {
+  fputc(v & 255, f);
+  fputc((v >> 8) & 255, f);
+}
+
+static void put32le(FILE *f, int v) {
+  put16le(f, v & 0xffff);
+  put16le(f, (v >> 16) & 0xffff);
+}
+
+// 24-bit uncompressed BMP, rows bottom-up padded to 4 bytes
+int write_bmp(const char *path, const stbi_uc *rgb, int w, int h) {
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return 0;
+  int pad = (4 - w * 3 % 4) % 4;
+  fputc('B', f);
+  fputc('M', f);
+  put32le(f, 54 + (w * 3 + pad) * h);
+  put32le(f, 0);
+  put32le(f, 54);                     // pixel data offset
+  put32le(f, 40);                     // BITMAPINFOHEADER
+  put32le(f, w);
+  put32le(f, h);
+  put16le(f, 1);
+  put16le(f, 24);
+  for (int i = 0; i < 6; i++)         // BI_RGB, sizes, resolution, palette
+    put32le(f, 0);
+  for (int y = h - 1; y >= 0; y--) {
+    for (int x = 0; x < w; x++) {
+      const stbi_uc *p = rgb + ((size_t) y * w + x) * 3;
+      fputc(p[2], f);
+      fputc(p[1], f);
+      fputc(p[0], f);
+    }
+    for (int i = 0; i < pad; i++)
+      fputc(0, f);
+  }
+  return fclose(f) == 0;
+}
+
+// Truecolor TGA of 3 or 4 channels, top-down, run-length encoded or not
+int write_tga(const char *path, const stbi_uc *pixels, int w, int h, int n, int rle) {
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return 0;
+  const unsigned char header[12] = { 0, 0, (unsigned char) (rle ? 10 : 2) };
+  fwrite(header, 1, sizeof(header), f);
+  put16le(f, w);
+  put16le(f, h);
+  fputc(n * 8, f);
+  fputc(0x20 | (n == 4 ? 8 : 0), f);  // top-down, alpha bits
+  for (size_t i = 0, count = (size_t) w * h; i < count;) {
+    const stbi_uc *p = pixels + i * n;
+    size_t run = 1;
+    if (rle) {
+      while (i + run < count && run < 128 && !memcmp(p, p + run * n, n))
+        run++;
+      fputc(run > 1 ? 0x80 | (int) (run - 1) : 0, f);
+    }
+    fputc(p[2], f);
+    fputc(p[1], f);
+    fputc(p[0], f);
+    if (n == 4)
+      fputc(p[3], f);
+    i += run;
+  }
+  return fclose(f) == 0;
+}
+
+// GIF with a 3-3-2 RGB palette. LZW codes stay 9 bits wide: a clear code
+// every 254 pixels keeps the table from growing
+int write_gif(const char *path, const stbi_uc *rgb, int w, int h) {
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return 0;
+  fwrite("GIF89a", 1, 6, f);
+  put16le(f, w);
+  put16le(f, h);
+  fputc(0xf7, f);                     // global palette of 256 colors
+  fputc(0, f);
+  fputc(0, f);
+  for (int i = 0; i < 256; i++) {
+    fputc((i >> 5) * 255 / 7, f);
+    fputc(((i >> 2) & 7) * 255 / 7, f);
+    fputc((i & 3) * 255 / 3, f);
+  }
+  fputc(',', f);
+  put16le(f, 0);
+  put16le(f, 0);
+  put16le(f, w);
+  put16le(f, h);
+  fputc(0, f);
+  fputc(8, f);                        // LZW minimum code size
+
+  unsigned char block[255];
+  int block_len = 0, bits = 0;
+  unsigned int buffer = 0;
+  size_t count = (size_t) w * h;
+  for (size_t i = 0; i <= count; i++) {
+    int codes[2], num_codes = 0;
+    if (i % 254 == 0)
+      codes[num_codes++] = 256;       // clear
+    if (i < count) {
+      const stbi_uc *p = rgb + i * 3;
+      codes[num_codes++] = (p[0] >> 5) << 5 | (p[1] >> 5) << 2 | p[2] >> 6;
+    } else {
+      codes[num_codes++] = 257;       // end of information
+    }
+    for (int c = 0; c < num_codes; c++) {
+      buffer |= (unsigned int) codes[c] << bits;
+      for (bits += 9; bits >= 8; bits -= 8, buffer >>= 8) {
+        block[block_len++] = buffer & 255;
+        if (block_len == 255) {
+          fputc(block_len, f);
+          fwrite(block, 1, block_len, f);
+          block_len = 0;
+        }
+      }
+    }
+  }
+  if (bits)
+    block[block_len++] = buffer & 255;
+  if (block_len) {
+    fputc(block_len, f);
+    fwrite(block, 1, block_len, f);
+  }
+  fputc(0, f);
+  fputc(';', f);
+  return fclose(f) == 0;
+}
+
+// Binary PPM
+int write_pnm(const char *path, const stbi_uc *rgb, int w, int h) {
+  FILE *f = fopen(path, "wb");
+  if (!f)
+    return 0;
+  fprintf(f, "P6\n%d %d\n255\n", w, h);
+  fwrite(rgb, 1, (size_t) w * h * 3, f);
+  return fclose(f) == 0;
+}
+
+// Files in other formats, made from the demos' textures
+int write_other_formats(const char *dir) {
+  int w, h, tw, th, n;
+  stbi_uc *rgb = stbi_load("texture.jpg", &w, &h, &n, 3);
+  stbi_uc *rgba = stbi_load("watchmen_smiley_trans.png", &tw, &th, &n, 4);
+  int ok = rgb && rgba;
+
+  for (int i = 0; ok && i < MMAP_OTHER_COPIES; i++) {
+    char path[64];
+    snprintf(path, sizeof(path), "%s/3-%04d.bmp", dir, i);
+    ok = write_bmp(path, rgb, w, h);
+    snprintf(path, sizeof(path), "%s/4-%04d.tga", dir, i);
+    ok = ok && write_tga(path, rgb, w, h, 3, 0);
+    snprintf(path, sizeof(path), "%s/5-%04d.tga", dir, i);
+    ok = ok && write_tga(path, rgba, tw, th, 4, 1);
+    snprintf(path, sizeof(path), "%s/6-%04d.gif", dir, i);
+    ok = ok && write_gif(path, rgb, w, h);
+    snprintf(path, sizeof(path), "%s/7-%04d.ppm", dir, i);
+    ok = ok && write_pnm(path, rgb, w, h);
+  }
+  if (!ok)
+    fprintf(stderr, "ERROR: could not write the BMP, TGA, GIF and PNM files\n");
+  stbi_image_free(rgba);
+  stbi_image_free(rgb);
+  return ok;
+}
+
+// Decodes every file through stdio and through a mapping. Returns the
+// number of files decoding differently (or only one way)
+int compare_mmap_loads(char **paths, int count) {
+  int mismatches = 0;
+  for (int i = 0; i < count; i++) {
+    int w[2], h[2], n[2];
+    stbi_uc *pixels[2];
+    for (int mapped = 0; mapped < 2; mapped++) {
+      stbi_set_mmap_files(mapped);
+      pixels[mapped] = stbi_load(paths[i], &w[mapped], &h[mapped], &n[mapped], 0);
+      if (!pixels[mapped])
+        printf("    %s: %s with %s\n", paths[i], stbi_failure_reason(), mapped ? "mmap" : "stdio");
+    }
+    if (pixels[0] || pixels[1]) {
+      if (!pixels[0] || !pixels[1] || w[0] != w[1] || h[0] != h[1] || n[0] != n[1] ||
+          memcmp(pixels[0], pixels[1], (size_t) w[0] * h[0] * n[0])) {
+        printf("    %s: MISMATCH between stdio and mmap\n", paths[i]);
+        mismatches++;
+      }
+    }
+    stbi_image_free(pixels[0]);
+    stbi_image_free(pixels[1]);
+  }
+  stbi_set_mmap_files(1);
+  return mismatches;
+}
+
+int compare_strings(const void *a, const void *b) {
+  return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// Paths of the files in dir, sorted
+char **list_dir(const char *dir, int *count) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    fprintf(stderr, "ERROR: could not open %s\n", dir);
+    return NULL;
+  }
+  char **paths = NULL;
+  int capacity = 0;
+  struct dirent *entry;
+  *count = 0;
+  while ((entry = readdir(d))) {
+    if (entry->d_name[0] == '.')
+      continue;
+    if (*count == capacity) {
+      capacity = capacity ? 2 * capacity : 1024;
+      paths = (char **) realloc(paths, capacity * sizeof(char *));
+    }
+    paths[*count] = (char *) malloc(strlen(dir) + strlen(entry->d_name) + 2);
+    sprintf(paths[*count], "%s/%s", dir, entry->d_name);
+    (*count)++;
+  }
+  closedir(d);
+  qsort(paths, *count, sizeof(char *), compare_strings);
+  return paths;
+}
+
+// Drops the files' pages from the page cache, so the next pass reads the disk
+void evict_files(char **paths, int count) {
+  for (int i = 0; i < count; i++) {
+    int fd = open(paths[i], O_RDONLY);
+    if (fd >= 0) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+      close(fd);
+    }
+  }
+}
+
+// stbi_load() of every file. Returns a checksum of the pixels, for
+// comparing passes
+unsigned bench_files(const char *label, char **paths, int count) {
+  unsigned checksum = 0;
+  int failed = 0;
+  double bytes = 0.0;
+
+  double t0 = bench_clock();
+  for (int i = 0; i < count; i++) {
+    int w, h, n;
+    stbi_uc *pixels = stbi_load(paths[i], &w, &h, &n, 0);
+    if (!pixels) {
+      failed++;
+      continue;
+    }
+    for (size_t j = 0; j < (size_t) w * h * n; j += 4099)
+      checksum = checksum * 31 + pixels[j];
+    bytes += (double) w * h * n;
+    stbi_image_free(pixels);
+  }
+  double elapsed = bench_clock() - t0;
+
+  printf("  %-16s %8.1f ms %7.1f files/s %7.3f ms/file %8.1f MB/s", label, elapsed * 1e3,
+         count / elapsed, elapsed / count * 1e3, bytes / elapsed * 1e-6);
+  if (failed)
+    printf("   (%d failed)", failed);
+  printf("\n");
+  return checksum;
+}
+
+int bench_mmap(int argc, char *argv[]) {
+  const char *textures[] = { "texture.jpg", "watchmen_smiley.png", "watchmen_smiley_trans.png" };
+  char tmpdir[] = "/tmp/imgbench-XXXXXX";
+  const char *dir = argc ? argv[0] : tmpdir;
+
+  if (!argc) {
+    if (!mkdtemp(tmpdir)) {
+      fprintf(stderr, "ERROR: could not create a temporary directory\n");
+      return 1;
+    }
+    for (int t = 0; t < 3; t++) {
+      int len;
+      unsigned char *file = read_file(textures[t], &len);
+      if (!file)
+        return 1;
+      for (int i = 0; i < MMAP_COPIES; i++) {
+        char path[64];
+        snprintf(path, sizeof(path), "%s/%d-%04d%s", tmpdir, t, i, strrchr(textures[t], '.'));
+        FILE *f = fopen(path, "wb");
+        if (!f || fwrite(file, 1, len, f) != (size_t) len) {
+          fprintf(stderr, "ERROR: could not write %s\n", path);
+          return 1;
+        }
+        fclose(f);
+      }
+      free(file);
+    }
+    if (!write_other_formats(tmpdir))
+      return 1;
+  }
+
+  int count;
+  char **paths = list_dir(dir, &count);
+  if (!paths)
+    return 1;
+  printf("%s: %d files\n", dir, count);
+
+  const char *modes[] = { "stdio", "mmap" };
+  unsigned checksums[2];
+  for (int mapped = 0; mapped < 2; mapped++) {
+    char label[32];
+    stbi_set_mmap_files(mapped);
+    evict_files(paths, count);
+    snprintf(label, sizeof(label), "load %s cold", modes[mapped]);
+    checksums[mapped] = bench_files(label, paths, count);
+    snprintf(label, sizeof(label), "load %s", modes[mapped]);
+    if (bench_files(label, paths, count) != checksums[mapped])
+      printf("    (MISMATCH vs cold load)\n");
+  }
+  if (checksums[0] != checksums[1])
+    printf("  MISMATCH between stdio and mmap\n");
+  stbi_set_mmap_files(1);
+
+  // Every file, whatever its format, must decode the same both ways
+  int mismatches = compare_mmap_loads(paths, count);
+  printf("  stdio against mmap: %d of %d files differ\n", mismatches, count);
+  if (checksums[0] != checksums[1])
+    mismatches++;
+
+  for (int i = 0; i < count; i++) {
+    if (!argc)
+      remove(paths[i]);
+    free(paths[i]);
+  }
+  free(paths);
+  if (!argc)
+    rmdir(tmpdir);
+  return mismatches ? 1 : 0;
+}
+
+#define ARENA_MAX (256 << 20)
+#define ARENA_DECODES 4096 // max decodes timed per case
+
+int compare_doubles(const void *a, const void *b) {
+  double x = *(const double *) a, y = *(const double *) b;
+  return x < y ? -1 : x > y;
+}
+
+int bench_arena(int argc, char *argv[]) {
+  const char *default_files[] = { "texture.jpg", "watchmen_smiley.png", "watchmen_smiley_trans.png" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 3;
+  const char *labels[] = { "malloc", "arena" };
+  double *times[2];
+  times[0] = (double *) malloc(2 * ARENA_DECODES * sizeof(double));
+  times[1] = times[0] + ARENA_DECODES;
+
+  for (int f = 0; f < num_files; f++) {
+    int len, w, h;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file)
+      return 1;
+
+    // Rounds of decodes with and without the arena take turns, so both see
+    // the same machine state (other load, the allocator's own caches), and
+    // the medians are compared: single runs of each vary more than they
+    // differ. Turning the arena off releases it, so each round starts with
+    // an untimed decode growing it again
+    stbi_uc *pixels[2] = { NULL, NULL };
+    size_t mallocs[2] = { 0, 0 };
+    int decodes[2] = { 0, 0 };
+    double t0 = bench_clock();
+    do {
+      for (int arena = 0; arena < 2; arena++) {
+        stbi_set_thread_arena(arena ? ARENA_MAX : 0);
+        stbi_image_free(stbi_load_from_memory(file, len, &w, &h, NULL, 4));
+        double round = bench_clock();
+        do {
+          size_t before = heap_mallocs;
+          double t = bench_clock();
+          stbi_uc *decoded = stbi_load_from_memory(file, len, &w, &h, NULL, 4);
+          times[arena][decodes[arena]++] = bench_clock() - t;
+          mallocs[arena] += heap_mallocs - before;
+          if (!decoded) {
+            fprintf(stderr, "ERROR: %s\n", stbi_failure_reason());
+            return 1;
+          }
+          stbi_image_free(pixels[arena]);
+          pixels[arena] = decoded;
+        } while (decodes[arena] < ARENA_DECODES && bench_clock() - round < BENCH_SECONDS / 10);
+      }
+    } while (decodes[1] < ARENA_DECODES && bench_clock() - t0 < 2 * BENCH_SECONDS);
+
+    printf("%s:\n", files[f]);
+    double median[2];
+    for (int arena = 0; arena < 2; arena++) {
+      qsort(times[arena], decodes[arena], sizeof(double), compare_doubles);
+      median[arena] = times[arena][decodes[arena] / 2] * 1e3;
+      printf("  %-12s %7.2f ms/decode %8.1f MB/s %4d mallocs/decode", labels[arena], median[arena],
+             (double) w * h * 4 / (median[arena] * 1e3), (int) (mallocs[arena] / decodes[arena]));
+      if (!arena)
+        printf("\n");
+    }
+    printf("   x%.2f%s\n", median[0] / median[1],
+           memcmp(pixels[0], pixels[1], (size_t) w * h * 4) ? "   MISMATCH vs malloc" : "");
+    stbi_image_free(pixels[0]);
+    stbi_image_free(pixels[1]);
+    free(file);
+  }
+  stbi_set_thread_arena(0);
+  free(times[0]);
+  return 0;
+}
+
+int bench_flip(int argc, char *argv[]) {
+  const char *default_files[] = { "texture.jpg", "watchmen_smiley.png", "watchmen_smiley_trans.png" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 3;
+  int best = stbi_simd_level();
+
+  for (int f = 0; f < num_files; f++) {
+    int len, w, h;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file)
+      return 1;
+
+    printf("%s:\n", files[f]);
+    for (int channels = 3; channels <= 4; channels++) {
+      double ms, flip_ms;
+      char label[32];
+      stbi_image_free(stbi_load_from_memory(file, len, &w, &h, NULL, channels)); // warm up
+      snprintf(label, sizeof(label), "%d ch", channels);
+      stbi_uc *pixels = bench_decode(label, file, len, channels, &w, &h, &ms);
+      if (!pixels)
+        return 1;
+      printf("\n");
+
+      snprintf(label, sizeof(label), "%d ch flip", channels);
+      stbi_set_flip_vertically_on_load(1);
+      stbi_uc *flipped = bench_decode(label, file, len, channels, &w, &h, &flip_ms);
+      stbi_set_flip_vertically_on_load(0);
+      if (!flipped)
+        return 1;
+
+      // what flipping used to cost on top of the decode. An odd number of
+      // passes leaves pixels flipped
+      int passes = 0;
+      double t0 = bench_clock(), elapsed;
+      do {
+        stbi__vertical_flip(pixels, w, h, channels);
+        passes++;
+      } while ((elapsed = bench_clock() - t0) < BENCH_SECONDS || passes % 2 == 0);
+      printf("   x%.2f   (flip pass %.2f ms)%s\n", ms / flip_ms, elapsed / passes * 1e3,
+             memcmp(flipped, pixels, (size_t) w * h * channels) ? "   MISMATCH vs flip pass" : "");
+      stbi_image_free(flipped);
+      stbi_image_free(pixels);
+
+      // Flipped decodes at every SIMD level, against flipping the unflipped one
+      printf("    flipped at");
+      for (int level = STBI_SIMD_NONE; level <= best; level++) {
+        stbi_set_simd_limit(level);
+        pixels = stbi_load_from_memory(file, len, &w, &h, NULL, channels);
+        stbi_set_flip_vertically_on_load(1);
+        flipped = stbi_load_from_memory(file, len, &w, &h, NULL, channels);
+        stbi_set_flip_vertically_on_load(0);
+        if (!pixels || !flipped)
+          return 1;
+        stbi__vertical_flip(pixels, w, h, channels);
+        printf(" %s%s", level_names[level],
+               memcmp(flipped, pixels, (size_t) w * h * channels) ? " (MISMATCH)" : "");
+        stbi_image_free(flipped);
+        stbi_image_free(pixels);
+      }
+      stbi_set_simd_limit(STBI_SIMD_AVX2);
+      printf("\n");
+    }
+    free(file);
+  }
+  return 0;
+}
+
+#define CONVERT_WIDTH 8192 // an 8K texture
+#define CONVERT_ROWS 64
+
+// Converts all the rows of src over and over. Leaves the result in out
+void bench_convert(const char *label, int img_n, int req_comp, int bytes, const void *src,
+                   void *out, const void *reference) {
+  stbi__convert_kernel kernel = bytes == 1 ? stbi__convert_row_kernel(img_n, req_comp) : NULL;
+  stbi__convert_kernel16 kernel16 = bytes == 2 ? stbi__convert_row_kernel16(img_n, req_comp) : NULL;
+  size_t in_row = (size_t) CONVERT_WIDTH * img_n * bytes, out_row = (size_t) CONVERT_WIDTH * req_comp * bytes;
+  int runs = 0;
+
+  double t0 = bench_clock(), elapsed;
+  do {
+    for (int j = 0; j < CONVERT_ROWS; j++) {
+      const stbi_uc *in = (const stbi_uc *) src + j * in_row;
+      stbi_uc *to = (stbi_uc *) out + j * out_row;
+      if (bytes == 1)
+        stbi__convert_row(in, to, img_n, req_comp, CONVERT_WIDTH, kernel);
+      else
+        stbi__convert_row16((const stbi__uint16 *) in, (stbi__uint16 *) to, img_n, req_comp,
+                            CONVERT_WIDTH, kernel16);
+    }
+    runs++;
+  } while ((elapsed = bench_clock() - t0) < BENCH_SECONDS);
+
+  printf("    %-6s %8.1f MB/s", label, (double) CONVERT_ROWS * out_row * runs / elapsed * 1e-6);
+  if (reference)
+    printf("%s", memcmp(out, reference, CONVERT_ROWS * out_row) ? "   MISMATCH vs C" : "");
+  printf("\n");
+}
+
+int bench_convert_formats(int argc, char *argv[]) {
+  const char *default_files[] = { "watchmen_smiley.png", "watchmen_smiley_trans.png" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 2;
+  // the conversions with SIMD kernels
+  const int conversions8[][2] = { { 1, 2 }, { 1, 3 }, { 1, 4 }, { 2, 1 }, { 2, 4 },
+                                  { 3, 1 }, { 3, 4 }, { 4, 1 }, { 4, 2 }, { 4, 3 } };
+  const int conversions16[][2] = { { 1, 2 }, { 1, 4 }, { 2, 4 }, { 3, 4 }, { 4, 3 } };
+  int best = stbi_simd_level();
+  printf("SIMD level: %s\n", level_names[best]);
+
+  size_t size = (size_t) CONVERT_WIDTH * CONVERT_ROWS * 4 * 2;
+  stbi_uc *src = (stbi_uc *) malloc(size);
+  stbi_uc *out = (stbi_uc *) malloc(size);
+  stbi_uc *reference = (stbi_uc *) malloc(size);
+  srand(1);
+  for (size_t i = 0; i < size; i++)
+    src[i] = (stbi_uc) rand();
+
+  for (int bytes = 1; bytes <= 2; bytes++) {
+    int count = bytes == 1 ? 10 : 5;
+    for (int c = 0; c < count; c++) {
+      int img_n = bytes == 1 ? conversions8[c][0] : conversions16[c][0];
+      int req_comp = bytes == 1 ? conversions8[c][1] : conversions16[c][1];
+      void *last = NULL;
+      printf("  %d -> %d components, %d bits:\n", img_n, req_comp, bytes * 8);
+      for (int level = STBI_SIMD_NONE; level <= best; level++) {
+        stbi_set_simd_limit(level);
+        void *kernel = bytes == 1 ? (void *) stbi__convert_row_kernel(img_n, req_comp)
+                                  : (void *) stbi__convert_row_kernel16(img_n, req_comp);
+        if (level && kernel == last)
+          continue; // no kernel for this level, same as the one below
+        last = kernel;
+        bench_convert(level_names[level], img_n, req_comp, bytes, src, out, level ? reference : NULL);
+        if (!level)
+          memcpy(reference, out, size);
+      }
+    }
+  }
+  free(reference);
+  free(out);
+  free(src);
+
+  for (int f = 0; f < num_files; f++) {
+    int len, w, h;
+    unsigned char *file = read_file(files[f], &len);
+    if (!file)
+      return 1;
+
+    printf("%s:\n", files[f]);
+    stbi_uc *pixels = NULL;
+    for (int level = STBI_SIMD_NONE; level <= best; level++) {
+      char label[32];
+      snprintf(label, sizeof(label), "RGBA %s", level_names[level]);
+      stbi_set_simd_limit(level);
+      stbi_uc *decoded = bench_decode(label, file, len, 4, &w, &h, NULL);
+      if (!decoded)
+        return 1;
+      if (!pixels) {
+        pixels = decoded;
+        continue;
+      }
+      if (memcmp(decoded, pixels, (size_t) w * h * 4))
+        printf("    (MISMATCH vs C)\n");
+      stbi_image_free(decoded);
+    }
+    stbi_image_free(pixels);
+    free(file);
+  }
+  stbi_set_simd_limit(STBI_SIMD_AVX2);
+  return 0;
+}
+
+GLenum gl_format(int channels) {
+  return channels == 1 ? GL_RED : channels == 2 ? GL_RG : channels == 3 ? GL_RGB : GL_RGBA;
+}
+
+// Builds the mip chain over and over. Returns ms per chain
+double bench_mipmap_chain(const stbi_uc *pixels, int w, int h, int channels, unsigned char *chain,
+                          mipmap_filter_t filter, int threads) {
+  int runs = 0;
+  double t0 = bench_clock(), elapsed;
+  do {
+    mipmap_generate(pixels, w, h, channels, w * channels, chain, filter, threads);
+    runs++;
+  } while ((elapsed = bench_clock() - t0) < BENCH_SECONDS);
+  return elapsed / runs * 1e3;
+}
+
+// Uploads level 0 and has the driver build the rest (chain NULL), or
+// builds them on the CPU and uploads them too, over and over. Returns ms
+// per texture, glFinish() included
+double bench_mipmap_gl(const stbi_uc *pixels, int w, int h, int channels, unsigned char *chain) {
+  GLenum format = gl_format(channels);
+  int runs = 0;
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  double t0 = bench_clock(), elapsed;
+  do {
+    glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format, GL_UNSIGNED_BYTE, pixels);
+    if (chain) {
+      mipmap_generate(pixels, w, h, channels, w * channels, chain, MIPMAP_BOX, 0);
+      mipmap_tex_levels(format, w, h, channels, chain);
+    } else {
+      glGenerateMipmap(GL_TEXTURE_2D);
+    }
+    glFinish();
+    runs++;
+  } while ((elapsed = bench_clock() - t0) < BENCH_SECONDS);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  return elapsed / runs * 1e3;
+}
+
+// Reads levels 1, 2... of the bound texture back, packed like mipmap_generate()
+void read_mipmap_levels(int w, int h, int channels, unsigned char *chain) {
+  glPixelStorei(GL_PACK_ALIGNMENT, 1);
+  for (int i = 1; w > 1 || h > 1; i++) {
+    w = w > 1 ? w / 2 : 1;
+    h = h > 1 ? h / 2 : 1;
+    glGetTexImage(GL_TEXTURE_2D, i, gl_format(channels), GL_UNSIGNED_BYTE, chain);
+    chain += (size_t) w * h * channels;
+  }
+  glPixelStorei(GL_PACK_ALIGNMENT, 4);
+}
+
+double psnr(const unsigned char *a, const unsigned char *b, size_t n) {
+  double error = 0.0;
+  for (size_t i = 0; i < n; i++)
+    error += (double) (a[i] - b[i]) * (a[i] - b[i]);
+  error /= n;
+  return error > 0.0 ? 10.0 * log10(255.0 * 255.0 / error) : 99.0;
+}
+
+int bench_mipmap(int argc, char *argv[]) {
+  const char *default_files[] = { "texture.jpg", "watchmen_smiley.png", "watchmen_smiley_trans.png" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 3;
+  const char *filter_names[] = { "none", "box", "Kaiser" };
+  int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  printf("%d CPUs online\n", cpus);
+
+  stbi_uc **images = (stbi_uc **) malloc(num_files * sizeof(stbi_uc *));
+  int *widths = (int *) malloc(num_files * 3 * sizeof(int));
+  int *heights = widths + num_files, *channels = heights + num_files;
+  for (int f = 0; f < num_files; f++) {
+    images[f] = stbi_load(files[f], &widths[f], &heights[f], &channels[f], 0);
+    if (!images[f]) {
+      fprintf(stderr, "ERROR: %s: %s\n", files[f], stbi_failure_reason());
+      return 1;
+    }
+  }
+
+  for (int f = 0; f < num_files; f++) {
+    int w = widths[f], h = heights[f], n = channels[f];
+    size_t size = mipmap_chain_size(w, h, n);
+    unsigned char *chain = (unsigned char *) malloc(size);
+    unsigned char *reference = (unsigned char *) malloc(size);
+
+    printf("%s, %dx%d, %d channels, %d levels:\n", files[f], w, h, n, mipmap_levels(w, h) + 1);
+    for (int filter = MIPMAP_BOX; filter <= MIPMAP_KAISER; filter++) {
+      double serial_ms = 0.0;
+      for (int simd = 0; simd <= 1; simd++) {
+        for (int threads = 1; threads <= 2 * cpus || threads <= 4; threads *= 2) {
+          if (!simd && threads > 1)
+            break;
+          mipmap_set_simd(simd);
+          double ms = bench_mipmap_chain(images[f], w, h, n, chain, (mipmap_filter_t) filter,
+                                         threads);
+          printf("  %-6s %-4s %2d thread%s %7.2f ms/chain %8.1f MB/s", filter_names[filter],
+                 simd ? "SSE2" : "C", threads, threads > 1 ? "s" : " ", ms,
+                 (double) w * h * n / (ms * 1e3));
+          if (!serial_ms) {
+            printf("\n");
+            serial_ms = ms;
+            memcpy(reference, chain, size);
+            continue;
+          }
+          printf("   x%.2f%s\n", serial_ms / ms,
+                 memcmp(chain, reference, size) ? "   MISMATCH vs C" : "");
+        }
+      }
+    }
+    mipmap_set_simd(1);
+    free(reference);
+    free(chain);
+  }
+
+  // The driver's mipmaps
+  headless_t hl;
+  headless_defaults(&hl);
+  hl.ring = 0;
+  if (!headless_init(&hl, 16, 16))
+    return 1;
+  printf("%s, %s\n", (const char *) glGetString(GL_RENDERER), (const char *) glGetString(GL_VERSION));
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  for (int f = 0; f < num_files; f++) {
+    int w = widths[f], h = heights[f], n = channels[f];
+    size_t size = mipmap_chain_size(w, h, n);
+    unsigned char *chain = (unsigned char *) malloc(size);
+    unsigned char *driver = (unsigned char *) malloc(size);
+
+    printf("%s:\n", files[f]);
+    double gl_ms = bench_mipmap_gl(images[f], w, h, n, NULL);
+    printf("  glGenerateMipmap      %7.2f ms/texture\n", gl_ms);
+    read_mipmap_levels(w, h, n, driver);
+
+    double cpu_ms = bench_mipmap_gl(images[f], w, h, n, chain);
+    printf("  CPU box, %2d thread%s   %7.2f ms/texture   x%.2f\n", cpus, cpus > 1 ? "s" : " ",
+           cpu_ms, gl_ms / cpu_ms);
+    // What was uploaded must read back unchanged
+    unsigned char *uploaded = (unsigned char *) malloc(size);
+    read_mipmap_levels(w, h, n, uploaded);
+    if (memcmp(uploaded, chain, size))
+      printf("    (MISMATCH uploaded levels)\n");
+    free(uploaded);
+
+    for (int filter = MIPMAP_BOX; filter <= MIPMAP_KAISER; filter++) {
+      mipmap_generate(images[f], w, h, n, w * n, chain, (mipmap_filter_t) filter, 0);
+      printf("  CPU %-6s PSNR vs driver levels %6.2f dB\n", filter_names[filter],
+             psnr(chain, driver, size));
+    }
+    free(driver);
+    free(chain);
+  }
+  glDeleteTextures(1, &texture);
+  eglMakeCurrent(hl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(hl.display, hl.context);
+  eglTerminate(hl.display);
+
+  for (int f = 0; f < num_files; f++)
+    stbi_image_free(images[f]);
+  free(widths);
+  free(images);
+  return 0;
+}
+
+// Compresses the image over and over. Returns ms per image
+double bench_bc_compress(const stbi_uc *pixels, int w, int h, int channels, unsigned char *blocks,
+                         bcenc_mode_t mode, int threads) {
+  int runs = 0;
+  double t0 = bench_clock(), elapsed;
+  do {
+    bcenc_compress(pixels, w, h, channels, w * channels, blocks, mode, threads);
+    runs++;
+  } while ((elapsed = bench_clock() - t0) < BENCH_SECONDS);
+  return elapsed / runs * 1e3;
+}
+
+// Uploads level 0, compressed (blocks) or not, over and over. Returns ms
+// per texture, glFinish() included
+double bench_bc_gl(const stbi_uc *pixels, int w, int h, int channels, const unsigned char *blocks) {
+  GLenum format = gl_format(channels);
+  int runs = 0;
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  double t0 = bench_clock(), elapsed;
+  do {
+    if (blocks)
+      glCompressedTexImage2D(GL_TEXTURE_2D, 0, bcenc_format(channels), w, h, 0,
+                             (GLsizei) bcenc_size(w, h, channels), blocks);
+    else
+      glTexImage2D(GL_TEXTURE_2D, 0, format, w, h, 0, format, GL_UNSIGNED_BYTE, pixels);
+    glFinish();
+    runs++;
+  } while ((elapsed = bench_clock() - t0) < BENCH_SECONDS);
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  return elapsed / runs * 1e3;
+}
+
+int bench_bc(int argc, char *argv[]) {
+  const char *default_files[] = { "texture.jpg", "watchmen_smiley_trans.png" };
+  const char **files = argc ? (const char **) argv : default_files;
+  int num_files = argc ? argc : 2;
+  const char *mode_names[] = { "none", "fast", "quality" };
+  int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  printf("%d CPUs online\n", cpus);
+
+  // Only RGB and RGBA, 1 and 2 channel files are expanded to them
+  stbi_uc **images = (stbi_uc **) malloc(num_files * sizeof(stbi_uc *));
+  int *widths = (int *) malloc(num_files * 3 * sizeof(int));
+  int *heights = widths + num_files, *channels = heights + num_files;
+  for (int f = 0; f < num_files; f++) {
+    int n;
+    if (!stbi_info(files[f], &widths[f], &heights[f], &n)) {
+      fprintf(stderr, "ERROR: %s: %s\n", files[f], stbi_failure_reason());
+      return 1;
+    }
+    channels[f] = n == 2 || n == 4 ? 4 : 3;
+    images[f] = stbi_load(files[f], &widths[f], &heights[f], &n, channels[f]);
+    if (!images[f]) {
+      fprintf(stderr, "ERROR: %s: %s\n", files[f], stbi_failure_reason());
+      return 1;
+    }
+  }
+
+  for (int f = 0; f < num_files; f++) {
+    int w = widths[f], h = heights[f], n = channels[f];
+    size_t size = bcenc_size(w, h, n);
+    unsigned char *blocks = (unsigned char *) malloc(size);
+    unsigned char *reference = (unsigned char *) malloc(size);
+
+    printf("%s, %dx%d, %d channels, %s:\n", files[f], w, h, n, n == 4 ? "BC3" : "BC1");
+    for (int mode = BCENC_FAST; mode <= BCENC_QUALITY; mode++) {
+      double serial_ms = 0.0;
+      for (int simd = 0; simd <= 1; simd++) {
+        for (int threads = 1; threads <= 2 * cpus || threads <= 4; threads *= 2) {
+          if (!simd && threads > 1)
+            break;
+          bcenc_set_simd(simd);
+          double ms = bench_bc_compress(images[f], w, h, n, blocks, (bcenc_mode_t) mode, threads);
+          printf("  %-7s %-4s %2d thread%s %7.2f ms/image %8.1f MB/s", mode_names[mode],
+                 simd ? "SSE2" : "C", threads, threads > 1 ? "s" : " ", ms,
+                 (double) w * h * n / (ms * 1e3));
+          if (!serial_ms) {
+            printf("   PSNR %6.2f dB\n", bcenc_psnr(images[f], w, h, n, w * n, blocks));
+            serial_ms = ms;
+            memcpy(reference, blocks, size);
+            continue;
+          }
+          printf("   x%.2f%s\n", serial_ms / ms,
+                 memcmp(blocks, reference, size) ? "   MISMATCH vs C" : "");
+        }
+      }
+    }
+    bcenc_set_simd(1);
+    free(reference);
+    free(blocks);
+  }
+
+  // Uploads, and the driver's decoding of the blocks
+  headless_t hl;
+  headless_defaults(&hl);
+  hl.ring = 0;
+  if (!headless_init(&hl, 16, 16))
+    return 1;
+  printf("%s, %s\n", (const char *) glGetString(GL_RENDERER), (const char *) glGetString(GL_VERSION));
+  if (!bcenc_supported()) {
+    printf("  no GL_EXT_texture_compression_s3tc\n");
+    return 0;
+  }
+
+  GLuint texture;
+  glGenTextures(1, &texture);
+  glBindTexture(GL_TEXTURE_2D, texture);
+  for (int f = 0; f < num_files; f++) {
+    int w = widths[f], h = heights[f], n = channels[f];
+    unsigned char *blocks = (unsigned char *) malloc(bcenc_size(w, h, n));
+    unsigned char *decoded = (unsigned char *) malloc((size_t) w * h * 4);
+    unsigned char *driver = (unsigned char *) malloc((size_t) w * h * 4);
+
+    printf("%s:\n", files[f]);
+    double raw_ms = bench_bc_gl(images[f], w, h, n, NULL);
+    printf("  glTexImage2D            %7.2f ms/texture %9zu bytes\n", raw_ms, (size_t) w * h * n);
+    bcenc_compress(images[f], w, h, n, w * n, blocks, BCENC_FAST, 0);
+    double bc_ms = bench_bc_gl(images[f], w, h, n, blocks);
+    printf("  glCompressedTexImage2D  %7.2f ms/texture %9zu bytes   x%.2f\n", bc_ms,
+           bcenc_size(w, h, n), raw_ms / bc_ms);
+
+    bcenc_decompress(blocks, w, h, n, decoded);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, GL_RGBA, GL_UNSIGNED_BYTE, driver);
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    if (memcmp(decoded, driver, (size_t) w * h * 4))
+      printf("    (driver decodes differently, PSNR %.2f dB)\n",
+             psnr(decoded, driver, (size_t) w * h * 4));
+    free(driver);
+    free(decoded);
+    free(blocks);
+  }
+  glDeleteTextures(1, &texture);
+  eglMakeCurrent(hl.display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+  eglDestroyContext(hl.display, hl.context);
+  eglTerminate(hl.display);
+
+  for (int f = 0; f < num_files; f++)
+    stbi_image_free(images[f]);
+  free(widths);
+  free(images);
+  return 0;
+}
+
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s <mode> [files...]\n", prog);
+  fprintf(stderr, "  jpeg-simd    IDCT/YCbCr kernels and JPEG decode at every SIMD level\n");
+  fprintf(stderr, "  jpeg-threads JPEG decode on 1, 2, 4... threads\n");
+  fprintf(stderr, "  jpeg-scaled  decode at 1/2, 1/4 and 1/8 of the full size\n");
+  fprintf(stderr, "  region       decode of tiles and halves of the image\n");
+  fprintf(stderr, "  rows         streaming decode to a row callback\n");
+  fprintf(stderr, "  inflate      fast and original inflate of PNG image data\n");
+  fprintf(stderr, "  png-unfilter PNG unfiltering kernels and PNG decode at every SIMD level\n");
+  fprintf(stderr, "  mmap         loading a directory of files with stdio and memory mapped\n");
+  fprintf(stderr, "  arena        decode with temporary buffers from malloc and from an arena\n");
+  fprintf(stderr, "  convert      channel conversion kernels and PNG decode to RGBA\n");
+  fprintf(stderr, "  flip         decode with and without vertical flipping\n");
+  fprintf(stderr, "  mipmap       CPU mip chains against glGenerateMipmap()\n");
+  fprintf(stderr, "  bc           BC1/BC3 compression, and uploads of the blocks\n");
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  if (!strcmp(argv[1], "jpeg-simd"))
+    return bench_jpeg_simd(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "jpeg-threads"))
+    return bench_jpeg_threads(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "jpeg-scaled"))
+    return bench_jpeg_scaled(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "region"))
+    return bench_region(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "rows"))
+    return bench_rows(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "inflate"))
+    return bench_inflate(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "png-unfilter"))
+    return bench_png_unfilter(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "mmap"))
+    return bench_mmap(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "arena"))
+    return bench_arena(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "convert"))
+    return bench_convert_formats(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "flip"))
+    return bench_flip(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "mipmap"))
+    return bench_mipmap(argc - 2, argv + 2);
+  if (!strcmp(argv[1], "bc"))
+    return bench_bc(argc - 2, argv + 2);
+
+  usage(argv[0]);
+  return 1;
+}
@@ -0,0 +1,459 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// Mipmap chains built on the CPU, instead of leaving glGenerateMipmap() to
+// the driver (single-threaded and slow on software GL, and whatever filter
+// the driver likes).
+//
+// Every level is filtered from the previous one in linear light: color
+// channels are decoded from sRGB through a table, filtered as floats and
+// encoded back, so downscaled textures don't darken; alpha is filtered as it
+// is. Two filters:
+//
+//   MIPMAP_BOX     average of each 2x2 block (odd sizes drop the last row or
+//                  column), cheap and what drivers usually do.
+//   MIPMAP_KAISER  separable 8-tap Kaiser-windowed sinc, sharper levels with
+//                  less aliasing. Taps past the edges repeat the edge pixels.
+//
+// Pixels are handled as 4 floats whatever the number of channels, so the
+// filters' inner loops are SSE2 on one pixel per register (generic C
+// otherwise, or after mipmap_set_simd(0)). The rows of each level are split
+// in bands filtered on separate threads; levels too small to pay for the
+// threads are filtered on the calling one. Levels are kept as floats only
+// until the next one is done, so peak memory is that of levels 1 and 2.
+//
+// mipmap_generate() writes levels 1, 2... down to 1x1, 8-bit and tightly
+// packed one after another (mipmap_chain_size() bytes), and
+// mipmap_tex_levels() uploads them below the level 0 already in the texture:
+//
+//   unsigned char *chain = malloc(mipmap_chain_size(width, height, channels));
+//   mipmap_generate(pixels, width, height, channels, width * channels, chain,
+//                   MIPMAP_BOX, 0);  // 0: one thread per CPU
+//   glTexImage2D(GL_TEXTURE_2D, 0, format, width, height, 0, format,
+//                GL_UNSIGNED_BYTE, pixels);
+//   mipmap_tex_levels(format, width, height, channels, chain);
+//   free(chain);
+
+#ifndef MIPMAP_H
+#define MIPMAP_H
+
+#include <GL/glew.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define MIPMAP_MAX_THREADS 64
+#define MIPMAP_BAND_PIXELS 16384 // min pixels of a level per thread
+#define MIPMAP_SRGB_STEPS 4096   // linear -> sRGB table entries
+#define MIPMAP_TAPS 8            // Kaiser filter taps
+#define MIPMAP_KAISER_ALPHA 4.0
+
+typedef enum {
+  MIPMAP_NONE,   // no mip levels, for texloader
+  MIPMAP_BOX,
+  MIPMAP_KAISER,
+} mipmap_filter_t;
+
+// One level to filter from the previous one
+typedef struct {
+  const unsigned char *pixels; // source, if it's level 0: 8-bit, rows of stride bytes
+  int stride;
+  const float *linear;         // source otherwise: 4 floats per pixel
+  int src_width, src_height;
+  float *dst;                  // the new level, 4 floats per pixel
+  unsigned char *out;          // and 8-bit, tightly packed
+  int width, height;
+  int channels;
+  int failed;                  // some band ran out of memory
+} mipmap_level_t;
+
+typedef void (*mipmap_rows_fn)(mipmap_level_t *level, int y0, int y1);
+
+typedef struct {
+  mipmap_rows_fn fn;
+  mipmap_level_t *level;
+  int y0, y1;
+} mipmap_band_t;
+
+static int mipmap_simd = 1;
+static pthread_once_t mipmap_tables_once = PTHREAD_ONCE_INIT;
+static float mipmap_to_linear[256];
+static unsigned char mipmap_to_srgb[MIPMAP_SRGB_STEPS];
+static float mipmap_kaiser[MIPMAP_TAPS];
+
+// Uses the SSE2 inner loops (the default, when compiled in) or generic C
+static inline void mipmap_set_simd(int enable) {
+  mipmap_simd = enable;
+}
+
+// Zeroth order modified Bessel function of the first kind
+static inline double mipmap_bessel_i0(double x) {
+  double sum = 1.0, term = 1.0;
+  for (int k = 1; k < 32; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+static inline void mipmap_init_tables(void) {
+  for (int i = 0; i < 256; i++) {
+    double c = i / 255.0;
+    mipmap_to_linear[i] = (float) (c <= 0.04045 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4));
+  }
+  for (int i = 0; i < MIPMAP_SRGB_STEPS; i++) {
+    double l = i / (double) (MIPMAP_SRGB_STEPS - 1);
+    double c = l <= 0.0031308 ? l * 12.92 : 1.055 * pow(l, 1 / 2.4) - 0.055;
+    mipmap_to_srgb[i] = (unsigned char) (c * 255 + 0.5);
+  }
+
+  // Halfway between source pixels: taps at -3.5 ... 3.5 source pixels of
+  // the destination pixel center, sinc for a 2x downscale
+  double sum = 0.0, w[MIPMAP_TAPS];
+  for (int k = 0; k < MIPMAP_TAPS; k++) {
+    double d = k - (MIPMAP_TAPS - 1) / 2.0, x = 3.14159265358979 * d / 2;
+    double t = d / (MIPMAP_TAPS / 2);
+    w[k] = sin(x) / x * mipmap_bessel_i0(MIPMAP_KAISER_ALPHA * sqrt(1 - t * t)) /
+           mipmap_bessel_i0(MIPMAP_KAISER_ALPHA);
+    sum += w[k];
+  }
+  for (int k = 0; k < MIPMAP_TAPS; k++)
+    mipmap_kaiser[k] = (float) (w[k] / sum);
+}
+
+// Number of levels below level 0, down to 1x1
+static inline int mipmap_levels(int width, int height) {
+  int levels = 0;
+  while (width > 1 || height > 1) {
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+    levels++;
+  }
+  return levels;
+}
+
+// Bytes of levels 1, 2... as written by mipmap_generate()
+static inline size_t mipmap_chain_size(int width, int height, int channels) {
+  size_t size = 0;
+  while (width > 1 || height > 1) {
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+    size += (size_t) width * height * channels;
+  }
+  return size;
+}
+
+// Row y of the source level as linear floats, decoded into buffer if the
+// source is 8-bit
+static inline const float *mipmap_source_row(const mipmap_level_t *level, int y, float *buffer) {
+  if (level->linear)
+    return level->linear + (size_t) y * level->src_width * 4;
+
+  const unsigned char *p = level->pixels + (size_t) y * level->stride;
+  int n = level->channels, color = n == 1 || n == 2 ? 1 : 3;
+  for (int x = 0; x < level->src_width; x++, p += n) {
+    float *q = buffer + x * 4;
+    q[0] = q[1] = q[2] = q[3] = 0.0f;
+    for (int c = 0; c < color; c++)
+      q[c] = mipmap_to_linear[p[c]];
+    for (int c = color; c < n; c++)
+      q[c] = p[c] * (1.0f / 255);
+  }
+  return buffer;
+}
+
+// Linear floats back to 8-bit: sRGB for color, straight for alpha
+static inline void mipmap_encode_row(const float *row, int width, int channels,
+                                     unsigned char *out) {
+  int color = channels == 1 || channels == 2 ? 1 : 3;
+
+#ifdef __SSE2__
+  if (mipmap_simd) {
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), half = _mm_set1_ps(0.5f);
+    const __m128 scale = color == 1 ? _mm_setr_ps(MIPMAP_SRGB_STEPS - 1, 255, 0, 0)
+                                    : _mm_setr_ps(MIPMAP_SRGB_STEPS - 1, MIPMAP_SRGB_STEPS - 1,
+                                                  MIPMAP_SRGB_STEPS - 1, 255);
+    int idx[4];
+    for (int x = 0; x < width; x++, out += channels) {
+      __m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(row + x * 4), zero), one);
+      v = _mm_add_ps(_mm_mul_ps(v, scale), half);
+      _mm_storeu_si128((__m128i *) idx, _mm_cvttps_epi32(v));
+      for (int c = 0; c < color; c++)
+        out[c] = mipmap_to_srgb[idx[c]];
+      for (int c = color; c < channels; c++)
+        out[c] = (unsigned char) idx[c];
+    }
+    return;
+  }
+#endif
+
+  for (int x = 0; x < width; x++, out += channels) {
+    for (int c = 0; c < channels; c++) {
+      float v = row[x * 4 + c];
+      v = v < 0.0f ? 0.0f : v > 1.0f ? 1.0f : v;
+      if (c < color)
+        out[c] = mipmap_to_srgb[(int) (v * (MIPMAP_SRGB_STEPS - 1) + 0.5f)];
+      else
+        out[c] = (unsigned char) (v * 255 + 0.5f);
+    }
+  }
+}
+
+// Average of 2x2 blocks of rows r0 and r1, src_width pixels wide
+static inline void mipmap_box_row(const float *r0, const float *r1, int src_width,
+                                  float *dst, int width) {
+  int step = src_width > 1 ? 4 : 0; // 1 pixel wide: both columns are the same
+
+#ifdef __SSE2__
+  if (mipmap_simd) {
+    const __m128 quarter = _mm_set1_ps(0.25f);
+    for (int x = 0; x < width; x++, r0 += 8, r1 += 8) {
+      __m128 s = _mm_add_ps(_mm_add_ps(_mm_loadu_ps(r0), _mm_loadu_ps(r0 + step)),
+                            _mm_add_ps(_mm_loadu_ps(r1), _mm_loadu_ps(r1 + step)));
+      _mm_storeu_ps(dst + x * 4, _mm_mul_ps(s, quarter));
+    }
+    return;
+  }
+#endif
+
+  for (int x = 0; x < width; x++, r0 += 8, r1 += 8)
+    for (int c = 0; c < 4; c++)
+      dst[x * 4 + c] = ((r0[c] + r0[step + c]) + (r1[c] + r1[step + c])) * 0.25f;
+}
+
+// Horizontal Kaiser pass of a row: src_width pixels down to width
+static inline void mipmap_kaiser_hrow(const float *src, int src_width, float *dst, int width) {
+#ifdef __SSE2__
+  if (mipmap_simd) {
+    __m128 w[MIPMAP_TAPS];
+    for (int k = 0; k < MIPMAP_TAPS; k++)
+      w[k] = _mm_set1_ps(mipmap_kaiser[k]);
+    for (int x = 0; x < width; x++) {
+      int x0 = 2 * x - (MIPMAP_TAPS / 2 - 1);
+      __m128 s = _mm_setzero_ps();
+      if (x0 >= 0 && x0 + MIPMAP_TAPS <= src_width) {
+        const float *p = src + x0 * 4;
+        for (int k = 0; k < MIPMAP_TAPS; k++)
+          s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(p + k * 4), w[k]));
+      } else {
+        for (int k = 0; k < MIPMAP_TAPS; k++) {
+          int i = x0 + k < 0 ? 0 : x0 + k >= src_width ? src_width - 1 : x0 + k;
+          s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(src + i * 4), w[k]));
+        }
+      }
+      _mm_storeu_ps(dst + x * 4, s);
+    }
+    return;
+  }
+#endif
+
+  for (int x = 0; x < width; x++) {
+    int x0 = 2 * x - (MIPMAP_TAPS / 2 - 1), idx[MIPMAP_TAPS];
+    for (int k = 0; k < MIPMAP_TAPS; k++)
+      idx[k] = x0 + k < 0 ? 0 : x0 + k >= src_width ? src_width - 1 : x0 + k;
+    for (int c = 0; c < 4; c++) {
+      float s = 0.0f;
+      for (int k = 0; k < MIPMAP_TAPS; k++)
+        s += src[idx[k] * 4 + c] * mipmap_kaiser[k];
+      dst[x * 4 + c] = s;
+    }
+  }
+}
+
+// Vertical Kaiser pass: one row out of MIPMAP_TAPS horizontally filtered
+// ones. Clamped to [0, 1], the negative lobes overshoot
+static inline void mipmap_kaiser_vrow(float *const rows[MIPMAP_TAPS], float *dst, int width) {
+  int n = width * 4, i = 0;
+
+#ifdef __SSE2__
+  if (mipmap_simd) {
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    for (; i < n; i += 4) {
+      __m128 s = _mm_setzero_ps();
+      for (int k = 0; k < MIPMAP_TAPS; k++)
+        s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(rows[k] + i), _mm_set1_ps(mipmap_kaiser[k])));
+      _mm_storeu_ps(dst + i, _mm_min_ps(_mm_max_ps(s, zero), one));
+    }
+  }
+#endif
+
+  for (; i < n; i++) {
+    float s = 0.0f;
+    for (int k = 0; k < MIPMAP_TAPS; k++)
+      s += rows[k][i] * mipmap_kaiser[k];
+    dst[i] = s < 0.0f ? 0.0f : s > 1.0f ? 1.0f : s;
+  }
+}
+
+// Rows y0 to y1 of a level with the box filter
+static inline void mipmap_box_rows(mipmap_level_t *level, int y0, int y1) {
+  float *buffer = NULL;
+
+  if (!level->linear &&
+      !(buffer = (float *) malloc((size_t) level->src_width * 2 * 4 * sizeof(float)))) {
+    level->failed = 1;
+    return;
+  }
+  for (int y = y0; y < y1; y++) {
+    int sy1 = level->src_height > 1 ? 2 * y + 1 : 0;
+    const float *r0 = mipmap_source_row(level, 2 * y, buffer);
+    const float *r1 = mipmap_source_row(level, sy1, buffer + level->src_width * 4);
+    float *dst = level->dst + (size_t) y * level->width * 4;
+    mipmap_box_row(r0, r1, level->src_width, dst, level->width);
+    mipmap_encode_row(dst, level->width, level->channels,
+                      level->out + (size_t) y * level->width * level->channels);
+  }
+  free(buffer);
+}
+
+// Rows y0 to y1 of a level with the Kaiser filter. The horizontally filtered
+// source rows are kept in a ring of MIPMAP_TAPS, each destination row needs
+// two new ones
+static inline void mipmap_kaiser_rows(mipmap_level_t *level, int y0, int y1) {
+  size_t row = (size_t) level->width * 4;
+  float *buffer = (float *) malloc((row * MIPMAP_TAPS + level->src_width * 4) * sizeof(float));
+  float *ring[MIPMAP_TAPS], *rows[MIPMAP_TAPS];
+  int ring_row[MIPMAP_TAPS];
+
+  if (!buffer) {
+    level->failed = 1;
+    return;
+  }
+  for (int k = 0; k < MIPMAP_TAPS; k++) {
+    ring[k] = buffer + row * k;
+    ring_row[k] = INT32_MIN;
+  }
+  float *source = buffer + row * MIPMAP_TAPS;
+
+  for (int y = y0; y < y1; y++) {
+    for (int k = 0; k < MIPMAP_TAPS; k++) {
+      int r = 2 * y - (MIPMAP_TAPS / 2 - 1) + k, slot = (r + MIPMAP_TAPS) % MIPMAP_TAPS;
+      if (ring_row[slot] != r) {
+        int sy = r < 0 ? 0 : r >= level->src_height ? level->src_height - 1 : r;
+        mipmap_kaiser_hrow(mipmap_source_row(level, sy, source), level->src_width,
+                           ring[slot], level->width);
+        ring_row[slot] = r;
+      }
+      rows[k] = ring[slot];
+    }
+    float *dst = level->dst + (size_t) y * level->width * 4;
+    mipmap_kaiser_vrow(rows, dst, level->width);
+    mipmap_encode_row(dst, level->width, level->channels,
+                      level->out + (size_t) y * level->width * level->channels);
+  }
+  free(buffer);
+}
+
+static inline void *mipmap_band_thread(void *arg) {
+  mipmap_band_t *band = (mipmap_band_t *) arg;
+  band->fn(band->level, band->y0, band->y1);
+  return NULL;
+}
+
+// Runs fn over the rows of level, in bands on up to threads threads, the
+// calling one included
+static inline void mipmap_parallel(mipmap_rows_fn fn, mipmap_level_t *level, int threads) {
+  pthread_t tids[MIPMAP_MAX_THREADS];
+  mipmap_band_t bands[MIPMAP_MAX_THREADS];
+  int rows = level->height;
+
+  long bands_max = (long) level->width * level->height / MIPMAP_BAND_PIXELS;
+  if (threads > bands_max)
+    threads = (int) bands_max;
+  if (threads > rows)
+    threads = rows;
+  if (threads < 1)
+    threads = 1;
+
+  int started[MIPMAP_MAX_THREADS] = { 0 };
+  for (int i = 0; i < threads; i++) {
+    bands[i].fn = fn;
+    bands[i].level = level;
+    bands[i].y0 = (int) ((long) rows * i / threads);
+    bands[i].y1 = (int) ((long) rows * (i + 1) / threads);
+    if (i > 0)
+      started[i] = pthread_create(&tids[i], NULL, mipmap_band_thread, &bands[i]) == 0;
+  }
+
+  // Band 0, and any whose thread couldn't start, on this one
+  for (int i = 0; i < threads; i++)
+    if (!started[i])
+      fn(level, bands[i].y0, bands[i].y1);
+  for (int i = 1; i < threads; i++)
+    if (started[i])
+      pthread_join(tids[i], NULL);
+}
+
+// Builds levels 1, 2... down to 1x1 of an image of 8-bit channels, 1 to 4
+// (the last one alpha if 2 or 4), rows stride bytes apart. They're written
+// into chain, mipmap_chain_size() bytes, tightly packed one after another.
+// filter is MIPMAP_BOX or MIPMAP_KAISER; threads <= 0 uses one per online CPU.
+// Returns 0 if out of memory
+static inline int mipmap_generate(const unsigned char *pixels, int width, int height,
+                                  int channels, int stride, unsigned char *chain,
+                                  mipmap_filter_t filter, int threads) {
+  mipmap_rows_fn fn = filter == MIPMAP_KAISER ? mipmap_kaiser_rows : mipmap_box_rows;
+  float *prev = NULL;
+  int ok = 1;
+
+  pthread_once(&mipmap_tables_once, mipmap_init_tables);
+  if (threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > MIPMAP_MAX_THREADS)
+    threads = MIPMAP_MAX_THREADS;
+
+  mipmap_level_t level;
+  memset(&level, 0, sizeof(level));
+  level.pixels = pixels;
+  level.stride = stride;
+  level.src_width = width;
+  level.src_height = height;
+  level.out = chain;
+  level.channels = channels;
+
+  while (ok && (level.src_width > 1 || level.src_height > 1)) {
+    level.width = level.src_width > 1 ? level.src_width / 2 : 1;
+    level.height = level.src_height > 1 ? level.src_height / 2 : 1;
+    level.dst = (float *) malloc((size_t) level.width * level.height * 4 * sizeof(float));
+    if (!level.dst)
+      break;
+
+    mipmap_parallel(fn, &level, threads);
+    ok = !level.failed;
+
+    // The new level is the next one's source
+    free(prev);
+    prev = level.dst;
+    level.linear = level.dst;
+    level.out += (size_t) level.width * level.height * channels;
+    level.src_width = level.width;
+    level.src_height = level.height;
+  }
+  free(prev);
+  return ok && level.src_width == 1 && level.src_height == 1;
+}
+
+// Uploads levels 1, 2... from mipmap_generate() to the texture bound to
+// GL_TEXTURE_2D, whose level 0 is width x height. chain is an offset into
+// the bound GL_PIXEL_UNPACK_BUFFER if there's one
+static inline void mipmap_tex_levels(GLenum format, int width, int height, int channels,
+                                     const unsigned char *chain) {
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+  for (int i = 1; width > 1 || height > 1; i++) {
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+    glTexImage2D(GL_TEXTURE_2D, i, format, width, height, 0, format, GL_UNSIGNED_BYTE, chain);
+    chain += (size_t) width * height * channels;
+  }
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+}
+
+#endif // MIPMAP_H
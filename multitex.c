@@ -8,8 +8,13 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include "headless.h"
+#include "progcache.h"
+#define STBI_THREADS // multithreaded decoding of big JPEGs
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "texloader.h"
+#include "texcache.h"
 
 int gl_width = 640;
 int gl_height = 480;
@@ -17,35 +22,56 @@ int gl_height = 480;
 void glfw_window_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
 void render(void);
+void startup_report(void);
 
 GLuint shader_program = 0; // shader program to set render pipeline
 GLuint vao = 0; // Vertext Array Object to set input data
 GLuint texture[2]; // Our two textures
+progcache_build_t program_build; // shader program, until its first use
 
-int main() {
-  // start GL context and O/S window using the GLFW helper library
-  if (!glfwInit()) {
-    fprintf(stderr, "ERROR: could not start GLFW3\n");
-    return 1;
-  }
+// Startup time breakdown (ms), reported after the first frame
+struct {
+  double start;
+  double context, shaders, geometry, cache, decode[2], mipmap[2], decode_wait, upload;
+} startup;
 
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-  //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+int main(int argc, char *argv[]) {
+  startup.start = headless_clock();
 
-  GLFWwindow* window = glfwCreateWindow(gl_width, gl_height, "Hello Texture on Quad", NULL, NULL);
-  if (!window) {
-    fprintf(stderr, "ERROR: could not open window with GLFW3\n");
-    glfwTerminate();
+  headless_t hl;
+  if (!headless_args(&hl, argc, argv))
     return 1;
-  }
-  glfwSetWindowSizeCallback(window, glfw_window_size_callback);
-  glfwMakeContextCurrent(window);
 
-  // start GLEW extension handler
-  // glewExperimental = GL_TRUE;
-  glewInit();
+  GLFWwindow* window = NULL;
+  if (hl.frames) {
+    // start GL context on an offscreen framebuffer, no window at all
+    if (!headless_init(&hl, gl_width, gl_height))
+      return 1;
+  } else {
+    // start GL context and O/S window using the GLFW helper library
+    if (!glfwInit()) {
+      fprintf(stderr, "ERROR: could not start GLFW3\n");
+      return 1;
+    }
+
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+    window = glfwCreateWindow(gl_width, gl_height, "Hello Texture on Quad", NULL, NULL);
+    if (!window) {
+      fprintf(stderr, "ERROR: could not open window with GLFW3\n");
+      glfwTerminate();
+      return 1;
+    }
+    glfwSetWindowSizeCallback(window, glfw_window_size_callback);
+    glfwMakeContextCurrent(window);
+
+    // start GLEW extension handler (headless_init() does it headless)
+    // glewExperimental = GL_TRUE;
+    glewInit();
+  }
 
   // get version info
   const GLubyte* vendor = glGetString(GL_VENDOR); // get vendor string
@@ -57,6 +83,7 @@ int main() {
   printf("OpenGL version supported %s\n", glversion);
   printf("GLSL version supported %s\n", glslversion);
   printf("Starting viewport: (width: %d, height: %d)\n", gl_width, gl_height);
+  startup.context = (headless_clock() - startup.start) * 1e3;
 
   // Vertex Shader
   const char* vertex_shader =
@@ -79,24 +106,41 @@ int main() {
     "  frag_col = mix(texture(texture1, vs_tex_coord), texture(texture2, vs_tex_coord), 0.5);"
     "}";
 
-  // Shaders compilation
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vs, 1, &vertex_shader, NULL);
-  glCompileShader(vs);
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fs, 1, &fragment_shader, NULL);
-  glCompileShader(fs);
-
-  // Create program, attach shaders to it and link it
-  shader_program = glCreateProgram();
-  glAttachShader(shader_program, fs);
-  glAttachShader(shader_program, vs);
-  glLinkProgram(shader_program);
-  glUseProgram(shader_program);
+  // Startup work overlaps: the driver compiles the shaders (on its own
+  // threads when it can) and worker threads decode the images missing from
+  // the texture cache while we set up the geometry. The program is only
+  // waited for at its first use
+  double t = headless_clock();
+
+  // Shader program, from the on-disk binary cache when possible
+  progcache_begin(&program_build, vertex_shader, fragment_shader, NULL);
+  shader_program = program_build.program;
+
+  const char *filenames[2] = {
+    "texture.jpg",
+    // Image from http://www.flickr.com/photos/seier/4364156221
+    // CC-BY-SA 2.0
+    "watchmen_smiley.png",
+    // Image from https://es.wikipedia.org/wiki/Archivo:Watchmen_Smiley.svg
+    // CC-BY-SA 3.0
+  };
 
-  // Release shader objects
-  glDeleteShader(vs);
-  glDeleteShader(fs);
+  // Textures decoded, flipped and mipmapped by a previous run are mapped
+  // from the cache. The rest are decoded into memory, not into pixel
+  // buffers, so that they can be saved to the cache afterwards
+  texcache_t caches[2];
+  texloader_pool_t loader;
+  texloader_image_t images[2];
+  texloader_pool_init(&loader, 0);
+  texloader_pool_mipmaps(&loader, MIPMAP_BOX); // mip levels built on the workers too
+  for (int i = 0; i < 2; i++) {
+    if (!texcache_open(&caches[i], filenames[i], 0, 1, MIPMAP_BOX))
+      texloader_pool_submit(&loader, &images[i], filenames[i], i, 0, 1);
+    startup.cache += caches[i].open_ms;
+  }
+
+  startup.shaders = (headless_clock() - t) * 1e3;
+  t = headless_clock();
 
   // Quad to be rendered (NDC): (x, y, z) (s, t)
   // => Two triangles, sharing 2 vertices
@@ -139,6 +183,8 @@ int main() {
   // Unbind vao
   glBindVertexArray(0);
 
+  startup.geometry = (headless_clock() - t) * 1e3;
+
   // Create texture objects
   glGenTextures(2, texture);
 
@@ -150,22 +196,6 @@ int main() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glUniform1i(glGetUniformLocation(shader_program, "texture1"), 0);
-
-  int width, height, nrChannels;
-  stbi_set_flip_vertically_on_load(1);
-  unsigned char *data = stbi_load("texture.jpg", &width, &height, &nrChannels, 0);
-  // Image from http://www.flickr.com/photos/seier/4364156221
-  // CC-BY-SA 2.0
-
-  if (data) {
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-  } else {
-    printf("Failed to load first texture\n");
-  }
-  stbi_image_free(data);
-
   // Second texture in Texture Unit #1
   glActiveTexture(GL_TEXTURE1);
   glBindTexture(GL_TEXTURE_2D, texture[1]);
@@ -174,18 +204,47 @@ int main() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glUniform1i(glGetUniformLocation(shader_program, "texture2"), 1);
+  // Upload the cached textures, then the decoded images in the order the
+  // loader hands them out, each one into the texture object (and unit) of
+  // its id
+  t = headless_clock();
+  for (int i = 0; i < 2; i++) {
+    if (caches[i].map) {
+      glActiveTexture(GL_TEXTURE0 + i);
+      glBindTexture(GL_TEXTURE_2D, texture[i]);
+      texcache_tex_image(&caches[i]);
+    }
+  }
+  startup.upload += (headless_clock() - t) * 1e3;
+  for (;;) {
+    t = headless_clock();
+    texloader_image_t *image = texloader_pool_next(&loader, 1);
+    startup.decode_wait += (headless_clock() - t) * 1e3;
+    if (!image)
+      break;
+    startup.decode[image->id] = image->decode_ms;
+    startup.mipmap[image->id] = image->mipmap_ms;
+
+    t = headless_clock();
+    glActiveTexture(GL_TEXTURE0 + image->id);
+    glBindTexture(GL_TEXTURE_2D, texture[image->id]);
+    texcache_save(&caches[image->id], image);
+    if (!texloader_tex_image(image)) {
+      printf("Failed to load texture %s\n", image->filename);
+    }
+    startup.upload += (headless_clock() - t) * 1e3;
+  }
+  texloader_pool_destroy(&loader);
 
-  data = stbi_load("watchmen_smiley.png", &width, &height, &nrChannels, 0);
-  // Image from https://es.wikipedia.org/wiki/Archivo:Watchmen_Smiley.svg
-  // CC-BY-SA 3.0
-  if (data) {
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-  } else {
-    printf("Failed to load second texture\n");
+  // Headless render loop: a fixed number of frames, each one saved to disk
+  if (hl.frames) {
+    while (headless_next_frame(&hl)) {
+      render();
+      headless_save_frame(&hl);
+    }
+    headless_terminate(&hl);
+    return 0;
   }
-  stbi_image_free(data);
 
   // Render loop
   while(!glfwWindowShouldClose(window)) {
@@ -213,6 +272,14 @@ void render(void) {
 
   glViewport(0, 0, gl_width, gl_height);
 
+  // First use of the program: wait for it to link, then set its samplers
+  if (!program_build.finished) {
+    progcache_finish(&program_build);
+    glUseProgram(shader_program);
+    glUniform1i(glGetUniformLocation(shader_program, "texture1"), 0);
+    glUniform1i(glGetUniformLocation(shader_program, "texture2"), 1);
+  }
+
   glUseProgram(shader_program);
   glBindVertexArray(vao);
 
@@ -222,6 +289,27 @@ void render(void) {
   glBindTexture(GL_TEXTURE_2D, texture[1]);
 
   glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+
+  static int first_frame = 1;
+  if (first_frame) {
+    first_frame = 0;
+    startup_report();
+  }
+}
+
+void startup_report(void) {
+  glFinish();
+  printf("Startup breakdown (ms):\n");
+  printf("  GL context             %8.2f\n", startup.context);
+  printf("  issue shaders, decodes %8.2f\n", startup.shaders);
+  printf("  geometry setup         %8.2f\n", startup.geometry);
+  printf("  texture cache lookup   %8.2f\n", startup.cache);
+  printf("  image decode (workers) %8.2f %8.2f\n", startup.decode[0], startup.decode[1]);
+  printf("  mip levels (workers)   %8.2f %8.2f\n", startup.mipmap[0], startup.mipmap[1]);
+  printf("  wait for decodes       %8.2f\n", startup.decode_wait);
+  printf("  texture upload         %8.2f\n", startup.upload);
+  printf("  wait for link          %8.2f\n", program_build.wait_ms);
+  printf("  first frame done       %8.2f\n", (headless_clock() - startup.start) * 1e3);
 }
 
 void processInput(GLFWwindow *window) {
@@ -8,8 +8,13 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include "headless.h"
+#include "progcache.h"
+#include "frametimes.h"
+#define STBI_THREADS // multithreaded decoding of big JPEGs
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
+#include "texloader.h"
 
 int gl_width = 640;
 int gl_height = 480;
@@ -17,35 +22,71 @@ int gl_height = 480;
 void glfw_window_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
 void render(void);
+void startup_report(void);
 
 GLuint shader_program = 0; // shader program to set render pipeline
 GLuint vao = 0; // Vertext Array Object to set input data
 GLuint texture[2]; // Our two textures
-
-int main() {
-  // start GL context and O/S window using the GLFW helper library
-  if (!glfwInit()) {
-    fprintf(stderr, "ERROR: could not start GLFW3\n");
-    return 1;
+progcache_build_t program_build; // shader program, until its first use
+
+// Startup time breakdown (ms), reported after the first frame
+struct {
+  double start;
+  double context, shaders, geometry, decode[2], mipmap[2], compress[2], decode_wait, upload;
+  double psnr[2];
+  size_t pixel_size[2], compressed_size[2]; // every level
+} startup;
+
+int main(int argc, char *argv[]) {
+  startup.start = headless_clock();
+
+  headless_t hl;
+  headless_defaults(&hl);
+  const char *stats_file = NULL; // frame time instrumentation (-stats)
+  bcenc_mode_t compress = BCENC_FAST; // texture compression (-bc)
+
+  for (int i = 1; i < argc; i++) {
+    if (!headless_arg(&hl, argc, argv, &i) && !frametimes_arg(&stats_file, argc, argv, &i) &&
+        !bcenc_arg(&compress, argc, argv, &i)) {
+      fprintf(stderr, "Usage: %s [-headless N] [-o prefix] [-ring D] [-stats file] [-bc mode]\n",
+              argv[0]);
+      headless_usage();
+      frametimes_usage();
+      bcenc_usage();
+      return 1;
+    }
   }
 
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-  //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+  GLFWwindow* window = NULL;
+  if (hl.frames) {
+    // start GL context on an offscreen framebuffer, no window at all
+    if (!headless_init(&hl, gl_width, gl_height))
+      return 1;
+  } else {
+    // start GL context and O/S window using the GLFW helper library
+    if (!glfwInit()) {
+      fprintf(stderr, "ERROR: could not start GLFW3\n");
+      return 1;
+    }
 
-  GLFWwindow* window = glfwCreateWindow(gl_width, gl_height, "Hello Texture on Quad", NULL, NULL);
-  if (!window) {
-    fprintf(stderr, "ERROR: could not open window with GLFW3\n");
-    glfwTerminate();
-    return 1;
-  }
-  glfwSetWindowSizeCallback(window, glfw_window_size_callback);
-  glfwMakeContextCurrent(window);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
 
-  // start GLEW extension handler
-  // glewExperimental = GL_TRUE;
-  glewInit();
+    window = glfwCreateWindow(gl_width, gl_height, "Hello Texture on Quad", NULL, NULL);
+    if (!window) {
+      fprintf(stderr, "ERROR: could not open window with GLFW3\n");
+      glfwTerminate();
+      return 1;
+    }
+    glfwSetWindowSizeCallback(window, glfw_window_size_callback);
+    glfwMakeContextCurrent(window);
+
+    // start GLEW extension handler (headless_init() does it headless)
+    // glewExperimental = GL_TRUE;
+    glewInit();
+  }
 
   // get version info
   const GLubyte* vendor = glGetString(GL_VENDOR); // get vendor string
@@ -57,6 +98,7 @@ int main() {
   printf("OpenGL version supported %s\n", glversion);
   printf("GLSL version supported %s\n", glslversion);
   printf("Starting viewport: (width: %d, height: %d)\n", gl_width, gl_height);
+  startup.context = (headless_clock() - startup.start) * 1e3;
 
   // Vertex Shader
   const char* vertex_shader =
@@ -82,24 +124,31 @@ int main() {
     "  gl_FragColor = tex2 + (1 - tex2.a) * tex1;"
     "}";
 
-  // Shaders compilation
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vs, 1, &vertex_shader, NULL);
-  glCompileShader(vs);
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fs, 1, &fragment_shader, NULL);
-  glCompileShader(fs);
-
-  // Create program, attach shaders to it and link it
-  shader_program = glCreateProgram();
-  glAttachShader(shader_program, fs);
-  glAttachShader(shader_program, vs);
-  glLinkProgram(shader_program);
-  glUseProgram(shader_program);
+  // Startup work overlaps: the driver compiles the shaders (on its own
+  // threads when it can) and worker threads decode the images while we set
+  // up the geometry. The program is only waited for at its first use
+  double t = headless_clock();
+
+  // Shader program, from the on-disk binary cache when possible
+  progcache_begin(&program_build, vertex_shader, fragment_shader, NULL);
+  shader_program = program_build.program;
+
+  texloader_pool_t loader;
+  texloader_image_t images[2];
+  texloader_pool_init(&loader, 0);
+  texloader_pool_mipmaps(&loader, MIPMAP_BOX); // mip levels built on the workers too
+  // and compressed there to BC1 (texture.jpg) and BC3 (the PNG, with alpha)
+  if (!texloader_pool_compress(&loader, compress))
+    printf("S3TC texture compression not supported, textures left uncompressed\n");
+  texloader_pool_submit(&loader, &images[0], "texture.jpg", 0, 0, 1);
+  // Image from http://www.flickr.com/photos/seier/4364156221
+  // CC-BY-SA 2.0
+  texloader_pool_submit(&loader, &images[1], "watchmen_smiley_trans.png", 1, 0, 1);
+  // Image from https://es.wikipedia.org/wiki/Archivo:Watchmen_Smiley.svg
+  // CC-BY-SA 3.0
 
-  // Release shader objects
-  glDeleteShader(vs);
-  glDeleteShader(fs);
+  startup.shaders = (headless_clock() - t) * 1e3;
+  t = headless_clock();
 
   // Quad to be rendered (NDC): (x, y, z) (s, t)
   // => Two triangles, sharing 2 vertices
@@ -142,6 +191,8 @@ int main() {
   // Unbind vao
   glBindVertexArray(0);
 
+  startup.geometry = (headless_clock() - t) * 1e3;
+
   // Create texture objects
   glGenTextures(2, texture);
 
@@ -153,22 +204,6 @@ int main() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glUniform1i(glGetUniformLocation(shader_program, "texture1"), 0);
-
-  int width, height, nrChannels;
-  stbi_set_flip_vertically_on_load(1);
-  unsigned char *data = stbi_load("texture.jpg", &width, &height, &nrChannels, 0);
-  // Image from http://www.flickr.com/photos/seier/4364156221
-  // CC-BY-SA 2.0
-
-  if (data) {
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-  } else {
-    printf("Failed to load first texture\n");
-  }
-  stbi_image_free(data);
-
   // Second texture in Texture Unit #1
   glActiveTexture(GL_TEXTURE1);
   glBindTexture(GL_TEXTURE_2D, texture[1]);
@@ -177,33 +212,73 @@ int main() {
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 
-  glUniform1i(glGetUniformLocation(shader_program, "texture2"), 1);
-
-  data = stbi_load("watchmen_smiley_trans.png", &width, &height, &nrChannels, 0);
-  // Image from https://es.wikipedia.org/wiki/Archivo:Watchmen_Smiley.svg
-  // CC-BY-SA 3.0
-  if (data) {
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-    glGenerateMipmap(GL_TEXTURE_2D);
-  } else {
-    printf("Failed to load second texture\n");
+  // Upload the images in the order the loader hands them out, each one into
+  // the texture object (and unit) of its id
+  for (;;) {
+    t = headless_clock();
+    texloader_image_t *image = texloader_pool_next(&loader, 1);
+    startup.decode_wait += (headless_clock() - t) * 1e3;
+    if (!image)
+      break;
+    startup.decode[image->id] = image->decode_ms;
+    startup.mipmap[image->id] = image->mipmap_ms;
+    startup.compress[image->id] = image->compress_ms;
+    startup.psnr[image->id] = image->psnr;
+    startup.compressed_size[image->id] = image->compressed_size;
+    startup.pixel_size[image->id] = (size_t) image->width * image->height * image->channels;
+    if (image->compressed_levels > 1)
+      startup.pixel_size[image->id] += mipmap_chain_size(image->width, image->height,
+                                                         image->channels);
+
+    t = headless_clock();
+    glActiveTexture(GL_TEXTURE0 + image->id);
+    glBindTexture(GL_TEXTURE_2D, texture[image->id]);
+    if (!texloader_tex_image(image)) {
+      printf("Failed to load texture %s\n", image->filename);
+    }
+    startup.upload += (headless_clock() - t) * 1e3;
+  }
+  texloader_pool_destroy(&loader);
+
+  frametimes_t ft;
+  frametimes_init(&ft, stats_file);
+
+  // Headless render loop: a fixed number of frames, each one saved to disk
+  if (hl.frames) {
+    while (headless_next_frame(&hl)) {
+      frametimes_begin_frame(&ft);
+      render();
+      frametimes_end_render(&ft);
+      headless_save_frame(&hl);
+      frametimes_end_frame(&ft);
+    }
+    frametimes_report(&ft);
+    headless_terminate(&hl);
+    return 0;
   }
-  stbi_image_free(data);
 
   // Render loop
   while(!glfwWindowShouldClose(window)) {
 
     processInput(window);
 
+    frametimes_begin_frame(&ft);
+
     render();
 
+    frametimes_end_render(&ft);
+
     // put the stuff we've been drawing onto the display
     glfwSwapBuffers(window);
 
+    frametimes_end_frame(&ft);
+
     // update other events like input handling
     glfwPollEvents();
   }
 
+  frametimes_report(&ft);
+
   // close GL context and any other GLFW resources
   glfwTerminate();
 
@@ -216,6 +291,14 @@ void render(void) {
 
   glViewport(0, 0, gl_width, gl_height);
 
+  // First use of the program: wait for it to link, then set its samplers
+  if (!program_build.finished) {
+    progcache_finish(&program_build);
+    glUseProgram(shader_program);
+    glUniform1i(glGetUniformLocation(shader_program, "texture1"), 0);
+    glUniform1i(glGetUniformLocation(shader_program, "texture2"), 1);
+  }
+
   glUseProgram(shader_program);
   glBindVertexArray(vao);
 
@@ -225,6 +308,33 @@ void render(void) {
   glBindTexture(GL_TEXTURE_2D, texture[1]);
 
   glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, 0);
+
+  static int first_frame = 1;
+  if (first_frame) {
+    first_frame = 0;
+    startup_report();
+  }
+}
+
+void startup_report(void) {
+  glFinish();
+  printf("Startup breakdown (ms):\n");
+  printf("  GL context             %8.2f\n", startup.context);
+  printf("  issue shaders, decodes %8.2f\n", startup.shaders);
+  printf("  geometry setup         %8.2f\n", startup.geometry);
+  printf("  image decode (workers) %8.2f %8.2f\n", startup.decode[0], startup.decode[1]);
+  printf("  mip levels (workers)   %8.2f %8.2f\n", startup.mipmap[0], startup.mipmap[1]);
+  printf("  compression (workers)  %8.2f %8.2f\n", startup.compress[0], startup.compress[1]);
+  printf("  wait for decodes       %8.2f\n", startup.decode_wait);
+  printf("  texture upload         %8.2f\n", startup.upload);
+  printf("  wait for link          %8.2f\n", program_build.wait_ms);
+  printf("  first frame done       %8.2f\n", (headless_clock() - startup.start) * 1e3);
+  for (int i = 0; i < 2; i++) {
+    if (startup.compressed_size[i])
+      printf("Texture %d: %zu -> %zu bytes compressed at %.1f MB/s, PSNR %.2f dB\n", i,
+             startup.pixel_size[i], startup.compressed_size[i],
+             startup.pixel_size[i] / (startup.compress[i] * 1e3), startup.psnr[i]);
+  }
 }
 
 void processInput(GLFWwindow *window) {
@@ -0,0 +1,281 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// On-disk cache of linked shader program binaries.
+//
+// progcache_program() compiles and links a vertex + fragment shader pair,
+// as every demo used to do inline, but first looks for the program binary
+// saved by a previous run (glGetProgramBinary/glProgramBinary). Cache files
+// live in PROGCACHE_DIR, named after a 64-bit FNV-1a hash of the shader
+// sources, the attribute bindings and the driver vendor, renderer and version
+// strings: a driver update just misses the cache. If the driver rejects a
+// cached binary anyway, the program is compiled from source and the cache
+// entry rewritten.
+//
+// Building can also be split in two, to overlap compilation with other
+// startup work: progcache_begin() loads the binary or just issues the
+// compile and link commands (on driver threads with
+// GL_KHR_parallel_shader_compile), and progcache_finish() waits for the
+// link status only when the program is about to be used.
+
+#ifndef PROGCACHE_H
+#define PROGCACHE_H
+
+#include <GL/glew.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef PROGCACHE_DIR
+#define PROGCACHE_DIR ".glcache"
+#endif
+
+#define PROGCACHE_MAGIC 0x42504c47 // "GLPB"
+
+// A program being built
+typedef struct {
+  GLuint program;
+  unsigned long long key;
+  int cacheable;    // driver supports program binaries
+  int from_cache;   // loaded from a cached binary
+  int finished;     // link status checked by progcache_finish()
+  double start;     // progcache_begin() time
+  double wait_ms;   // time blocked in progcache_finish()
+} progcache_build_t;
+
+typedef struct {
+  unsigned int magic;
+  GLenum format;   // driver specific binary format
+  GLint length;    // bytes of binary data following the header
+} progcache_header_t;
+
+static inline double progcache_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 64-bit FNV-1a, string terminator included so that "ab"+"c" != "a"+"bc"
+static inline unsigned long long progcache_hash(unsigned long long h, const char *s) {
+  if (!s)
+    s = "";
+  do {
+    h ^= (unsigned char) *s;
+    h *= 0x100000001b3ULL;
+  } while (*s++);
+  return h;
+}
+
+static inline unsigned long long progcache_key(const char *vertex_shader,
+                                               const char *fragment_shader,
+                                               const char *const *attribs) {
+  unsigned long long h = 0xcbf29ce484222325ULL;
+  h = progcache_hash(h, vertex_shader);
+  h = progcache_hash(h, fragment_shader);
+  for (int i = 0; attribs && attribs[i]; i++)
+    h = progcache_hash(h, attribs[i]);
+  h = progcache_hash(h, (const char *) glGetString(GL_VENDOR));
+  h = progcache_hash(h, (const char *) glGetString(GL_RENDERER));
+  h = progcache_hash(h, (const char *) glGetString(GL_VERSION));
+  return h;
+}
+
+// Driver can hand out program binaries at all
+static inline int progcache_supported(void) {
+  GLint formats = 0;
+  if (!GLEW_ARB_get_program_binary)
+    return 0;
+  glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+  return formats > 0;
+}
+
+static inline void progcache_filename(char *filename, size_t size, unsigned long long key) {
+  snprintf(filename, size, "%s/%016llx.bin", PROGCACHE_DIR, key);
+}
+
+// Loads a cached binary into program. Returns 1 if it links
+static inline int progcache_load(GLuint program, unsigned long long key) {
+  char filename[256];
+  progcache_header_t header;
+  GLint status = GL_FALSE;
+
+  progcache_filename(filename, sizeof(filename), key);
+  FILE *f = fopen(filename, "rb");
+  if (!f)
+    return 0;
+
+  // A corrupt or truncated entry, with a length past the end of the file,
+  // is just a miss
+  struct stat st;
+  if (fread(&header, sizeof(header), 1, f) == 1 && header.magic == PROGCACHE_MAGIC &&
+      header.length > 0 && fstat(fileno(f), &st) == 0 &&
+      header.length <= st.st_size - (off_t) sizeof(header)) {
+    void *binary = malloc(header.length);
+    if (binary && fread(binary, header.length, 1, f) == 1) {
+      glProgramBinary(program, header.format, binary, header.length);
+      glGetProgramiv(program, GL_LINK_STATUS, &status);
+    }
+    free(binary);
+  }
+  fclose(f);
+  return status == GL_TRUE;
+}
+
+// Saves the binary of a linked program. Written to a temporary file and
+// renamed, so concurrent runs never see half-written entries
+static inline void progcache_save(GLuint program, unsigned long long key) {
+  char filename[256], tmpname[300];
+  progcache_header_t header;
+
+  glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &header.length);
+  if (header.length <= 0)
+    return;
+
+  void *binary = malloc(header.length);
+  if (!binary)
+    return;
+  glGetProgramBinary(program, header.length, NULL, &header.format, binary);
+  header.magic = PROGCACHE_MAGIC;
+
+  mkdir(PROGCACHE_DIR, 0755);
+  progcache_filename(filename, sizeof(filename), key);
+  snprintf(tmpname, sizeof(tmpname), "%s.%d", filename, (int) getpid());
+
+  FILE *f = fopen(tmpname, "wb");
+  if (f) {
+    int ok = fwrite(&header, sizeof(header), 1, f) == 1 &&
+             fwrite(binary, header.length, 1, f) == 1;
+    if (fclose(f) == 0 && ok)
+      rename(tmpname, filename);
+    else
+      remove(tmpname);
+  }
+  free(binary);
+}
+
+// Issues compilation of both shaders and linking into program. Nothing
+// here waits for the results
+static inline void progcache_compile(GLuint program, const char *vertex_shader,
+                                     const char *fragment_shader) {
+  // Shaders compilation
+  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
+  glShaderSource(vs, 1, &vertex_shader, NULL);
+  glCompileShader(vs);
+  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
+  glShaderSource(fs, 1, &fragment_shader, NULL);
+  glCompileShader(fs);
+
+  // Attach shaders to the program and link it
+  glAttachShader(program, fs);
+  glAttachShader(program, vs);
+  glLinkProgram(program);
+
+  // Release shader objects (freed along with the program)
+  glDeleteShader(vs);
+  glDeleteShader(fs);
+}
+
+// Lets the driver compile and link on as many threads as it likes
+static inline void progcache_parallel_compile(void) {
+  static int done = 0;
+
+  if (done)
+    return;
+  done = 1;
+  if (GLEW_KHR_parallel_shader_compile)
+    glMaxShaderCompilerThreadsKHR(0xffffffff);
+  else if (GLEW_ARB_parallel_shader_compile)
+    glMaxShaderCompilerThreadsARB(0xffffffff);
+}
+
+// Starts building a program for a vertex + fragment shader pair: loads it
+// from the cache when possible, otherwise issues compilation and linking
+// without waiting for them. attribs is NULL or a NULL-terminated list of
+// vertex attribute names bound to locations 0, 1, 2...
+static inline void progcache_begin(progcache_build_t *build, const char *vertex_shader,
+                                   const char *fragment_shader, const char *const *attribs) {
+  memset(build, 0, sizeof(*build));
+  build->start = progcache_clock();
+  build->cacheable = progcache_supported();
+  build->key = progcache_key(vertex_shader, fragment_shader, attribs);
+
+  build->program = glCreateProgram();
+  for (int i = 0; attribs && attribs[i]; i++)
+    glBindAttribLocation(build->program, i, attribs[i]);
+
+  if (build->cacheable && progcache_load(build->program, build->key)) {
+    build->from_cache = 1;
+    return;
+  }
+
+  // Cache miss or binary rejected by the driver: start over from source
+  glDeleteProgram(build->program);
+  build->program = glCreateProgram();
+  for (int i = 0; attribs && attribs[i]; i++)
+    glBindAttribLocation(build->program, i, attribs[i]);
+  if (build->cacheable)
+    glProgramParameteri(build->program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+
+  progcache_parallel_compile();
+  progcache_compile(build->program, vertex_shader, fragment_shader);
+}
+
+// Nonzero when progcache_finish() won't block. Without parallel shader
+// compilation the driver can't tell, so it's assumed ready
+static inline int progcache_ready(const progcache_build_t *build) {
+  GLint done = GL_TRUE;
+
+  if (build->finished || build->from_cache)
+    return 1;
+  if (GLEW_KHR_parallel_shader_compile || GLEW_ARB_parallel_shader_compile)
+    glGetProgramiv(build->program, GL_COMPLETION_STATUS_KHR, &done);
+  return done == GL_TRUE;
+}
+
+// Waits for the program to link, reports errors and saves the binary to
+// the cache. Returns the program
+static inline GLuint progcache_finish(progcache_build_t *build) {
+  GLint status = GL_FALSE;
+
+  if (build->finished)
+    return build->program;
+  build->finished = 1;
+
+  double t0 = progcache_clock();
+  if (build->from_cache) {
+    printf("Shader program %016llx: loaded from cache in %.2f ms\n", build->key,
+           (t0 - build->start) * 1e3);
+    return build->program;
+  }
+
+  glGetProgramiv(build->program, GL_LINK_STATUS, &status);
+  build->wait_ms = (progcache_clock() - t0) * 1e3;
+
+  if (status != GL_TRUE) {
+    char log[1024];
+    glGetProgramInfoLog(build->program, sizeof(log), NULL, log);
+    fprintf(stderr, "ERROR: could not link shader program\n%s\n", log);
+  } else if (build->cacheable) {
+    progcache_save(build->program, build->key);
+  }
+
+  printf("Shader program %016llx: compiled in %.2f ms (%.2f ms waiting for the link)%s\n",
+         build->key, (t0 - build->start) * 1e3 + build->wait_ms, build->wait_ms,
+         build->cacheable ? "" : " (no binary cache)");
+  return build->program;
+}
+
+// Builds a program right away: progcache_begin() + progcache_finish()
+static inline GLuint progcache_program(const char *vertex_shader, const char *fragment_shader,
+                                       const char *const *attribs) {
+  progcache_build_t build;
+
+  progcache_begin(&build, vertex_shader, fragment_shader, attribs);
+  return progcache_finish(&build);
+}
+
+#endif // PROGCACHE_H
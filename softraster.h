@@ -0,0 +1,437 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// Tile-based multithreaded software rasterizer for spinningcube, for
+// machines with no GPU at all (not even llvmpipe through EGL).
+//
+// It implements just the pipeline state the demo uses: an indexed triangle
+// mesh drawn once per mv_matrix, proj_matrix, vs_color = v_pos * 2.0 + 0.4
+// interpolated with perspective correction, depth test GL_LESS against a
+// depth buffer cleared to 1.0, black clear color and no face culling. Images follow GL
+// conventions (RGB, bottom row first) and can go straight to
+// headless_write_ppm().
+//
+// A frame runs in two phases on every thread (the calling one included):
+// - geometry: each thread takes a contiguous range of instances, transforms
+//   their vertices, clips triangles against the near plane (and a guard
+//   band), snaps them to 8-bit subpixel fixed point and bins them into the
+//   screen tiles their bounding box touches. Every thread has its own bins,
+//   so nothing is shared while binning.
+// - raster: threads grab whole tiles from an atomic counter, clear them and
+//   rasterize the triangles binned to them, in submission order. A tile is
+//   only ever touched by one thread, its color and depth stay in cache.
+//
+//   softraster_t sr;
+//   softraster_init(&sr, width, height, 0);  // 0: one thread per CPU
+//   softraster_mesh(&sr, vertex_positions, 8, vertex_indices, 36);
+//   softraster_draw(&sr, proj_matrix, mv_matrices, num_cubes);
+//   headless_write_ppm("frame.ppm", sr.color.data(), sr.width, sr.height);
+//   softraster_terminate(&sr);
+
+#ifndef SOFTRASTER_H
+#define SOFTRASTER_H
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include <glm/glm.hpp>
+
+#define SOFTRASTER_TILE 32        // tile side in pixels
+#define SOFTRASTER_SUBPIXEL 256   // fixed point subpixel steps per pixel
+#define SOFTRASTER_GUARD 64.0f    // guard band, in viewports from the center
+#define SOFTRASTER_MAX_THREADS 64
+
+// A triangle ready to rasterize: screen position in fixed point, window
+// depth and 1/w for perspective-correct color
+struct softraster_tri_t {
+  int64_t x[3], y[3];
+  int min_x, min_y, max_x, max_y; // pixel bounding box, inclusive
+  float z[3], inv_w[3];
+  glm::vec3 color_w[3];           // color / w
+  float inv_area;
+};
+
+// Post-transform vertex
+struct softraster_vertex_t {
+  glm::vec4 clip;
+  glm::vec3 color;
+};
+
+// Geometry phase output of a thread
+struct softraster_bins_t {
+  std::vector<softraster_vertex_t> vertices; // current instance
+  std::vector<softraster_tri_t> tris;
+  std::vector<std::vector<uint32_t> > bins; // per tile, indices into tris
+};
+
+struct softraster_t;
+
+struct softraster_thread_t {
+  softraster_t *sr;
+  int id;
+};
+
+struct softraster_t {
+  int width, height;
+  int tiles_x, tiles_y;
+  std::vector<unsigned char> color; // RGB, bottom-up
+  std::vector<float> depth;
+
+  // Mesh: (x, y, z) positions and triangle indices
+  const float *positions;
+  int num_vertices;
+  const unsigned short *indices;
+  int num_indices;
+
+  int num_threads;                  // including the calling thread
+  pthread_t threads[SOFTRASTER_MAX_THREADS];
+  softraster_thread_t thread_args[SOFTRASTER_MAX_THREADS];
+  pthread_mutex_t lock;             // held while the workers are started
+  pthread_barrier_t start, binned, done;
+  std::vector<softraster_bins_t> per_thread;
+
+  // Current frame
+  glm::mat4 proj_matrix;
+  const glm::mat4 *mv_matrices;
+  int num_instances;
+  int next_tile;                    // atomic
+  bool quit;
+};
+
+// Edge function of a -> b at p, positive on the left
+static inline int64_t softraster_edge(int64_t ax, int64_t ay, int64_t bx, int64_t by,
+                                      int64_t px, int64_t py) {
+  return (bx - ax) * (py - ay) - (by - ay) * (px - ax);
+}
+
+// Top-left fill rule: pixels exactly on an edge belong to only one of the
+// two triangles sharing it, which walk it in opposite directions
+static inline bool softraster_top_left(int64_t dx, int64_t dy) {
+  return dy < 0 || (dy == 0 && dx < 0);
+}
+
+// Snaps a clipped triangle to the viewport and bins it
+static inline void softraster_setup(softraster_t *sr, softraster_bins_t *out,
+                                    const softraster_vertex_t *v0, const softraster_vertex_t *v1,
+                                    const softraster_vertex_t *v2) {
+  const softraster_vertex_t *v[3] = { v0, v1, v2 };
+  softraster_tri_t tri;
+
+  for (int i = 0; i < 3; i++) {
+    float inv_w = 1.0f / v[i]->clip.w;
+    glm::vec3 ndc = glm::vec3(v[i]->clip) * inv_w;
+    tri.x[i] = (int64_t) lrintf((ndc.x * 0.5f + 0.5f) * sr->width * SOFTRASTER_SUBPIXEL);
+    tri.y[i] = (int64_t) lrintf((ndc.y * 0.5f + 0.5f) * sr->height * SOFTRASTER_SUBPIXEL);
+    tri.z[i] = ndc.z * 0.5f + 0.5f;
+    tri.inv_w[i] = inv_w;
+    tri.color_w[i] = v[i]->color * inv_w;
+  }
+
+  // Counter-clockwise either way: both faces are drawn, as in GL without culling
+  int64_t area = softraster_edge(tri.x[0], tri.y[0], tri.x[1], tri.y[1], tri.x[2], tri.y[2]);
+  if (area == 0)
+    return;
+  if (area < 0) {
+    std::swap(tri.x[1], tri.x[2]);
+    std::swap(tri.y[1], tri.y[2]);
+    std::swap(tri.z[1], tri.z[2]);
+    std::swap(tri.inv_w[1], tri.inv_w[2]);
+    std::swap(tri.color_w[1], tri.color_w[2]);
+    area = -area;
+  }
+  tri.inv_area = 1.0f / (float) area;
+
+  // Pixels whose center (x + 0.5) may be covered
+  int64_t lo_x = std::min(tri.x[0], std::min(tri.x[1], tri.x[2]));
+  int64_t hi_x = std::max(tri.x[0], std::max(tri.x[1], tri.x[2]));
+  int64_t lo_y = std::min(tri.y[0], std::min(tri.y[1], tri.y[2]));
+  int64_t hi_y = std::max(tri.y[0], std::max(tri.y[1], tri.y[2]));
+  tri.min_x = std::max(0, (int) ((lo_x - SOFTRASTER_SUBPIXEL / 2 + SOFTRASTER_SUBPIXEL - 1) / SOFTRASTER_SUBPIXEL));
+  tri.min_y = std::max(0, (int) ((lo_y - SOFTRASTER_SUBPIXEL / 2 + SOFTRASTER_SUBPIXEL - 1) / SOFTRASTER_SUBPIXEL));
+  tri.max_x = std::min(sr->width - 1, (int) ((hi_x - SOFTRASTER_SUBPIXEL / 2) / SOFTRASTER_SUBPIXEL));
+  tri.max_y = std::min(sr->height - 1, (int) ((hi_y - SOFTRASTER_SUBPIXEL / 2) / SOFTRASTER_SUBPIXEL));
+  if (tri.min_x > tri.max_x || tri.min_y > tri.max_y)
+    return;
+
+  uint32_t index = (uint32_t) out->tris.size();
+  out->tris.push_back(tri);
+  for (int ty = tri.min_y / SOFTRASTER_TILE; ty <= tri.max_y / SOFTRASTER_TILE; ty++)
+    for (int tx = tri.min_x / SOFTRASTER_TILE; tx <= tri.max_x / SOFTRASTER_TILE; tx++)
+      out->bins[ty * sr->tiles_x + tx].push_back(index);
+}
+
+// Signed distance to the clip planes: near (z >= -w) and the guard band
+static inline float softraster_plane(const glm::vec4 &p, int plane) {
+  switch (plane) {
+  case 0: return p.z + p.w;
+  case 1: return SOFTRASTER_GUARD * p.w - p.x;
+  case 2: return SOFTRASTER_GUARD * p.w + p.x;
+  case 3: return SOFTRASTER_GUARD * p.w - p.y;
+  default: return SOFTRASTER_GUARD * p.w + p.y;
+  }
+}
+
+// Sutherland-Hodgman clipping of a triangle, then fan triangulation. Points
+// beyond the far plane are left to the depth test, which rejects them
+// against the 1.0 clear value just like GL clipping would
+static inline void softraster_clip(softraster_t *sr, softraster_bins_t *out,
+                                   const softraster_vertex_t *tri) {
+  softraster_vertex_t poly[2][9];
+  int n = 3, cur = 0;
+
+  bool inside = true;
+  for (int plane = 0; plane < 5 && inside; plane++)
+    for (int i = 0; i < 3; i++)
+      inside = inside && softraster_plane(tri[i].clip, plane) >= 0.0f;
+  if (inside) {
+    softraster_setup(sr, out, &tri[0], &tri[1], &tri[2]);
+    return;
+  }
+
+  for (int i = 0; i < 3; i++)
+    poly[0][i] = tri[i];
+  for (int plane = 0; plane < 5 && n >= 3; plane++) {
+    const softraster_vertex_t *in = poly[cur];
+    softraster_vertex_t *clipped = poly[!cur];
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+      const softraster_vertex_t &a = in[i], &b = in[(i + 1) % n];
+      float da = softraster_plane(a.clip, plane), db = softraster_plane(b.clip, plane);
+      if (da >= 0.0f)
+        clipped[m++] = a;
+      if ((da >= 0.0f) != (db >= 0.0f)) {
+        float t = da / (da - db);
+        clipped[m].clip = a.clip + (b.clip - a.clip) * t;
+        clipped[m].color = a.color + (b.color - a.color) * t;
+        m++;
+      }
+    }
+    n = m;
+    cur = !cur;
+  }
+
+  for (int i = 1; i + 1 < n; i++)
+    softraster_setup(sr, out, &poly[cur][0], &poly[cur][i], &poly[cur][i + 1]);
+}
+
+// Geometry phase for instances [first, last). Each vertex is transformed
+// ("shaded") once per instance, however many triangles share it
+static inline void softraster_geometry(softraster_t *sr, softraster_bins_t *out,
+                                       int first, int last) {
+  out->tris.clear();
+  for (size_t t = 0; t < out->bins.size(); t++)
+    out->bins[t].clear();
+  out->vertices.resize(sr->num_vertices);
+
+  for (int instance = first; instance < last; instance++) {
+    glm::mat4 mvp = sr->proj_matrix * sr->mv_matrices[instance];
+    for (int i = 0; i < sr->num_vertices; i++) {
+      glm::vec4 v_pos(sr->positions[i * 3], sr->positions[i * 3 + 1],
+                      sr->positions[i * 3 + 2], 1.0f);
+      out->vertices[i].clip = mvp * v_pos;
+      out->vertices[i].color = glm::vec3(v_pos) * 2.0f + glm::vec3(0.4f);
+    }
+    for (int i = 0; i + 2 < sr->num_indices; i += 3) {
+      softraster_vertex_t tri[3] = { out->vertices[sr->indices[i]],
+                                     out->vertices[sr->indices[i + 1]],
+                                     out->vertices[sr->indices[i + 2]] };
+      softraster_clip(sr, out, tri);
+    }
+  }
+}
+
+static inline unsigned char softraster_unorm8(float c) {
+  c = c < 0.0f ? 0.0f : (c > 1.0f ? 1.0f : c);
+  return (unsigned char) (c * 255.0f + 0.5f);
+}
+
+// Rasterizes tri into the pixels of the tile at (x0, y0)
+static inline void softraster_triangle(softraster_t *sr, const softraster_tri_t &tri,
+                                       int x0, int y0) {
+  int min_x = std::max(tri.min_x, x0), max_x = std::min(tri.max_x, x0 + SOFTRASTER_TILE - 1);
+  int min_y = std::max(tri.min_y, y0), max_y = std::min(tri.max_y, y0 + SOFTRASTER_TILE - 1);
+  if (min_x > max_x || min_y > max_y)
+    return;
+
+  // Edge i is opposite to vertex i; its function is vertex i's barycentric weight
+  int64_t step_x[3], step_y[3], row[3];
+  int64_t px = (int64_t) min_x * SOFTRASTER_SUBPIXEL + SOFTRASTER_SUBPIXEL / 2;
+  int64_t py = (int64_t) min_y * SOFTRASTER_SUBPIXEL + SOFTRASTER_SUBPIXEL / 2;
+  for (int i = 0; i < 3; i++) {
+    int a = (i + 1) % 3, b = (i + 2) % 3;
+    int64_t dx = tri.x[b] - tri.x[a], dy = tri.y[b] - tri.y[a];
+    step_x[i] = -dy * SOFTRASTER_SUBPIXEL;
+    step_y[i] = dx * SOFTRASTER_SUBPIXEL;
+    // Bias so that "e > 0" covers the top-left edges too
+    row[i] = softraster_edge(tri.x[a], tri.y[a], tri.x[b], tri.y[b], px, py) -
+             (softraster_top_left(dx, dy) ? 0 : 1);
+  }
+
+  for (int y = min_y; y <= max_y; y++) {
+    int64_t e0 = row[0], e1 = row[1], e2 = row[2];
+    float *depth = &sr->depth[(size_t) y * sr->width];
+    unsigned char *color = &sr->color[(size_t) y * sr->width * 3];
+
+    for (int x = min_x; x <= max_x; x++) {
+      if ((e0 | e1 | e2) >= 0) {
+        // (the fill rule bias is negligible for the weights)
+        float b0 = (float) e0 * tri.inv_area;
+        float b1 = (float) e1 * tri.inv_area;
+        float b2 = 1.0f - b0 - b1;
+        float z = b0 * tri.z[0] + b1 * tri.z[1] + b2 * tri.z[2];
+        if (z < depth[x]) {
+          depth[x] = z;
+          float w = 1.0f / (b0 * tri.inv_w[0] + b1 * tri.inv_w[1] + b2 * tri.inv_w[2]);
+          glm::vec3 c = (b0 * tri.color_w[0] + b1 * tri.color_w[1] + b2 * tri.color_w[2]) * w;
+          color[x * 3] = softraster_unorm8(c.r);
+          color[x * 3 + 1] = softraster_unorm8(c.g);
+          color[x * 3 + 2] = softraster_unorm8(c.b);
+        }
+      }
+      e0 += step_x[0];
+      e1 += step_x[1];
+      e2 += step_x[2];
+    }
+    row[0] += step_y[0];
+    row[1] += step_y[1];
+    row[2] += step_y[2];
+  }
+}
+
+// Raster phase: tiles handed out one at a time until none is left
+static inline void softraster_tiles(softraster_t *sr) {
+  int num_tiles = sr->tiles_x * sr->tiles_y;
+  int tile;
+
+  while ((tile = __atomic_fetch_add(&sr->next_tile, 1, __ATOMIC_RELAXED)) < num_tiles) {
+    int x0 = (tile % sr->tiles_x) * SOFTRASTER_TILE, y0 = (tile / sr->tiles_x) * SOFTRASTER_TILE;
+    int x1 = std::min(x0 + SOFTRASTER_TILE, sr->width), y1 = std::min(y0 + SOFTRASTER_TILE, sr->height);
+
+    for (int y = y0; y < y1; y++) {
+      std::fill(&sr->depth[(size_t) y * sr->width + x0], &sr->depth[(size_t) y * sr->width + x1], 1.0f);
+      std::fill(&sr->color[((size_t) y * sr->width + x0) * 3], &sr->color[((size_t) y * sr->width + x1) * 3], 0);
+    }
+
+    // Threads binned consecutive instance ranges: visiting them in order keeps
+    // the submission order
+    for (int t = 0; t < sr->num_threads; t++) {
+      const softraster_bins_t &bins = sr->per_thread[t];
+      const std::vector<uint32_t> &bin = bins.bins[tile];
+      for (size_t i = 0; i < bin.size(); i++)
+        softraster_triangle(sr, bins.tris[bin[i]], x0, y0);
+    }
+  }
+}
+
+// Both phases of a frame, as thread id
+static inline void softraster_work(softraster_t *sr, int id) {
+  int first = (int) ((long long) sr->num_instances * id / sr->num_threads);
+  int last = (int) ((long long) sr->num_instances * (id + 1) / sr->num_threads);
+  softraster_geometry(sr, &sr->per_thread[id], first, last);
+
+  pthread_barrier_wait(&sr->binned);
+  softraster_tiles(sr);
+}
+
+static inline void *softraster_worker(void *arg) {
+  softraster_thread_t *thread = (softraster_thread_t *) arg;
+  softraster_t *sr = thread->sr;
+  int id = thread->id;
+
+  // Barriers are ready once softraster_init() releases the lock
+  pthread_mutex_lock(&sr->lock);
+  pthread_mutex_unlock(&sr->lock);
+
+  for (;;) {
+    pthread_barrier_wait(&sr->start);
+    if (sr->quit)
+      break;
+    softraster_work(sr, id);
+    pthread_barrier_wait(&sr->done);
+  }
+  return NULL;
+}
+
+// threads <= 0: one per online CPU
+static inline void softraster_init(softraster_t *sr, int width, int height, int threads) {
+  sr->width = width;
+  sr->height = height;
+  sr->tiles_x = (width + SOFTRASTER_TILE - 1) / SOFTRASTER_TILE;
+  sr->tiles_y = (height + SOFTRASTER_TILE - 1) / SOFTRASTER_TILE;
+  sr->color.assign((size_t) width * height * 3, 0);
+  sr->depth.assign((size_t) width * height, 1.0f);
+  sr->positions = NULL;
+  sr->indices = NULL;
+  sr->num_vertices = sr->num_indices = 0;
+  sr->mv_matrices = NULL;
+  sr->num_instances = 0;
+  sr->quit = false;
+
+  if (threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  sr->num_threads = std::max(1, std::min(threads, SOFTRASTER_MAX_THREADS));
+
+  sr->per_thread.resize(sr->num_threads);
+  for (int t = 0; t < sr->num_threads; t++)
+    sr->per_thread[t].bins.resize(sr->tiles_x * sr->tiles_y);
+
+  // The calling thread is 0. If a worker can't be started, the pool
+  // shrinks to the ones that were, so the barriers are sized afterwards
+  pthread_mutex_init(&sr->lock, NULL);
+  pthread_mutex_lock(&sr->lock);
+  int started = 1;
+  for (int t = 1; t < sr->num_threads; t++) {
+    sr->thread_args[t].sr = sr;
+    sr->thread_args[t].id = t;
+    if (pthread_create(&sr->threads[t], NULL, softraster_worker, &sr->thread_args[t]) != 0)
+      break;
+    started++;
+  }
+  sr->num_threads = started;
+
+  pthread_barrier_init(&sr->start, NULL, sr->num_threads);
+  pthread_barrier_init(&sr->binned, NULL, sr->num_threads);
+  pthread_barrier_init(&sr->done, NULL, sr->num_threads);
+  pthread_mutex_unlock(&sr->lock);
+}
+
+// Mesh drawn for every instance. The arrays must outlive sr
+static inline void softraster_mesh(softraster_t *sr, const float *positions, int num_vertices,
+                                   const unsigned short *indices, int num_indices) {
+  sr->positions = positions;
+  sr->num_vertices = num_vertices;
+  sr->indices = indices;
+  sr->num_indices = num_indices;
+}
+
+// Renders the mesh once per model-view matrix into sr->color (and sr->depth)
+static inline void softraster_draw(softraster_t *sr, const glm::mat4 &proj_matrix,
+                                   const glm::mat4 *mv_matrices, int num_instances) {
+  sr->proj_matrix = proj_matrix;
+  sr->mv_matrices = mv_matrices;
+  sr->num_instances = num_instances;
+  sr->next_tile = 0;
+
+  pthread_barrier_wait(&sr->start);
+  softraster_work(sr, 0);
+  pthread_barrier_wait(&sr->done);
+}
+
+static inline void softraster_terminate(softraster_t *sr) {
+  sr->quit = true;
+  pthread_barrier_wait(&sr->start);
+  for (int t = 1; t < sr->num_threads; t++)
+    pthread_join(sr->threads[t], NULL);
+
+  pthread_barrier_destroy(&sr->start);
+  pthread_barrier_destroy(&sr->binned);
+  pthread_barrier_destroy(&sr->done);
+  pthread_mutex_destroy(&sr->lock);
+}
+
+#endif // SOFTRASTER_H
@@ -8,6 +8,9 @@
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
 
 // GLM library to deal with matrix operations
 #include <glm/glm.hpp>
@@ -15,41 +18,175 @@
 #include <glm/gtc/matrix_transform.hpp> // glm::translate, glm::rotate, glm::perspective
 #include <glm/gtc/type_ptr.hpp>
 
+#include "headless.h"
+#include "progcache.h"
+#include "frametimes.h"
+#include "gpuprofiler.h"
+#include "softraster.h"
+
 int gl_width = 640;
 int gl_height = 480;
 
 void glfw_window_size_callback(GLFWwindow* window, int width, int height);
 void processInput(GLFWwindow *window);
 void render(double);
+int render_cpu(headless_t *hl, int threads);
+glm::mat4 cube_matrix(int cube, double currentTime);
 
 GLuint shader_program = 0; // shader program to set render pipeline
+GLuint instanced_program = 0; // same pipeline, mv_matrix as per-instance attribute
 GLuint vao = 0; // Vertext Array Object to set input data
+GLuint vao_arrays = 0; // same cube as 36 non-indexed vertices
+GLuint instance_vbo = 0; // per-cube model-view matrices for instanced drawing
 GLint mv_location, proj_location; // Uniforms for transformation matrices
+GLint instanced_proj_location; // proj_matrix uniform in instanced_program
 
-int main() {
-  // start GL context and O/S window using the GLFW helper library
-  if (!glfwInit()) {
-    fprintf(stderr, "ERROR: could not start GLFW3\n");
-    return 1;
+int num_cubes = 1; // cubes drawn per frame (-n)
+bool instanced = false; // one glDrawArraysInstanced instead of a draw per cube (-i)
+bool indexed = true; // draw from the 8-vertex indexed mesh (-a turns it off)
+std::vector<glm::mat4> instance_matrices;
+
+// Vertex shader invocations, counted with a pipeline statistics query
+GLuint stats_query = 0;
+bool stats_pending = false;
+GLuint64 vs_invocations = 0;
+
+// Frames rendered by the CPU rasterizer when not saving them (-cpu alone)
+#define CPU_BENCHMARK_FRAMES 300
+
+// GPU time per region of render() (-profile)
+gpuprof_t profiler;
+int prof_frame, prof_clear, prof_upload, prof_draw;
+
+// Cube to be rendered
+//
+//          0        3
+//       7        4 <-- top-right-near
+// bottom
+// left
+// far ---> 1        2
+//       6        5
+//
+const GLfloat vertex_positions[] = {
+  -0.25f,  0.25f, -0.25f, // 0
+  -0.25f, -0.25f, -0.25f, // 1
+   0.25f, -0.25f, -0.25f, // 2
+   0.25f,  0.25f, -0.25f, // 3
+   0.25f,  0.25f,  0.25f, // 4
+   0.25f, -0.25f,  0.25f, // 5
+  -0.25f, -0.25f,  0.25f, // 6
+  -0.25f,  0.25f,  0.25f  // 7
+};
+
+// Two triangles per face. Each triangle shares an edge with the previous one
+// as we walk around the cube, so a corner is still in the post-transform
+// cache whenever it is referenced again and gets shaded only once per cube.
+#define NUM_INDICES 36
+const GLushort vertex_indices[NUM_INDICES] = {
+  1, 0, 2,   3, 2, 0, // far
+  2, 3, 5,   4, 5, 3, // right
+  5, 4, 6,   7, 6, 4, // near
+  6, 7, 1,   0, 1, 7, // left
+  2, 5, 1,   6, 1, 5, // bottom
+  4, 3, 7,   0, 7, 3  // top
+};
+
+void setup_instance_attributes() {
+  glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+  for (int c = 0; c < 4; c++) {
+    glVertexAttribPointer(1 + c, 4, GL_FLOAT, GL_FALSE, sizeof(glm::mat4),
+                          (void *) (c * sizeof(glm::vec4)));
+    glEnableVertexAttribArray(1 + c);
+    glVertexAttribDivisor(1 + c, 1);
   }
+}
 
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-  //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
-  //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
-  //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+void usage(const char *prog) {
+  fprintf(stderr, "Usage: %s [-n cubes] [-i] [-a] [-cpu] [-threads T] [-headless N] [-o prefix] [-ring D] [-stats file] [-profile]\n", prog);
+  fprintf(stderr, "  -n cubes  number of cubes drawn per frame (default 1)\n");
+  fprintf(stderr, "  -i        instanced rendering: a single draw call for all cubes\n");
+  fprintf(stderr, "  -a        non-indexed cube (36 vertices) instead of 8 indexed ones\n");
+  fprintf(stderr, "  -profile  GPU time of each region of render() (clear, upload, draw)\n");
+  fprintf(stderr, "  -cpu      software rasterizer, no GL at all: saves the -headless N frames,\n"
+                  "            or renders %d frames to measure fps\n", CPU_BENCHMARK_FRAMES);
+  fprintf(stderr, "  -threads T  CPU rasterizer threads (default: one per CPU)\n");
+  headless_usage();
+  frametimes_usage();
+}
 
-  GLFWwindow* window = glfwCreateWindow(gl_width, gl_height, "My spinning cube", NULL, NULL);
-  if (!window) {
-    fprintf(stderr, "ERROR: could not open window with GLFW3\n");
-    glfwTerminate();
+int main(int argc, char *argv[]) {
+  bool benchmark = false; // report draw throughput once per second
+  headless_t hl;
+  headless_defaults(&hl);
+  const char *stats_file = NULL; // frame time instrumentation (-stats)
+  bool profile = false; // GPU profiler scopes in render() (-profile)
+  bool cpu = false; // software rasterizer instead of GL (-cpu)
+  int cpu_threads = 0; // 0: one per CPU (-threads)
+
+  for (int i = 1; i < argc; i++) {
+    if (headless_arg(&hl, argc, argv, &i) || frametimes_arg(&stats_file, argc, argv, &i)) {
+      continue;
+    } else if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+      num_cubes = atoi(argv[++i]);
+      benchmark = true;
+    } else if (!strcmp(argv[i], "-i")) {
+      instanced = true;
+    } else if (!strcmp(argv[i], "-a")) {
+      indexed = false;
+    } else if (!strcmp(argv[i], "-profile")) {
+      profile = true;
+    } else if (!strcmp(argv[i], "-cpu")) {
+      cpu = true;
+    } else if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+      cpu_threads = atoi(argv[++i]);
+    } else {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (num_cubes < 1) {
+    fprintf(stderr, "ERROR: cube count must be positive\n");
     return 1;
   }
-  glfwSetWindowSizeCallback(window, glfw_window_size_callback);
-  glfwMakeContextCurrent(window);
 
-  // start GLEW extension handler
-  // glewExperimental = GL_TRUE;
-  glewInit();
+  // Software rendering: no GL context, no window
+  if (cpu)
+    return render_cpu(&hl, cpu_threads);
+
+  GLFWwindow* window = NULL;
+  if (hl.frames) {
+    // start GL context on an offscreen framebuffer, no window at all
+    if (!headless_init(&hl, gl_width, gl_height))
+      return 1;
+  } else {
+    // start GL context and O/S window using the GLFW helper library
+    if (!glfwInit()) {
+      fprintf(stderr, "ERROR: could not start GLFW3\n");
+      return 1;
+    }
+
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    //  glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 3);
+    //  glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
+    //  glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
+
+    window = glfwCreateWindow(gl_width, gl_height, "My spinning cube", NULL, NULL);
+    if (!window) {
+      fprintf(stderr, "ERROR: could not open window with GLFW3\n");
+      glfwTerminate();
+      return 1;
+    }
+    glfwSetWindowSizeCallback(window, glfw_window_size_callback);
+    glfwMakeContextCurrent(window);
+
+    // Don't let vsync cap the frame rate when measuring throughput
+    if (benchmark)
+      glfwSwapInterval(0);
+
+    // start GLEW extension handler (headless_init() does it headless)
+    // glewExperimental = GL_TRUE;
+    glewInit();
+  }
 
   // get version info
   const GLubyte* vendor = glGetString(GL_VENDOR); // get vendor string
@@ -94,97 +231,78 @@ int main() {
     "  frag_col = vs_color;"
     "}";
 
-  // Shaders compilation
-  GLuint vs = glCreateShader(GL_VERTEX_SHADER);
-  glShaderSource(vs, 1, &vertex_shader, NULL);
-  glCompileShader(vs);
-  GLuint fs = glCreateShader(GL_FRAGMENT_SHADER);
-  glShaderSource(fs, 1, &fragment_shader, NULL);
-  glCompileShader(fs);
-
-  // Create program, attach shaders to it and link it
-  shader_program = glCreateProgram();
-  glAttachShader(shader_program, fs);
-  glAttachShader(shader_program, vs);
-  glLinkProgram(shader_program);
-
-  // Release shader objects
-  glDeleteShader(vs);
-  glDeleteShader(fs);
-
-  // Vertex Array Object
+  // Vertex Shader for instanced rendering: mv_matrix comes from a
+  // per-instance vertex attribute (locations 1 to 4) instead of a uniform
+  const char* instanced_vertex_shader =
+    "#version 130\n"
+
+    "in vec4 v_pos;"
+    "in mat4 mv_matrix;"
+
+    "out vec4 vs_color;"
+
+    "uniform mat4 proj_matrix;"
+
+    "void main() {"
+    "  gl_Position = proj_matrix * mv_matrix * v_pos;"
+    "  vs_color = v_pos * 2.0 + vec4(0.4, 0.4, 0.4, 0.0);"
+    "}";
+
+  // Shader programs, from the on-disk binary cache when possible.
+  // The instanced one shares the fragment shader and gets mv_matrix at
+  // attribute locations 1 to 4
+  shader_program = progcache_program(vertex_shader, fragment_shader, NULL);
+
+  const char *instanced_attribs[] = { "v_pos", "mv_matrix", NULL };
+  instanced_program = progcache_program(instanced_vertex_shader, fragment_shader,
+                                        instanced_attribs);
+
+  // Vertex Array Objects: indexed cube and the same cube expanded to 36
+  // vertices, for comparison (-a)
   glGenVertexArrays(1, &vao);
-  glBindVertexArray(vao);
+  glGenVertexArrays(1, &vao_arrays);
 
-  // Cube to be rendered
-  //
-  //          0        3
-  //       7        4 <-- top-right-near
-  // bottom
-  // left
-  // far ---> 1        2
-  //       6        5
-  //
-  const GLfloat vertex_positions[] = {
-    -0.25f, -0.25f, -0.25f, // 1
-    -0.25f,  0.25f, -0.25f, // 0
-     0.25f, -0.25f, -0.25f, // 2
-
-     0.25f,  0.25f, -0.25f, // 3
-     0.25f, -0.25f, -0.25f, // 2
-    -0.25f,  0.25f, -0.25f, // 0
-
-     0.25f, -0.25f, -0.25f, // 2
-     0.25f,  0.25f, -0.25f, // 3
-     0.25f, -0.25f,  0.25f, // 5
-
-     0.25f,  0.25f,  0.25f, // 4
-     0.25f, -0.25f,  0.25f, // 5
-     0.25f,  0.25f, -0.25f, // 3
-
-     0.25f, -0.25f,  0.25f, // 5
-     0.25f,  0.25f,  0.25f, // 4
-    -0.25f, -0.25f,  0.25f, // 6
-
-    -0.25f,  0.25f,  0.25f, // 7
-    -0.25f, -0.25f,  0.25f, // 6
-     0.25f,  0.25f,  0.25f, // 4
-
-    -0.25f, -0.25f,  0.25f, // 6
-    -0.25f,  0.25f,  0.25f, // 7
-    -0.25f, -0.25f, -0.25f, // 1
-
-    -0.25f,  0.25f, -0.25f, // 0
-    -0.25f, -0.25f, -0.25f, // 1
-    -0.25f,  0.25f,  0.25f, // 7
-
-     0.25f, -0.25f, -0.25f, // 2
-     0.25f, -0.25f,  0.25f, // 5
-    -0.25f, -0.25f, -0.25f, // 1
-
-    -0.25f, -0.25f,  0.25f, // 6
-    -0.25f, -0.25f, -0.25f, // 1
-     0.25f, -0.25f,  0.25f, // 5
-
-     0.25f,  0.25f,  0.25f, // 4
-     0.25f,  0.25f, -0.25f, // 3
-    -0.25f,  0.25f,  0.25f, // 7
-
-    -0.25f,  0.25f, -0.25f, // 0
-    -0.25f,  0.25f,  0.25f, // 7
-     0.25f,  0.25f, -0.25f  // 3
-  };
-
-  // Vertex Buffer Object (for vertex coordinates)
-  GLuint vbo = 0;
+  // Instance VBO (one model-view matrix per cube, refilled every frame)
+  instance_matrices.resize(num_cubes);
+  glGenBuffers(1, &instance_vbo);
+  glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+  glBufferData(GL_ARRAY_BUFFER, num_cubes * sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+
+  // VBO, EBO: 8 unique corners plus triangle indices
+  GLuint vbo = 0, ebo = 0;
   glGenBuffers(1, &vbo);
+  glGenBuffers(1, &ebo);
+
+  glBindVertexArray(vao);
+
   glBindBuffer(GL_ARRAY_BUFFER, vbo);
   glBufferData(GL_ARRAY_BUFFER, sizeof(vertex_positions), vertex_positions, GL_STATIC_DRAW);
+  glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, ebo);
+  glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(vertex_indices), vertex_indices, GL_STATIC_DRAW);
 
   // Vertex attributes
   // 0: vertex position (x, y, z)
   glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
   glEnableVertexAttribArray(0);
+  // 1..4: mv_matrix columns, advancing once per instance
+  setup_instance_attributes();
+
+  // Non-indexed VBO: every triangle corner stored on its own
+  GLfloat expanded_positions[NUM_INDICES * 3];
+  for (int i = 0; i < NUM_INDICES; i++)
+    for (int c = 0; c < 3; c++)
+      expanded_positions[i * 3 + c] = vertex_positions[vertex_indices[i] * 3 + c];
+
+  GLuint vbo_arrays = 0;
+  glGenBuffers(1, &vbo_arrays);
+
+  glBindVertexArray(vao_arrays);
+
+  glBindBuffer(GL_ARRAY_BUFFER, vbo_arrays);
+  glBufferData(GL_ARRAY_BUFFER, sizeof(expanded_positions), expanded_positions, GL_STATIC_DRAW);
+  glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, NULL);
+  glEnableVertexAttribArray(0);
+  setup_instance_attributes();
 
   // Unbind vbo (it was conveniently registered by VertexAttribPointer)
   glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -197,57 +315,254 @@ int main() {
   // - Projection matrix
   mv_location = glGetUniformLocation(shader_program, "mv_matrix");
   proj_location = glGetUniformLocation(shader_program, "proj_matrix");
+  instanced_proj_location = glGetUniformLocation(instanced_program, "proj_matrix");
+
+  printf("Drawing %d cube(s) %s\n", num_cubes,
+         instanced ? "with a single instanced draw call" : "with one draw call each");
+  if (indexed)
+    printf("Indexed cube: %d vertices, %d indices, %d bytes of geometry\n",
+           (int) (sizeof(vertex_positions) / (3 * sizeof(GLfloat))), NUM_INDICES,
+           (int) (sizeof(vertex_positions) + sizeof(vertex_indices)));
+  else
+    printf("Non-indexed cube: %d vertices, %d bytes of geometry\n",
+           NUM_INDICES, (int) (NUM_INDICES * 3 * sizeof(GLfloat)));
+
+  if (benchmark && GLEW_ARB_pipeline_statistics_query)
+    glGenQueries(1, &stats_query);
+
+  frametimes_t ft;
+  frametimes_init(&ft, stats_file);
+
+  gpuprof_init(&profiler, profile);
+  prof_frame = gpuprof_scope(&profiler, "frame");
+  prof_clear = gpuprof_scope(&profiler, "clear");
+  prof_upload = gpuprof_scope(&profiler, "upload");
+  prof_draw = gpuprof_scope(&profiler, "draw");
+
+  // Headless render loop: a fixed number of frames, each one saved to disk
+  if (hl.frames) {
+    while (headless_next_frame(&hl)) {
+      frametimes_begin_frame(&ft);
+      render(headless_time(&hl));
+      frametimes_end_render(&ft);
+      gpuprof_frame(&profiler);
+      headless_save_frame(&hl);
+      frametimes_end_frame(&ft);
+    }
+    frametimes_report(&ft);
+    gpuprof_report(&profiler);
+    headless_terminate(&hl);
+    return 0;
+  }
 
   // Render loop
+  double report_time = glfwGetTime();
+  int report_frames = 0;
+
   while(!glfwWindowShouldClose(window)) {
 
     processInput(window);
 
+    frametimes_begin_frame(&ft);
+
     render(glfwGetTime());
 
+    frametimes_end_render(&ft);
+
+    gpuprof_frame(&profiler);
+
     glfwSwapBuffers(window);
 
+    frametimes_end_frame(&ft);
+
     glfwPollEvents();
+
+    // Pick up the vertex shader count once the GPU is done with it
+    if (stats_pending) {
+      GLuint available = 0;
+      glGetQueryObjectuiv(stats_query, GL_QUERY_RESULT_AVAILABLE, &available);
+      if (available) {
+        glGetQueryObjectui64v(stats_query, GL_QUERY_RESULT, &vs_invocations);
+        stats_pending = false;
+      }
+    }
+
+    // Throughput report: frames and cubes per second
+    report_frames++;
+    double now = glfwGetTime();
+    if (benchmark && now - report_time >= 1.0) {
+      double fps = report_frames / (now - report_time);
+      printf("%d cubes: %.1f fps, %.0f cubes/s\n", num_cubes, fps, fps * num_cubes);
+      if (stats_query)
+        printf("  vertex shader invocations: %llu per frame, %.1f per cube\n",
+               (unsigned long long) vs_invocations, (double) vs_invocations / num_cubes);
+      report_time = now;
+      report_frames = 0;
+    }
   }
 
+  frametimes_report(&ft);
+  gpuprof_report(&profiler);
+
   glfwTerminate();
 
   return 0;
 }
 
+// Profiler scopes: "upload" is the per-frame data (instance matrices or
+// projection uniform), "draw" the draw calls, which in the non-instanced
+// path also set every cube's mv_matrix uniform
 void render(double currentTime) {
-  float f = (float)currentTime * 0.3f;
+  gpuprof_begin(&profiler, prof_frame);
 
+  gpuprof_begin(&profiler, prof_clear);
   glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+  gpuprof_end(&profiler, prof_clear);
 
   glViewport(0, 0, gl_width, gl_height);
 
-  glUseProgram(shader_program);
-  glBindVertexArray(vao);
+  glBindVertexArray(indexed ? vao : vao_arrays);
+
+  if (stats_query && !stats_pending)
+    glBeginQuery(GL_VERTEX_SHADER_INVOCATIONS_ARB, stats_query);
+
+  glm::mat4 proj_matrix = glm::perspective(glm::radians(50.0f),
+                                           (float) gl_width / (float) gl_height,
+                                           0.1f, 1000.0f);
+
+  if (instanced) {
+    for (int i = 0; i < num_cubes; i++)
+      instance_matrices[i] = cube_matrix(i, currentTime);
+
+    gpuprof_begin(&profiler, prof_upload);
+
+    // Orphan last frame's storage so the upload doesn't wait on the GPU
+    glBindBuffer(GL_ARRAY_BUFFER, instance_vbo);
+    glBufferData(GL_ARRAY_BUFFER, num_cubes * sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, num_cubes * sizeof(glm::mat4), instance_matrices.data());
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glUseProgram(instanced_program);
+    glUniformMatrix4fv(instanced_proj_location, 1, GL_FALSE, glm::value_ptr(proj_matrix));
+
+    gpuprof_end(&profiler, prof_upload);
+
+    gpuprof_begin(&profiler, prof_draw);
+    if (indexed)
+      glDrawElementsInstanced(GL_TRIANGLES, NUM_INDICES, GL_UNSIGNED_SHORT, 0, num_cubes);
+    else
+      glDrawArraysInstanced(GL_TRIANGLES, 0, NUM_INDICES, num_cubes);
+    gpuprof_end(&profiler, prof_draw);
+  } else {
+    gpuprof_begin(&profiler, prof_upload);
+    glUseProgram(shader_program);
+    glUniformMatrix4fv(proj_location, 1, GL_FALSE, glm::value_ptr(proj_matrix));
+    gpuprof_end(&profiler, prof_upload);
+
+    gpuprof_begin(&profiler, prof_draw);
+    for (int i = 0; i < num_cubes; i++) {
+      glm::mat4 mv_matrix = cube_matrix(i, currentTime);
+      glUniformMatrix4fv(mv_location, 1, GL_FALSE, glm::value_ptr(mv_matrix));
+
+      if (indexed)
+        glDrawElements(GL_TRIANGLES, NUM_INDICES, GL_UNSIGNED_SHORT, 0);
+      else
+        glDrawArrays(GL_TRIANGLES, 0, NUM_INDICES);
+    }
+    gpuprof_end(&profiler, prof_draw);
+  }
+
+  if (stats_query && !stats_pending) {
+    glEndQuery(GL_VERTEX_SHADER_INVOCATIONS_ARB);
+    stats_pending = true;
+  }
+
+  gpuprof_end(&profiler, prof_frame);
+}
+
+// Same frames as render(), rasterized on the CPU (softraster.h). With
+// -headless N they are written out just like the GL ones, so both paths can
+// be compared image by image; otherwise frames are only timed
+int render_cpu(headless_t *hl, int threads) {
+  bool save = hl->frames > 0;
+  if (!save)
+    hl->frames = CPU_BENCHMARK_FRAMES;
+  hl->width = gl_width;
+  hl->height = gl_height;
+
+  softraster_t sr;
+  softraster_init(&sr, gl_width, gl_height, threads);
+  softraster_mesh(&sr, vertex_positions, 8, vertex_indices, NUM_INDICES);
+  instance_matrices.resize(num_cubes);
+
+  printf("CPU rasterizer: %d frames of %dx%d, %d threads, %dx%d pixel tiles\n", hl->frames,
+         gl_width, gl_height, sr.num_threads, SOFTRASTER_TILE, SOFTRASTER_TILE);
+  printf("Drawing %d cube(s)\n", num_cubes);
+
+  glm::mat4 proj_matrix = glm::perspective(glm::radians(50.0f),
+                                           (float) gl_width / (float) gl_height,
+                                           0.1f, 1000.0f);
+
+  double start = headless_clock(), report_time = start, render_time = 0.0;
+  int report_frames = 0;
+
+  while (headless_next_frame(hl)) {
+    double t0 = headless_clock();
+    for (int i = 0; i < num_cubes; i++)
+      instance_matrices[i] = cube_matrix(i, headless_time(hl));
+    softraster_draw(&sr, proj_matrix, instance_matrices.data(), num_cubes);
+    double now = headless_clock();
+    render_time += now - t0;
+
+    if (save)
+      headless_write_frame(hl, hl->frame, sr.color.data());
+
+    // Throughput report: frames and cubes per second
+    report_frames++;
+    if (now - report_time >= 1.0) {
+      double fps = report_frames / (now - report_time);
+      printf("%d cubes: %.1f fps, %.0f cubes/s\n", num_cubes, fps, fps * num_cubes);
+      report_time = now;
+      report_frames = 0;
+    }
+  }
 
-  glm::mat4 mv_matrix, proj_matrix;
+  double elapsed = headless_clock() - start;
+  printf("Rendered %d frames in %.3f s (%.1f fps), %.3f s rasterizing (%.1f fps, %.0f cubes/s)\n",
+         hl->frames, elapsed, hl->frames / elapsed, render_time, hl->frames / render_time,
+         hl->frames * num_cubes / render_time);
 
-  mv_matrix = glm::translate(glm::mat4(1.f), glm::vec3(0.0f, 0.0f, -4.0f));
+  softraster_terminate(&sr);
+  return 0;
+}
+
+// Model-View matrix for a cube: cubes are laid out on a square grid in front
+// of the camera, each one spinning with its own phase. A single cube moves
+// exactly as in the original demo.
+glm::mat4 cube_matrix(int cube, double currentTime) {
+  int side = (int) ceilf(sqrtf((float) num_cubes));
+  float half = (side - 1) * 0.5f;
+  float t = (float) currentTime + cube * 0.1f;
+  float f = t * 0.3f;
+
+  glm::mat4 mv_matrix;
+
+  mv_matrix = glm::translate(glm::mat4(1.f), glm::vec3(0.0f, 0.0f, -4.0f - 2.0f * half));
+  mv_matrix = glm::translate(mv_matrix,
+                             glm::vec3((cube % side) - half, (cube / side) - half, 0.0f));
   mv_matrix = glm::translate(mv_matrix,
                              glm::vec3(sinf(2.1f * f) * 0.5f,
                                        cosf(1.7f * f) * 0.5f,
                                        sinf(1.3f * f) * cosf(1.5f * f) * 2.0f));
 
   mv_matrix = glm::rotate(mv_matrix,
-                          glm::radians((float)currentTime * 45.0f),
+                          glm::radians(t * 45.0f),
                           glm::vec3(0.0f, 1.0f, 0.0f));
   mv_matrix = glm::rotate(mv_matrix,
-                          glm::radians((float)currentTime * 81.0f),
+                          glm::radians(t * 81.0f),
                           glm::vec3(1.0f, 0.0f, 0.0f));
 
-  glUniformMatrix4fv(mv_location, 1, GL_FALSE, glm::value_ptr(mv_matrix));
-
-  proj_matrix = glm::perspective(glm::radians(50.0f),
-                                 (float) gl_width / (float) gl_height,
-                                 0.1f, 1000.0f);
-  glUniformMatrix4fv(proj_location, 1, GL_FALSE, glm::value_ptr(proj_matrix));
-
-  glDrawArrays(GL_TRIANGLES, 0, 36);
+  return mv_matrix;
 }
 
 void processInput(GLFWwindow *window) {
@@ -37,7 +37,7 @@
 
       - decode from memory or through FILE (define STBI_NO_STDIO to remove code)
       - decode from arbitrary I/O callbacks
-      - SIMD acceleration on x86/x64 (SSE2) and ARM (NEON)
+      - SIMD acceleration on x86/x64 (SSE2, AVX2) and ARM (NEON)
 
    Full documentation under "DOCUMENTATION" below.
 
@@ -233,7 +233,13 @@ RECENT REVISION HISTORY:
 // code.)
 //
 // On x86, SSE2 will automatically be used when available based on a run-time
-// test; if not, the generic C versions are used as a fall-back. On ARM targets,
+// test; if not, the generic C versions are used as a fall-back. On top of that,
+// AVX2 versions of the JPEG IDCT and YCbCr->RGB conversion are picked at
+// run-time on CPUs (and OSes) that support them; with GCC/Clang they are
+// compiled through a per-function target attribute, no -mavx2 needed. Define
+// STBI_NO_AVX2 to leave them out. stbi_set_simd_limit() caps the level used
+// (STBI_SIMD_NONE, STBI_SIMD_SSE2, STBI_SIMD_AVX2), e.g. to benchmark or
+// debug the kernels against each other. On ARM targets,
 // the typical path is to have separate builds for NEON and non-NEON devices
 // (at least this is true for iOS and Android). Therefore, the NEON support is
 // toggled by a build flag: define STBI_NEON to get NEON loops.
@@ -244,6 +250,49 @@ RECENT REVISION HISTORY:
 //
 // ===========================================================================
 //
+// Threads
+//
+// Define STBI_THREADS along with STB_IMAGE_IMPLEMENTATION to decode large
+// JPEGs on several POSIX threads (link with -lpthread). Baseline scans with
+// restart markers (RSTn) are split at restart intervals: every interval
+// starts a fresh entropy decoder and DC prediction, so each thread Huffman
+// decodes and IDCTs a band of consecutive intervals on its own. Upsampling
+// and color conversion then run per band of output rows, for any JPEG.
+// Images under 64K pixels per thread stay on the calling thread, and the
+// output is identical to a single-threaded decode. stbi_set_jpeg_threads()
+// sets the number of threads (default: one per online CPU).
+//
+// ===========================================================================
+//
+// Memory-mapped files
+//
+// On POSIX systems the functions taking a filename map the file into memory
+// (mmap) and decode it in place, as stbi_load_from_memory() would: no stdio
+// buffering, no copies and no read() calls, just page faults on the bytes
+// the decoder touches. Files that can't be mapped (pipes, empty or over 2GB)
+// are read with stdio as before. stbi_info(), stbi_is_16_bit() and
+// stbi_is_hdr() always use stdio: they only need the header, and setting up
+// a mapping costs more than reading it. stbi_set_mmap_files(0) turns mapping
+// off; define STBI_NO_MMAP to leave it out altogether. Either way, the
+// stbi_*_from_file() functions read from their FILE with stdio.
+//
+// ===========================================================================
+//
+// Temporary buffers
+//
+// Besides the image it returns, a decode allocates buffers it frees before
+// returning: JPEG component planes, line buffers and progressive
+// coefficients, PNG compressed data and inflate output. Decoding many images
+// in a row, these come and go from malloc at every one, and the large ones
+// are fresh pages to fault in each time. stbi_set_thread_arena(max_bytes)
+// keeps them instead in an arena of the calling thread, a single block
+// handed out in order and emptied at the start of each decode. Whatever
+// didn't fit comes from malloc as usual, and the arena grows to what the
+// decode needed, up to max_bytes, for the next one. Needs thread-local
+// variables, like stbi_set_flip_vertically_on_load_thread().
+//
+// ===========================================================================
+//
 // HDR image support   (disable by defining STBI_NO_HDR)
 //
 // stb_image supports loading HDR images in general, and currently the Radiance
@@ -402,6 +451,66 @@ STBIDEF stbi_uc *stbi_load_from_file  (FILE *f, int *x, int *y, int *channels_in
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp);
 #endif
 
+// downscaled loading, e.g. for thumbnails or the smaller mip levels: 1/scale
+// of the full size on each axis, rounded up (scale is 1, 2, 4 or 8). JPEGs
+// are decoded straight to that size with reduced IDCTs, in less time and
+// memory; other formats are decoded in full and box filtered
+STBIDEF stbi_uc *stbi_load_scaled_from_memory   (stbi_uc           const *buffer, int len   , int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+STBIDEF stbi_uc *stbi_load_scaled_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_scaled               (char const *filename, int *x, int *y, int *channels_in_file, int desired_channels, int scale);
+#endif
+
+// region loading, e.g. a sprite out of a big atlas: just the rw x rh pixels
+// at (rx,ry), counted from the top-left corner as stored in the file (before
+// any vertical flip) and clipped to the image; *x and *y get the clipped
+// size. JPEGs only reconstruct the blocks around the region and stop reading
+// after its last row, non-interlaced PNGs stop inflating and unfiltering after
+// its last scanline; other formats are decoded in full and cropped
+STBIDEF stbi_uc *stbi_load_region_from_memory   (stbi_uc           const *buffer, int len   , int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk  , void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF stbi_uc *stbi_load_region               (char const *filename, int rx, int ry, int rw, int rh, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+// streaming load, e.g. straight into glTexSubImage2D or a mapped buffer:
+// rows are handed to a callback in batches as soon as they're decoded,
+// instead of returned in one buffer. begin() (may be NULL) gets the image
+// size and the channels per pixel of the rows before any of them. rows()
+// gets n rows starting at row y of the final image, tightly packed and only
+// valid during the call; with vertical flipping on, batches come bottom-up.
+// Either one returns 0 to stop the load. Returns 1 once every row has been
+// handed out, 0 on failure.
+//
+// Baseline JPEGs in a single scan (nearly all of them) never hold more than
+// three MCU rows of pixels, non-interlaced PNGs a few scanlines besides the
+// compressed data. Other JPEGs keep their component planes, but not the
+// output image; interlaced PNGs and other formats are decoded in full and
+// then handed out
+typedef struct
+{
+   int (*begin)(void *user, int x, int y, int channels);
+   int (*rows) (void *user, const stbi_uc *pixels, int y, int n);
+} stbi_row_callbacks;
+
+STBIDEF int stbi_load_rows_from_memory   (stbi_uc           const *buffer, int len   , stbi_row_callbacks const *rows, void *rows_user, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk  , void *user, stbi_row_callbacks const *rows, void *rows_user, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_rows               (char const *filename, stbi_row_callbacks const *rows, void *rows_user, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
+// load into a buffer of the caller's, e.g. a mapped pixel unpack buffer:
+// row j of the image goes to out + j*out_stride (out_stride 0 for tightly
+// packed rows), out_len bytes at most. Size the buffer with stbi_info(),
+// and ask for the channels it's sized for. Returns 1 on success, 0 on
+// failure, including an image that doesn't fit; out may be half written.
+// Built on the streaming load, so JPEG and PNG never hold the whole image
+STBIDEF int stbi_load_into_from_memory   (stbi_uc           const *buffer, int len   , stbi_uc *out, int out_len, int out_stride, int *x, int *y, int *channels_in_file, int desired_channels);
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk  , void *user, stbi_uc *out, int out_len, int out_stride, int *x, int *y, int *channels_in_file, int desired_channels);
+#ifndef STBI_NO_STDIO
+STBIDEF int stbi_load_into               (char const *filename, stbi_uc *out, int out_len, int out_stride, int *x, int *y, int *channels_in_file, int desired_channels);
+#endif
+
 #ifdef STBI_WINDOWS_UTF8
 STBIDEF int stbi_convert_wchar_to_utf8(char *buffer, size_t bufferlen, const wchar_t* input);
 #endif
@@ -491,6 +600,41 @@ STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip);
 // calling it will fail to link if your compiler doesn't
 STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_flip);
 
+// keep the temporary buffers of decodes on the calling thread in an arena of
+// up to max_bytes reused from one decode to the next; 0 (the default) to go
+// back to malloc and release it. also only there with thread-local variables
+STBIDEF void stbi_set_thread_arena(size_t max_bytes);
+
+// SIMD kernel levels, see stbi_set_simd_limit()
+enum
+{
+   STBI_SIMD_NONE = 0, // generic C
+   STBI_SIMD_SSE2 = 1, // SSE2, or NEON on ARM
+   STBI_SIMD_AVX2 = 2
+};
+
+// cap the SIMD kernels used to max_level (default: best available). global,
+// meant for benchmarking and testing rather than for use while decoding
+STBIDEF void stbi_set_simd_limit(int max_level);
+
+// the SIMD level decoders use: the best one the CPU supports, under the limit
+STBIDEF int  stbi_simd_level(void);
+
+// threads used to decode a JPEG when built with STBI_THREADS: 0 for one per
+// online CPU (the default), 1 to decode on the calling thread only. global
+STBIDEF void stbi_set_jpeg_threads(int threads);
+
+// inflate PNGs with the fast decoder (the default: 64-bit bit buffer, whole
+// symbols and pairs of literals per table lookup, word-sized match copies),
+// or with the original one symbol and byte at a time. global, for benchmarking
+STBIDEF void stbi_set_fast_inflate(int flag_true_if_fast);
+
+#ifndef STBI_NO_STDIO
+// load files by name through memory mappings (the default, where available)
+// or with stdio. global
+STBIDEF void stbi_set_mmap_files(int flag_true_if_mmap);
+#endif
+
 // ZLIB client - used by PNG, available for other purposes
 
 STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int initial_size, int *outlen);
@@ -565,6 +709,23 @@ STBIDEF int   stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const ch
 #include <stdio.h>
 #endif
 
+#if !defined(STBI_NO_STDIO) && !defined(STBI_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define STBI__MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#if defined(STBI_THREADS) && defined(STBI_NO_JPEG)
+#undef STBI_THREADS // only the JPEG decoder is threaded
+#endif
+
+#ifdef STBI_THREADS
+#include <pthread.h>
+#include <unistd.h> // sysconf
+#endif
+
 #ifndef STBI_ASSERT
 #include <assert.h>
 #define STBI_ASSERT(x) assert(x)
@@ -618,6 +779,12 @@ typedef uint32_t stbi__uint32;
 typedef int32_t  stbi__int32;
 #endif
 
+#ifdef _MSC_VER
+typedef unsigned __int64 stbi__uint64;
+#else
+typedef uint64_t stbi__uint64;
+#endif
+
 // should produce compiler error if size is wrong
 typedef unsigned char validate_uint32[sizeof(stbi__uint32)==4 ? 1 : -1];
 
@@ -717,18 +884,15 @@ static int stbi__cpuid3(void)
 
 #define STBI_SIMD_ALIGN(type, name) __declspec(align(16)) type name
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    int info3 = stbi__cpuid3();
    return ((info3 >> 26) & 1) != 0;
 }
-#endif
 
 #else // assume GCC-style if not VC++
 #define STBI_SIMD_ALIGN(type, name) type name __attribute__((aligned(16)))
 
-#if !defined(STBI_NO_JPEG) && defined(STBI_SSE2)
 static int stbi__sse2_available(void)
 {
    // If we're even attempting to compile this on GCC/Clang, that means
@@ -736,8 +900,46 @@ static int stbi__sse2_available(void)
    // instructions at will, and so are we.
    return 1;
 }
+
 #endif
+#endif
+
+// AVX2 kernels, on top of SSE2. Unlike SSE2 they are never assumed: the CPU
+// has to report AVX2 and the OS has to save YMM state (XCR0 bits 1-2). With
+// GCC/Clang only the AVX2 functions themselves get target("avx2"), so the
+// rest of the library still runs on any SSE2 machine.
+#if defined(STBI_SSE2) && !defined(STBI_NO_AVX2) && \
+    ((defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__))) || (defined(_MSC_VER) && _MSC_VER >= 1800))
+#define STBI_AVX2
+#include <immintrin.h>
 
+#ifdef _MSC_VER
+#define STBI__AVX2_TARGET
+static int stbi__avx2_available(void)
+{
+   int info[4];
+   __cpuid(info,1);
+   // OSXSAVE (bit 27) and AVX (bit 28)
+   if ((info[2] & (3 << 27)) != (3 << 27) || (_xgetbv(0) & 6) != 6)
+      return 0;
+   __cpuidex(info,7,0);
+   return ((info[1] >> 5) & 1) != 0;
+}
+#else
+#include <cpuid.h>
+#define STBI__AVX2_TARGET __attribute__((target("avx2")))
+static int stbi__avx2_available(void)
+{
+   unsigned int a, b, c, d, xcr0, xcr0_hi;
+   // OSXSAVE (bit 27) and AVX (bit 28)
+   if (!__get_cpuid(1, &a, &b, &c, &d) || (c & (3u << 27)) != (3u << 27))
+      return 0;
+   __asm__ ("xgetbv" : "=a" (xcr0), "=d" (xcr0_hi) : "c" (0));
+   if ((xcr0 & 6) != 6 || __get_cpuid_max(0, NULL) < 7)
+      return 0;
+   __cpuid_count(7, 0, a, b, c, d);
+   return ((b >> 5) & 1) != 0;
+}
 #endif
 #endif
 
@@ -764,6 +966,16 @@ static int stbi__sse2_available(void)
 //
 //  stbi__context struct and start_xxx functions
 
+// where a streaming load hands out its rows
+typedef struct
+{
+   stbi_row_callbacks cb;
+   void *user;
+   int x, y, channels;
+   int flip;      // rows come in decode order, flip them on the way out
+   int handed;    // rows handed out so far
+} stbi__row_sink;
+
 // stbi__context structure is our basic context used by all images, so it
 // contains all the IO context, plus some basic image information
 typedef struct
@@ -781,6 +993,11 @@ typedef struct
 
    stbi_uc *img_buffer, *img_buffer_end;
    stbi_uc *img_buffer_original, *img_buffer_original_end;
+
+   int scale_shift; // downscale by 1 << scale_shift, cleared by loaders that do it
+   int roi_x, roi_y, roi_w, roi_h; // region to crop to if roi_w, cleared by loaders that do it
+   stbi__row_sink *sink; // streaming load: loaders that stream return NULL when done
+   int flip; // loaders may write rows bottom-up, see stbi__result_info.flipped
 } stbi__context;
 
 
@@ -792,6 +1009,10 @@ static void stbi__start_mem(stbi__context *s, stbi_uc const *buffer, int len)
    s->io.read = NULL;
    s->read_from_callbacks = 0;
    s->callback_already_read = 0;
+   s->scale_shift = 0;
+   s->roi_w = 0;
+   s->sink = NULL;
+   s->flip = 0;
    s->img_buffer = s->img_buffer_original = (stbi_uc *) buffer;
    s->img_buffer_end = s->img_buffer_original_end = (stbi_uc *) buffer+len;
 }
@@ -804,6 +1025,10 @@ static void stbi__start_callbacks(stbi__context *s, stbi_io_callbacks *c, void *
    s->buflen = sizeof(s->buffer_start);
    s->read_from_callbacks = 1;
    s->callback_already_read = 0;
+   s->scale_shift = 0;
+   s->roi_w = 0;
+   s->sink = NULL;
+   s->flip = 0;
    s->img_buffer = s->img_buffer_original = s->buffer_start;
    stbi__refill_buffer(s);
    s->img_buffer_original_end = s->img_buffer_end;
@@ -867,6 +1092,7 @@ typedef struct
    int bits_per_channel;
    int num_channels;
    int channel_order;
+   int flipped; // rows already stored bottom-up, as asked by stbi__context.flip
 } stbi__result_info;
 
 #ifndef STBI_NO_JPEG
@@ -1006,7 +1232,7 @@ static int stbi__mad4sizes_valid(int a, int b, int c, int d, int add)
 }
 #endif
 
-#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
+#if !defined(STBI_NO_PNG) || !defined(STBI_NO_TGA) || !defined(STBI_NO_HDR)
 // mallocs with size overflow checking
 static void *stbi__malloc_mad2(int a, int b, int add)
 {
@@ -1029,6 +1255,149 @@ static void *stbi__malloc_mad4(int a, int b, int c, int d, int add)
 }
 #endif
 
+// temporary buffers: freed before the decode returns, and only with
+// stbi__temp_free() on the thread that allocated them. they come from the
+// thread's arena while it's decoding (see stbi_set_thread_arena), else malloc
+#ifdef STBI_THREAD_LOCAL
+#define STBI__ARENA_HEADER 16 // each block starts with its size, keeping 16-byte alignment
+
+typedef struct
+{
+   stbi_uc *base;
+   size_t size, used;
+   size_t max;      // stbi_set_thread_arena()
+   size_t wanted;   // peak of used plus what went to malloc, this decode
+   size_t missed;   // bytes that went to malloc
+   int depth;       // decodes running on the thread: nested from callbacks
+} stbi__arena;
+
+static STBI_THREAD_LOCAL stbi__arena stbi__arena_local;
+
+STBIDEF void stbi_set_thread_arena(size_t max_bytes)
+{
+   stbi__arena *a = &stbi__arena_local;
+   a->max = max_bytes;
+   if (a->size > max_bytes && !a->depth) {
+      STBI_FREE(a->base);
+      a->base = NULL;
+      a->size = 0;
+   }
+}
+
+// a decode starting: the outermost one on the thread empties the arena,
+// grown first to what the previous one wanted
+static void stbi__arena_enter(void)
+{
+   stbi__arena *a = &stbi__arena_local;
+   if (a->depth++ || !a->max) return;
+   if (a->wanted > a->size && a->size < a->max) {
+      size_t size = a->wanted < a->max ? a->wanted : a->max;
+      STBI_FREE(a->base);
+      a->base = (stbi_uc *) STBI_MALLOC(size);
+      a->size = a->base ? size : 0;
+   }
+   a->used = a->wanted = a->missed = 0;
+}
+
+static void stbi__arena_leave(void)
+{
+   --stbi__arena_local.depth;
+}
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_ZLIB)
+static int stbi__arena_owns(stbi__arena *a, void *p)
+{
+   return (stbi_uc *) p >= a->base && (stbi_uc *) p < a->base + a->size;
+}
+
+static size_t stbi__arena_block(size_t size)
+{
+   return STBI__ARENA_HEADER + ((size + 15) & ~(size_t) 15);
+}
+
+static void *stbi__temp_malloc(size_t size)
+{
+   stbi__arena *a = &stbi__arena_local;
+   if (a->depth && a->max) {
+      size_t need = stbi__arena_block(size);
+      if (need <= a->size - a->used) {
+         stbi_uc *p = a->base + a->used;
+         memcpy(p, &size, sizeof(size));
+         a->used += need;
+         if (a->used + a->missed > a->wanted) a->wanted = a->used + a->missed;
+         return p + STBI__ARENA_HEADER;
+      }
+      a->missed += need;
+      if (a->used + a->missed > a->wanted) a->wanted = a->used + a->missed;
+   }
+   return stbi__malloc(size);
+}
+
+static void stbi__temp_free(void *p)
+{
+   stbi__arena *a = &stbi__arena_local;
+   if (stbi__arena_owns(a, p)) {
+      size_t size;
+      stbi_uc *block = (stbi_uc *) p - STBI__ARENA_HEADER;
+      memcpy(&size, block, sizeof(size));
+      // only the last block gives its space back; the rest waits for the next decode
+      if (block + stbi__arena_block(size) == a->base + a->used)
+         a->used = (size_t) (block - a->base);
+   } else {
+      STBI_FREE(p);
+   }
+}
+
+#endif
+
+#if !defined(STBI_NO_ZLIB) || defined(STBI_THREADS)
+static void *stbi__temp_realloc(void *p, size_t newsize)
+{
+   stbi__arena *a = &stbi__arena_local;
+   size_t size;
+   void *q;
+   if (!p) return stbi__temp_malloc(newsize);
+   if (!stbi__arena_owns(a, p)) return STBI_REALLOC(p, newsize);
+   memcpy(&size, (stbi_uc *) p - STBI__ARENA_HEADER, sizeof(size));
+   // the last block grows in place while there's room
+   if ((stbi_uc *) p - STBI__ARENA_HEADER + stbi__arena_block(size) == a->base + a->used &&
+       stbi__arena_block(newsize) - STBI__ARENA_HEADER <= a->size - (size_t) ((stbi_uc *) p - a->base)) {
+      a->used = (size_t) ((stbi_uc *) p - a->base) + stbi__arena_block(newsize) - STBI__ARENA_HEADER;
+      if (a->used + a->missed > a->wanted) a->wanted = a->used + a->missed;
+      memcpy((stbi_uc *) p - STBI__ARENA_HEADER, &newsize, sizeof(newsize));
+      return p;
+   }
+   q = stbi__temp_malloc(newsize);
+   if (!q) return NULL;
+   memcpy(q, p, size < newsize ? size : newsize);
+   stbi__temp_free(p);
+   return q;
+}
+#endif
+#else
+#define stbi__arena_enter()
+#define stbi__arena_leave()
+#define stbi__temp_malloc(sz)       stbi__malloc(sz)
+#define stbi__temp_realloc(p,newsz) STBI_REALLOC(p,newsz)
+#define stbi__temp_free(p)          STBI_FREE(p)
+#endif // STBI_THREAD_LOCAL
+
+#if !defined(STBI_NO_JPEG) || !defined(STBI_NO_PNG)
+static void *stbi__temp_malloc_mad2(int a, int b, int add)
+{
+   if (!stbi__mad2sizes_valid(a, b, add)) return NULL;
+   return stbi__temp_malloc(a*b + add);
+}
+#endif
+
+#ifndef STBI_NO_JPEG
+static void *stbi__temp_malloc_mad3(int a, int b, int c, int add)
+{
+   if (!stbi__mad3sizes_valid(a, b, c, add)) return NULL;
+   return stbi__temp_malloc(a*b*c + add);
+}
+#endif
+
 // stbi__err - error
 // stbi__errpf - error returning pointer to float
 // stbi__errpuc - error returning pointer to unsigned char
@@ -1057,6 +1426,53 @@ static float   *stbi__ldr_to_hdr(stbi_uc *data, int x, int y, int comp);
 static stbi_uc *stbi__hdr_to_ldr(float   *data, int x, int y, int comp);
 #endif
 
+static int stbi__simd_limit = STBI_SIMD_AVX2;
+
+STBIDEF void stbi_set_simd_limit(int max_level)
+{
+   stbi__simd_limit = max_level;
+}
+
+STBIDEF int stbi_simd_level(void)
+{
+   int level = STBI_SIMD_NONE;
+#ifdef STBI_SSE2
+   if (stbi__sse2_available())
+      level = STBI_SIMD_SSE2;
+#endif
+#ifdef STBI_NEON
+   level = STBI_SIMD_SSE2;
+#endif
+#ifdef STBI_AVX2
+   if (level == STBI_SIMD_SSE2 && stbi__avx2_available())
+      level = STBI_SIMD_AVX2;
+#endif
+   return level < stbi__simd_limit ? level : stbi__simd_limit;
+}
+
+static int stbi__jpeg_threads = 0;
+
+STBIDEF void stbi_set_jpeg_threads(int threads)
+{
+   stbi__jpeg_threads = threads;
+}
+
+static int stbi__zfast_inflate = 1;
+
+STBIDEF void stbi_set_fast_inflate(int flag_true_if_fast)
+{
+   stbi__zfast_inflate = flag_true_if_fast;
+}
+
+#ifndef STBI_NO_STDIO
+static int stbi__mmap_files = 1;
+
+STBIDEF void stbi_set_mmap_files(int flag_true_if_mmap)
+{
+   stbi__mmap_files = flag_true_if_mmap;
+}
+#endif
+
 static int stbi__vertically_flip_on_load_global = 0;
 
 STBIDEF void stbi_set_flip_vertically_on_load(int flag_true_if_should_flip)
@@ -1080,7 +1496,7 @@ STBIDEF void stbi_set_flip_vertically_on_load_thread(int flag_true_if_should_fli
                                          : stbi__vertically_flip_on_load_global)
 #endif // STBI_THREAD_LOCAL
 
-static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+static void *stbi__load_any(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
 {
    memset(ri, 0, sizeof(*ri)); // make sure it's initialized if we add new fields
    ri->bits_per_channel = 8; // default is 8 so most paths don't have to be changed
@@ -1127,6 +1543,15 @@ static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int re
    return stbi__errpuc("unknown image type", "Image not of any known type, or corrupt");
 }
 
+static void *stbi__load_main(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri, int bpc)
+{
+   void *result;
+   stbi__arena_enter();
+   result = stbi__load_any(s, x, y, comp, req_comp, ri, bpc);
+   stbi__arena_leave();
+   return result;
+}
+
 static stbi_uc *stbi__convert_16_to_8(stbi__uint16 *orig, int w, int h, int channels)
 {
    int i;
@@ -1197,10 +1622,93 @@ static void stbi__vertical_flip_slices(void *image, int w, int h, int z, int byt
 }
 #endif
 
+// box filter, for loaders that can't decode downscaled themselves
+static stbi_uc *stbi__downscale(stbi_uc *data, int *x, int *y, int channels, int shift)
+{
+   int w = (*x + (1 << shift)-1) >> shift, h = (*y + (1 << shift)-1) >> shift;
+   int i,j,c,u,v;
+   stbi_uc *out = (stbi_uc *) stbi__malloc_mad3(w, h, channels, 0);
+   stbi__uint32 *sum = (stbi__uint32 *) stbi__malloc_mad3(w, channels, sizeof(stbi__uint32), 0);
+   if (!out || !sum) {
+      STBI_FREE(out);
+      STBI_FREE(sum);
+      STBI_FREE(data);
+      return stbi__errpuc("outofmem", "Out of memory");
+   }
+   for (j=0; j < h; ++j) {
+      int y0 = j << shift, y1 = (j+1) << shift < *y ? (j+1) << shift : *y;
+      stbi_uc *o = out + (size_t) j * w * channels;
+      // add up the source rows, then divide by the pixels each sum took
+      memset(sum, 0, (size_t) w * channels * sizeof(stbi__uint32));
+      for (v=y0; v < y1; ++v) {
+         stbi_uc *p = data + (size_t) v * *x * channels;
+         stbi__uint32 *s = sum;
+         for (i=0; i < w; ++i, s += channels) {
+            int n = (i+1) << shift < *x ? 1 << shift : *x - (i << shift);
+            for (c=0; c < channels; ++c) {
+               stbi__uint32 acc = 0;
+               for (u=0; u < n; ++u)
+                  acc += p[u * channels + c];
+               s[c] += acc;
+            }
+            p += n * channels;
+         }
+      }
+      for (i=0; i < w; ++i) {
+         int x1 = (i+1) << shift < *x ? (i+1) << shift : *x;
+         int count = (x1 - (i << shift)) * (y1-y0);
+         for (c=0; c < channels; ++c)
+            o[i * channels + c] = (stbi_uc) ((sum[i * channels + c] + (count >> 1)) / count);
+      }
+   }
+   STBI_FREE(sum);
+   STBI_FREE(data);
+   *x = w;
+   *y = h;
+   return out;
+}
+
+// clips a region to a w x h image. Returns 0 if nothing is left
+static int stbi__clip_region(int *rx, int *ry, int *rw, int *rh, int w, int h)
+{
+   if (*rx < 0) { *rw += *rx; *rx = 0; }
+   if (*ry < 0) { *rh += *ry; *ry = 0; }
+   if (*rw <= 0 || *rh <= 0 || *rx >= w || *ry >= h) return 0;
+   if (*rw > w - *rx) *rw = w - *rx;
+   if (*rh > h - *ry) *rh = h - *ry;
+   return 1;
+}
+
+// crop, for loaders that can't decode just a region themselves
+static stbi_uc *stbi__crop(stbi_uc *data, int *x, int *y, int channels, int rx, int ry, int rw, int rh)
+{
+   stbi_uc *out;
+   int j;
+   if (!stbi__clip_region(&rx, &ry, &rw, &rh, *x, *y)) {
+      STBI_FREE(data);
+      return stbi__errpuc("bad region", "Region outside the image");
+   }
+   out = (stbi_uc *) stbi__malloc_mad3(rw, rh, channels, 0);
+   if (!out) {
+      STBI_FREE(data);
+      return stbi__errpuc("outofmem", "Out of memory");
+   }
+   for (j=0; j < rh; ++j)
+      memcpy(out + (size_t) j * rw * channels, data + ((size_t) (ry+j) * *x + rx) * channels, (size_t) rw * channels);
+   STBI_FREE(data);
+   *x = rw;
+   *y = rh;
+   return out;
+}
+
 static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+   void *result;
+
+   s->flip = stbi__vertically_flip_on_load;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 8);
+   s->flip = 0;
 
    if (result == NULL)
       return NULL;
@@ -1215,7 +1723,19 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
 
    // @TODO: move stbi__convert_format to here
 
-   if (stbi__vertically_flip_on_load) {
+   if (s->roi_w) {
+      result = stbi__crop((stbi_uc *) result, x, y, req_comp ? req_comp : *comp, s->roi_x, s->roi_y, s->roi_w, s->roi_h);
+      if (result == NULL)
+         return NULL;
+   }
+
+   if (s->scale_shift) {
+      result = stbi__downscale((stbi_uc *) result, x, y, req_comp ? req_comp : *comp, s->scale_shift);
+      if (result == NULL)
+         return NULL;
+   }
+
+   if (stbi__vertically_flip_on_load && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi_uc));
    }
@@ -1223,10 +1743,122 @@ static unsigned char *stbi__load_and_postprocess_8bit(stbi__context *s, int *x,
    return (unsigned char *) result;
 }
 
+static unsigned char *stbi__load_scaled_8bit(stbi__context *s, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   switch (scale) {
+      case 1: s->scale_shift = 0; break;
+      case 2: s->scale_shift = 1; break;
+      case 4: s->scale_shift = 2; break;
+      case 8: s->scale_shift = 3; break;
+      default: return stbi__errpuc("bad scale", "Downscale factor must be 1, 2, 4 or 8");
+   }
+   return stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+}
+
+static int stbi__sink_begin(stbi__row_sink *sink, int x, int y, int channels)
+{
+   sink->x = x;
+   sink->y = y;
+   sink->channels = channels;
+   sink->handed = 0;
+   if (sink->cb.begin && !sink->cb.begin(sink->user, x, y, channels))
+      return stbi__err("cancelled", "Load stopped by the callback");
+   return 1;
+}
+
+// hands out n rows starting at row y, in decode order. They're flipped in place
+static int stbi__sink_rows(stbi__row_sink *sink, stbi_uc *pixels, int y, int n)
+{
+   if (sink->flip) {
+      stbi__vertical_flip(pixels, sink->x, n, sink->channels);
+      y = sink->y - y - n;
+   }
+   if (!sink->cb.rows(sink->user, pixels, y, n))
+      return stbi__err("cancelled", "Load stopped by the callback");
+   sink->handed += n;
+   return 1;
+}
+
+static int stbi__load_rows_8bit(stbi__context *s, stbi_row_callbacks const *cb, void *user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__row_sink sink;
+   unsigned char *result;
+   memset(&sink, 0, sizeof(sink));
+   sink.cb = *cb;
+   sink.user = user;
+   sink.flip = stbi__vertically_flip_on_load;
+   sink.y = -1;
+   s->sink = &sink;
+   result = stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+   if (result) {
+      // the loader doesn't stream: hand the whole image out, already flipped
+      int ok;
+      sink.flip = 0;
+      ok = stbi__sink_begin(&sink, *x, *y, req_comp ? req_comp : *comp) && stbi__sink_rows(&sink, result, 0, *y);
+      STBI_FREE(result);
+      return ok;
+   }
+   return sink.handed == sink.y;
+}
+
+// decode into: rows are copied straight to their place in out
+typedef struct
+{
+   stbi_uc *out;
+   int len, stride, row_bytes;
+   int too_small;
+} stbi__into;
+
+static int stbi__into_begin(void *user, int x, int y, int channels)
+{
+   stbi__into *into = (stbi__into *) user;
+   if (!into->stride) into->stride = x * channels;
+   into->row_bytes = x * channels;
+   into->too_small = into->stride < into->row_bytes || (into->stride && into->len / into->stride < y);
+   return !into->too_small;
+}
+
+static int stbi__into_rows(void *user, const stbi_uc *pixels, int y, int n)
+{
+   stbi__into *into = (stbi__into *) user;
+   int j;
+   for (j=0; j < n; ++j)
+      memcpy(into->out + (size_t) into->stride * (y+j), pixels + (size_t) into->row_bytes * j, into->row_bytes);
+   return 1;
+}
+
+static int stbi__load_into_8bit(stbi__context *s, stbi_uc *out, int out_len, int out_stride, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__into into;
+   stbi_row_callbacks cb = { stbi__into_begin, stbi__into_rows };
+   if (out_stride < 0 || out_len < 0) return stbi__err("bad stride", "Negative buffer size");
+   into.out = out;
+   into.len = out_len;
+   into.stride = out_stride;
+   into.too_small = 0;
+   if (stbi__load_rows_8bit(s, &cb, &into, x, y, comp, req_comp)) return 1;
+   if (into.too_small) return stbi__err("too small", "Image doesn't fit in the buffer");
+   return 0;
+}
+
+static unsigned char *stbi__load_region_8bit(stbi__context *s, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   if (rw <= 0 || rh <= 0) return stbi__errpuc("bad region", "Region outside the image");
+   s->roi_x = rx;
+   s->roi_y = ry;
+   s->roi_w = rw;
+   s->roi_h = rh;
+   return stbi__load_and_postprocess_8bit(s, x, y, comp, req_comp);
+}
+
 static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x, int *y, int *comp, int req_comp)
 {
    stbi__result_info ri;
-   void *result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+   void *result;
+
+   s->flip = stbi__vertically_flip_on_load;
+   result = stbi__load_main(s, x, y, comp, req_comp, &ri, 16);
+   s->flip = 0;
 
    if (result == NULL)
       return NULL;
@@ -1242,7 +1874,7 @@ static stbi__uint16 *stbi__load_and_postprocess_16bit(stbi__context *s, int *x,
    // @TODO: move stbi__convert_format16 to here
    // @TODO: special case RGB-to-Y (and RGBA-to-YA) for 8-bit-to-16-bit case to keep more precision
 
-   if (stbi__vertically_flip_on_load) {
+   if (stbi__vertically_flip_on_load && !ri.flipped) {
       int channels = req_comp ? req_comp : *comp;
       stbi__vertical_flip(result, *x, *y, channels * sizeof(stbi__uint16));
    }
@@ -1302,24 +1934,126 @@ static FILE *stbi__fopen(char const *filename, char const *mode)
    return f;
 }
 
+// a file opened by name: mapped into memory, or read with stdio
+typedef struct
+{
+   FILE *f;
+   void *map;
+   size_t map_len;
+} stbi__file;
+
+static void *stbi__map_file(char const *filename, size_t *len)
+{
+#ifdef STBI__MMAP
+   void *map = NULL;
+   struct stat st;
+   int fd;
+   if (!stbi__mmap_files) return NULL;
+   fd = open(filename, O_RDONLY);
+   if (fd < 0) return NULL;
+   // stbi__start_mem() takes an int length
+   if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size <= INT_MAX) {
+      map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED)
+         map = NULL;
+      else
+         *len = (size_t) st.st_size;
+   }
+   close(fd); // the mapping keeps the file
+   return map;
+#else
+   STBI_NOTUSED(filename);
+   STBI_NOTUSED(len);
+   return NULL;
+#endif
+}
+
+// starts s on filename, mapped if possible
+static int stbi__open_file(stbi__file *file, stbi__context *s, char const *filename)
+{
+   file->f = NULL;
+   file->map = stbi__map_file(filename, &file->map_len);
+   if (file->map) {
+      stbi__start_mem(s, (stbi_uc const *) file->map, (int) file->map_len);
+      return 1;
+   }
+   file->f = stbi__fopen(filename, "rb");
+   if (!file->f) return stbi__err("can't fopen", "Unable to open file");
+   stbi__start_file(s, file->f);
+   return 1;
+}
+
+static void stbi__close_file(stbi__file *file)
+{
+#ifdef STBI__MMAP
+   if (file->map) munmap(file->map, file->map_len);
+#endif
+   if (file->f) fclose(file->f);
+}
+
 
 STBIDEF stbi_uc *stbi_load(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   stbi__file file;
    unsigned char *result;
-   if (!f) return stbi__errpuc("can't fopen", "Unable to open file");
-   result = stbi_load_from_file(f,x,y,comp,req_comp);
-   fclose(f);
+   stbi__context s;
+   if (!stbi__open_file(&file,&s,filename)) return NULL;
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   stbi__close_file(&file);
    return result;
 }
 
-STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+STBIDEF stbi_uc *stbi_load_scaled(char const *filename, int *x, int *y, int *comp, int req_comp, int scale)
 {
+   stbi__file file;
    unsigned char *result;
    stbi__context s;
-   stbi__start_file(&s,f);
-   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
-   if (result) {
+   if (!stbi__open_file(&file,&s,filename)) return NULL;
+   result = stbi__load_scaled_8bit(&s,x,y,comp,req_comp,scale);
+   stbi__close_file(&file);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_region(char const *filename, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__file file;
+   unsigned char *result;
+   stbi__context s;
+   if (!stbi__open_file(&file,&s,filename)) return NULL;
+   result = stbi__load_region_8bit(&s,rx,ry,rw,rh,x,y,comp,req_comp);
+   stbi__close_file(&file);
+   return result;
+}
+
+STBIDEF int stbi_load_rows(char const *filename, stbi_row_callbacks const *rows, void *rows_user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__file file;
+   int result;
+   stbi__context s;
+   if (!stbi__open_file(&file,&s,filename)) return 0;
+   result = stbi__load_rows_8bit(&s,rows,rows_user,x,y,comp,req_comp);
+   stbi__close_file(&file);
+   return result;
+}
+
+STBIDEF int stbi_load_into(char const *filename, stbi_uc *out, int out_len, int out_stride, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__file file;
+   int result;
+   stbi__context s;
+   if (!stbi__open_file(&file,&s,filename)) return 0;
+   result = stbi__load_into_8bit(&s,out,out_len,out_stride,x,y,comp,req_comp);
+   stbi__close_file(&file);
+   return result;
+}
+
+STBIDEF stbi_uc *stbi_load_from_file(FILE *f, int *x, int *y, int *comp, int req_comp)
+{
+   unsigned char *result;
+   stbi__context s;
+   stbi__start_file(&s,f);
+   result = stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
+   if (result) {
       // need to 'unget' all the characters in the IO buffer
       fseek(f, - (int) (s.img_buffer_end - s.img_buffer), SEEK_CUR);
    }
@@ -1341,11 +2075,12 @@ STBIDEF stbi__uint16 *stbi_load_from_file_16(FILE *f, int *x, int *y, int *comp,
 
 STBIDEF stbi_us *stbi_load_16(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
-   FILE *f = stbi__fopen(filename, "rb");
+   stbi__file file;
    stbi__uint16 *result;
-   if (!f) return (stbi_us *) stbi__errpuc("can't fopen", "Unable to open file");
-   result = stbi_load_from_file_16(f,x,y,comp,req_comp);
-   fclose(f);
+   stbi__context s;
+   if (!stbi__open_file(&file,&s,filename)) return NULL;
+   result = stbi__load_and_postprocess_16bit(&s,x,y,comp,req_comp);
+   stbi__close_file(&file);
    return result;
 }
 
@@ -1380,6 +2115,62 @@ STBIDEF stbi_uc *stbi_load_from_callbacks(stbi_io_callbacks const *clbk, void *u
    return stbi__load_and_postprocess_8bit(&s,x,y,comp,req_comp);
 }
 
+STBIDEF stbi_uc *stbi_load_scaled_from_memory(stbi_uc const *buffer, int len, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_scaled_8bit(&s,x,y,comp,req_comp,scale);
+}
+
+STBIDEF stbi_uc *stbi_load_scaled_from_callbacks(stbi_io_callbacks const *clbk, void *user, int *x, int *y, int *comp, int req_comp, int scale)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_scaled_8bit(&s,x,y,comp,req_comp,scale);
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_memory(stbi_uc const *buffer, int len, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_region_8bit(&s,rx,ry,rw,rh,x,y,comp,req_comp);
+}
+
+STBIDEF stbi_uc *stbi_load_region_from_callbacks(stbi_io_callbacks const *clbk, void *user, int rx, int ry, int rw, int rh, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_region_8bit(&s,rx,ry,rw,rh,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_rows_from_memory(stbi_uc const *buffer, int len, stbi_row_callbacks const *rows, void *rows_user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_rows_8bit(&s,rows,rows_user,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_rows_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_row_callbacks const *rows, void *rows_user, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_rows_8bit(&s,rows,rows_user,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_into_from_memory(stbi_uc const *buffer, int len, stbi_uc *out, int out_len, int out_stride, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_mem(&s,buffer,len);
+   return stbi__load_into_8bit(&s,out,out_len,out_stride,x,y,comp,req_comp);
+}
+
+STBIDEF int stbi_load_into_from_callbacks(stbi_io_callbacks const *clbk, void *user, stbi_uc *out, int out_len, int out_stride, int *x, int *y, int *comp, int req_comp)
+{
+   stbi__context s;
+   stbi__start_callbacks(&s, (stbi_io_callbacks *) clbk, user);
+   return stbi__load_into_8bit(&s,out,out_len,out_stride,x,y,comp,req_comp);
+}
+
 #ifndef STBI_NO_GIF
 STBIDEF stbi_uc *stbi_load_gif_from_memory(stbi_uc const *buffer, int len, int **delays, int *x, int *y, int *z, int *comp, int req_comp)
 {
@@ -1432,11 +2223,12 @@ STBIDEF float *stbi_loadf_from_callbacks(stbi_io_callbacks const *clbk, void *us
 #ifndef STBI_NO_STDIO
 STBIDEF float *stbi_loadf(char const *filename, int *x, int *y, int *comp, int req_comp)
 {
+   stbi__file file;
    float *result;
-   FILE *f = stbi__fopen(filename, "rb");
-   if (!f) return stbi__errpf("can't fopen", "Unable to open file");
-   result = stbi_loadf_from_file(f,x,y,comp,req_comp);
-   fclose(f);
+   stbi__context s;
+   if (!stbi__open_file(&file,&s,filename)) return NULL;
+   result = stbi__loadf_main(&s,x,y,comp,req_comp);
+   stbi__close_file(&file);
    return result;
 }
 
@@ -1691,10 +2483,258 @@ static stbi_uc stbi__compute_y(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_BMP) && defined(STBI_NO_PSD) && defined(STBI_NO_TGA) && defined(STBI_NO_GIF) && defined(STBI_NO_PIC) && defined(STBI_NO_PNM)
 // nothing
 #else
+#define STBI__COMBO(a,b)  ((a)*8+(b))
+
+// converts the first pixels of a row of x from one number of components to
+// another with SIMD. Returns how many it did, the rest is left to the C loop
+typedef unsigned int (*stbi__convert_kernel)(unsigned char *dest, const unsigned char *src, unsigned int x);
+
+#ifdef STBI_SSE2
+// stbi__compute_y() of 16-bit lanes of r, g and b; the sum fits in 16 bits
+stbi_inline static __m128i stbi__compute_y_sse2(__m128i r, __m128i g, __m128i b)
+{
+   __m128i y = _mm_add_epi16(_mm_mullo_epi16(r, _mm_set1_epi16(77)), _mm_mullo_epi16(g, _mm_set1_epi16(150)));
+   return _mm_srli_epi16(_mm_add_epi16(y, _mm_mullo_epi16(b, _mm_set1_epi16(29))), 8);
+}
+
+static unsigned int stbi__convert_1_2_sse2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   __m128i ff = _mm_set1_epi8(-1);
+   unsigned int i;
+   for (i=0; i+16 <= x; i += 16, src += 16, dest += 32) {
+      __m128i g = _mm_loadu_si128((const __m128i *) src);
+      _mm_storeu_si128((__m128i *) dest,      _mm_unpacklo_epi8(g, ff));
+      _mm_storeu_si128((__m128i *) (dest+16), _mm_unpackhi_epi8(g, ff));
+   }
+   return i;
+}
+
+static unsigned int stbi__convert_1_4_sse2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   __m128i ff = _mm_set1_epi8(-1);
+   unsigned int i;
+   for (i=0; i+16 <= x; i += 16, src += 16, dest += 64) {
+      __m128i g  = _mm_loadu_si128((const __m128i *) src);
+      __m128i gg = _mm_unpacklo_epi8(g, g);
+      __m128i ga = _mm_unpacklo_epi8(g, ff);
+      _mm_storeu_si128((__m128i *) dest,      _mm_unpacklo_epi16(gg, ga));
+      _mm_storeu_si128((__m128i *) (dest+16), _mm_unpackhi_epi16(gg, ga));
+      gg = _mm_unpackhi_epi8(g, g);
+      ga = _mm_unpackhi_epi8(g, ff);
+      _mm_storeu_si128((__m128i *) (dest+32), _mm_unpacklo_epi16(gg, ga));
+      _mm_storeu_si128((__m128i *) (dest+48), _mm_unpackhi_epi16(gg, ga));
+   }
+   return i;
+}
+
+static unsigned int stbi__convert_2_1_sse2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   __m128i lo = _mm_set1_epi16(0xff);
+   unsigned int i;
+   for (i=0; i+16 <= x; i += 16, src += 32, dest += 16) {
+      __m128i a = _mm_and_si128(_mm_loadu_si128((const __m128i *) src), lo);
+      __m128i b = _mm_and_si128(_mm_loadu_si128((const __m128i *) (src+16)), lo);
+      _mm_storeu_si128((__m128i *) dest, _mm_packus_epi16(a, b));
+   }
+   return i;
+}
+
+static unsigned int stbi__convert_2_4_sse2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   __m128i lo = _mm_set1_epi16(0xff);
+   unsigned int i;
+   for (i=0; i+8 <= x; i += 8, src += 16, dest += 32) {
+      __m128i ga = _mm_loadu_si128((const __m128i *) src);
+      __m128i g  = _mm_and_si128(ga, lo);
+      __m128i gg = _mm_or_si128(g, _mm_slli_epi16(g, 8));
+      _mm_storeu_si128((__m128i *) dest,      _mm_unpacklo_epi16(gg, ga));
+      _mm_storeu_si128((__m128i *) (dest+16), _mm_unpackhi_epi16(gg, ga));
+   }
+   return i;
+}
+
+// luminance of 8 RGBA pixels, in 16-bit lanes
+stbi_inline static __m128i stbi__rgba_to_y_sse2(__m128i p0, __m128i p1)
+{
+   __m128i lo = _mm_set1_epi32(0xff);
+   __m128i r = _mm_packs_epi32(_mm_and_si128(p0, lo), _mm_and_si128(p1, lo));
+   __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), lo), _mm_and_si128(_mm_srli_epi32(p1, 8), lo));
+   __m128i b = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), lo), _mm_and_si128(_mm_srli_epi32(p1, 16), lo));
+   return stbi__compute_y_sse2(r, g, b);
+}
+
+static unsigned int stbi__convert_4_1_sse2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   unsigned int i;
+   for (i=0; i+8 <= x; i += 8, src += 32, dest += 8) {
+      __m128i y = stbi__rgba_to_y_sse2(_mm_loadu_si128((const __m128i *) src), _mm_loadu_si128((const __m128i *) (src+16)));
+      _mm_storel_epi64((__m128i *) dest, _mm_packus_epi16(y, y));
+   }
+   return i;
+}
+
+static unsigned int stbi__convert_4_2_sse2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   unsigned int i;
+   for (i=0; i+8 <= x; i += 8, src += 32, dest += 16) {
+      __m128i p0 = _mm_loadu_si128((const __m128i *) src);
+      __m128i p1 = _mm_loadu_si128((const __m128i *) (src+16));
+      __m128i a  = _mm_packs_epi32(_mm_srli_epi32(p0, 24), _mm_srli_epi32(p1, 24));
+      _mm_storeu_si128((__m128i *) dest, _mm_or_si128(stbi__rgba_to_y_sse2(p0, p1), _mm_slli_epi16(a, 8)));
+   }
+   return i;
+}
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+// the ones that need byte shuffles. 3-component pixels don't fit lanes, so
+// 8 pixels (24 bytes) are moved around as dwords: 4 pixels to a lane
+static STBI__AVX2_TARGET unsigned int stbi__convert_3_4_avx2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   const __m256i idx   = _mm256_setr_epi32(0,1,2,0, 3,4,5,0);
+   const __m256i mask  = _mm256_setr_epi8(0,1,2,-128, 3,4,5,-128, 6,7,8,-128, 9,10,11,-128,
+                                          0,1,2,-128, 3,4,5,-128, 6,7,8,-128, 9,10,11,-128);
+   const __m256i alpha = _mm256_set1_epi32((int) 0xff000000);
+   unsigned int i;
+   for (i=0; i+8 <= x; i += 8, src += 24, dest += 32) {
+      __m256i p = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) src)),
+                                          _mm_loadl_epi64((const __m128i *) (src+16)), 1);
+      p = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(p, idx), mask);
+      _mm256_storeu_si256((__m256i *) dest, _mm256_or_si256(p, alpha));
+   }
+   return i;
+}
+
+static STBI__AVX2_TARGET unsigned int stbi__convert_4_3_avx2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   const __m256i mask = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14, -128,-128,-128,-128,
+                                         0,1,2,4,5,6,8,9,10,12,13,14, -128,-128,-128,-128);
+   const __m256i idx  = _mm256_setr_epi32(0,1,2,4,5,6, 3,7);
+   unsigned int i;
+   for (i=0; i+8 <= x; i += 8, src += 32, dest += 24) {
+      __m256i p = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) src), mask);
+      p = _mm256_permutevar8x32_epi32(p, idx);
+      _mm_storeu_si128((__m128i *) dest, _mm256_castsi256_si128(p));
+      _mm_storel_epi64((__m128i *) (dest+16), _mm256_extracti128_si256(p, 1));
+   }
+   return i;
+}
+
+static STBI__AVX2_TARGET unsigned int stbi__convert_1_3_avx2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   const __m256i m01 = _mm256_setr_epi8(0,0,0,1,1,1,2,2,2,3,3,3,4,4,4,5, 5,5,6,6,6,7,7,7,8,8,8,9,9,9,10,10);
+   const __m128i m2  = _mm_setr_epi8(10,11,11,11,12,12,12,13,13,13,14,14,14,15,15,15);
+   unsigned int i;
+   for (i=0; i+16 <= x; i += 16, src += 16, dest += 48) {
+      __m128i g = _mm_loadu_si128((const __m128i *) src);
+      _mm256_storeu_si256((__m256i *) dest, _mm256_shuffle_epi8(_mm256_broadcastsi128_si256(g), m01));
+      _mm_storeu_si128((__m128i *) (dest+32), _mm_shuffle_epi8(g, m2));
+   }
+   return i;
+}
+
+static STBI__AVX2_TARGET unsigned int stbi__convert_3_1_avx2(unsigned char *dest, const unsigned char *src, unsigned int x)
+{
+   // each of r, g and b of 16 pixels gathered from the 3 blocks of 16 bytes
+   const __m128i r0 = _mm_setr_epi8(0,3,6,9,12,15,-128,-128,-128,-128,-128,-128,-128,-128,-128,-128);
+   const __m128i r1 = _mm_setr_epi8(-128,-128,-128,-128,-128,-128,2,5,8,11,14,-128,-128,-128,-128,-128);
+   const __m128i r2 = _mm_setr_epi8(-128,-128,-128,-128,-128,-128,-128,-128,-128,-128,-128,1,4,7,10,13);
+   const __m128i g0 = _mm_setr_epi8(1,4,7,10,13,-128,-128,-128,-128,-128,-128,-128,-128,-128,-128,-128);
+   const __m128i g1 = _mm_setr_epi8(-128,-128,-128,-128,-128,0,3,6,9,12,15,-128,-128,-128,-128,-128);
+   const __m128i g2 = _mm_setr_epi8(-128,-128,-128,-128,-128,-128,-128,-128,-128,-128,-128,2,5,8,11,14);
+   const __m128i b0 = _mm_setr_epi8(2,5,8,11,14,-128,-128,-128,-128,-128,-128,-128,-128,-128,-128,-128);
+   const __m128i b1 = _mm_setr_epi8(-128,-128,-128,-128,-128,1,4,7,10,13,-128,-128,-128,-128,-128,-128);
+   const __m128i b2 = _mm_setr_epi8(-128,-128,-128,-128,-128,-128,-128,-128,-128,-128,0,3,6,9,12,15);
+   const __m128i zero = _mm_setzero_si128();
+   unsigned int i;
+   for (i=0; i+16 <= x; i += 16, src += 48, dest += 16) {
+      __m128i p0 = _mm_loadu_si128((const __m128i *) src);
+      __m128i p1 = _mm_loadu_si128((const __m128i *) (src+16));
+      __m128i p2 = _mm_loadu_si128((const __m128i *) (src+32));
+      __m128i r = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, r0), _mm_shuffle_epi8(p1, r1)), _mm_shuffle_epi8(p2, r2));
+      __m128i g = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, g0), _mm_shuffle_epi8(p1, g1)), _mm_shuffle_epi8(p2, g2));
+      __m128i b = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(p0, b0), _mm_shuffle_epi8(p1, b1)), _mm_shuffle_epi8(p2, b2));
+      __m128i ylo = stbi__compute_y_sse2(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero), _mm_unpacklo_epi8(b, zero));
+      __m128i yhi = stbi__compute_y_sse2(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(b, zero));
+      _mm_storeu_si128((__m128i *) dest, _mm_packus_epi16(ylo, yhi));
+   }
+   return i;
+}
+#endif // STBI_AVX2
+
+// the SIMD kernel for a conversion, if there's one. Picked once per image
+static stbi__convert_kernel stbi__convert_row_kernel(int img_n, int req_comp)
+{
+#ifdef STBI_SSE2
+   int level = stbi_simd_level();
+#ifdef STBI_AVX2
+   if (level >= STBI_SIMD_AVX2) {
+      switch (STBI__COMBO(img_n, req_comp)) {
+         case STBI__COMBO(1,3): return stbi__convert_1_3_avx2;
+         case STBI__COMBO(3,1): return stbi__convert_3_1_avx2;
+         case STBI__COMBO(3,4): return stbi__convert_3_4_avx2;
+         case STBI__COMBO(4,3): return stbi__convert_4_3_avx2;
+      }
+   }
+#endif
+   if (level >= STBI_SIMD_SSE2) {
+      switch (STBI__COMBO(img_n, req_comp)) {
+         case STBI__COMBO(1,2): return stbi__convert_1_2_sse2;
+         case STBI__COMBO(1,4): return stbi__convert_1_4_sse2;
+         case STBI__COMBO(2,1): return stbi__convert_2_1_sse2;
+         case STBI__COMBO(2,4): return stbi__convert_2_4_sse2;
+         case STBI__COMBO(4,1): return stbi__convert_4_1_sse2;
+         case STBI__COMBO(4,2): return stbi__convert_4_2_sse2;
+      }
+   }
+#endif
+   STBI_NOTUSED(img_n);
+   STBI_NOTUSED(req_comp);
+   return NULL;
+}
+
+// converts a row of x pixels from img_n to req_comp components, the first ones
+// with simd if it's not NULL. Returns 0 for a conversion it doesn't know
+static int stbi__convert_row(const unsigned char *src, unsigned char *dest, int img_n, int req_comp, unsigned int x,
+                             stbi__convert_kernel simd)
+{
+   int i;
+
+   if (simd) {
+      unsigned int done = simd(dest, src, x);
+      if (done == x) return 1;
+      src += done * img_n;
+      dest += done * req_comp;
+      x -= done;
+   }
+
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    unsigned char *good;
+   stbi__convert_kernel simd;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
@@ -1705,30 +2745,13 @@ static unsigned char *stbi__convert_format(unsigned char *data, int img_n, int r
       return stbi__errpuc("outofmem", "Out of memory");
    }
 
+   simd = stbi__convert_row_kernel(img_n, req_comp);
    for (j=0; j < (int) y; ++j) {
-      unsigned char *src  = data + j * x * img_n   ;
-      unsigned char *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=255;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=255;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                  } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                  } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                  } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=255;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = 255;    } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                    } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
+      if (!stbi__convert_row(data + j * x * img_n, good + j * x * req_comp, img_n, req_comp, x, simd)) {
+         STBI_FREE(data);
+         STBI_FREE(good);
+         return stbi__errpuc("unsupported", "Unsupported format conversion");
+      }
    }
 
    STBI_FREE(data);
@@ -1748,10 +2771,155 @@ static stbi__uint16 stbi__compute_y_16(int r, int g, int b)
 #if defined(STBI_NO_PNG) && defined(STBI_NO_PSD)
 // nothing
 #else
+typedef unsigned int (*stbi__convert_kernel16)(stbi__uint16 *dest, const stbi__uint16 *src, unsigned int x);
+
+#ifdef STBI_SSE2
+static unsigned int stbi__convert16_1_2_sse2(stbi__uint16 *dest, const stbi__uint16 *src, unsigned int x)
+{
+   __m128i ff = _mm_set1_epi16(-1);
+   unsigned int i;
+   for (i=0; i+8 <= x; i += 8, src += 8, dest += 16) {
+      __m128i g = _mm_loadu_si128((const __m128i *) src);
+      _mm_storeu_si128((__m128i *) dest,     _mm_unpacklo_epi16(g, ff));
+      _mm_storeu_si128((__m128i *) (dest+8), _mm_unpackhi_epi16(g, ff));
+   }
+   return i;
+}
+
+static unsigned int stbi__convert16_1_4_sse2(stbi__uint16 *dest, const stbi__uint16 *src, unsigned int x)
+{
+   __m128i ff = _mm_set1_epi16(-1);
+   unsigned int i;
+   for (i=0; i+8 <= x; i += 8, src += 8, dest += 32) {
+      __m128i g  = _mm_loadu_si128((const __m128i *) src);
+      __m128i gg = _mm_unpacklo_epi16(g, g);
+      __m128i ga = _mm_unpacklo_epi16(g, ff);
+      _mm_storeu_si128((__m128i *) dest,      _mm_unpacklo_epi32(gg, ga));
+      _mm_storeu_si128((__m128i *) (dest+8),  _mm_unpackhi_epi32(gg, ga));
+      gg = _mm_unpackhi_epi16(g, g);
+      ga = _mm_unpackhi_epi16(g, ff);
+      _mm_storeu_si128((__m128i *) (dest+16), _mm_unpacklo_epi32(gg, ga));
+      _mm_storeu_si128((__m128i *) (dest+24), _mm_unpackhi_epi32(gg, ga));
+   }
+   return i;
+}
+
+static unsigned int stbi__convert16_2_4_sse2(stbi__uint16 *dest, const stbi__uint16 *src, unsigned int x)
+{
+   unsigned int i;
+   for (i=0; i+4 <= x; i += 4, src += 8, dest += 16) {
+      __m128i ga = _mm_loadu_si128((const __m128i *) src);
+      __m128i lo = _mm_unpacklo_epi32(ga, ga), hi = _mm_unpackhi_epi32(ga, ga);
+      // g a g a -> g g g a, in each half
+      lo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, _MM_SHUFFLE(1,0,0,0)), _MM_SHUFFLE(1,0,0,0));
+      hi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, _MM_SHUFFLE(1,0,0,0)), _MM_SHUFFLE(1,0,0,0));
+      _mm_storeu_si128((__m128i *) dest,     lo);
+      _mm_storeu_si128((__m128i *) (dest+8), hi);
+   }
+   return i;
+}
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+// 4 pixels of 3 components are 24 bytes, moved around as in stbi__convert_3_4_avx2()
+static STBI__AVX2_TARGET unsigned int stbi__convert16_3_4_avx2(stbi__uint16 *dest, const stbi__uint16 *src, unsigned int x)
+{
+   const __m256i idx   = _mm256_setr_epi32(0,1,2,0, 3,4,5,0);
+   const __m256i mask  = _mm256_setr_epi8(0,1,2,3,4,5,-128,-128, 6,7,8,9,10,11,-128,-128,
+                                          0,1,2,3,4,5,-128,-128, 6,7,8,9,10,11,-128,-128);
+   const __m256i alpha = _mm256_set1_epi64x((long long) 0xffff000000000000ULL);
+   unsigned int i;
+   for (i=0; i+4 <= x; i += 4, src += 12, dest += 16) {
+      __m256i p = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) src)),
+                                          _mm_loadl_epi64((const __m128i *) (src+8)), 1);
+      p = _mm256_shuffle_epi8(_mm256_permutevar8x32_epi32(p, idx), mask);
+      _mm256_storeu_si256((__m256i *) dest, _mm256_or_si256(p, alpha));
+   }
+   return i;
+}
+
+static STBI__AVX2_TARGET unsigned int stbi__convert16_4_3_avx2(stbi__uint16 *dest, const stbi__uint16 *src, unsigned int x)
+{
+   const __m256i mask = _mm256_setr_epi8(0,1,2,3,4,5, 8,9,10,11,12,13, -128,-128,-128,-128,
+                                         0,1,2,3,4,5, 8,9,10,11,12,13, -128,-128,-128,-128);
+   const __m256i idx  = _mm256_setr_epi32(0,1,2,4,5,6, 3,7);
+   unsigned int i;
+   for (i=0; i+4 <= x; i += 4, src += 16, dest += 12) {
+      __m256i p = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i *) src), mask);
+      p = _mm256_permutevar8x32_epi32(p, idx);
+      _mm_storeu_si128((__m128i *) dest, _mm256_castsi256_si128(p));
+      _mm_storel_epi64((__m128i *) (dest+8), _mm256_extracti128_si256(p, 1));
+   }
+   return i;
+}
+#endif // STBI_AVX2
+
+static stbi__convert_kernel16 stbi__convert_row_kernel16(int img_n, int req_comp)
+{
+#ifdef STBI_SSE2
+   int level = stbi_simd_level();
+#ifdef STBI_AVX2
+   if (level >= STBI_SIMD_AVX2) {
+      switch (STBI__COMBO(img_n, req_comp)) {
+         case STBI__COMBO(3,4): return stbi__convert16_3_4_avx2;
+         case STBI__COMBO(4,3): return stbi__convert16_4_3_avx2;
+      }
+   }
+#endif
+   if (level >= STBI_SIMD_SSE2) {
+      switch (STBI__COMBO(img_n, req_comp)) {
+         case STBI__COMBO(1,2): return stbi__convert16_1_2_sse2;
+         case STBI__COMBO(1,4): return stbi__convert16_1_4_sse2;
+         case STBI__COMBO(2,4): return stbi__convert16_2_4_sse2;
+      }
+   }
+#endif
+   STBI_NOTUSED(img_n);
+   STBI_NOTUSED(req_comp);
+   return NULL;
+}
+
+// stbi__convert_row() for 16 bits per component
+static int stbi__convert_row16(const stbi__uint16 *src, stbi__uint16 *dest, int img_n, int req_comp, unsigned int x,
+                               stbi__convert_kernel16 simd)
+{
+   int i;
+
+   if (simd) {
+      unsigned int done = simd(dest, src, x);
+      if (done == x) return 1;
+      src += done * img_n;
+      dest += done * req_comp;
+      x -= done;
+   }
+
+   #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
+   // convert source image with img_n components to one with req_comp components;
+   // avoid switch per pixel, so use switch per scanline and massive macros
+   switch (STBI__COMBO(img_n, req_comp)) {
+      STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
+      STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
+      STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
+      STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
+      STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
+      STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
+      STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
+      STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
+      STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
+      STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
+      default: STBI_ASSERT(0); return 0;
+   }
+   #undef STBI__CASE
+   return 1;
+}
+
 static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int req_comp, unsigned int x, unsigned int y)
 {
-   int i,j;
+   int j;
    stbi__uint16 *good;
+   stbi__convert_kernel16 simd;
 
    if (req_comp == img_n) return data;
    STBI_ASSERT(req_comp >= 1 && req_comp <= 4);
@@ -1762,30 +2930,13 @@ static stbi__uint16 *stbi__convert_format16(stbi__uint16 *data, int img_n, int r
       return (stbi__uint16 *) stbi__errpuc("outofmem", "Out of memory");
    }
 
+   simd = stbi__convert_row_kernel16(img_n, req_comp);
    for (j=0; j < (int) y; ++j) {
-      stbi__uint16 *src  = data + j * x * img_n   ;
-      stbi__uint16 *dest = good + j * x * req_comp;
-
-      #define STBI__COMBO(a,b)  ((a)*8+(b))
-      #define STBI__CASE(a,b)   case STBI__COMBO(a,b): for(i=x-1; i >= 0; --i, src += a, dest += b)
-      // convert source image with img_n components to one with req_comp components;
-      // avoid switch per pixel, so use switch per scanline and massive macros
-      switch (STBI__COMBO(img_n, req_comp)) {
-         STBI__CASE(1,2) { dest[0]=src[0]; dest[1]=0xffff;                                     } break;
-         STBI__CASE(1,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(1,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=0xffff;                     } break;
-         STBI__CASE(2,1) { dest[0]=src[0];                                                     } break;
-         STBI__CASE(2,3) { dest[0]=dest[1]=dest[2]=src[0];                                     } break;
-         STBI__CASE(2,4) { dest[0]=dest[1]=dest[2]=src[0]; dest[3]=src[1];                     } break;
-         STBI__CASE(3,4) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];dest[3]=0xffff;        } break;
-         STBI__CASE(3,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(3,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = 0xffff; } break;
-         STBI__CASE(4,1) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]);                   } break;
-         STBI__CASE(4,2) { dest[0]=stbi__compute_y_16(src[0],src[1],src[2]); dest[1] = src[3]; } break;
-         STBI__CASE(4,3) { dest[0]=src[0];dest[1]=src[1];dest[2]=src[2];                       } break;
-         default: STBI_ASSERT(0); STBI_FREE(data); STBI_FREE(good); return (stbi__uint16*) stbi__errpuc("unsupported", "Unsupported format conversion");
-      }
-      #undef STBI__CASE
+      if (!stbi__convert_row16(data + j * x * img_n, good + j * x * req_comp, img_n, req_comp, x, simd)) {
+         STBI_FREE(data);
+         STBI_FREE(good);
+         return (stbi__uint16 *) stbi__errpuc("unsupported", "Unsupported format conversion");
+      }
    }
 
    STBI_FREE(data);
@@ -1933,6 +3084,18 @@ typedef struct
    int scan_n, order[4];
    int restart_interval, todo;
 
+   int scale_shift;   // decoding at 1/(1 << scale_shift) of the full size
+   int block_size;    // pixels per side the IDCT makes of a block: 8, or 4/2/1 downscaled
+   int coeff_last;    // last coefficient (zigzag order) the IDCT uses
+
+   int roi;           // decoding just a region: roi_x,y,w,h in pixels, else the whole image
+   int roi_x, roi_y, roi_w, roi_h;
+   int roi_mcu_x0, roi_mcu_y0, roi_mcu_x1, roi_mcu_y1; // MCUs reconstructed for it
+
+   int buf_mcu_y;     // MCU rows the component buffers hold: all, or a ring of them when streaming
+   int buf_scans;     // scans decoded into the ring
+   struct stbi__jpeg_stream *stream; // streaming load, else NULL
+
 // kernels
    void (*idct_block_kernel)(stbi_uc *out, int out_stride, short data[64]);
    void (*YCbCr_to_RGB_kernel)(stbi_uc *out, const stbi_uc *y, const stbi_uc *pcb, const stbi_uc *pcr, int count, int step);
@@ -2139,6 +3302,35 @@ static const stbi_uc stbi__jpeg_dezigzag[64+15] =
 };
 
 // decode one 64-entry block--
+// parses the AC coefficients of a block from index k on, without storing them
+static int stbi__jpeg_skip_ac(stbi__jpeg *j, stbi__huffman *hac, stbi__int16 *fac, int k)
+{
+   do {
+      int c,r,s;
+      if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+      c = (j->code_buffer >> (32 - FAST_BITS)) & ((1 << FAST_BITS)-1);
+      r = fac[c];
+      if (r) { // fast-AC path
+         k += ((r >> 4) & 15) + 1;
+         s = r & 15;
+      } else {
+         int rs = stbi__jpeg_huff_decode(j, hac);
+         if (rs < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+         s = rs & 15;
+         if (s == 0) {
+            if (rs != 0xf0) break; // end block
+            k += 16;
+            continue;
+         }
+         k += (rs >> 4) + 1;
+         if (j->code_bits < s) stbi__grow_buffer_unsafe(j);
+      }
+      j->code_buffer <<= s;
+      j->code_bits -= s;
+   } while (k < 64);
+   return 1;
+}
+
 static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b, stbi__uint16 *dequant)
 {
    int diff,dc,k;
@@ -2158,7 +3350,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
 
    // decode AC components, see JPEG spec
    k = 1;
-   do {
+   while (k <= j->coeff_last) {
       unsigned int zig;
       int c,r,s;
       if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
@@ -2178,7 +3370,7 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
          s = rs & 15;
          r = rs >> 4;
          if (s == 0) {
-            if (rs != 0xf0) break; // end block
+            if (rs != 0xf0) return 1; // end block
             k += 16;
          } else {
             k += r;
@@ -2187,8 +3379,20 @@ static int stbi__jpeg_decode_block(stbi__jpeg *j, short data[64], stbi__huffman
             data[zig] = (short) (stbi__extend_receive(j,s) * dequant[zig]);
          }
       }
-   } while (k < 64);
-   return 1;
+   }
+   // downscaling: the reduced IDCT won't look at the rest of the block
+   return k < 64 ? stbi__jpeg_skip_ac(j, hac, fac, k) : 1;
+}
+
+// a block outside the region: the DC prediction goes on, the rest is skipped
+static int stbi__jpeg_skip_block(stbi__jpeg *j, stbi__huffman *hdc, stbi__huffman *hac, stbi__int16 *fac, int b)
+{
+   int t;
+   if (j->code_bits < 16) stbi__grow_buffer_unsafe(j);
+   t = stbi__jpeg_huff_decode(j, hdc);
+   if (t < 0) return stbi__err("bad huffman code","Corrupt JPEG");
+   j->img_comp[b].dc_pred += t ? stbi__extend_receive(j, t) : 0;
+   return stbi__jpeg_skip_ac(j, hac, fac, 1);
 }
 
 static int stbi__jpeg_decode_block_prog_dc(stbi__jpeg *j, short data[64], stbi__huffman *hdc, int b)
@@ -2449,6 +3653,59 @@ static void stbi__idct_block(stbi_uc *out, int out_stride, short data[64])
    }
 }
 
+// reduced IDCTs for downscaled decoding: an 8x8 block of coefficients makes
+// 4x4, 2x2 or 1x1 pixels. Only the lowest NxN frequencies are used, with an
+// N-point IDCT, which samples the full reconstruction at the centers of the
+// pixels being merged without the detail that would alias at that size
+static void stbi__idct_4x4(stbi_uc *out, int out_stride, short data[64])
+{
+   int i,val[16],*v=val;
+   int a = stbi__f2f(0.353553391f), b = stbi__f2f(0.461939766f), c = stbi__f2f(0.191341716f);
+   stbi_uc *o;
+   short *d = data;
+
+   // rows; constants scaled things up by 1<<12, keep 1<<2 of that
+   for (i=0; i < 4; ++i, d+=8, v+=4) {
+      int t0 = a * (d[0] + d[2]), t1 = a * (d[0] - d[2]);
+      int t2 = b * d[1] + c * d[3], t3 = c * d[1] - b * d[3];
+      v[0] = (t0 + t2 + 512) >> 10;
+      v[1] = (t1 + t3 + 512) >> 10;
+      v[2] = (t1 - t3 + 512) >> 10;
+      v[3] = (t0 - t2 + 512) >> 10;
+   }
+
+   // columns: 1<<14 to remove, rounding and the +128 bias folded in
+   for (i=0, o=out; i < 4; ++i, ++o) {
+      int t0 = a * (val[i] + val[8+i]), t1 = a * (val[i] - val[8+i]);
+      int t2 = b * val[4+i] + c * val[12+i], t3 = c * val[4+i] - b * val[12+i];
+      t0 += 8192 + (128<<14);
+      t1 += 8192 + (128<<14);
+      o[0]            = stbi__clamp((t0 + t2) >> 14);
+      o[out_stride]   = stbi__clamp((t1 + t3) >> 14);
+      o[out_stride*2] = stbi__clamp((t1 - t3) >> 14);
+      o[out_stride*3] = stbi__clamp((t0 - t2) >> 14);
+   }
+}
+
+static void stbi__idct_2x2(stbi_uc *out, int out_stride, short data[64])
+{
+   int a = stbi__f2f(0.353553391f);
+   int r0 = (a * (data[0] + data[1]) + 512) >> 10, r1 = (a * (data[0] - data[1]) + 512) >> 10;
+   int r2 = (a * (data[8] + data[9]) + 512) >> 10, r3 = (a * (data[8] - data[9]) + 512) >> 10;
+   int bias = 8192 + (128<<14);
+   out[0]            = stbi__clamp((a * (r0 + r2) + bias) >> 14);
+   out[1]            = stbi__clamp((a * (r1 + r3) + bias) >> 14);
+   out[out_stride]   = stbi__clamp((a * (r0 - r2) + bias) >> 14);
+   out[out_stride+1] = stbi__clamp((a * (r1 - r3) + bias) >> 14);
+}
+
+static void stbi__idct_1x1(stbi_uc *out, int out_stride, short data[64])
+{
+   STBI_NOTUSED(out_stride);
+   // the DC term alone is the block average, times 8
+   out[0] = stbi__clamp(((data[0] + 4) >> 3) + 128);
+}
+
 #ifdef STBI_SSE2
 // sse2 integer IDCT. not the fastest possible implementation but it
 // produces bit-identical results to the generic C version so it's
@@ -2474,28 +3731,206 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 
    // out = in << 12  (in 16-bit, out 32-bit)
    #define dct_widen(out, in) \
-      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
-      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+      __m128i out##_l = _mm_srai_epi32(_mm_unpacklo_epi16(_mm_setzero_si128(), (in)), 4); \
+      __m128i out##_h = _mm_srai_epi32(_mm_unpackhi_epi16(_mm_setzero_si128(), (in)), 4)
+
+   // wide add
+   #define dct_wadd(out, a, b) \
+      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+
+   // wide sub
+   #define dct_wsub(out, a, b) \
+      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
+      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+
+   // butterfly a/b, add bias, then shift by "s" and pack
+   #define dct_bfly32o(out0, out1, a,b,bias,s) \
+      { \
+         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
+         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
+         dct_wadd(sum, abiased, b); \
+         dct_wsub(dif, abiased, b); \
+         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
+         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+      }
+
+   // 8-bit interleave step (for transposes)
+   #define dct_interleave8(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi8(a, b); \
+      b = _mm_unpackhi_epi8(tmp, b)
+
+   // 16-bit interleave step (for transposes)
+   #define dct_interleave16(a, b) \
+      tmp = a; \
+      a = _mm_unpacklo_epi16(a, b); \
+      b = _mm_unpackhi_epi16(tmp, b)
+
+   #define dct_pass(bias,shift) \
+      { \
+         /* even part */ \
+         dct_rot(t2e,t3e, row2,row6, rot0_0,rot0_1); \
+         __m128i sum04 = _mm_add_epi16(row0, row4); \
+         __m128i dif04 = _mm_sub_epi16(row0, row4); \
+         dct_widen(t0e, sum04); \
+         dct_widen(t1e, dif04); \
+         dct_wadd(x0, t0e, t3e); \
+         dct_wsub(x3, t0e, t3e); \
+         dct_wadd(x1, t1e, t2e); \
+         dct_wsub(x2, t1e, t2e); \
+         /* odd part */ \
+         dct_rot(y0o,y2o, row7,row3, rot2_0,rot2_1); \
+         dct_rot(y1o,y3o, row5,row1, rot3_0,rot3_1); \
+         __m128i sum17 = _mm_add_epi16(row1, row7); \
+         __m128i sum35 = _mm_add_epi16(row3, row5); \
+         dct_rot(y4o,y5o, sum17,sum35, rot1_0,rot1_1); \
+         dct_wadd(x4, y0o, y4o); \
+         dct_wadd(x5, y1o, y5o); \
+         dct_wadd(x6, y2o, y5o); \
+         dct_wadd(x7, y3o, y4o); \
+         dct_bfly32o(row0,row7, x0,x7,bias,shift); \
+         dct_bfly32o(row1,row6, x1,x6,bias,shift); \
+         dct_bfly32o(row2,row5, x2,x5,bias,shift); \
+         dct_bfly32o(row3,row4, x3,x4,bias,shift); \
+      }
+
+   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+
+   // rounding biases in column/row passes, see stbi__idct_block for explanation.
+   __m128i bias_0 = _mm_set1_epi32(512);
+   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+
+   // load
+   row0 = _mm_load_si128((const __m128i *) (data + 0*8));
+   row1 = _mm_load_si128((const __m128i *) (data + 1*8));
+   row2 = _mm_load_si128((const __m128i *) (data + 2*8));
+   row3 = _mm_load_si128((const __m128i *) (data + 3*8));
+   row4 = _mm_load_si128((const __m128i *) (data + 4*8));
+   row5 = _mm_load_si128((const __m128i *) (data + 5*8));
+   row6 = _mm_load_si128((const __m128i *) (data + 6*8));
+   row7 = _mm_load_si128((const __m128i *) (data + 7*8));
+
+   // column pass
+   dct_pass(bias_0, 10);
+
+   {
+      // 16bit 8x8 transpose pass 1
+      dct_interleave16(row0, row4);
+      dct_interleave16(row1, row5);
+      dct_interleave16(row2, row6);
+      dct_interleave16(row3, row7);
+
+      // transpose pass 2
+      dct_interleave16(row0, row2);
+      dct_interleave16(row1, row3);
+      dct_interleave16(row4, row6);
+      dct_interleave16(row5, row7);
+
+      // transpose pass 3
+      dct_interleave16(row0, row1);
+      dct_interleave16(row2, row3);
+      dct_interleave16(row4, row5);
+      dct_interleave16(row6, row7);
+   }
+
+   // row pass
+   dct_pass(bias_1, 17);
+
+   {
+      // pack
+      __m128i p0 = _mm_packus_epi16(row0, row1); // a0a1a2a3...a7b0b1b2b3...b7
+      __m128i p1 = _mm_packus_epi16(row2, row3);
+      __m128i p2 = _mm_packus_epi16(row4, row5);
+      __m128i p3 = _mm_packus_epi16(row6, row7);
+
+      // 8bit 8x8 transpose pass 1
+      dct_interleave8(p0, p2); // a0e0a1e1...
+      dct_interleave8(p1, p3); // c0g0c1g1...
+
+      // transpose pass 2
+      dct_interleave8(p0, p1); // a0c0e0g0...
+      dct_interleave8(p2, p3); // b0d0f0h0...
+
+      // transpose pass 3
+      dct_interleave8(p0, p2); // a0b0c0d0...
+      dct_interleave8(p1, p3); // a4b4c4d4...
+
+      // store
+      _mm_storel_epi64((__m128i *) out, p0); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p0, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p2); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p2, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p1); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p1, 0x4e)); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, p3); out += out_stride;
+      _mm_storel_epi64((__m128i *) out, _mm_shuffle_epi32(p3, 0x4e));
+   }
+
+#undef dct_const
+#undef dct_rot
+#undef dct_widen
+#undef dct_wadd
+#undef dct_wsub
+#undef dct_bfly32o
+#undef dct_interleave8
+#undef dct_interleave16
+#undef dct_pass
+}
+
+#endif // STBI_SSE2
+
+#ifdef STBI_AVX2
+// avx2 integer IDCT. same algorithm (and bit-identical results) as the sse2
+// one above, but every 32-bit intermediate, which sse2 has to keep as a lo/hi
+// pair of registers, fits in a single ymm register: each rotation takes two
+// madds instead of four, and widening, sums and descaling take half the
+// instructions. Rows and transposes stay 8x16-bit in xmm registers.
+static STBI__AVX2_TARGET void stbi__idct_avx2(stbi_uc *out, int out_stride, short data[64])
+{
+   __m128i row0, row1, row2, row3, row4, row5, row6, row7;
+   __m128i tmp;
+
+   // dot product constant: even elems=x, odd elems=y
+   #define dct_const(x,y)  _mm256_setr_epi16((x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y),(x),(y))
+
+   // out(0) = c0[even]*x + c0[odd]*y   (c0, x, y 16-bit, out 32-bit)
+   // out(1) = c1[even]*x + c1[odd]*y
+   #define dct_rot(out0,out1, x,y,c0,c1) \
+      __m256i c0##xy = _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_unpacklo_epi16((x),(y))), \
+                                               _mm_unpackhi_epi16((x),(y)), 1); \
+      __m256i out0 = _mm256_madd_epi16(c0##xy, c0); \
+      __m256i out1 = _mm256_madd_epi16(c0##xy, c1)
+
+   // out = in << 12  (in 16-bit, out 32-bit)
+   #define dct_widen(out, in) \
+      __m256i out = _mm256_slli_epi32(_mm256_cvtepi16_epi32(in), 12)
 
    // wide add
    #define dct_wadd(out, a, b) \
-      __m128i out##_l = _mm_add_epi32(a##_l, b##_l); \
-      __m128i out##_h = _mm_add_epi32(a##_h, b##_h)
+      __m256i out = _mm256_add_epi32(a, b)
 
    // wide sub
    #define dct_wsub(out, a, b) \
-      __m128i out##_l = _mm_sub_epi32(a##_l, b##_l); \
-      __m128i out##_h = _mm_sub_epi32(a##_h, b##_h)
+      __m256i out = _mm256_sub_epi32(a, b)
 
-   // butterfly a/b, add bias, then shift by "s" and pack
+   // butterfly a/b, add bias, then shift by "s" and pack. packs works within
+   // 128-bit lanes, the permute puts the four 64-bit halves back in order
    #define dct_bfly32o(out0, out1, a,b,bias,s) \
       { \
-         __m128i abiased_l = _mm_add_epi32(a##_l, bias); \
-         __m128i abiased_h = _mm_add_epi32(a##_h, bias); \
-         dct_wadd(sum, abiased, b); \
-         dct_wsub(dif, abiased, b); \
-         out0 = _mm_packs_epi32(_mm_srai_epi32(sum_l, s), _mm_srai_epi32(sum_h, s)); \
-         out1 = _mm_packs_epi32(_mm_srai_epi32(dif_l, s), _mm_srai_epi32(dif_h, s)); \
+         __m256i abiased = _mm256_add_epi32(a, bias); \
+         __m256i sum = _mm256_srai_epi32(_mm256_add_epi32(abiased, b), s); \
+         __m256i dif = _mm256_srai_epi32(_mm256_sub_epi32(abiased, b), s); \
+         __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(sum, dif), 0xd8); \
+         out0 = _mm256_castsi256_si128(packed); \
+         out1 = _mm256_extracti128_si256(packed, 1); \
       }
 
    // 8-bit interleave step (for transposes)
@@ -2538,18 +3973,18 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
          dct_bfly32o(row3,row4, x3,x4,bias,shift); \
       }
 
-   __m128i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
-   __m128i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
-   __m128i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
-   __m128i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
-   __m128i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
-   __m128i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
-   __m128i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
-   __m128i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
+   __m256i rot0_0 = dct_const(stbi__f2f(0.5411961f), stbi__f2f(0.5411961f) + stbi__f2f(-1.847759065f));
+   __m256i rot0_1 = dct_const(stbi__f2f(0.5411961f) + stbi__f2f( 0.765366865f), stbi__f2f(0.5411961f));
+   __m256i rot1_0 = dct_const(stbi__f2f(1.175875602f) + stbi__f2f(-0.899976223f), stbi__f2f(1.175875602f));
+   __m256i rot1_1 = dct_const(stbi__f2f(1.175875602f), stbi__f2f(1.175875602f) + stbi__f2f(-2.562915447f));
+   __m256i rot2_0 = dct_const(stbi__f2f(-1.961570560f) + stbi__f2f( 0.298631336f), stbi__f2f(-1.961570560f));
+   __m256i rot2_1 = dct_const(stbi__f2f(-1.961570560f), stbi__f2f(-1.961570560f) + stbi__f2f( 3.072711026f));
+   __m256i rot3_0 = dct_const(stbi__f2f(-0.390180644f) + stbi__f2f( 2.053119869f), stbi__f2f(-0.390180644f));
+   __m256i rot3_1 = dct_const(stbi__f2f(-0.390180644f), stbi__f2f(-0.390180644f) + stbi__f2f( 1.501321110f));
 
    // rounding biases in column/row passes, see stbi__idct_block for explanation.
-   __m128i bias_0 = _mm_set1_epi32(512);
-   __m128i bias_1 = _mm_set1_epi32(65536 + (128<<17));
+   __m256i bias_0 = _mm256_set1_epi32(512);
+   __m256i bias_1 = _mm256_set1_epi32(65536 + (128<<17));
 
    // load
    row0 = _mm_load_si128((const __m128i *) (data + 0*8));
@@ -2628,7 +4063,7 @@ static void stbi__idct_simd(stbi_uc *out, int out_stride, short data[64])
 #undef dct_pass
 }
 
-#endif // STBI_SSE2
+#endif // STBI_AVX2
 
 #ifdef STBI_NEON
 
@@ -2872,6 +4307,31 @@ static void stbi__jpeg_reset(stbi__jpeg *j)
    // since we don't even allow 1<<30 pixels
 }
 
+static int stbi__jpeg_stream_mcu_rows(stbi__jpeg *z, int done);
+
+// MCU (mx,my) is reconstructed: it's in the region's window, or rows below it
+// that scans don't get to
+#define STBI__JPEG_WANTED(z,mx,my) ((mx) >= (z)->roi_mcu_x0 && (mx) < (z)->roi_mcu_x1 && (my) >= (z)->roi_mcu_y0)
+
+// block rows of a non-interleaved scan down to the region's last MCU row
+#define STBI__JPEG_ROWS(z,rows,v)  ((z)->roi_mcu_y1 * (v) < (rows) ? (z)->roi_mcu_y1 * (v) : (rows))
+
+// ends a scan the region let stop early: skips the rest of its entropy-coded
+// data, up to the marker after it
+static int stbi__jpeg_end_scan(stbi__jpeg *z)
+{
+   if (z->roi_mcu_y1 == z->img_mcu_y) return 1;
+   if (z->marker != STBI__MARKER_none && !STBI__RESTART(z->marker)) return 1;
+   z->marker = STBI__MARKER_none;
+   while (!stbi__at_eof(z->s)) {
+      int c;
+      if (stbi__get8(z->s) != 0xff) continue;
+      do c = stbi__get8(z->s); while (c == 0xff);
+      if (c != 0 && !STBI__RESTART(c)) { z->marker = (unsigned char) c; break; }
+   }
+   return 1;
+}
+
 static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
 {
    stbi__jpeg_reset(z);
@@ -2885,12 +4345,17 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          // number of blocks to do just depends on how many actual "pixels" this
          // component has, independent of interleaved MCU blocking and such
          int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
+         int h = STBI__JPEG_ROWS(z, (z->img_comp[n].y+7) >> 3, z->img_comp[n].v);
          for (j=0; j < h; ++j) {
+            int jr = j % (z->buf_mcu_y * z->img_comp[n].v); // block row in the buffer
             for (i=0; i < w; ++i) {
                int ha = z->img_comp[n].ha;
-               if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               if (STBI__JPEG_WANTED(z, i / z->img_comp[n].h, j / z->img_comp[n].v)) {
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*jr*z->block_size+i*z->block_size, z->img_comp[n].w2, data);
+               } else {
+                  if (!stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n)) return 0;
+               }
                // every data block is an MCU, so countdown the restart interval
                if (--z->todo <= 0) {
                   if (z->code_bits < 24) stbi__grow_buffer_unsafe(z);
@@ -2900,13 +4365,16 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->buf_mcu_y < z->img_mcu_y && !stbi__jpeg_stream_mcu_rows(z, (j+1) / z->img_comp[n].v)) return 0;
          }
-         return 1;
+         return stbi__jpeg_end_scan(z);
       } else { // interleaved
          int i,j,k,x,y;
          STBI_SIMD_ALIGN(short, data[64]);
-         for (j=0; j < z->img_mcu_y; ++j) {
+         for (j=0; j < z->roi_mcu_y1; ++j) {
+            int jr = j % z->buf_mcu_y; // MCU row in the buffers
             for (i=0; i < z->img_mcu_x; ++i) {
+               int wanted = STBI__JPEG_WANTED(z, i, j);
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
                   int n = z->order[k];
@@ -2914,9 +4382,13 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   // by the basic H and V specified for the component
                   for (y=0; y < z->img_comp[n].v; ++y) {
                      for (x=0; x < z->img_comp[n].h; ++x) {
-                        int x2 = (i*z->img_comp[n].h + x)*8;
-                        int y2 = (j*z->img_comp[n].v + y)*8;
+                        int x2 = (i*z->img_comp[n].h + x)*z->block_size;
+                        int y2 = (jr*z->img_comp[n].v + y)*z->block_size;
                         int ha = z->img_comp[n].ha;
+                        if (!wanted) {
+                           if (!stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n)) return 0;
+                           continue;
+                        }
                         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
                         z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
                      }
@@ -2930,8 +4402,9 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                   stbi__jpeg_reset(z);
                }
             }
+            if (z->buf_mcu_y < z->img_mcu_y && !stbi__jpeg_stream_mcu_rows(z, j+1)) return 0;
          }
-         return 1;
+         return stbi__jpeg_end_scan(z);
       }
    } else {
       if (z->scan_n == 1) {
@@ -2942,7 +4415,7 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
          // number of blocks to do just depends on how many actual "pixels" this
          // component has, independent of interleaved MCU blocking and such
          int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
+         int h = STBI__JPEG_ROWS(z, (z->img_comp[n].y+7) >> 3, z->img_comp[n].v);
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
@@ -2962,10 +4435,10 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                }
             }
          }
-         return 1;
+         return stbi__jpeg_end_scan(z);
       } else { // interleaved
          int i,j,k,x,y;
-         for (j=0; j < z->img_mcu_y; ++j) {
+         for (j=0; j < z->roi_mcu_y1; ++j) {
             for (i=0; i < z->img_mcu_x; ++i) {
                // scan an interleaved mcu... process scan_n components in order
                for (k=0; k < z->scan_n; ++k) {
@@ -2991,10 +4464,259 @@ static int stbi__parse_entropy_coded_data(stbi__jpeg *z)
                }
             }
          }
-         return 1;
+         return stbi__jpeg_end_scan(z);
+      }
+   }
+}
+
+#ifdef STBI_THREADS
+#define STBI__MAX_THREADS 64
+
+// runs func(arg, 0..threads-1) in parallel, part 0 on the calling thread.
+// parts whose thread can't be started also run on the calling thread
+typedef void (*stbi__parallel_func)(void *arg, int part);
+
+typedef struct
+{
+   stbi__parallel_func func;
+   void *arg;
+   int part;
+} stbi__parallel_job;
+
+static void *stbi__parallel_worker(void *job_)
+{
+   stbi__parallel_job *job = (stbi__parallel_job *) job_;
+   job->func(job->arg, job->part);
+   return NULL;
+}
+
+static void stbi__parallel_for(stbi__parallel_func func, void *arg, int threads)
+{
+   pthread_t tid[STBI__MAX_THREADS];
+   stbi__parallel_job job[STBI__MAX_THREADS];
+   int started[STBI__MAX_THREADS];
+   int i;
+   for (i=1; i < threads; ++i) {
+      job[i].func = func;
+      job[i].arg = arg;
+      job[i].part = i;
+      started[i] = pthread_create(&tid[i], NULL, stbi__parallel_worker, &job[i]) == 0;
+   }
+   func(arg, 0);
+   for (i=1; i < threads; ++i) {
+      if (started[i])
+         pthread_join(tid[i], NULL);
+      else
+         func(arg, i);
+   }
+}
+
+// threads worth using for a decode with at most max_parts independent parts
+static int stbi__jpeg_thread_count(stbi__jpeg *z, int max_parts)
+{
+   int threads = stbi__jpeg_threads;
+   int pixels_per_thread = 1 << 16; // below that, thread startup isn't paid back
+   int most = (int) (((stbi__uint32) z->roi_w * z->roi_h) / pixels_per_thread);
+   if (threads <= 0)
+      threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+   if (threads > STBI__MAX_THREADS) threads = STBI__MAX_THREADS;
+   if (threads > max_parts) threads = max_parts;
+   if (threads > most) threads = most;
+   return threads < 1 ? 1 : threads;
+}
+
+// baseline units (MCUs, or blocks of a non-interleaved scan) first..first+count-1
+// of the scan, in raster order
+static int stbi__jpeg_decode_units(stbi__jpeg *z, int first, int count)
+{
+   int u,k,x,y;
+   STBI_SIMD_ALIGN(short, data[64]);
+   for (u=first; u < first+count; ++u) {
+      if (z->scan_n == 1) {
+         int n = z->order[0];
+         int w = (z->img_comp[n].x+7) >> 3;
+         int i = u % w, j = u / w;
+         int ha = z->img_comp[n].ha;
+         if (!STBI__JPEG_WANTED(z, i / z->img_comp[n].h, j / z->img_comp[n].v)) {
+            if (!stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n)) return 0;
+            continue;
+         }
+         if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+         z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*z->block_size+i*z->block_size, z->img_comp[n].w2, data);
+      } else {
+         int i = u % z->img_mcu_x, j = u / z->img_mcu_x;
+         int wanted = STBI__JPEG_WANTED(z, i, j);
+         for (k=0; k < z->scan_n; ++k) {
+            int n = z->order[k];
+            for (y=0; y < z->img_comp[n].v; ++y) {
+               for (x=0; x < z->img_comp[n].h; ++x) {
+                  int x2 = (i*z->img_comp[n].h + x)*z->block_size;
+                  int y2 = (j*z->img_comp[n].v + y)*z->block_size;
+                  int ha = z->img_comp[n].ha;
+                  if (!wanted) {
+                     if (!stbi__jpeg_skip_block(z, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n)) return 0;
+                     continue;
+                  }
+                  if (!stbi__jpeg_decode_block(z, data, z->huff_dc+z->img_comp[n].hd, z->huff_ac+ha, z->fast_ac[ha], n, z->dequant[z->img_comp[n].tq])) return 0;
+                  z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*y2+x2, z->img_comp[n].w2, data);
+               }
+            }
+         }
+      }
+   }
+   return 1;
+}
+
+// MCU row of a unit of the scan
+static int stbi__jpeg_unit_row(stbi__jpeg *z, int unit)
+{
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      return unit / ((z->img_comp[n].x+7) >> 3) / z->img_comp[n].v;
+   }
+   return unit / z->img_mcu_x;
+}
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi_uc *data;   // entropy-coded data of the scan
+   int *start;      // byte range of each restart interval in data, RSTn
+   int *end;        //   markers left out
+   int intervals, units;
+   int threads;
+   int failed;
+} stbi__jpeg_scan_job;
+
+static void stbi__jpeg_decode_band(void *arg, int part)
+{
+   stbi__jpeg_scan_job *job = (stbi__jpeg_scan_job *) arg;
+   stbi__jpeg *z = (stbi__jpeg *) stbi__malloc(sizeof(stbi__jpeg));
+   stbi__context s;
+   int first = job->intervals * part / job->threads;
+   int last = job->intervals * (part+1) / job->threads;
+   int i;
+
+   if (!z) { job->failed = 1; return; }
+   // private copy for the bit reader and DC predictions; tables and
+   // component buffers are shared, and each band writes its own blocks
+   memcpy(z, job->z, sizeof(stbi__jpeg));
+   z->s = &s;
+   for (i=first; i < last; ++i) {
+      int unit = i * z->restart_interval;
+      int count = job->units - unit < z->restart_interval ? job->units - unit : z->restart_interval;
+      // intervals start over the DC predictions: those off the region's MCU
+      // rows are skipped altogether
+      if (stbi__jpeg_unit_row(z, unit) >= z->roi_mcu_y1 || stbi__jpeg_unit_row(z, unit+count-1) < z->roi_mcu_y0)
+         continue;
+      // past the end of the interval the context reads zeros, just as the
+      // serial decoder pads the bit buffer once it hits the marker
+      stbi__start_mem(&s, job->data + job->start[i], job->end[i] - job->start[i]);
+      stbi__jpeg_reset(z);
+      if (!stbi__jpeg_decode_units(z, unit, count)) { job->failed = 1; break; }
+   }
+   STBI_FREE(z);
+}
+
+// next byte of the scan. Streams from callbacks are copied to *copy as they
+// go, so that the intervals can be decoded from memory afterwards
+static int stbi__jpeg_scan_get8(stbi__context *s, stbi_uc **copy, int *len, int *cap)
+{
+   int b = stbi__get8(s);
+   if (s->io.read) {
+      if (*len == *cap) {
+         int size = *cap ? *cap * 2 : 65536;
+         stbi_uc *p = (stbi_uc *) stbi__temp_realloc(*copy, size);
+         if (!p) return -1;
+         *copy = p;
+         *cap = size;
+      }
+      (*copy)[(*len)++] = (stbi_uc) b;
+   }
+   return b;
+}
+
+// baseline scan with restart intervals, decoded in bands of intervals on
+// several threads. Other scans go to stbi__parse_entropy_coded_data()
+static int stbi__parse_entropy_coded_data_threaded(stbi__jpeg *z)
+{
+   stbi__context *s = z->s, mem;
+   stbi__jpeg_scan_job job;
+   stbi_uc *copy = NULL, *base = s->img_buffer;
+   int len = 0, cap = 0, scan_len, expected, b, c, ok = 1;
+   unsigned char marker = STBI__MARKER_none;
+
+   if (z->progressive || !z->restart_interval || z->stream)
+      return stbi__parse_entropy_coded_data(z);
+   if (z->scan_n == 1) {
+      int n = z->order[0];
+      job.units = ((z->img_comp[n].x+7) >> 3) * ((z->img_comp[n].y+7) >> 3);
+   } else {
+      job.units = z->img_mcu_x * z->img_mcu_y;
+   }
+   expected = (job.units + z->restart_interval-1) / z->restart_interval;
+   job.threads = stbi__jpeg_thread_count(z, expected);
+   if (job.threads < 2)
+      return stbi__parse_entropy_coded_data(z);
+
+   job.start = (int *) stbi__temp_malloc_mad2(expected+1, 2*sizeof(int), 0);
+   if (!job.start) return stbi__err("outofmem", "Out of memory");
+   job.end = job.start + expected+1;
+
+   // find the RSTn markers, up to the marker that ends the scan
+#define STBI__SCAN_POS  (s->io.read ? len : (int) (s->img_buffer - base))
+   job.start[0] = 0;
+   job.intervals = 0;
+   for (;;) {
+      int at = STBI__SCAN_POS;
+      if (stbi__at_eof(s)) {
+         if (job.intervals <= expected) job.end[job.intervals] = at;
+         ++job.intervals;
+         break;
       }
+      if ((b = stbi__jpeg_scan_get8(s, &copy, &len, &cap)) != 0xff) {
+         if (b < 0) { ok = 0; break; }
+         continue;
+      }
+      do c = stbi__jpeg_scan_get8(s, &copy, &len, &cap); while (c == 0xff);
+      if (c < 0) { ok = 0; break; }
+      if (c == 0) continue; // stuffed 0xff data byte
+      if (job.intervals <= expected) job.end[job.intervals] = at;
+      ++job.intervals;
+      if (!STBI__RESTART(c)) { marker = (unsigned char) c; break; }
+      if (job.intervals <= expected) job.start[job.intervals] = STBI__SCAN_POS;
+   }
+   scan_len = job.end[(job.intervals <= expected ? job.intervals : expected+1) - 1];
+#undef STBI__SCAN_POS
+   job.data = s->io.read ? copy : base;
+
+   if (!ok) {
+      stbi__temp_free(copy);
+      stbi__temp_free(job.start);
+      return stbi__err("outofmem", "Out of memory");
+   }
+
+   job.z = z;
+   job.failed = 0;
+   if (job.intervals == expected) {
+      stbi__parallel_for(stbi__jpeg_decode_band, &job, job.threads);
+      ok = !job.failed;
+      if (!ok) stbi__err("bad huffman code","Corrupt JPEG");
+   } else {
+      // markers don't match the image size: leave it to the serial decoder,
+      // over the same bytes, to salvage what it can
+      stbi__start_mem(&mem, job.data, scan_len);
+      z->s = &mem;
+      ok = stbi__parse_entropy_coded_data(z);
+      z->s = s;
    }
+   z->marker = marker;
+
+   stbi__temp_free(copy);
+   stbi__temp_free(job.start);
+   return ok;
 }
+#endif // STBI_THREADS
 
 static void stbi__jpeg_dequantize(short *data, stbi__uint16 *dequant)
 {
@@ -3010,12 +4732,13 @@ static void stbi__jpeg_finish(stbi__jpeg *z)
       int i,j,n;
       for (n=0; n < z->s->img_n; ++n) {
          int w = (z->img_comp[n].x+7) >> 3;
-         int h = (z->img_comp[n].y+7) >> 3;
+         int h = STBI__JPEG_ROWS(z, (z->img_comp[n].y+7) >> 3, z->img_comp[n].v);
          for (j=0; j < h; ++j) {
             for (i=0; i < w; ++i) {
                short *data = z->img_comp[n].coeff + 64 * (i + j * z->img_comp[n].coeff_w);
+               if (!STBI__JPEG_WANTED(z, i / z->img_comp[n].h, j / z->img_comp[n].v)) continue;
                stbi__jpeg_dequantize(data, z->dequant[z->img_comp[n].tq]);
-               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*8+i*8, z->img_comp[n].w2, data);
+               z->idct_block_kernel(z->img_comp[n].data+z->img_comp[n].w2*j*z->block_size+i*z->block_size, z->img_comp[n].w2, data);
             }
          }
       }
@@ -3169,17 +4892,17 @@ static int stbi__free_jpeg_components(stbi__jpeg *z, int ncomp, int why)
    int i;
    for (i=0; i < ncomp; ++i) {
       if (z->img_comp[i].raw_data) {
-         STBI_FREE(z->img_comp[i].raw_data);
+         stbi__temp_free(z->img_comp[i].raw_data);
          z->img_comp[i].raw_data = NULL;
          z->img_comp[i].data = NULL;
       }
       if (z->img_comp[i].raw_coeff) {
-         STBI_FREE(z->img_comp[i].raw_coeff);
+         stbi__temp_free(z->img_comp[i].raw_coeff);
          z->img_comp[i].raw_coeff = 0;
          z->img_comp[i].coeff = 0;
       }
       if (z->img_comp[i].linebuf) {
-         STBI_FREE(z->img_comp[i].linebuf);
+         stbi__temp_free(z->img_comp[i].linebuf);
          z->img_comp[i].linebuf = NULL;
       }
    }
@@ -3236,6 +4959,32 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
    z->img_mcu_x = (s->img_x + z->img_mcu_w-1) / z->img_mcu_w;
    z->img_mcu_y = (s->img_y + z->img_mcu_h-1) / z->img_mcu_h;
 
+   // streaming only keeps a ring of MCU rows, enough to upsample the middle
+   // one, as long as the image comes in a single scan
+   z->buf_mcu_y = z->stream && !z->progressive && z->img_mcu_y > 3 ? 3 : z->img_mcu_y;
+   z->buf_scans = 0;
+
+   z->roi_mcu_x0 = z->roi_mcu_y0 = 0;
+   z->roi_mcu_x1 = z->img_mcu_x;
+   z->roi_mcu_y1 = z->img_mcu_y;
+   if (z->roi) {
+      if (!stbi__clip_region(&z->roi_x, &z->roi_y, &z->roi_w, &z->roi_h, s->img_x, s->img_y))
+         return stbi__err("bad region", "Region outside the image");
+      // the MCUs under the region, plus one more all around for upsampling
+      z->roi_mcu_x0 = z->roi_x / z->img_mcu_w - 1;
+      z->roi_mcu_y0 = z->roi_y / z->img_mcu_h - 1;
+      z->roi_mcu_x1 = (z->roi_x + z->roi_w-1) / z->img_mcu_w + 2;
+      z->roi_mcu_y1 = (z->roi_y + z->roi_h-1) / z->img_mcu_h + 2;
+      if (z->roi_mcu_x0 < 0) z->roi_mcu_x0 = 0;
+      if (z->roi_mcu_y0 < 0) z->roi_mcu_y0 = 0;
+      if (z->roi_mcu_x1 > z->img_mcu_x) z->roi_mcu_x1 = z->img_mcu_x;
+      if (z->roi_mcu_y1 > z->img_mcu_y) z->roi_mcu_y1 = z->img_mcu_y;
+   } else {
+      z->roi_x = z->roi_y = 0;
+      z->roi_w = s->img_x;
+      z->roi_h = s->img_y;
+   }
+
    for (i=0; i < s->img_n; ++i) {
       // number of effective pixels (e.g. for non-interleaved MCU)
       z->img_comp[i].x = (s->img_x * z->img_comp[i].h + h_max-1) / h_max;
@@ -3247,21 +4996,20 @@ static int stbi__process_frame_header(stbi__jpeg *z, int scan)
       //
       // img_mcu_x, img_mcu_y: <=17 bits; comp[i].h and .v are <=4 (checked earlier)
       // so these muls can't overflow with 32-bit ints (which we require)
-      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * 8;
-      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * 8;
+      z->img_comp[i].w2 = z->img_mcu_x * z->img_comp[i].h * z->block_size;
+      z->img_comp[i].h2 = z->buf_mcu_y * z->img_comp[i].v * z->block_size;
       z->img_comp[i].coeff = 0;
       z->img_comp[i].raw_coeff = 0;
       z->img_comp[i].linebuf = NULL;
-      z->img_comp[i].raw_data = stbi__malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+      z->img_comp[i].raw_data = stbi__temp_malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
       if (z->img_comp[i].raw_data == NULL)
          return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
       // align blocks for idct using mmx/sse
       z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
       if (z->progressive) {
-         // w2, h2 are multiples of 8 (see above)
-         z->img_comp[i].coeff_w = z->img_comp[i].w2 / 8;
-         z->img_comp[i].coeff_h = z->img_comp[i].h2 / 8;
-         z->img_comp[i].raw_coeff = stbi__malloc_mad3(z->img_comp[i].w2, z->img_comp[i].h2, sizeof(short), 15);
+         z->img_comp[i].coeff_w = z->img_mcu_x * z->img_comp[i].h;
+         z->img_comp[i].coeff_h = z->img_mcu_y * z->img_comp[i].v;
+         z->img_comp[i].raw_coeff = stbi__temp_malloc_mad3(z->img_comp[i].coeff_w * 8, z->img_comp[i].coeff_h * 8, sizeof(short), 15);
          if (z->img_comp[i].raw_coeff == NULL)
             return stbi__free_jpeg_components(z, i+1, stbi__err("outofmem", "Out of memory"));
          z->img_comp[i].coeff = (short*) (((size_t) z->img_comp[i].raw_coeff + 15) & ~15);
@@ -3305,6 +5053,25 @@ static int stbi__decode_jpeg_header(stbi__jpeg *z, int scan)
 }
 
 // decode image to YCbCr format
+// a scan coming into the ring of MCU rows kept when streaming: fine if it's
+// the only one and has every component; otherwise, if nothing went into the
+// ring yet, back to whole component buffers
+static int stbi__jpeg_ring_scan(stbi__jpeg *z)
+{
+   int i;
+   if (z->buf_scans++) return stbi__err("bad scans", "Corrupt JPEG"); // the ring's rows are gone
+   if (z->scan_n == z->s->img_n) return 1;
+   for (i=0; i < z->s->img_n; ++i) {
+      stbi__temp_free(z->img_comp[i].raw_data);
+      z->img_comp[i].h2 = z->img_mcu_y * z->img_comp[i].v * z->block_size;
+      z->img_comp[i].raw_data = stbi__temp_malloc_mad2(z->img_comp[i].w2, z->img_comp[i].h2, 15);
+      if (z->img_comp[i].raw_data == NULL) return stbi__err("outofmem", "Out of memory");
+      z->img_comp[i].data = (stbi_uc*) (((size_t) z->img_comp[i].raw_data + 15) & ~15);
+   }
+   z->buf_mcu_y = z->img_mcu_y;
+   return 1;
+}
+
 static int stbi__decode_jpeg_image(stbi__jpeg *j)
 {
    int m;
@@ -3318,7 +5085,12 @@ static int stbi__decode_jpeg_image(stbi__jpeg *j)
    while (!stbi__EOI(m)) {
       if (stbi__SOS(m)) {
          if (!stbi__process_scan_header(j)) return 0;
+         if (j->buf_mcu_y < j->img_mcu_y && !stbi__jpeg_ring_scan(j)) return 0;
+#ifdef STBI_THREADS
+         if (!stbi__parse_entropy_coded_data_threaded(j)) return 0;
+#else
          if (!stbi__parse_entropy_coded_data(j)) return 0;
+#endif
          if (j->marker == STBI__MARKER_none ) {
             // handle 0s at the end of image data from IP Kamera 9060
             while (!stbi__at_eof(j->s)) {
@@ -3576,7 +5348,8 @@ static void stbi__YCbCr_to_RGB_row(stbi_uc *out, const stbi_uc *y, const stbi_uc
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4)
+         out[3] = 255;
       out += step;
    }
 }
@@ -3710,58 +5483,474 @@ static void stbi__YCbCr_to_RGB_simd(stbi_uc *out, stbi_uc const *y, stbi_uc cons
       out[0] = (stbi_uc)r;
       out[1] = (stbi_uc)g;
       out[2] = (stbi_uc)b;
-      out[3] = 255;
+      if (step == 4)
+         out[3] = 255;
+      out += step;
+   }
+}
+#endif
+
+#ifdef STBI_AVX2
+// pshufb masks interleaving r, g and b vectors (16 pixels) into 48 bytes of
+// rgb: output byte k is pixel k/3 of channel k%3, -1 zeroes the byte
+static const signed char stbi__rgb_interleave_mask[9][16] =
+{
+   { 0,-1,-1,1,-1,-1,2,-1,-1,3,-1,-1,4,-1,-1,5 }, // bytes  0-15, r
+   { -1,0,-1,-1,1,-1,-1,2,-1,-1,3,-1,-1,4,-1,-1 }, // bytes  0-15, g
+   { -1,-1,0,-1,-1,1,-1,-1,2,-1,-1,3,-1,-1,4,-1 }, // bytes  0-15, b
+   { -1,-1,6,-1,-1,7,-1,-1,8,-1,-1,9,-1,-1,10,-1 }, // bytes 16-31, r
+   { 5,-1,-1,6,-1,-1,7,-1,-1,8,-1,-1,9,-1,-1,10 }, // bytes 16-31, g
+   { -1,5,-1,-1,6,-1,-1,7,-1,-1,8,-1,-1,9,-1,-1 }, // bytes 16-31, b
+   { -1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1,-1 }, // bytes 32-47, r
+   { -1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15,-1 }, // bytes 32-47, g
+   { 10,-1,-1,11,-1,-1,12,-1,-1,13,-1,-1,14,-1,-1,15 }, // bytes 32-47, b
+};
+
+// 16 pixels per iteration, with the same fixed point math as the sse2
+// version (so same results). Also handles step == 3, which is what you get
+// for RGB output (req_comp 0 or 3), with a pshufb-based interleave.
+static STBI__AVX2_TARGET void stbi__YCbCr_to_RGB_avx2(stbi_uc *out, stbi_uc const *y, stbi_uc const *pcb, stbi_uc const *pcr, int count, int step)
+{
+   int i = 0;
+
+   if (step == 3 || step == 4) {
+      __m128i signflip  = _mm_set1_epi8(-0x80);
+      __m256i cr_const0 = _mm256_set1_epi16(   (short) ( 1.40200f*4096.0f+0.5f));
+      __m256i cr_const1 = _mm256_set1_epi16( - (short) ( 0.71414f*4096.0f+0.5f));
+      __m256i cb_const0 = _mm256_set1_epi16( - (short) ( 0.34414f*4096.0f+0.5f));
+      __m256i cb_const1 = _mm256_set1_epi16(   (short) ( 1.77200f*4096.0f+0.5f));
+      __m256i y_bias = _mm256_set1_epi16(8); // (y<<8 | 128) >> 4, as in sse2
+      __m256i xw = _mm256_set1_epi16(255); // alpha channel
+
+      int k;
+
+      for (; i+15 < count; i += 16) {
+         // load
+         __m128i y_bytes = _mm_loadu_si128((__m128i *) (y+i));
+         __m128i cr_bytes = _mm_loadu_si128((__m128i *) (pcr+i));
+         __m128i cb_bytes = _mm_loadu_si128((__m128i *) (pcb+i));
+         __m128i cr_biased = _mm_xor_si128(cr_bytes, signflip); // -128
+         __m128i cb_biased = _mm_xor_si128(cb_bytes, signflip); // -128
+
+         // widen to short (and left-shift cr, cb by 8)
+         __m256i yws = _mm256_add_epi16(_mm256_slli_epi16(_mm256_cvtepu8_epi16(y_bytes), 4), y_bias);
+         __m256i crw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(cr_biased), 8);
+         __m256i cbw = _mm256_slli_epi16(_mm256_cvtepi8_epi16(cb_biased), 8);
+
+         // color transform
+         __m256i cr0 = _mm256_mulhi_epi16(cr_const0, crw);
+         __m256i cb0 = _mm256_mulhi_epi16(cb_const0, cbw);
+         __m256i cb1 = _mm256_mulhi_epi16(cbw, cb_const1);
+         __m256i cr1 = _mm256_mulhi_epi16(crw, cr_const1);
+         __m256i rws = _mm256_add_epi16(cr0, yws);
+         __m256i gwt = _mm256_add_epi16(cb0, yws);
+         __m256i bws = _mm256_add_epi16(yws, cb1);
+         __m256i gws = _mm256_add_epi16(gwt, cr1);
+
+         // descale
+         __m256i rw = _mm256_srai_epi16(rws, 4);
+         __m256i bw = _mm256_srai_epi16(bws, 4);
+         __m256i gw = _mm256_srai_epi16(gws, 4);
+
+         if (step == 4) {
+            // back to byte, set up for transpose (per 128-bit lane: pixels 0-7, 8-15)
+            __m256i brb = _mm256_packus_epi16(rw, bw);
+            __m256i gxb = _mm256_packus_epi16(gw, xw);
+
+            // transpose to interleave channels
+            __m256i t0 = _mm256_unpacklo_epi8(brb, gxb);
+            __m256i t1 = _mm256_unpackhi_epi8(brb, gxb);
+            __m256i o0 = _mm256_unpacklo_epi16(t0, t1); // pixels 0-3, 8-11
+            __m256i o1 = _mm256_unpackhi_epi16(t0, t1); // pixels 4-7, 12-15
+
+            // store
+            _mm256_storeu_si256((__m256i *) (out + 0), _mm256_permute2x128_si256(o0, o1, 0x20));
+            _mm256_storeu_si256((__m256i *) (out + 32), _mm256_permute2x128_si256(o0, o1, 0x31));
+            out += 64;
+         } else {
+            // back to byte: r0-15, g0-15 and b0-15 in one register each
+            __m256i rg = _mm256_permute4x64_epi64(_mm256_packus_epi16(rw, gw), 0xd8);
+            __m256i bb = _mm256_permute4x64_epi64(_mm256_packus_epi16(bw, bw), 0xd8);
+            __m128i rb = _mm256_castsi256_si128(rg);
+            __m128i gb = _mm256_extracti128_si256(rg, 1);
+            __m128i bb8 = _mm256_castsi256_si128(bb);
+
+            // interleave r/g/b into 48 bytes
+            for (k=0; k < 3; ++k) {
+               const __m128i *mask = (const __m128i *) stbi__rgb_interleave_mask[k*3];
+               __m128i o = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(rb, _mm_loadu_si128(mask + 0)),
+                                                     _mm_shuffle_epi8(gb, _mm_loadu_si128(mask + 1))),
+                                        _mm_shuffle_epi8(bb8, _mm_loadu_si128(mask + 2)));
+               _mm_storeu_si128((__m128i *) (out + k*16), o);
+            }
+            out += 48;
+         }
+      }
+   }
+
+   for (; i < count; ++i) {
+      int y_fixed = (y[i] << 20) + (1<<19); // rounding
+      int r,g,b;
+      int cr = pcr[i] - 128;
+      int cb = pcb[i] - 128;
+      r = y_fixed + cr* stbi__float2fixed(1.40200f);
+      g = y_fixed + cr*-stbi__float2fixed(0.71414f) + ((cb*-stbi__float2fixed(0.34414f)) & 0xffff0000);
+      b = y_fixed                                   +   cb* stbi__float2fixed(1.77200f);
+      r >>= 20;
+      g >>= 20;
+      b >>= 20;
+      if ((unsigned) r > 255) { if (r < 0) r = 0; else r = 255; }
+      if ((unsigned) g > 255) { if (g < 0) g = 0; else g = 255; }
+      if ((unsigned) b > 255) { if (b < 0) b = 0; else b = 255; }
+      out[0] = (stbi_uc)r;
+      out[1] = (stbi_uc)g;
+      out[2] = (stbi_uc)b;
+      if (step == 4)
+         out[3] = 255;
       out += step;
    }
 }
 #endif
 
-// set up the kernels
-static void stbi__setup_jpeg(stbi__jpeg *j)
+// set up the kernels
+static void stbi__setup_jpeg(stbi__jpeg *j)
+{
+   j->scale_shift = 0;
+   j->block_size = 8;
+   j->coeff_last = 63;
+   j->roi = 0;
+   j->stream = NULL;
+   j->idct_block_kernel = stbi__idct_block;
+   j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
+   j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
+
+#if defined(STBI_SSE2) || defined(STBI_NEON)
+   if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+      j->idct_block_kernel = stbi__idct_simd;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
+      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
+   }
+#endif
+
+#ifdef STBI_AVX2
+   if (stbi_simd_level() >= STBI_SIMD_AVX2) {
+      j->idct_block_kernel = stbi__idct_avx2;
+      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_avx2;
+   }
+#endif
+}
+
+// clean up the temporary component buffers
+static void stbi__cleanup_jpeg(stbi__jpeg *j)
+{
+   stbi__free_jpeg_components(j, j->s->img_n, 0);
+}
+
+typedef struct
+{
+   resample_row_func resample;
+   stbi_uc *line0,*line1;
+   int hs,vs;   // expansion factor in each axis
+   int w_lores; // horizontal pixels pre-expansion
+   int ystep;   // how far through vertical expansion we are
+   int ypos;    // which pre-expansion row we're on
+} stbi__resample;
+
+// fast 0..255 * 0..255 => 0..255 rounded multiplication
+static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
+{
+   unsigned int t = x*y + 128;
+   return (stbi_uc) ((t + (t >>8)) >> 8);
+}
+
+// resamples and color-converts rows j0..j1-1 of the region into output, with
+// res_comp set up for row j0. Row j0 goes to output and each next one stride
+// bytes further, negative to store them bottom-up
+static void stbi__jpeg_convert_rows(stbi__jpeg *z, stbi__resample *res_comp, stbi_uc **linebuf,
+                                    stbi_uc *output, ptrdiff_t stride, int n, int decode_n, int is_rgb,
+                                    int j0, int j1)
+{
+   int k,j;
+   unsigned int i, width = z->roi_w;
+   stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+   int lx0[4], lx1[4];
+
+   // input pixels each component needs for the region's columns, with one
+   // more on each side for upsampling
+   for (k=0; k < decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+      lx0[k] = z->roi_x / r->hs - 1;
+      lx1[k] = (z->roi_x + z->roi_w-1) / r->hs + 2;
+      if (lx0[k] < 0) lx0[k] = 0;
+      if (lx1[k] > r->w_lores) lx1[k] = r->w_lores;
+   }
+
+   for (j=j0; j < j1; ++j) {
+      stbi_uc *out = output + stride * (j - j0);
+      for (k=0; k < decode_n; ++k) {
+         stbi__resample *r = &res_comp[k];
+         int y_bot = r->ystep >= (r->vs >> 1);
+         coutput[k] = r->resample(linebuf[k],
+                                  (y_bot ? r->line1 : r->line0) + lx0[k],
+                                  (y_bot ? r->line0 : r->line1) + lx0[k],
+                                  lx1[k] - lx0[k], r->hs) + (z->roi_x - lx0[k] * r->hs);
+         if (++r->ystep >= r->vs) {
+            r->ystep = 0;
+            r->line0 = r->line1;
+            if (++r->ypos < z->img_comp[k].y) {
+               r->line1 += z->img_comp[k].w2;
+               if (r->line1 == z->img_comp[k].data + z->img_comp[k].w2 * z->img_comp[k].h2)
+                  r->line1 = z->img_comp[k].data; // streaming's ring of MCU rows
+            }
+         }
+      }
+      if (n >= 3) {
+         stbi_uc *y = coutput[0];
+         if (z->s->img_n == 3) {
+            if (is_rgb) {
+               for (i=0; i < width; ++i) {
+                  out[0] = y[i];
+                  out[1] = coutput[1][i];
+                  out[2] = coutput[2][i];
+                  if (n == 4) out[3] = 255;
+                  out += n;
+               }
+            } else {
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], width, n);
+            }
+         } else if (z->s->img_n == 4) {
+            if (z->app14_color_transform == 0) { // CMYK
+               for (i=0; i < width; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(coutput[0][i], m);
+                  out[1] = stbi__blinn_8x8(coutput[1][i], m);
+                  out[2] = stbi__blinn_8x8(coutput[2][i], m);
+                  if (n == 4) out[3] = 255;
+                  out += n;
+               }
+            } else if (z->app14_color_transform == 2) { // YCCK
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], width, n);
+               for (i=0; i < width; ++i) {
+                  stbi_uc m = coutput[3][i];
+                  out[0] = stbi__blinn_8x8(255 - out[0], m);
+                  out[1] = stbi__blinn_8x8(255 - out[1], m);
+                  out[2] = stbi__blinn_8x8(255 - out[2], m);
+                  out += n;
+               }
+            } else { // YCbCr + alpha?  Ignore the fourth channel for now
+               z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], width, n);
+            }
+         } else
+            for (i=0; i < width; ++i) {
+               out[0] = out[1] = out[2] = y[i];
+               if (n == 4) out[3] = 255; // with n==3 it would land on the next pixel, maybe in another band
+               out += n;
+            }
+      } else {
+         if (is_rgb) {
+            if (n == 1)
+               for (i=0; i < width; ++i)
+                  *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+            else {
+               for (i=0; i < width; ++i, out += 2) {
+                  out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
+                  out[1] = 255;
+               }
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
+            for (i=0; i < width; ++i) {
+               stbi_uc m = coutput[3][i];
+               stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
+               stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
+               stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
+               out[0] = stbi__compute_y(r, g, b);
+               if (n == 2) out[1] = 255; // with n==1 it would land on the next pixel, maybe in another row
+               out += n;
+            }
+         } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
+            for (i=0; i < width; ++i) {
+               out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
+               if (n == 2) out[1] = 255;
+               out += n;
+            }
+         } else {
+            stbi_uc *y = coutput[0];
+            if (n == 1)
+               for (i=0; i < width; ++i) out[i] = y[i];
+            else
+               for (i=0; i < width; ++i) { *out++ = y[i]; *out++ = 255; }
+         }
+      }
+   }
+}
+
+// moves a resampler set up for the first row to output row j
+static void stbi__resample_seek(stbi__resample *r, stbi_uc *data, int w2, int lines, int j)
+{
+   int steps = j + r->ystep;
+   int wraps = steps / r->vs;
+   r->ystep = steps % r->vs;
+   r->ypos  = wraps;
+   r->line1 = data + w2 * (wraps < lines-1 ? wraps : lines-1);
+   r->line0 = wraps ? data + w2 * (wraps-1 < lines-1 ? wraps-1 : lines-1) : data;
+}
+
+#ifdef STBI_THREADS
+
+typedef struct
+{
+   stbi__jpeg *z;
+   stbi__resample *res_comp;
+   stbi_uc *output;
+   ptrdiff_t stride;
+   int n, decode_n, is_rgb;
+   int threads;
+   int failed;
+} stbi__jpeg_convert_job;
+
+static void stbi__jpeg_convert_band(void *arg, int part)
+{
+   stbi__jpeg_convert_job *job = (stbi__jpeg_convert_job *) arg;
+   stbi__jpeg *z = job->z;
+   int j0 = z->roi_y + (int) (z->roi_h * (stbi__uint32) part / job->threads);
+   int j1 = z->roi_y + (int) (z->roi_h * (stbi__uint32) (part+1) / job->threads);
+   stbi__resample res_comp[4];
+   stbi_uc *linebuf[4] = { NULL, NULL, NULL, NULL };
+   int k;
+
+   for (k=0; k < job->decode_n; ++k) {
+      res_comp[k] = job->res_comp[k];
+      stbi__resample_seek(&res_comp[k], z->img_comp[k].data, z->img_comp[k].w2, z->img_comp[k].y, j0);
+      // band 0 uses the line buffers already allocated
+      linebuf[k] = part ? (stbi_uc *) stbi__malloc(z->s->img_x + 3) : z->img_comp[k].linebuf;
+      if (!linebuf[k]) job->failed = 1;
+   }
+   if (!job->failed)
+      stbi__jpeg_convert_rows(z, res_comp, linebuf, job->output + job->stride * (j0 - z->roi_y), job->stride,
+                              job->n, job->decode_n, job->is_rgb, j0, j1);
+   if (part)
+      for (k=0; k < job->decode_n; ++k)
+         STBI_FREE(linebuf[k]);
+}
+
+// stbi__jpeg_convert_rows() over the whole region, in bands of rows on several
+// threads. Returns 0 if it's not worth it, to go serial
+static int stbi__jpeg_convert_threaded(stbi__jpeg *z, stbi__resample *res_comp, stbi_uc *output,
+                                       ptrdiff_t stride, int n, int decode_n, int is_rgb)
+{
+   stbi__jpeg_convert_job job;
+   job.threads = stbi__jpeg_thread_count(z, z->roi_h);
+   if (job.threads < 2)
+      return 0;
+   job.z = z;
+   job.res_comp = res_comp;
+   job.output = output;
+   job.stride = stride;
+   job.n = n;
+   job.decode_n = decode_n;
+   job.is_rgb = is_rgb;
+   job.failed = 0;
+   stbi__parallel_for(stbi__jpeg_convert_band, &job, job.threads);
+   if (job.failed) {
+      // out of memory for some band's line buffers: do it all over serially
+      stbi_uc *linebuf[4];
+      int k;
+      for (k=0; k < decode_n; ++k) {
+         linebuf[k] = z->img_comp[k].linebuf;
+         stbi__resample_seek(&res_comp[k], z->img_comp[k].data, z->img_comp[k].w2, z->img_comp[k].y, z->roi_y);
+      }
+      stbi__jpeg_convert_rows(z, res_comp, linebuf, output, stride, n, decode_n, is_rgb, z->roi_y, z->roi_y + z->roi_h);
+   }
+   return 1;
+}
+#endif // STBI_THREADS
+
+// output channels, the components they're made of, and the resamplers and
+// line buffers to make them
+static int stbi__jpeg_setup_convert(stbi__jpeg *z, stbi__resample *res_comp, int req_comp,
+                                    int *n, int *decode_n, int *is_rgb)
 {
-   j->idct_block_kernel = stbi__idct_block;
-   j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_row;
-   j->resample_row_hv_2_kernel = stbi__resample_row_hv_2;
+   int k;
 
-#ifdef STBI_SSE2
-   if (stbi__sse2_available()) {
-      j->idct_block_kernel = stbi__idct_simd;
-      j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
-      j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
-   }
-#endif
+   // determine actual number of components to generate
+   *n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
 
-#ifdef STBI_NEON
-   j->idct_block_kernel = stbi__idct_simd;
-   j->YCbCr_to_RGB_kernel = stbi__YCbCr_to_RGB_simd;
-   j->resample_row_hv_2_kernel = stbi__resample_row_hv_2_simd;
-#endif
+   *is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
+
+   if (z->s->img_n == 3 && *n < 3 && !*is_rgb)
+      *decode_n = 1;
+   else
+      *decode_n = z->s->img_n;
+
+   for (k=0; k < *decode_n; ++k) {
+      stbi__resample *r = &res_comp[k];
+
+      // allocate line buffer big enough for upsampling off the edges
+      // with upsample factor of 4
+      z->img_comp[k].linebuf = (stbi_uc *) stbi__temp_malloc(z->s->img_x + 3);
+      if (!z->img_comp[k].linebuf) return stbi__err("outofmem", "Out of memory");
+
+      r->hs      = z->img_h_max / z->img_comp[k].h;
+      r->vs      = z->img_v_max / z->img_comp[k].v;
+      r->ystep   = r->vs >> 1;
+      r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
+      r->ypos    = 0;
+      r->line0   = r->line1 = z->img_comp[k].data;
+
+      if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
+      else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
+      else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
+      else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
+      else                               r->resample = stbi__resample_row_generic;
+   }
+   return 1;
 }
 
-// clean up the temporary component buffers
-static void stbi__cleanup_jpeg(stbi__jpeg *j)
+// streaming: output rows are converted an MCU row at a time into a small
+// buffer and handed to the sink, as soon as the MCU rows they need are in
+struct stbi__jpeg_stream
 {
-   stbi__free_jpeg_components(j, j->s->img_n, 0);
-}
+   stbi__row_sink *sink;
+   stbi__resample res_comp[4];
+   stbi_uc *rows;     // one MCU row of output
+   int req_comp, n, decode_n, is_rgb;
+   int y;             // next row to hand out, -1 before any
+};
 
-typedef struct
+// hands out the rows up to y1
+static int stbi__jpeg_stream_to(stbi__jpeg *z, int y1)
 {
-   resample_row_func resample;
-   stbi_uc *line0,*line1;
-   int hs,vs;   // expansion factor in each axis
-   int w_lores; // horizontal pixels pre-expansion
-   int ystep;   // how far through vertical expansion we are
-   int ypos;    // which pre-expansion row we're on
-} stbi__resample;
+   struct stbi__jpeg_stream *st = z->stream;
+   stbi_uc *linebuf[4];
+   int k;
+   if (st->y < 0) {
+      if (!stbi__jpeg_setup_convert(z, st->res_comp, st->req_comp, &st->n, &st->decode_n, &st->is_rgb))
+         return 0;
+      st->rows = (stbi_uc *) stbi__temp_malloc_mad3(st->n, z->s->img_x, z->img_mcu_h, 1); // +1 as for a whole image
+      if (!st->rows) return stbi__err("outofmem", "Out of memory");
+      if (!stbi__sink_begin(st->sink, z->s->img_x, z->s->img_y, st->n)) return 0;
+      st->y = 0;
+   }
+   if (y1 > (int) z->s->img_y) y1 = z->s->img_y;
+   for (k=0; k < st->decode_n; ++k)
+      linebuf[k] = z->img_comp[k].linebuf;
+   while (st->y < y1) {
+      int rows = y1 - st->y < z->img_mcu_h ? y1 - st->y : z->img_mcu_h;
+      stbi__jpeg_convert_rows(z, st->res_comp, linebuf, st->rows, (ptrdiff_t) st->n * z->roi_w, st->n, st->decode_n, st->is_rgb, st->y, st->y + rows);
+      if (!stbi__sink_rows(st->sink, st->rows, st->y, rows)) return 0;
+      st->y += rows;
+   }
+   return 1;
+}
 
-// fast 0..255 * 0..255 => 0..255 rounded multiplication
-static stbi_uc stbi__blinn_8x8(stbi_uc x, stbi_uc y)
+// the first done MCU rows are decoded into the ring: upsampling the last
+// one needs the next, the rows before it can go
+static int stbi__jpeg_stream_mcu_rows(stbi__jpeg *z, int done)
 {
-   unsigned int t = x*y + 128;
-   return (stbi_uc) ((t + (t >>8)) >> 8);
+   return done < 2 || stbi__jpeg_stream_to(z, (done-1) * z->img_mcu_h);
 }
 
-static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp)
+static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp, int req_comp, stbi__result_info *ri)
 {
    int n, decode_n, is_rgb;
    z->s->img_n = 0; // make stbi__cleanup_jpeg safe
@@ -3769,152 +5958,84 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
    // validate req_comp
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
 
+   if (z->s->sink) {
+      struct stbi__jpeg_stream st;
+      int ok;
+      st.sink = z->s->sink;
+      st.req_comp = req_comp;
+      st.rows = NULL;
+      st.y = -1;
+      z->stream = &st;
+      ok = stbi__decode_jpeg_image(z) && stbi__jpeg_stream_to(z, z->s->img_y);
+      stbi__temp_free(st.rows);
+      stbi__cleanup_jpeg(z);
+      z->stream = NULL;
+      if (ok) {
+         *out_x = z->s->img_x;
+         *out_y = z->s->img_y;
+         if (comp) *comp = z->s->img_n >= 3 ? 3 : 1;
+      }
+      return NULL; // rows went to the sink
+   }
+
    // load a jpeg image from whichever source, but leave in YCbCr format
    if (!stbi__decode_jpeg_image(z)) { stbi__cleanup_jpeg(z); return NULL; }
 
-   // determine actual number of components to generate
-   n = req_comp ? req_comp : z->s->img_n >= 3 ? 3 : 1;
-
-   is_rgb = z->s->img_n == 3 && (z->rgb == 3 || (z->app14_color_transform == 0 && !z->jfif));
-
-   if (z->s->img_n == 3 && n < 3 && !is_rgb)
-      decode_n = 1;
-   else
-      decode_n = z->s->img_n;
+   if (z->scale_shift) {
+      // decoded downscaled: from here on, the image is that size
+      int k, round = (1 << z->scale_shift) - 1;
+      for (k=0; k < z->s->img_n; ++k) {
+         z->img_comp[k].x = (z->img_comp[k].x + round) >> z->scale_shift;
+         z->img_comp[k].y = (z->img_comp[k].y + round) >> z->scale_shift;
+      }
+      z->s->img_x = (z->s->img_x + round) >> z->scale_shift;
+      z->s->img_y = (z->s->img_y + round) >> z->scale_shift;
+      z->roi_w = z->s->img_x;
+      z->roi_h = z->s->img_y;
+   }
 
    // resample and color-convert
    {
       int k;
-      unsigned int i,j;
-      stbi_uc *output;
-      stbi_uc *coutput[4] = { NULL, NULL, NULL, NULL };
+      stbi_uc *output, *first;
+      ptrdiff_t stride;
 
       stbi__resample res_comp[4];
 
-      for (k=0; k < decode_n; ++k) {
-         stbi__resample *r = &res_comp[k];
-
-         // allocate line buffer big enough for upsampling off the edges
-         // with upsample factor of 4
-         z->img_comp[k].linebuf = (stbi_uc *) stbi__malloc(z->s->img_x + 3);
-         if (!z->img_comp[k].linebuf) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
-
-         r->hs      = z->img_h_max / z->img_comp[k].h;
-         r->vs      = z->img_v_max / z->img_comp[k].v;
-         r->ystep   = r->vs >> 1;
-         r->w_lores = (z->s->img_x + r->hs-1) / r->hs;
-         r->ypos    = 0;
-         r->line0   = r->line1 = z->img_comp[k].data;
-
-         if      (r->hs == 1 && r->vs == 1) r->resample = resample_row_1;
-         else if (r->hs == 1 && r->vs == 2) r->resample = stbi__resample_row_v_2;
-         else if (r->hs == 2 && r->vs == 1) r->resample = stbi__resample_row_h_2;
-         else if (r->hs == 2 && r->vs == 2) r->resample = z->resample_row_hv_2_kernel;
-         else                               r->resample = stbi__resample_row_generic;
-      }
+      if (!stbi__jpeg_setup_convert(z, res_comp, req_comp, &n, &decode_n, &is_rgb)) { stbi__cleanup_jpeg(z); return NULL; }
 
       // can't error after this so, this is safe
-      output = (stbi_uc *) stbi__malloc_mad3(n, z->s->img_x, z->s->img_y, 1);
+      output = (stbi_uc *) stbi__malloc_mad3(n, z->roi_w, z->roi_h, 1);
       if (!output) { stbi__cleanup_jpeg(z); return stbi__errpuc("outofmem", "Out of memory"); }
 
+      // region and downscale are done by now, so a vertical flip is just
+      // storing rows bottom-up
+      stride = (ptrdiff_t) n * z->roi_w;
+      first = output;
+      if (z->s->flip) {
+         first = output + stride * (z->roi_h - 1);
+         stride = -stride;
+         ri->flipped = 1;
+      }
+
       // now go ahead and resample
-      for (j=0; j < z->s->img_y; ++j) {
-         stbi_uc *out = output + n * z->s->img_x * j;
+#ifdef STBI_THREADS
+      if (stbi__jpeg_convert_threaded(z, res_comp, first, stride, n, decode_n, is_rgb))
+         ;
+      else
+#endif
+      {
+         stbi_uc *linebuf[4];
          for (k=0; k < decode_n; ++k) {
-            stbi__resample *r = &res_comp[k];
-            int y_bot = r->ystep >= (r->vs >> 1);
-            coutput[k] = r->resample(z->img_comp[k].linebuf,
-                                     y_bot ? r->line1 : r->line0,
-                                     y_bot ? r->line0 : r->line1,
-                                     r->w_lores, r->hs);
-            if (++r->ystep >= r->vs) {
-               r->ystep = 0;
-               r->line0 = r->line1;
-               if (++r->ypos < z->img_comp[k].y)
-                  r->line1 += z->img_comp[k].w2;
-            }
-         }
-         if (n >= 3) {
-            stbi_uc *y = coutput[0];
-            if (z->s->img_n == 3) {
-               if (is_rgb) {
-                  for (i=0; i < z->s->img_x; ++i) {
-                     out[0] = y[i];
-                     out[1] = coutput[1][i];
-                     out[2] = coutput[2][i];
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else {
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else if (z->s->img_n == 4) {
-               if (z->app14_color_transform == 0) { // CMYK
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(coutput[0][i], m);
-                     out[1] = stbi__blinn_8x8(coutput[1][i], m);
-                     out[2] = stbi__blinn_8x8(coutput[2][i], m);
-                     out[3] = 255;
-                     out += n;
-                  }
-               } else if (z->app14_color_transform == 2) { // YCCK
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-                  for (i=0; i < z->s->img_x; ++i) {
-                     stbi_uc m = coutput[3][i];
-                     out[0] = stbi__blinn_8x8(255 - out[0], m);
-                     out[1] = stbi__blinn_8x8(255 - out[1], m);
-                     out[2] = stbi__blinn_8x8(255 - out[2], m);
-                     out += n;
-                  }
-               } else { // YCbCr + alpha?  Ignore the fourth channel for now
-                  z->YCbCr_to_RGB_kernel(out, y, coutput[1], coutput[2], z->s->img_x, n);
-               }
-            } else
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = out[1] = out[2] = y[i];
-                  out[3] = 255; // not used if n==3
-                  out += n;
-               }
-         } else {
-            if (is_rgb) {
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i)
-                     *out++ = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-               else {
-                  for (i=0; i < z->s->img_x; ++i, out += 2) {
-                     out[0] = stbi__compute_y(coutput[0][i], coutput[1][i], coutput[2][i]);
-                     out[1] = 255;
-                  }
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 0) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  stbi_uc m = coutput[3][i];
-                  stbi_uc r = stbi__blinn_8x8(coutput[0][i], m);
-                  stbi_uc g = stbi__blinn_8x8(coutput[1][i], m);
-                  stbi_uc b = stbi__blinn_8x8(coutput[2][i], m);
-                  out[0] = stbi__compute_y(r, g, b);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else if (z->s->img_n == 4 && z->app14_color_transform == 2) {
-               for (i=0; i < z->s->img_x; ++i) {
-                  out[0] = stbi__blinn_8x8(255 - coutput[0][i], coutput[3][i]);
-                  out[1] = 255;
-                  out += n;
-               }
-            } else {
-               stbi_uc *y = coutput[0];
-               if (n == 1)
-                  for (i=0; i < z->s->img_x; ++i) out[i] = y[i];
-               else
-                  for (i=0; i < z->s->img_x; ++i) { *out++ = y[i]; *out++ = 255; }
-            }
+            linebuf[k] = z->img_comp[k].linebuf;
+            if (z->roi_y)
+               stbi__resample_seek(&res_comp[k], z->img_comp[k].data, z->img_comp[k].w2, z->img_comp[k].y, z->roi_y);
          }
+         stbi__jpeg_convert_rows(z, res_comp, linebuf, first, stride, n, decode_n, is_rgb, z->roi_y, z->roi_y + z->roi_h);
       }
       stbi__cleanup_jpeg(z);
-      *out_x = z->s->img_x;
-      *out_y = z->s->img_y;
+      *out_x = z->roi_w;
+      *out_y = z->roi_h;
       if (comp) *comp = z->s->img_n >= 3 ? 3 : 1; // report original components, not output
       return output;
    }
@@ -3923,24 +6044,39 @@ static stbi_uc *load_jpeg_image(stbi__jpeg *z, int *out_x, int *out_y, int *comp
 static void *stbi__jpeg_load(stbi__context *s, int *x, int *y, int *comp, int req_comp, stbi__result_info *ri)
 {
    unsigned char* result;
-   stbi__jpeg* j = (stbi__jpeg*) stbi__malloc(sizeof(stbi__jpeg));
-   STBI_NOTUSED(ri);
+   stbi__jpeg* j = (stbi__jpeg*) stbi__temp_malloc(sizeof(stbi__jpeg));
    j->s = s;
    stbi__setup_jpeg(j);
-   result = load_jpeg_image(j, x,y,comp,req_comp);
-   STBI_FREE(j);
+   if (s->scale_shift) {
+      static void (*reduced_idct[4])(stbi_uc *, int, short [64]) = { NULL, stbi__idct_4x4, stbi__idct_2x2, stbi__idct_1x1 };
+      static const int coeff_last[4] = { 63, 24, 4, 0 }; // lowest 4x4, 2x2, 1x1
+      j->scale_shift = s->scale_shift;
+      j->block_size = 8 >> s->scale_shift;
+      j->coeff_last = coeff_last[s->scale_shift];
+      j->idct_block_kernel = reduced_idct[s->scale_shift];
+      s->scale_shift = 0; // done here, no box filter needed
+   } else if (s->roi_w) {
+      j->roi = 1;
+      j->roi_x = s->roi_x;
+      j->roi_y = s->roi_y;
+      j->roi_w = s->roi_w;
+      j->roi_h = s->roi_h;
+      s->roi_w = 0; // done here, no crop needed
+   }
+   result = load_jpeg_image(j, x,y,comp,req_comp, ri);
+   stbi__temp_free(j);
    return result;
 }
 
 static int stbi__jpeg_test(stbi__context *s)
 {
    int r;
-   stbi__jpeg* j = (stbi__jpeg*)stbi__malloc(sizeof(stbi__jpeg));
+   stbi__jpeg* j = (stbi__jpeg*)stbi__temp_malloc(sizeof(stbi__jpeg));
    j->s = s;
    stbi__setup_jpeg(j);
    r = stbi__decode_jpeg_header(j, STBI__SCAN_type);
    stbi__rewind(s);
-   STBI_FREE(j);
+   stbi__temp_free(j);
    return r;
 }
 
@@ -3992,6 +6128,20 @@ typedef struct
    stbi__uint16 value[288];
 } stbi__zhuffman;
 
+// fast path tables: a main one indexed by the next bits, then subtables for
+// longer codes. each entry decodes a whole symbol, or two literals
+#define STBI__ZFAST_LEN_BITS   11
+#define STBI__ZFAST_DIST_BITS   8
+#define STBI__ZFAST_LEN_SIZE   ((1 << STBI__ZFAST_LEN_BITS) + 512)
+#define STBI__ZFAST_DIST_SIZE  ((1 << STBI__ZFAST_DIST_BITS) + 256)
+
+// entries are value << 16 | flags | extra bits << 8 | bits to consume, with
+// no flags for a length or distance (value its base), and 0 if invalid
+#define STBI__ZE_LIT   0x8000 // literal byte in value
+#define STBI__ZE_PAIR  0x4000 // and another one in its high byte
+#define STBI__ZE_SUB   0x2000 // subtable at value, extra bits its index bits
+#define STBI__ZE_END   0x1000 // end of block
+
 stbi_inline static int stbi__bitreverse16(int n)
 {
   n = ((n & 0xAAAA) >>  1) | ((n & 0x5555) << 1);
@@ -4072,8 +6222,18 @@ typedef struct
    char *zout_start;
    char *zout_end;
    int   z_expandable;
+   int   z_want;       // if nonzero, stop after the block that gets this much output
+   int   z_temp;       // output buffer from stbi__temp_malloc()
+
+   // streaming: output is handed to z_flush as the buffer fills up, rather
+   // than the buffer grown. z_flushed bytes of it have been taken so far
+   int (*z_flush)(void *user, stbi_uc *data, int len, int final);
+   void *z_flush_user;
+   int   z_flushed;
 
    stbi__zhuffman z_length, z_distance;
+   int z_fast; // fast path tables built for the current block
+   stbi__uint32 z_fast_length[STBI__ZFAST_LEN_SIZE], z_fast_distance[STBI__ZFAST_DIST_SIZE];
 } stbi__zbuf;
 
 stbi_inline static int stbi__zeof(stbi__zbuf *z)
@@ -4146,12 +6306,33 @@ stbi_inline static int stbi__zhuffman_decode(stbi__zbuf *a, stbi__zhuffman *z)
    return stbi__zhuffman_decode_slowpath(a, z);
 }
 
+// streaming: hands the new output to z_flush, then slides down what it left
+// and the 32K window that matches may refer back to
+static int stbi__zflush(stbi__zbuf *z)
+{
+   int cur = (int) (z->zout - z->zout_start), keep;
+   int used = z->z_flush(z->z_flush_user, (stbi_uc *) z->zout_start + z->z_flushed, cur - z->z_flushed, 0);
+   if (used < 0) return 0;
+   z->z_flushed += used;
+   keep = cur - 32768 < z->z_flushed ? cur - 32768 : z->z_flushed; // bytes that can go
+   if (keep > 0) {
+      memmove(z->zout_start, z->zout_start + keep, cur - keep);
+      z->zout -= keep;
+      z->z_flushed -= keep;
+   }
+   return 1;
+}
+
 static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room for n bytes
 {
    char *q;
    unsigned int cur, limit, old_limit;
    z->zout = zout;
    if (!z->z_expandable) return stbi__err("output buffer limit","Corrupt PNG");
+   if (z->z_flush) {
+      if (!stbi__zflush(z)) return 0;
+      if (z->zout + n <= z->zout_end) return 1;
+   }
    cur   = (unsigned int) (z->zout - z->zout_start);
    limit = old_limit = (unsigned) (z->zout_end - z->zout_start);
    if (UINT_MAX - cur < (unsigned) n) return stbi__err("outofmem", "Out of memory");
@@ -4159,7 +6340,10 @@ static int stbi__zexpand(stbi__zbuf *z, char *zout, int n)  // need to make room
       if(limit > UINT_MAX / 2) return stbi__err("outofmem", "Out of memory");
       limit *= 2;
    }
-   q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
+   if (z->z_temp)
+      q = (char *) stbi__temp_realloc(z->zout_start, limit);
+   else
+      q = (char *) STBI_REALLOC_SIZED(z->zout_start, old_limit, limit);
    STBI_NOTUSED(old_limit);
    if (q == NULL) return stbi__err("outofmem", "Out of memory");
    z->zout_start = q;
@@ -4182,11 +6366,213 @@ static const int stbi__zdist_base[32] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129
 static const int stbi__zdist_extra[32] =
 { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13};
 
+// builds a fast path table from code lengths already checked by
+// stbi__zbuild_huffman. Returns 0 if the subtables don't fit
+static int stbi__zbuild_fast(stbi__uint32 *table, int bits, int size, const stbi_uc *sizelist, int num, int dist)
+{
+   int i,j,s,code,used = 1 << bits, mask = (1 << bits) - 1;
+   int next_code[16], sizes[16];
+   stbi_uc sub[1 << STBI__ZFAST_LEN_BITS]; // subtable bits under each prefix
+
+   memset(sizes, 0, sizeof(sizes));
+   for (i=0; i < num; ++i)
+      ++sizes[sizelist[i]];
+   sizes[0] = 0;
+   code = 0;
+   for (s=1; s < 16; ++s) {
+      next_code[s] = code;
+      code = (code + sizes[s]) << 1;
+   }
+
+   // subtables take the longest code under their prefix
+   memset(table, 0, sizeof(*table) << bits);
+   memset(sub, 0, (size_t) 1 << bits);
+   for (s=bits+1; s < 16; ++s)
+      for (i=0; i < sizes[s]; ++i) {
+         int p = stbi__bit_reverse(next_code[s] + i, s) & mask;
+         if (s - bits > sub[p]) sub[p] = (stbi_uc) (s - bits);
+      }
+   for (i=0; i <= mask; ++i)
+      if (sub[i]) {
+         if (used + (1 << sub[i]) > size) return 0;
+         table[i] = (stbi__uint32) used << 16 | STBI__ZE_SUB | sub[i] << 8 | bits;
+         memset(table + used, 0, sizeof(*table) << sub[i]);
+         used += 1 << sub[i];
+      }
+
+   for (i=0; i < num; ++i) {
+      stbi__uint32 e;
+      int rev;
+      s = sizelist[i];
+      if (!s) continue;
+      if (dist)
+         e = i < 30 ? (stbi__uint32) stbi__zdist_base[i] << 16 | stbi__zdist_extra[i] << 8 : 0;
+      else if (i < 256)
+         e = (stbi__uint32) i << 16 | STBI__ZE_LIT;
+      else if (i == 256)
+         e = STBI__ZE_END;
+      else
+         e = i < 286 ? (stbi__uint32) stbi__zlength_base[i-257] << 16 | stbi__zlength_extra[i-257] << 8 : 0;
+      rev = stbi__bit_reverse(next_code[s]++, s);
+      if (!e) continue; // left invalid
+      if (s <= bits) {
+         for (j=rev; j <= mask; j += 1 << s)
+            table[j] = e | s;
+      } else {
+         stbi__uint32 *t = table + (table[rev & mask] >> 16);
+         for (j=rev >> bits; j < (1 << sub[rev & mask]); j += 1 << (s - bits))
+            t[j] = e | (s - bits);
+      }
+   }
+
+   // two literals whose codes fit in one lookup; going down, the second one
+   // (at a lower index) hasn't been paired yet
+   if (!dist)
+      for (i=mask; i >= 0; --i) {
+         stbi__uint32 e = table[i], e2;
+         int n = e & 255;
+         if (!(e & STBI__ZE_LIT) || n >= bits) continue;
+         e2 = table[i >> n];
+         if ((e2 & STBI__ZE_LIT) && !(e2 & STBI__ZE_PAIR) && n + (int) (e2 & 255) <= bits)
+            table[i] = (e >> 16 | (e2 >> 16) << 8) << 16 | STBI__ZE_LIT | STBI__ZE_PAIR | (n + (e2 & 255));
+      }
+   return 1;
+}
+
+static void stbi__zbuild_fast_tables(stbi__zbuf *a, const stbi_uc *lengths, int nlength, const stbi_uc *dists, int ndist)
+{
+   a->z_fast = stbi__zfast_inflate &&
+               stbi__zbuild_fast(a->z_fast_length, STBI__ZFAST_LEN_BITS, STBI__ZFAST_LEN_SIZE, lengths, nlength, 0) &&
+               stbi__zbuild_fast(a->z_fast_distance, STBI__ZFAST_DIST_BITS, STBI__ZFAST_DIST_SIZE, dists, ndist, 1);
+}
+
+stbi_inline static stbi__uint64 stbi__zload64(const stbi_uc *p)
+{
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86) || \
+    (defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+   stbi__uint64 v;
+   memcpy(&v, p, 8);
+   return v;
+#else
+   return (stbi__uint64) p[0]       | (stbi__uint64) p[1] <<  8 | (stbi__uint64) p[2] << 16 |
+          (stbi__uint64) p[3] << 24 | (stbi__uint64) p[4] << 32 | (stbi__uint64) p[5] << 40 |
+          (stbi__uint64) p[6] << 48 | (stbi__uint64) p[7] << 56;
+#endif
+}
+
+// decodes a huffman block on the fast path while there's a word of input
+// left and room for the longest match plus a word of slack. The bit buffer
+// is topped up to 56+ bits per symbol, enough for a length and a distance
+// with their extra bits. Returns 1 at the end of the block, 0 on error, 2
+// near the end of either buffer: the caller carries on symbol by symbol
+static int stbi__zfast_block(stbi__zbuf *a)
+{
+   const stbi__uint32 *lt = a->z_fast_length, *dt = a->z_fast_distance;
+   const stbi_uc *in = a->zbuffer, *in_end;
+   stbi_uc *out = (stbi_uc *) a->zout, *out_end;
+   stbi__uint64 bitbuf = a->code_buffer;
+   int bitcount = a->num_bits, ret = 2;
+
+   if (a->zbuffer_end - a->zbuffer < 8 || a->zout_end - a->zout < 258 + 8) return 2;
+   in_end = a->zbuffer_end - 8;
+   out_end = (stbi_uc *) a->zout_end - (258 + 8);
+
+   while (in <= in_end && out <= out_end) {
+      stbi__uint32 e;
+      int len, dist;
+      stbi_uc *src;
+
+      // bits above bitcount are the next ones in the stream already, so
+      // topping up again just ORs the same bits in
+      bitbuf |= stbi__zload64(in) << bitcount;
+      in += (63 - bitcount) >> 3;
+      bitcount |= 56;
+
+      e = lt[bitbuf & ((1 << STBI__ZFAST_LEN_BITS) - 1)];
+      if (e & STBI__ZE_SUB) {
+         bitbuf >>= STBI__ZFAST_LEN_BITS;
+         bitcount -= STBI__ZFAST_LEN_BITS;
+         e = lt[(e >> 16) + (bitbuf & ((1 << ((e >> 8) & 15)) - 1))];
+      }
+      bitbuf >>= e & 255;
+      bitcount -= e & 255;
+      if (e & STBI__ZE_LIT) {
+         out[0] = (stbi_uc) (e >> 16);
+         out[1] = (stbi_uc) (e >> 24); // junk past the end unless a pair
+         out += e & STBI__ZE_PAIR ? 2 : 1;
+         continue;
+      }
+      if (e & STBI__ZE_END) {
+         ret = 1;
+         break;
+      }
+      if (!(e & 255)) {
+         ret = stbi__err("bad huffman code","Corrupt PNG");
+         break;
+      }
+      len = (int) (e >> 16) + (int) (bitbuf & ((1 << ((e >> 8) & 15)) - 1));
+      bitbuf >>= (e >> 8) & 15;
+      bitcount -= (e >> 8) & 15;
+
+      e = dt[bitbuf & ((1 << STBI__ZFAST_DIST_BITS) - 1)];
+      if (e & STBI__ZE_SUB) {
+         bitbuf >>= STBI__ZFAST_DIST_BITS;
+         bitcount -= STBI__ZFAST_DIST_BITS;
+         e = dt[(e >> 16) + (bitbuf & ((1 << ((e >> 8) & 15)) - 1))];
+      }
+      if (!(e & 255)) {
+         ret = stbi__err("bad huffman code","Corrupt PNG");
+         break;
+      }
+      bitbuf >>= e & 255;
+      bitcount -= e & 255;
+      dist = (int) (e >> 16) + (int) (bitbuf & ((1 << ((e >> 8) & 15)) - 1));
+      bitbuf >>= (e >> 8) & 15;
+      bitcount -= (e >> 8) & 15;
+
+      if (out - (stbi_uc *) a->zout_start < dist) {
+         ret = stbi__err("bad dist","Corrupt PNG");
+         break;
+      }
+      src = out - dist;
+      if (dist >= 8) { // a word at a time, maybe a few bytes over the end
+         stbi_uc *end = out + len;
+         do {
+            memcpy(out, src, 8);
+            out += 8;
+            src += 8;
+         } while (out < end);
+         out = end;
+      } else if (dist == 1) {
+         memset(out, *src, len);
+         out += len;
+      } else {
+         do *out++ = *src++; while (--len);
+      }
+   }
+
+   // hand back the whole bytes still in the bit buffer
+   in -= bitcount >> 3;
+   bitcount &= 7;
+   a->code_buffer = (stbi__uint32) (bitbuf & ((1 << bitcount) - 1));
+   a->num_bits = bitcount;
+   a->zbuffer = (stbi_uc *) in;
+   a->zout = (char *) out;
+   return ret;
+}
+
 static int stbi__parse_huffman_block(stbi__zbuf *a)
 {
    char *zout = a->zout;
    for(;;) {
-      int z = stbi__zhuffman_decode(a, &a->z_length);
+      int z;
+      if (a->z_fast) {
+         a->zout = zout;
+         z = stbi__zfast_block(a);
+         if (z != 2) return z;
+         zout = a->zout;
+      }
+      z = stbi__zhuffman_decode(a, &a->z_length);
       if (z < 256) {
          if (z < 0) return stbi__err("bad huffman code","Corrupt PNG"); // error in huffman codes
          if (zout >= a->zout_end) {
@@ -4271,6 +6657,7 @@ static int stbi__compute_huffman_codes(stbi__zbuf *a)
    if (n != ntot) return stbi__err("bad codelengths","Corrupt PNG");
    if (!stbi__zbuild_huffman(&a->z_length, lencodes, hlit)) return 0;
    if (!stbi__zbuild_huffman(&a->z_distance, lencodes+hlit, hdist)) return 0;
+   stbi__zbuild_fast_tables(a, lencodes, hlit, lencodes+hlit, hdist);
    return 1;
 }
 
@@ -4365,21 +6752,25 @@ static int stbi__parse_zlib(stbi__zbuf *a, int parse_header)
             // use fixed code lengths
             if (!stbi__zbuild_huffman(&a->z_length  , stbi__zdefault_length  , 288)) return 0;
             if (!stbi__zbuild_huffman(&a->z_distance, stbi__zdefault_distance,  32)) return 0;
+            stbi__zbuild_fast_tables(a, stbi__zdefault_length, 288, stbi__zdefault_distance, 32);
          } else {
             if (!stbi__compute_huffman_codes(a)) return 0;
          }
          if (!stbi__parse_huffman_block(a)) return 0;
       }
-   } while (!final);
+   } while (!final && !(a->z_want && a->zout - a->zout_start >= a->z_want));
    return 1;
 }
 
-static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header)
+static int stbi__do_zlib(stbi__zbuf *a, char *obuf, int olen, int exp, int parse_header, int want, int temp)
 {
    a->zout_start = obuf;
    a->zout       = obuf;
    a->zout_end   = obuf + olen;
    a->z_expandable = exp;
+   a->z_want     = want;
+   a->z_temp     = temp;
+   a->z_flush    = NULL;
 
    return stbi__parse_zlib(a, parse_header);
 }
@@ -4391,7 +6782,7 @@ STBIDEF char *stbi_zlib_decode_malloc_guesssize(const char *buffer, int len, int
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer + len;
-   if (stbi__do_zlib(&a, p, initial_size, 1, 1)) {
+   if (stbi__do_zlib(&a, p, initial_size, 1, 1, 0, 0)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
@@ -4405,28 +6796,63 @@ STBIDEF char *stbi_zlib_decode_malloc(char const *buffer, int len, int *outlen)
    return stbi_zlib_decode_malloc_guesssize(buffer, len, 16384, outlen);
 }
 
-STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
+// inflates at least the first want bytes of the stream, or all of it if want
+// is 0, into a temporary buffer if temp is set
+static char *stbi__zlib_decode_malloc_prefix(const char *buffer, int len, int initial_size, int *outlen, int parse_header, int want, int temp)
 {
    stbi__zbuf a;
-   char *p = (char *) stbi__malloc(initial_size);
+   char *p = (char *) (temp ? stbi__temp_malloc(initial_size) : stbi__malloc(initial_size));
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer + len;
-   if (stbi__do_zlib(&a, p, initial_size, 1, parse_header)) {
+   if (stbi__do_zlib(&a, p, initial_size, 1, parse_header, want, temp)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
-      STBI_FREE(a.zout_start);
+      if (temp)
+         stbi__temp_free(a.zout_start);
+      else
+         STBI_FREE(a.zout_start);
       return NULL;
    }
 }
 
+// inflates through a buffer of about initial_size bytes, handing the output
+// to flush as it fills up; the last call has final set
+static int stbi__zlib_decode_stream(const char *buffer, int len, int initial_size, int parse_header,
+                                    int (*flush)(void *user, stbi_uc *data, int len, int final), void *user)
+{
+   stbi__zbuf a;
+   int ok;
+   char *p = (char *) stbi__temp_malloc(initial_size);
+   if (p == NULL) return stbi__err("outofmem", "Out of memory");
+   a.zbuffer = (stbi_uc *) buffer;
+   a.zbuffer_end = (stbi_uc *) buffer + len;
+   a.zout_start = a.zout = p;
+   a.zout_end = p + initial_size;
+   a.z_expandable = 1;
+   a.z_want = 0;
+   a.z_temp = 1;
+   a.z_flush = flush;
+   a.z_flush_user = user;
+   a.z_flushed = 0;
+   ok = stbi__parse_zlib(&a, parse_header) &&
+        flush(user, (stbi_uc *) a.zout_start + a.z_flushed, (int) (a.zout - a.zout_start) - a.z_flushed, 1) >= 0;
+   stbi__temp_free(a.zout_start);
+   return ok;
+}
+
+STBIDEF char *stbi_zlib_decode_malloc_guesssize_headerflag(const char *buffer, int len, int initial_size, int *outlen, int parse_header)
+{
+   return stbi__zlib_decode_malloc_prefix(buffer, len, initial_size, outlen, parse_header, 0, 0);
+}
+
 STBIDEF int stbi_zlib_decode_buffer(char *obuffer, int olen, char const *ibuffer, int ilen)
 {
    stbi__zbuf a;
    a.zbuffer = (stbi_uc *) ibuffer;
    a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
-   if (stbi__do_zlib(&a, obuffer, olen, 0, 1))
+   if (stbi__do_zlib(&a, obuffer, olen, 0, 1, 0, 0))
       return (int) (a.zout - a.zout_start);
    else
       return -1;
@@ -4439,7 +6865,7 @@ STBIDEF char *stbi_zlib_decode_noheader_malloc(char const *buffer, int len, int
    if (p == NULL) return NULL;
    a.zbuffer = (stbi_uc *) buffer;
    a.zbuffer_end = (stbi_uc *) buffer+len;
-   if (stbi__do_zlib(&a, p, 16384, 1, 0)) {
+   if (stbi__do_zlib(&a, p, 16384, 1, 0, 0, 0)) {
       if (outlen) *outlen = (int) (a.zout - a.zout_start);
       return a.zout_start;
    } else {
@@ -4453,7 +6879,7 @@ STBIDEF int stbi_zlib_decode_noheader_buffer(char *obuffer, int olen, const char
    stbi__zbuf a;
    a.zbuffer = (stbi_uc *) ibuffer;
    a.zbuffer_end = (stbi_uc *) ibuffer + ilen;
-   if (stbi__do_zlib(&a, obuffer, olen, 0, 0))
+   if (stbi__do_zlib(&a, obuffer, olen, 0, 0, 0, 0))
       return (int) (a.zout - a.zout_start);
    else
       return -1;
@@ -4499,6 +6925,7 @@ typedef struct
    stbi__context *s;
    stbi_uc *idata, *expanded, *out;
    int depth;
+   int flipped; // out was stored bottom-up
 } stbi__png;
 
 
@@ -4533,10 +6960,189 @@ static int stbi__paeth(int a, int b, int c)
    return c;
 }
 
+// unfilter kernels: n bytes of a scanline from its second pixel on, with
+// bpp bytes per pixel; cur[-bpp] and prior[-bpp] are the pixels before
+typedef void (*stbi__unfilter_kernel)(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int n, int bpp);
+
+static void stbi__unfilter_sub(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int n, int bpp)
+{
+   int k;
+   STBI_NOTUSED(prior);
+   for (k=0; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + cur[k-bpp]);
+}
+
+static void stbi__unfilter_up(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int n, int bpp)
+{
+   int k;
+   STBI_NOTUSED(bpp);
+   for (k=0; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + prior[k]);
+}
+
+static void stbi__unfilter_avg(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int n, int bpp)
+{
+   int k;
+   for (k=0; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-bpp])>>1));
+}
+
+static void stbi__unfilter_paeth(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int n, int bpp)
+{
+   int k;
+   for (k=0; k < n; ++k) cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-bpp],prior[k],prior[k-bpp]));
+}
+
+#ifdef STBI_SSE2
+// SSE2 unfiltering for 3 and 4 bytes per pixel. Up goes 16 bytes at a time
+// and Sub as a prefix sum over the pixels in 16 bytes; Avg and Paeth depend
+// on the pixel just done, so they go a pixel at a time, all its bytes at once.
+// There's no AVX2 version: Up is bound by memory and the carry of Sub has to
+// cross lanes, and both measured slower than these
+stbi_inline static __m128i stbi__load_pixel_sse2(const stbi_uc *p, int bpp)
+{
+   // never reads past the pixel: with 3 bytes, the next one may not be written yet
+   stbi__uint32 v = p[0] | p[1] << 8 | p[2] << 16;
+   if (bpp == 4)
+      v |= (stbi__uint32) p[3] << 24; // unsigned: alpha >= 128 would overflow an int
+   return _mm_cvtsi32_si128((int) v);
+}
+
+stbi_inline static __m128i stbi__load32_sse2(const stbi_uc *p)
+{
+   int v;
+   memcpy(&v, p, 4);
+   return _mm_cvtsi32_si128(v);
+}
+
+stbi_inline static void stbi__store32_sse2(stbi_uc *p, __m128i x)
+{
+   int v = _mm_cvtsi128_si32(x);
+   memcpy(p, &v, 4);
+}
+
+static void stbi__unfilter_up_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int n, int bpp)
+{
+   int k;
+   for (k=0; k+16 <= n; k += 16)
+      _mm_storeu_si128((__m128i *) (cur+k), _mm_add_epi8(_mm_loadu_si128((const __m128i *) (raw+k)),
+                                                         _mm_loadu_si128((const __m128i *) (prior+k))));
+   stbi__unfilter_up(cur+k, raw+k, prior+k, n-k, bpp);
+}
+
+// a 3-byte pixel in the low bytes, repeated over the first 15
+stbi_inline static __m128i stbi__spread3_sse2(__m128i x)
+{
+   x = _mm_and_si128(x, _mm_cvtsi32_si128(0xffffff));
+   x = _mm_or_si128(x, _mm_slli_si128(x, 3));
+   x = _mm_or_si128(x, _mm_slli_si128(x, 6));
+   return _mm_or_si128(x, _mm_slli_si128(x, 12));
+}
+
+static void stbi__unfilter_sub_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int n, int bpp)
+{
+   int k = 0;
+   if (bpp == 4) {
+      __m128i carry = _mm_shuffle_epi32(stbi__load_pixel_sse2(cur-4, 4), 0);
+      for (; k+16 <= n; k += 16) {
+         __m128i d = _mm_loadu_si128((const __m128i *) (raw+k));
+         d = _mm_add_epi8(d, _mm_slli_si128(d, 4));
+         d = _mm_add_epi8(d, _mm_slli_si128(d, 8));
+         d = _mm_add_epi8(d, carry);
+         _mm_storeu_si128((__m128i *) (cur+k), d);
+         carry = _mm_shuffle_epi32(d, 0xff);
+      }
+   } else if (bpp == 3) {
+      // five pixels per 16 bytes, the last byte is junk rewritten next round
+      __m128i carry = stbi__spread3_sse2(stbi__load_pixel_sse2(cur-3, 3));
+      for (; k+16 <= n; k += 15) {
+         __m128i d = _mm_loadu_si128((const __m128i *) (raw+k));
+         d = _mm_add_epi8(d, _mm_slli_si128(d, 3));
+         d = _mm_add_epi8(d, _mm_slli_si128(d, 6));
+         d = _mm_add_epi8(d, _mm_slli_si128(d, 12));
+         d = _mm_add_epi8(d, carry);
+         _mm_storeu_si128((__m128i *) (cur+k), d);
+         carry = stbi__spread3_sse2(_mm_srli_si128(d, 12));
+      }
+   }
+   stbi__unfilter_sub(cur+k, raw+k, prior+k, n-k, bpp);
+}
+
+static void stbi__unfilter_avg_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int n, int bpp)
+{
+   int k;
+   __m128i one = _mm_set1_epi8(1);
+   __m128i a = stbi__load_pixel_sse2(cur-bpp, bpp);
+   // 4 bytes per pixel, so with 3 the last one is junk rewritten next pixel
+   for (k=0; k+4 <= n; k += bpp) {
+      __m128i b = stbi__load32_sse2(prior+k);
+      // _mm_avg_epu8 rounds up: take the low bit back off where it did
+      __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+      a = _mm_add_epi8(stbi__load32_sse2(raw+k), avg);
+      stbi__store32_sse2(cur+k, a);
+   }
+   stbi__unfilter_avg(cur+k, raw+k, prior+k, n-k, bpp);
+}
+
+static void stbi__unfilter_paeth_sse2(stbi_uc *cur, const stbi_uc *raw, const stbi_uc *prior, int n, int bpp)
+{
+   int k;
+   __m128i zero = _mm_setzero_si128();
+   __m128i a = _mm_unpacklo_epi8(stbi__load_pixel_sse2(cur-bpp, bpp), zero);
+   __m128i c = _mm_unpacklo_epi8(stbi__load_pixel_sse2(prior-bpp, bpp), zero);
+   for (k=0; k+4 <= n; k += bpp) {
+      __m128i b = _mm_unpacklo_epi8(stbi__load32_sse2(prior+k), zero);
+      // with p = a+b-c: |p-a| = |b-c|, |p-b| = |a-c|, |p-c| = |b-c + a-c|
+      __m128i pa = _mm_sub_epi16(b, c);
+      __m128i pb = _mm_sub_epi16(a, c);
+      __m128i pc = _mm_add_epi16(pa, pb);
+      __m128i smallest, use_a, use_b, nearest;
+      pa = _mm_max_epi16(pa, _mm_sub_epi16(zero, pa));
+      pb = _mm_max_epi16(pb, _mm_sub_epi16(zero, pb));
+      pc = _mm_max_epi16(pc, _mm_sub_epi16(zero, pc));
+      // ties go to a, then b, as in stbi__paeth
+      smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+      use_a = _mm_cmpeq_epi16(smallest, pa);
+      use_b = _mm_andnot_si128(use_a, _mm_cmpeq_epi16(smallest, pb));
+      nearest = _mm_or_si128(_mm_or_si128(_mm_and_si128(use_a, a), _mm_and_si128(use_b, b)),
+                             _mm_andnot_si128(_mm_or_si128(use_a, use_b), c));
+      a = _mm_add_epi8(stbi__load32_sse2(raw+k), _mm_packus_epi16(nearest, nearest));
+      stbi__store32_sse2(cur+k, a);
+      a = _mm_unpacklo_epi8(a, zero);
+      c = b;
+   }
+   stbi__unfilter_paeth(cur+k, raw+k, prior+k, n-k, bpp);
+}
+#endif // STBI_SSE2
+
+// kernels for each filter, the SIMD ones for 3 or 4 bytes per pixel
+static void stbi__png_unfilter_kernels(stbi__unfilter_kernel *kernels, int bpp)
+{
+   kernels[STBI__F_none]  = NULL; // a memcpy
+   kernels[STBI__F_sub]   = stbi__unfilter_sub;
+   kernels[STBI__F_up]    = stbi__unfilter_up;
+   kernels[STBI__F_avg]   = stbi__unfilter_avg;
+   kernels[STBI__F_paeth] = stbi__unfilter_paeth;
+   if (bpp != 3 && bpp != 4) return;
+
+#ifdef STBI_SSE2
+   if (stbi_simd_level() >= STBI_SIMD_SSE2) {
+      kernels[STBI__F_sub]   = stbi__unfilter_sub_sse2;
+      kernels[STBI__F_up]    = stbi__unfilter_up_sse2;
+      kernels[STBI__F_avg]   = stbi__unfilter_avg_sse2;
+      kernels[STBI__F_paeth] = stbi__unfilter_paeth_sse2;
+   }
+#endif
+}
+
 static const stbi_uc stbi__depth_scale_table[9] = { 0, 0xff, 0x55, 0, 0x11, 0,0,0, 0x01 };
 
 // create the png data from post-deflated data
-static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color)
+// prior_row is NULL for a whole image. Decoding in batches, it holds the
+// scanline above the first one, unfiltered (zeros for the top of the image),
+// and gets the last one
+// rows are stored bottom-up if flip is set. With conv_n, 8-bit rows are
+// unfiltered into a two-row ring and converted to conv_n components on their
+// way to a->out
+static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 raw_len, int out_n, stbi__uint32 x, stbi__uint32 y, int depth, int color, stbi_uc *prior_row,
+                                      int flip, int conv_n)
 {
    int bytes = (depth == 16? 2 : 1);
    stbi__context *s = a->s;
@@ -4548,9 +7154,17 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    int output_bytes = out_n*bytes;
    int filter_bytes = img_n*bytes;
    int width = x;
+   stbi__unfilter_kernel unfilter[5];
+   stbi_uc *ring = NULL, *last = NULL;
+   stbi__convert_kernel simd = NULL;
 
    STBI_ASSERT(out_n == s->img_n || out_n == s->img_n+1);
-   a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   if (conv_n) {
+      STBI_ASSERT(depth == 8 && out_n == img_n && !prior_row);
+      a->out = (stbi_uc *) stbi__malloc_mad3(x, y, conv_n, 0);
+   } else {
+      a->out = (stbi_uc *) stbi__malloc_mad3(x, y, output_bytes, 0); // extra bytes to write off the end into
+   }
    if (!a->out) return stbi__err("outofmem", "Out of memory");
 
    if (!stbi__mad3sizes_valid(img_n, x, depth, 7)) return stbi__err("too large", "Corrupt PNG");
@@ -4562,13 +7176,23 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    // so just check for raw_len < img_len always.
    if (raw_len < img_len) return stbi__err("not enough pixels","Corrupt PNG");
 
+   if (conv_n) {
+      ring = (stbi_uc *) stbi__temp_malloc_mad2(2, stride, 0);
+      if (!ring) return stbi__err("outofmem", "Out of memory");
+      simd = stbi__convert_row_kernel(img_n, conv_n);
+   }
+
+   stbi__png_unfilter_kernels(unfilter, depth < 8 ? 1 : filter_bytes);
    for (j=0; j < y; ++j) {
-      stbi_uc *cur = a->out + stride*j;
+      stbi_uc *row = ring ? ring + stride*(j&1) : a->out + stride*(flip ? y-1-j : j);
+      stbi_uc *cur = row;
       stbi_uc *prior;
       int filter = *raw++;
 
-      if (filter > 4)
+      if (filter > 4) {
+         stbi__temp_free(ring);
          return stbi__err("invalid filter","Corrupt PNG");
+      }
 
       if (depth < 8) {
          if (img_width_bytes > x) return stbi__err("invalid width","Corrupt PNG");
@@ -4576,10 +7200,14 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          filter_bytes = 1;
          width = img_width_bytes;
       }
-      prior = cur - stride; // bugfix: need to compute this after 'cur +=' computation above
+      // bugfix: need to compute this after 'cur +=' computation above
+      if (j == 0)
+         prior = prior_row ? prior_row + (cur - row) : cur; // not read without prior_row, see below
+      else
+         prior = last + (cur - row);
 
       // if first row, use special filter that doesn't sample previous row
-      if (j == 0) filter = first_row_filter[filter];
+      if (j == 0 && !prior_row) filter = first_row_filter[filter];
 
       // handle first byte explicitly
       for (k=0; k < filter_bytes; ++k) {
@@ -4623,10 +7251,10 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          switch (filter) {
             // "none" filter turns into a memcpy here; make that explicit.
             case STBI__F_none:         memcpy(cur, raw, nk); break;
-            STBI__CASE(STBI__F_sub)          { cur[k] = STBI__BYTECAST(raw[k] + cur[k-filter_bytes]); } break;
-            STBI__CASE(STBI__F_up)           { cur[k] = STBI__BYTECAST(raw[k] + prior[k]); } break;
-            STBI__CASE(STBI__F_avg)          { cur[k] = STBI__BYTECAST(raw[k] + ((prior[k] + cur[k-filter_bytes])>>1)); } break;
-            STBI__CASE(STBI__F_paeth)        { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],prior[k],prior[k-filter_bytes])); } break;
+            case STBI__F_sub:
+            case STBI__F_up:
+            case STBI__F_avg:
+            case STBI__F_paeth:        unfilter[filter](cur, raw, prior, nk, filter_bytes); break;
             STBI__CASE(STBI__F_avg_first)    { cur[k] = STBI__BYTECAST(raw[k] + (cur[k-filter_bytes] >> 1)); } break;
             STBI__CASE(STBI__F_paeth_first)  { cur[k] = STBI__BYTECAST(raw[k] + stbi__paeth(cur[k-filter_bytes],0,0)); } break;
          }
@@ -4652,14 +7280,22 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
          // the loop above sets the high byte of the pixels' alpha, but for
          // 16 bit png files we also need the low byte set. we'll do that here.
          if (depth == 16) {
-            cur = a->out + stride*j; // start at the beginning of the row again
+            cur = row; // start at the beginning of the row again
             for (i=0; i < x; ++i,cur+=output_bytes) {
                cur[filter_bytes+1] = 255;
             }
          }
       }
+
+      if (ring)
+         stbi__convert_row(row, a->out + (size_t) x*conv_n*(flip ? y-1-j : j), img_n, conv_n, x, simd);
+      last = row;
    }
 
+   stbi__temp_free(ring);
+   if (prior_row)
+      memcpy(prior_row, last, stride);
+
    // we make a separate pass to expand bits to pixels; for performance,
    // this could run two scanlines behind the above code, so it won't
    // intefere with filtering but will still be in the cache.
@@ -4748,14 +7384,17 @@ static int stbi__create_png_image_raw(stbi__png *a, stbi_uc *raw, stbi__uint32 r
    return 1;
 }
 
-static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced)
+// conv_n as for stbi__create_png_image_raw(), only for non-interlaced images
+static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint32 image_data_len, int out_n, int depth, int color, int interlaced,
+                                  int flip, int conv_n)
 {
    int bytes = (depth == 16 ? 2 : 1);
    int out_bytes = out_n * bytes;
    stbi_uc *final;
    int p;
    if (!interlaced)
-      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color);
+      return stbi__create_png_image_raw(a, image_data, image_data_len, out_n, a->s->img_x, a->s->img_y, depth, color, NULL, flip, conv_n);
+   STBI_ASSERT(!conv_n);
 
    // de-interlacing
    final = (stbi_uc *) stbi__malloc_mad3(a->s->img_x, a->s->img_y, out_bytes, 0);
@@ -4770,7 +7409,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
       y = (a->s->img_y - yorig[p] + yspc[p]-1) / yspc[p];
       if (x && y) {
          stbi__uint32 img_len = ((((a->s->img_n * x * depth) + 7) >> 3) + 1) * y;
-         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color)) {
+         if (!stbi__create_png_image_raw(a, image_data, image_data_len, out_n, x, y, depth, color, NULL, 0, 0)) {
             STBI_FREE(final);
             return 0;
          }
@@ -4778,6 +7417,7 @@ static int stbi__create_png_image(stbi__png *a, stbi_uc *image_data, stbi__uint3
             for (i=0; i < x; ++i) {
                int out_y = j*yspc[p]+yorig[p];
                int out_x = i*xspc[p]+xorig[p];
+               if (flip) out_y = a->s->img_y-1 - out_y;
                memcpy(final + out_y*a->s->img_x*out_bytes + out_x*out_bytes,
                       a->out + (j*x+i)*out_bytes, out_bytes);
             }
@@ -4937,18 +7577,142 @@ static void stbi__de_iphone(stbi__png *z)
 
 #define STBI__PNG_TYPE(a,b,c,d)  (((unsigned) (a) << 24) + ((unsigned) (b) << 16) + ((unsigned) (c) << 8) + (unsigned) (d))
 
+// streaming: scanlines are unfiltered and handed out in batches straight
+// out of inflate, which slides its window along instead of keeping them all
+typedef struct
+{
+   stbi__png *z;
+   stbi__row_sink *sink;
+   stbi_uc *palette, *tc;
+   stbi__uint16 *tc16;
+   int pal_len, pal_img_n, has_trans, is_iphone, req_comp, color;
+   int img_n, out_n;  // channels in the file, and out of unfiltering
+   int row_bytes;     // a scanline as inflated: filter byte and pixels
+   int batch;         // scanlines per batch
+   int y;             // scanlines done
+   stbi_uc *prior;    // the last one, unfiltered
+} stbi__png_stream;
+
+// unfilters rows scanlines and takes them through the same passes as a whole
+// image, from tRNS to the requested channels, on to the sink
+static int stbi__png_stream_batch(stbi__png_stream *st, stbi_uc *raw, int rows)
+{
+   stbi__png *z = st->z;
+   stbi__context *s = z->s;
+   stbi__uint32 img_y = s->img_y;
+   int ok, out_n = st->out_n;
+   void *out;
+
+   // the passes below work on s->img_y rows of z->out: this batch
+   s->img_y = rows;
+   s->img_n = st->img_n;
+   s->img_out_n = out_n;
+   ok = stbi__create_png_image_raw(z, raw, rows * st->row_bytes, out_n, s->img_x, rows, z->depth, st->color, st->prior, 0, 0);
+   if (ok && st->has_trans) {
+      if (z->depth == 16)
+         ok = stbi__compute_transparency16(z, st->tc16, out_n);
+      else
+         ok = stbi__compute_transparency(z, st->tc, out_n);
+   }
+   if (ok && st->is_iphone && stbi__de_iphone_flag && out_n > 2)
+      stbi__de_iphone(z);
+   if (ok && st->pal_img_n) {
+      out_n = st->req_comp >= 3 ? st->req_comp : st->pal_img_n;
+      ok = stbi__expand_png_palette(z, st->palette, st->pal_len, out_n);
+   }
+   out = z->out;
+   z->out = NULL;
+   if (ok && st->req_comp && st->req_comp != out_n) {
+      if (z->depth == 16)
+         out = stbi__convert_format16((stbi__uint16 *) out, out_n, st->req_comp, s->img_x, rows);
+      else
+         out = stbi__convert_format((unsigned char *) out, out_n, st->req_comp, s->img_x, rows);
+      out_n = st->req_comp;
+      ok = out != NULL;
+   }
+   if (ok && z->depth == 16) {
+      out = stbi__convert_16_to_8((stbi__uint16 *) out, s->img_x, rows, out_n);
+      ok = out != NULL;
+   }
+   s->img_y = img_y;
+   if (ok)
+      ok = stbi__sink_rows(st->sink, (stbi_uc *) out, st->y, rows);
+   STBI_FREE(out);
+   st->y += rows;
+   return ok;
+}
+
+// inflate output: takes the complete scanlines, in whole batches until the end
+static int stbi__png_stream_flush(void *user, stbi_uc *data, int len, int final)
+{
+   stbi__png_stream *st = (stbi__png_stream *) user;
+   int used = 0, rows = st->z->s->img_y - st->y;
+   if (!rows) return len; // trailing data
+   while (rows) {
+      int n = rows < st->batch ? rows : st->batch;
+      if ((len - used) / st->row_bytes < n) {
+         if (!final) break;
+         n = (len - used) / st->row_bytes;
+         if (!n) return stbi__err("not enough pixels","Corrupt PNG") - 1;
+      }
+      if (!stbi__png_stream_batch(st, data + used, n)) return -1;
+      used += n * st->row_bytes;
+      rows -= n;
+   }
+   return used;
+}
+
+static int stbi__png_stream_image(stbi__png_stream *st, stbi_uc *idata, stbi__uint32 idata_len)
+{
+   stbi__png *z = st->z;
+   stbi__context *s = z->s;
+   int channels, ok, bytes = z->depth == 16 ? 2 : 1;
+
+   st->img_n = s->img_n;
+   if ((st->req_comp == s->img_n+1 && st->req_comp != 3 && !st->pal_img_n) || st->has_trans)
+      st->out_n = s->img_n+1;
+   else
+      st->out_n = s->img_n;
+   if (st->pal_img_n)
+      channels = st->req_comp >= 3 ? st->req_comp : st->pal_img_n;
+   else
+      channels = st->out_n;
+   if (st->req_comp) channels = st->req_comp;
+
+   if (!stbi__mad3sizes_valid(s->img_n, s->img_x, z->depth, 7)) return stbi__err("too large", "Corrupt PNG");
+   st->row_bytes = ((s->img_n * s->img_x * z->depth + 7) >> 3) + 1;
+   st->batch = 65536 / st->row_bytes ? 65536 / st->row_bytes : 1;
+   st->y = 0;
+   st->prior = (stbi_uc *) stbi__temp_malloc_mad2(s->img_x, st->out_n * bytes, 0);
+   if (!st->prior) return stbi__err("outofmem", "Out of memory");
+   memset(st->prior, 0, s->img_x * st->out_n * bytes);
+
+   ok = stbi__sink_begin(st->sink, s->img_x, s->img_y, channels) &&
+        stbi__zlib_decode_stream((char *) idata, idata_len, 32768 + 65536 + 2 * st->batch * st->row_bytes,
+                                 !st->is_iphone, stbi__png_stream_flush, st);
+   stbi__temp_free(st->prior);
+
+   // what stbi_info would say
+   if (st->pal_img_n)
+      s->img_n = st->pal_img_n;
+   else if (st->has_trans)
+      s->img_n = st->img_n + 1;
+   return ok;
+}
+
 static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
 {
    stbi_uc palette[1024], pal_img_n=0;
    stbi_uc has_trans=0, tc[3]={0};
    stbi__uint16 tc16[3];
    stbi__uint32 ioff=0, idata_limit=0, i, pal_len=0;
-   int first=1,k,interlace=0, color=0, is_iphone=0;
+   int first=1,k,interlace=0, color=0, is_iphone=0, conv_n;
    stbi__context *s = z->s;
 
    z->expanded = NULL;
    z->idata = NULL;
    z->out = NULL;
+   z->flipped = 0;
 
    if (!stbi__check_png_header(s)) return 0;
 
@@ -5035,13 +7799,11 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (scan == STBI__SCAN_header) { s->img_n = pal_img_n; return 1; }
             if ((int)(ioff + c.length) < (int)ioff) return 0;
             if (ioff + c.length > idata_limit) {
-               stbi__uint32 idata_limit_old = idata_limit;
                stbi_uc *p;
                if (idata_limit == 0) idata_limit = c.length > 4096 ? c.length : 4096;
                while (ioff + c.length > idata_limit)
                   idata_limit *= 2;
-               STBI_NOTUSED(idata_limit_old);
-               p = (stbi_uc *) STBI_REALLOC_SIZED(z->idata, idata_limit_old, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
+               p = (stbi_uc *) stbi__temp_realloc(z->idata, idata_limit); if (p == NULL) return stbi__err("outofmem", "Out of memory");
                z->idata = p;
             }
             if (!stbi__getn(s, z->idata+ioff,c.length)) return stbi__err("outofdata","Corrupt PNG");
@@ -5054,17 +7816,55 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
             if (first) return stbi__err("first not IHDR", "Corrupt PNG");
             if (scan != STBI__SCAN_load) return 1;
             if (z->idata == NULL) return stbi__err("no IDAT","Corrupt PNG");
+            if (s->sink && !interlace) {
+               stbi__png_stream st;
+               int ok;
+               st.z = z;
+               st.sink = s->sink;
+               st.palette = palette;
+               st.pal_len = pal_len;
+               st.pal_img_n = pal_img_n;
+               st.has_trans = has_trans;
+               st.tc = tc;
+               st.tc16 = tc16;
+               st.is_iphone = is_iphone;
+               st.req_comp = req_comp;
+               st.color = color;
+               ok = stbi__png_stream_image(&st, z->idata, ioff);
+               stbi__temp_free(z->idata); z->idata = NULL;
+               if (!ok) return 0;
+               // end of PNG chunk, read and skip CRC
+               stbi__get32be(s);
+               return 1;
+            }
+            if (s->roi_w && !interlace) {
+               // region: scanlines past its last one are neither inflated nor
+               // unfiltered, the image just ends there. The crop does the rest
+               int rx = s->roi_x, ry = s->roi_y, rw = s->roi_w, rh = s->roi_h;
+               if (!stbi__clip_region(&rx, &ry, &rw, &rh, s->img_x, s->img_y))
+                  return stbi__err("bad region", "Region outside the image");
+               s->img_y = ry + rh;
+            }
             // initial guess for decoded data size to avoid unnecessary reallocs
             bpl = (s->img_x * z->depth + 7) / 8; // bytes per line, per component
             raw_len = bpl * s->img_y * s->img_n /* pixels */ + s->img_y /* filter mode per row */;
-            z->expanded = (stbi_uc *) stbi_zlib_decode_malloc_guesssize_headerflag((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone);
+            z->expanded = (stbi_uc *) stbi__zlib_decode_malloc_prefix((char *) z->idata, ioff, raw_len, (int *) &raw_len, !is_iphone,
+                                                                      s->roi_w && !interlace ? (int) raw_len : 0, 1);
             if (z->expanded == NULL) return 0; // zlib should set error
-            STBI_FREE(z->idata); z->idata = NULL;
+            stbi__temp_free(z->idata); z->idata = NULL;
             if ((req_comp == s->img_n+1 && req_comp != 3 && !pal_img_n) || has_trans)
                s->img_out_n = s->img_n+1;
             else
                s->img_out_n = s->img_n;
-            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace)) return 0;
+            // rows go straight to their place in the flipped image, unless there's
+            // a crop or downscale still to do on it. 8-bit images that need no more
+            // work per pixel are also converted to req_comp components right there
+            z->flipped = s->flip && !s->roi_w && !s->scale_shift;
+            conv_n = 0;
+            if (req_comp && req_comp != s->img_out_n && z->depth == 8 && !interlace && !pal_img_n && !has_trans && !is_iphone)
+               conv_n = req_comp;
+            if (!stbi__create_png_image(z, z->expanded, raw_len, s->img_out_n, z->depth, color, interlace, z->flipped, conv_n)) return 0;
+            if (conv_n) s->img_out_n = conv_n;
             if (has_trans) {
                if (z->depth == 16) {
                   if (!stbi__compute_transparency16(z, tc16, s->img_out_n)) return 0;
@@ -5085,7 +7885,7 @@ static int stbi__parse_png_file(stbi__png *z, int scan, int req_comp)
                // non-paletted image with tRNS -> source image has (constant) alpha
                ++s->img_n;
             }
-            STBI_FREE(z->expanded); z->expanded = NULL;
+            stbi__temp_free(z->expanded); z->expanded = NULL;
             // end of PNG chunk, read and skip CRC
             stbi__get32be(s);
             return 1;
@@ -5118,12 +7918,19 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
    void *result=NULL;
    if (req_comp < 0 || req_comp > 4) return stbi__errpuc("bad req_comp", "Internal error");
    if (stbi__parse_png_file(p, STBI__SCAN_load, req_comp)) {
+      if (!p->out) { // streamed, rows went to the sink
+         *x = p->s->img_x;
+         *y = p->s->img_y;
+         if (n) *n = p->s->img_n;
+         return NULL;
+      }
       if (p->depth <= 8)
          ri->bits_per_channel = 8;
       else if (p->depth == 16)
          ri->bits_per_channel = 16;
       else
          return stbi__errpuc("bad bits_per_channel", "PNG not supported: unsupported color depth");
+      ri->flipped = p->flipped;
       result = p->out;
       p->out = NULL;
       if (req_comp && req_comp != p->s->img_out_n) {
@@ -5139,8 +7946,8 @@ static void *stbi__do_png(stbi__png *p, int *x, int *y, int *n, int req_comp, st
       if (n) *n = p->s->img_n;
    }
    STBI_FREE(p->out);      p->out      = NULL;
-   STBI_FREE(p->expanded); p->expanded = NULL;
-   STBI_FREE(p->idata);    p->idata    = NULL;
+   stbi__temp_free(p->expanded); p->expanded = NULL;
+   stbi__temp_free(p->idata);    p->idata    = NULL;
 
    return result;
 }
@@ -5395,7 +8202,7 @@ static void *stbi__bmp_load(stbi__context *s, int *x, int *y, int *comp, int req
    }
    if (psize == 0) {
       STBI_ASSERT(info.offset == s->callback_already_read + (int) (s->img_buffer - s->img_buffer_original));
-      if (info.offset != s->callback_already_read + (s->img_buffer - s->buffer_start)) {
+      if (info.offset != s->callback_already_read + (s->img_buffer - s->img_buffer_original)) {
         return stbi__errpuc("bad offset", "Corrupt BMP");
       }
    }
@@ -0,0 +1,308 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// On-disk cache of decoded textures, mip levels included.
+//
+// Decoding a JPEG or PNG and building its mip chain again on every launch
+// is wasted work while the file doesn't change. Cache entries, in
+// TEXCACHE_DIR, are KTX-like containers: a header followed by every level,
+// already decoded, flipped and filtered, rows padded to 4 bytes as the
+// default GL_UNPACK_ALIGNMENT wants. texcache_open() maps the entry saved by
+// a previous run and texcache_tex_image() hands its levels straight to
+// glTexImage2D: no decode, no copy other than the driver's.
+//
+// Entries are named after a 64-bit FNV-1a hash of the source path and the
+// decode options (channels, flip, mip filter), and record the source's
+// size, mtime and a FNV-1a hash of its contents. Same size and mtime: the
+// entry is used as it is. Otherwise the source is hashed: the same contents
+// (a touched or copied file) only refresh the recorded mtime, different ones
+// miss the cache. On a miss the image is decoded as usual and
+// texcache_save() writes the entry for the next run.
+//
+//   texcache_t cache;
+//   if (texcache_open(&cache, "texture.jpg", 0, 1, MIPMAP_BOX)) {
+//     texcache_tex_image(&cache);  // every level, then unmapped
+//   } else {
+//     texloader_pool_submit(&loader, &image, "texture.jpg", 0, 0, 1);
+//     ... once decoded, pixels still in memory:
+//     texcache_save(&cache, &image);
+//     texloader_tex_image(&image);
+//   }
+//
+// stb_image.h must be included before this header.
+
+#ifndef TEXCACHE_H
+#define TEXCACHE_H
+
+#include <GL/glew.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "texloader.h"
+
+#ifndef TEXCACHE_DIR
+#define TEXCACHE_DIR ".glcache"
+#endif
+
+#define TEXCACHE_MAGIC 0x58544c47 // "GLTX"
+#define TEXCACHE_VERSION 1
+#define TEXCACHE_MAX_LEVELS 32
+
+typedef struct {
+  unsigned int magic;
+  unsigned int version;
+  unsigned long long source_size;
+  long long source_mtime;       // ns since the epoch
+  unsigned long long source_hash;
+  int width, height, channels;  // of level 0
+  int flip;
+  int mipmaps;                  // mipmap_filter_t the levels were built with
+  int levels;                   // level 0 included
+  unsigned long long offset[TEXCACHE_MAX_LEVELS]; // of each level in the file
+} texcache_header_t;
+
+// A cache lookup, mapped entry on a hit
+typedef struct {
+  char filename[256];           // entry file
+  const char *source;
+  int desired_channels, flip;
+  mipmap_filter_t mipmaps;
+  int source_ok;                // source found: size and mtime are valid
+  unsigned long long source_size;
+  long long source_mtime;
+  int hashed;                   // source_hash computed
+  unsigned long long source_hash;
+  const unsigned char *map;     // mapped entry, NULL on a miss
+  size_t map_size;
+  double open_ms;               // time spent looking the entry up
+} texcache_t;
+
+static inline double texcache_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// 64-bit FNV-1a
+static inline unsigned long long texcache_hash(unsigned long long h, const void *data, size_t n) {
+  const unsigned char *p = (const unsigned char *) data;
+  for (size_t i = 0; i < n; i++) {
+    h ^= p[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Hashes the source's contents, through a mapping. Returns 0 if unreadable
+static inline int texcache_hash_source(texcache_t *cache) {
+  if (cache->hashed)
+    return 1;
+
+  int fd = open(cache->source, O_RDONLY);
+  if (fd < 0)
+    return 0;
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && st.st_size > 0)
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+    return 0;
+
+  cache->source_hash = texcache_hash(0xcbf29ce484222325ULL, data, st.st_size);
+  cache->hashed = 1;
+  munmap(data, st.st_size);
+  return 1;
+}
+
+// Row stride of a level: padded to 4 bytes, like GL_UNPACK_ALIGNMENT
+static inline size_t texcache_stride(int width, int channels) {
+  return ((size_t) width * channels + 3) & ~(size_t) 3;
+}
+
+// The mapped entry is a well-formed one for the lookup's options
+static inline int texcache_check(const texcache_t *cache) {
+  const texcache_header_t *header = (const texcache_header_t *) cache->map;
+
+  if (cache->map_size < sizeof(*header) || header->magic != TEXCACHE_MAGIC ||
+      header->version != TEXCACHE_VERSION || header->width < 1 || header->height < 1 ||
+      header->channels < 1 || header->channels > 4 || header->flip != cache->flip ||
+      header->mipmaps != (int) cache->mipmaps || header->levels < 1 ||
+      header->levels > TEXCACHE_MAX_LEVELS ||
+      (cache->desired_channels && header->channels != cache->desired_channels))
+    return 0;
+
+  int width = header->width, height = header->height;
+  for (int i = 0; i < header->levels; i++) {
+    size_t size = texcache_stride(width, header->channels) * height;
+    if (header->offset[i] > cache->map_size || size > cache->map_size - header->offset[i])
+      return 0;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+  return 1;
+}
+
+// Looks the entry for source up, decoded to desired_channels (0: as many
+// as the file has), flipped or not and with mip levels built with mipmaps.
+// Returns 1 on a hit, with the entry mapped
+static inline int texcache_open(texcache_t *cache, const char *source, int desired_channels,
+                                int flip, mipmap_filter_t mipmaps) {
+  double t0 = texcache_clock();
+
+  memset(cache, 0, sizeof(*cache));
+  cache->source = source;
+  cache->desired_channels = desired_channels;
+  cache->flip = flip;
+  cache->mipmaps = mipmaps;
+
+  // Entry name: the source path and every option that changes the pixels
+  int options[3] = { desired_channels, flip, (int) mipmaps };
+  unsigned long long key = texcache_hash(0xcbf29ce484222325ULL, source, strlen(source) + 1);
+  key = texcache_hash(key, options, sizeof(options));
+  snprintf(cache->filename, sizeof(cache->filename), "%s/%016llx.tex", TEXCACHE_DIR, key);
+
+  struct stat st;
+  if (stat(source, &st) == 0) {
+    cache->source_ok = 1;
+    cache->source_size = st.st_size;
+    cache->source_mtime = st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+  }
+
+  int fd = open(cache->filename, O_RDWR);
+  if (fd >= 0) {
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map != MAP_FAILED) {
+      cache->map = (const unsigned char *) map;
+      cache->map_size = st.st_size;
+    }
+
+    const texcache_header_t *header = (const texcache_header_t *) cache->map;
+    if (cache->map && (!cache->source_ok || !texcache_check(cache) ||
+                       header->source_size != cache->source_size)) {
+      munmap((void *) cache->map, cache->map_size);
+      cache->map = NULL;
+    }
+
+    // Same size, different mtime: only a different hash invalidates it.
+    // Otherwise record the new mtime, so the next run doesn't hash again
+    if (cache->map && header->source_mtime != cache->source_mtime) {
+      if (texcache_hash_source(cache) && cache->source_hash == header->source_hash) {
+        if (pwrite(fd, &cache->source_mtime, sizeof(cache->source_mtime),
+                   offsetof(texcache_header_t, source_mtime)) < 0)
+          perror(cache->filename);
+      } else {
+        munmap((void *) cache->map, cache->map_size);
+        cache->map = NULL;
+      }
+    }
+    close(fd);
+  }
+
+  cache->open_ms = (texcache_clock() - t0) * 1e3;
+  return cache->map != NULL;
+}
+
+// Uploads every level of a hit to the texture bound to GL_TEXTURE_2D and
+// unmaps the entry. An entry saved without its mip levels (they failed to
+// build) gets them from glGenerateMipmap()
+static inline void texcache_tex_image(texcache_t *cache) {
+  const texcache_header_t *header = (const texcache_header_t *) cache->map;
+  GLenum format = texloader_format(header->channels);
+  int width = header->width, height = header->height;
+
+  glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+  for (int i = 0; i < header->levels; i++) {
+    glTexImage2D(GL_TEXTURE_2D, i, format, width, height, 0, format, GL_UNSIGNED_BYTE,
+                 cache->map + header->offset[i]);
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+  if (header->mipmaps && header->levels == 1 && (header->width > 1 || header->height > 1))
+    glGenerateMipmap(GL_TEXTURE_2D);
+
+  munmap((void *) cache->map, cache->map_size);
+  cache->map = NULL;
+}
+
+// Writes the entry for a missed lookup from its decoded image, pixels and
+// mip levels still in memory (not in a pixel buffer nor compressed). Written to a
+// temporary file and renamed, so concurrent runs never see half-written
+// entries, and the mapping of an older one stays valid. Returns 1 if saved
+static inline int texcache_save(texcache_t *cache, const texloader_image_t *image) {
+  texcache_header_t header;
+
+  if (!cache->source_ok || !image->data || image->pbo || image->compressed_levels ||
+      !texcache_hash_source(cache))
+    return 0;
+
+  memset(&header, 0, sizeof(header));
+  header.magic = TEXCACHE_MAGIC;
+  header.version = TEXCACHE_VERSION;
+  header.source_size = cache->source_size;
+  header.source_mtime = cache->source_mtime;
+  header.source_hash = cache->source_hash;
+  header.width = image->width;
+  header.height = image->height;
+  header.channels = image->channels;
+  header.flip = cache->flip;
+  header.mipmaps = (int) cache->mipmaps;
+  header.levels = image->mips ? mipmap_levels(image->width, image->height) + 1 : 1;
+  if (header.levels > TEXCACHE_MAX_LEVELS)
+    return 0;
+
+  // Levels start 16-byte aligned, the last one ends the file
+  unsigned long long offset = (sizeof(header) + 15) & ~15ULL;
+  int width = image->width, height = image->height;
+  for (int i = 0; i < header.levels; i++) {
+    header.offset[i] = offset;
+    offset += (texcache_stride(width, image->channels) * height + 15) & ~(size_t) 15;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+
+  char tmpname[300];
+  snprintf(tmpname, sizeof(tmpname), "%s.%d", cache->filename, (int) getpid());
+  mkdir(TEXCACHE_DIR, 0755);
+  FILE *f = fopen(tmpname, "wb");
+  if (!f)
+    return 0;
+
+  static const unsigned char zeros[16];
+  int ok = fwrite(&header, sizeof(header), 1, f) == 1;
+  const unsigned char *level = image->data;
+  width = image->width;
+  height = image->height;
+  for (int i = 0; ok && i < header.levels; i++) {
+    size_t row = (size_t) width * image->channels, stride = texcache_stride(width, image->channels);
+    ok = fseek(f, header.offset[i], SEEK_SET) == 0;
+    for (int y = 0; ok && y < height; y++, level += row)
+      ok = fwrite(level, 1, row, f) == row && fwrite(zeros, 1, stride - row, f) == stride - row;
+    // Level 0 is followed by the rest, packed, in mips
+    if (i == 0)
+      level = image->mips;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+
+  if (fclose(f) == 0 && ok && rename(tmpname, cache->filename) == 0)
+    return 1;
+  remove(tmpname);
+  return 0;
+}
+
+// Unmaps the entry of a hit that wasn't uploaded
+static inline void texcache_close(texcache_t *cache) {
+  if (cache->map)
+    munmap((void *) cache->map, cache->map_size);
+  cache->map = NULL;
+}
+
+#endif // TEXCACHE_H
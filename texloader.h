@@ -0,0 +1,509 @@
+// Copyright (C) 2021 Emilio J. Padrón
+// Released as Free Software under the X11 License
+// https://spdx.org/licenses/X11.html
+//
+// Texture loading pool: images decoded in parallel off the GL thread.
+//
+// A fixed set of worker threads takes image files from a job queue, decodes
+// them with stb_image and appends the results to a second queue, in the
+// order they finish. The GL thread pulls them with texloader_pool_next() and
+// uploads each one as soon as it arrives, so uploads overlap with the decodes
+// still running. stb_image is reentrant except for its global settings:
+// vertical flipping is set per thread (stbi_set_flip_vertically_on_load_thread)
+// so concurrent decodes don't step on each other. Each worker keeps the
+// decoder's temporary buffers in its own arena (stbi_set_thread_arena), reused
+// from one image to the next instead of going back to malloc.
+//
+// texloader_pool_submit_pbo() has the image decoded straight into a pixel
+// unpack buffer instead, mapped on the GL thread before queueing it: no
+// malloc'd copy of the pixels, and glTexImage2D reads them from the buffer.
+// texloader_tex_image() uploads either kind and releases its pixels.
+//
+// After texloader_pool_mipmaps(), images also get their mip levels built by
+// mipmap_generate() on the worker, right after decoding, using the CPUs left
+// over by the workers. texloader_tex_image() uploads every level then. For
+// a pixel buffer, mapped write-only, the image is decoded into memory first
+// and copied into it along with the levels.
+//
+// After texloader_pool_compress(), RGB and RGBA images are also compressed
+// to BC1 and BC3 by bcenc_compress() on the worker, every mip level, and
+// texloader_tex_image() uploads the blocks with glCompressedTexImage2D().
+// For a pixel buffer the blocks, not the pixels, are what's written to it.
+//
+//   texloader_pool_t loader;
+//   texloader_image_t images[N];
+//   texloader_pool_init(&loader, 0);  // 0: one worker per CPU
+//   for (int i = 0; i < N; i++)
+//     texloader_pool_submit(&loader, &images[i], filenames[i], i, 0, 1);
+//   texloader_image_t *image;
+//   while ((image = texloader_pool_next(&loader, 1))) {
+//     glBindTexture(GL_TEXTURE_2D, texture[image->id]);
+//     texloader_tex_image(image);  // or glTexImage2D() + stbi_image_free()
+//   }
+//   texloader_pool_destroy(&loader);
+//
+// stb_image.h must be included before this header.
+
+#ifndef TEXLOADER_H
+#define TEXLOADER_H
+
+#include <GL/glew.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "bcenc.h"
+#include "mipmap.h"
+
+#define TEXLOADER_MAX_THREADS 64
+#define TEXLOADER_ARENA (64 << 20) // max bytes of each worker's arena
+
+typedef struct texloader_image {
+  const char *filename;
+  int id;                 // caller's tag, e.g. index of the texture object
+  int desired_channels;   // 0: as many as the file has
+  int flip;               // flip vertically, as GL wants the first row at the bottom
+  unsigned char *data;    // decoded pixels, NULL on failure
+  int width, height, channels;
+  GLuint pbo;             // pixel unpack buffer decoded into, 0 if none
+  unsigned char *dest;    // its mapping: rows of stride bytes
+  int stride;
+  mipmap_filter_t mipmaps; // filter building the mip levels, MIPMAP_NONE for none
+  int mipmap_threads;     // threads building them, and compressing
+  unsigned char *mips;    // levels 1, 2..., NULL if not built (in the mapping for a PBO)
+  bcenc_mode_t compress;  // BC1/BC3 compression, BCENC_NONE for none
+  int compressed_levels;  // levels in data as blocks, 0 if uncompressed
+  size_t compressed_size; // bytes of them
+  double decode_ms;       // time spent decoding on the worker
+  double mipmap_ms;       // and building the mip levels
+  double compress_ms;     // and compressing them
+  double psnr;            // of level 0 once compressed, in dB
+  struct texloader_image *next; // queue link
+} texloader_image_t;
+
+typedef struct {
+  pthread_t threads[TEXLOADER_MAX_THREADS];
+  int num_threads;        // 0: no workers, images decoded on submission
+  pthread_mutex_t lock;
+  pthread_cond_t work;    // jobs queued, or quitting
+  pthread_cond_t done;    // results queued
+  texloader_image_t *jobs, *jobs_tail;       // waiting to be decoded
+  texloader_image_t *results, *results_tail; // decoded, in arrival order
+  int pending;            // submitted but not handed out yet
+  int quit;
+  mipmap_filter_t mipmaps; // for images submitted from now on
+  bcenc_mode_t compress;
+} texloader_pool_t;
+
+static inline double texloader_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// GL pixel format for a number of 8-bit channels
+static inline GLenum texloader_format(int channels) {
+  switch (channels) {
+  case 1: return GL_RED;
+  case 2: return GL_RG;
+  case 3: return GL_RGB;
+  default: return GL_RGBA;
+  }
+}
+
+// Builds the mip levels of a decoded image. One decoded into memory for a
+// pixel buffer is copied into it, followed by the levels, unless it's going
+// to be compressed
+static inline void texloader_mipmaps(texloader_image_t *image) {
+  double t0 = texloader_clock();
+  int width = image->width, height = image->height, channels = image->channels;
+  int to_pbo = image->dest && !image->compress;
+  unsigned char *chain;
+
+  if (to_pbo)
+    chain = image->dest + (size_t) image->stride * height;
+  else
+    chain = (unsigned char *) malloc(mipmap_chain_size(width, height, channels));
+
+  if (chain && mipmap_generate(image->data, width, height, channels, width * channels, chain,
+                               image->mipmaps, image->mipmap_threads))
+    image->mips = chain;
+  else if (!to_pbo)
+    free(chain);
+
+  if (to_pbo) {
+    for (int y = 0; y < height; y++)
+      memcpy(image->dest + (size_t) y * image->stride,
+             image->data + (size_t) y * width * channels, (size_t) width * channels);
+    stbi_image_free(image->data);
+    image->data = image->dest;
+  }
+  image->mipmap_ms = (texloader_clock() - t0) * 1e3;
+}
+
+// Bytes of the blocks of an image and, if it has them, its mip levels
+static inline size_t texloader_compressed_size(int width, int height, int channels, int mipmaps) {
+  int levels = mipmaps ? mipmap_levels(width, height) + 1 : 1;
+  size_t size = 0;
+  for (int i = 0; i < levels; i++) {
+    size += bcenc_size(width, height, channels);
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+  return size;
+}
+
+// Compresses a decoded image and its mip levels, all of them one after the
+// other, into its pixel buffer or memory, replacing its pixels. Left as it
+// is if out of memory
+static inline void texloader_compress(texloader_image_t *image) {
+  double t0 = texloader_clock();
+  int width = image->width, height = image->height, channels = image->channels;
+  int levels = image->mips ? mipmap_levels(width, height) + 1 : 1;
+  size_t size = texloader_compressed_size(width, height, channels, image->mips != NULL);
+  unsigned char *blocks = image->dest ? image->dest : (unsigned char *) malloc(size);
+
+  if (!blocks)
+    return;
+  const unsigned char *level = image->data;
+  unsigned char *out = blocks;
+  for (int i = 0; i < levels; i++) {
+    bcenc_compress(level, width, height, channels, width * channels, out, image->compress,
+                   image->mipmap_threads);
+    out += bcenc_size(width, height, channels);
+    level = i == 0 ? image->mips : level + (size_t) width * height * channels;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+  image->compress_ms = (texloader_clock() - t0) * 1e3;
+  image->psnr = bcenc_psnr(image->data, image->width, image->height, channels,
+                           image->width * channels, blocks);
+
+  stbi_image_free(image->data);
+  free(image->mips);
+  image->data = blocks;
+  image->mips = NULL;
+  image->compressed_levels = levels;
+  image->compressed_size = size;
+}
+
+static inline void texloader_decode(texloader_image_t *image) {
+  double t0 = texloader_clock();
+  int width = image->width, height = image->height;
+
+  stbi_set_flip_vertically_on_load_thread(image->flip);
+  if (image->dest && (image->mipmaps || image->compress)) {
+    // Must fit the buffer, sized after the header
+    image->data = stbi_load(image->filename, &image->width, &image->height,
+                            &image->channels, image->desired_channels);
+    if (image->data && (image->width != width || image->height != height)) {
+      stbi_image_free(image->data);
+      image->data = NULL;
+    }
+  } else if (image->dest) {
+    if (stbi_load_into(image->filename, image->dest, image->stride * image->height, image->stride,
+                       &image->width, &image->height, &image->channels, image->desired_channels))
+      image->data = image->dest;
+  } else {
+    image->data = stbi_load(image->filename, &image->width, &image->height,
+                            &image->channels, image->desired_channels);
+  }
+  if (image->data && image->desired_channels)
+    image->channels = image->desired_channels;
+  if (image->channels != 3 && image->channels != 4)
+    image->compress = BCENC_NONE; // only RGB and RGBA have a BC format here
+
+  image->decode_ms = (texloader_clock() - t0) * 1e3;
+  if (image->data && image->mipmaps)
+    texloader_mipmaps(image);
+  if (image->data && image->compress)
+    texloader_compress(image);
+}
+
+// Appends image to a queue. Called with the pool locked
+static inline void texloader_enqueue(texloader_image_t **head, texloader_image_t **tail,
+                                     texloader_image_t *image) {
+  image->next = NULL;
+  if (*tail)
+    (*tail)->next = image;
+  else
+    *head = image;
+  *tail = image;
+}
+
+static inline texloader_image_t *texloader_dequeue(texloader_image_t **head,
+                                                   texloader_image_t **tail) {
+  texloader_image_t *image = *head;
+  if (image) {
+    *head = image->next;
+    if (!*head)
+      *tail = NULL;
+  }
+  return image;
+}
+
+static inline void *texloader_worker(void *arg) {
+  texloader_pool_t *pool = (texloader_pool_t *) arg;
+
+  stbi_set_thread_arena(TEXLOADER_ARENA);
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->jobs && !pool->quit)
+      pthread_cond_wait(&pool->work, &pool->lock);
+    texloader_image_t *image = texloader_dequeue(&pool->jobs, &pool->jobs_tail);
+    if (!image)
+      break; // quitting, nothing left to decode
+    pthread_mutex_unlock(&pool->lock);
+
+    texloader_decode(image);
+
+    pthread_mutex_lock(&pool->lock);
+    texloader_enqueue(&pool->results, &pool->results_tail, image);
+    pthread_cond_signal(&pool->done);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  stbi_set_thread_arena(0);
+  return NULL;
+}
+
+// Starts the workers: threads of them, or one per online CPU if threads <= 0
+static inline void texloader_pool_init(texloader_pool_t *pool, int threads) {
+  memset(pool, 0, sizeof(*pool));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->done, NULL);
+
+  if (threads <= 0)
+    threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1)
+    threads = 1;
+  if (threads > TEXLOADER_MAX_THREADS)
+    threads = TEXLOADER_MAX_THREADS;
+
+  while (pool->num_threads < threads &&
+         pthread_create(&pool->threads[pool->num_threads], NULL, texloader_worker, pool) == 0)
+    pool->num_threads++;
+}
+
+// Images submitted from now on also get mip levels built with filter, or
+// none with MIPMAP_NONE (the default)
+static inline void texloader_pool_mipmaps(texloader_pool_t *pool, mipmap_filter_t filter) {
+  pool->mipmaps = filter;
+}
+
+// Images submitted from now on are also compressed in mode, if the driver
+// takes S3TC textures, or not with BCENC_NONE (the default). Returns 0 if
+// compression was asked for but isn't supported
+static inline int texloader_pool_compress(texloader_pool_t *pool, bcenc_mode_t mode) {
+  pool->compress = mode && bcenc_supported() ? mode : BCENC_NONE;
+  return pool->compress == mode;
+}
+
+// Decodes image right away without workers, otherwise queues it for them
+static inline void texloader_pool_queue(texloader_pool_t *pool, texloader_image_t *image) {
+  // Mip levels get the CPUs the workers leave, all of them without workers
+  int cpus = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  image->mipmaps = pool->mipmaps;
+  image->mipmap_threads = pool->num_threads ? cpus / pool->num_threads : cpus;
+  if (image->mipmap_threads < 1)
+    image->mipmap_threads = 1;
+  image->mips = NULL;
+  image->mipmap_ms = 0.0;
+  // A pixel buffer's channels are known already: only RGB and RGBA ones are
+  // decoded into memory to be compressed. Others once decoded
+  int channels = image->desired_channels;
+  image->compress = image->dest && channels != 3 && channels != 4 ? BCENC_NONE : pool->compress;
+  image->compressed_levels = 0;
+  image->compressed_size = 0;
+  image->compress_ms = 0.0;
+  image->psnr = 0.0;
+
+  // Without workers, decode right here
+  if (!pool->num_threads)
+    texloader_decode(image);
+
+  pthread_mutex_lock(&pool->lock);
+  if (pool->num_threads) {
+    texloader_enqueue(&pool->jobs, &pool->jobs_tail, image);
+    pthread_cond_signal(&pool->work);
+  } else {
+    texloader_enqueue(&pool->results, &pool->results_tail, image);
+  }
+  pool->pending++;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// Queues filename for decoding into image, which must stay alive until it's
+// returned by texloader_pool_next(). id is left untouched for the caller
+static inline void texloader_pool_submit(texloader_pool_t *pool, texloader_image_t *image,
+                                         const char *filename, int id,
+                                         int desired_channels, int flip) {
+  image->filename = filename;
+  image->id = id;
+  image->desired_channels = desired_channels;
+  image->flip = flip;
+  image->data = NULL;
+  image->width = image->height = image->channels = 0;
+  image->pbo = 0;
+  image->dest = NULL;
+  image->stride = 0;
+  image->decode_ms = 0.0;
+
+  texloader_pool_queue(pool, image);
+}
+
+// Like texloader_pool_submit(), but the image is decoded into a pixel unpack
+// buffer mapped here, on the GL thread, with rows aligned for the default
+// GL_UNPACK_ALIGNMENT. desired_channels 0 takes them from the file header.
+// Falls back to decoding into memory if the header can't be read or the
+// buffer mapped
+static inline void texloader_pool_submit_pbo(texloader_pool_t *pool, texloader_image_t *image,
+                                             const char *filename, int id,
+                                             int desired_channels, int flip) {
+  int width, height, channels;
+
+  if (!stbi_info(filename, &width, &height, &channels)) {
+    texloader_pool_submit(pool, image, filename, id, desired_channels, flip);
+    return;
+  }
+  if (desired_channels)
+    channels = desired_channels;
+  int stride = (width * channels + 3) & ~3;
+  GLsizeiptr size = (GLsizeiptr) stride * height;
+  if (pool->mipmaps)
+    size += mipmap_chain_size(width, height, channels);
+  if (pool->compress && (channels == 3 || channels == 4)) {
+    // Blocks of tiny levels can take more than their pixels
+    GLsizeiptr blocks = texloader_compressed_size(width, height, channels, pool->mipmaps);
+    size = blocks > size ? blocks : size;
+  }
+
+  GLuint pbo;
+  glGenBuffers(1, &pbo);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+  glBufferData(GL_PIXEL_UNPACK_BUFFER, size, NULL, GL_STREAM_DRAW);
+  void *dest = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                                GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+  glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+  if (!dest) {
+    glDeleteBuffers(1, &pbo);
+    texloader_pool_submit(pool, image, filename, id, desired_channels, flip);
+    return;
+  }
+
+  // The header's channels, asked for explicitly: what the buffer is sized for
+  image->filename = filename;
+  image->id = id;
+  image->desired_channels = channels;
+  image->flip = flip;
+  image->data = NULL;
+  image->width = width;
+  image->height = height;
+  image->channels = 0;
+  image->pbo = pbo;
+  image->dest = (unsigned char *) dest;
+  image->stride = stride;
+  image->decode_ms = 0.0;
+
+  texloader_pool_queue(pool, image);
+}
+
+// Uploads the levels of a compressed image from blocks, or the bound pixel
+// buffer if NULL. One meant to have mip levels but without them gets level
+// 0 only: glGenerateMipmap() can't build them for compressed formats
+static inline void texloader_tex_compressed(const texloader_image_t *image,
+                                            const unsigned char *blocks) {
+  GLenum format = bcenc_format(image->channels);
+  int width = image->width, height = image->height;
+
+  for (int i = 0; i < image->compressed_levels; i++) {
+    GLsizei size = (GLsizei) bcenc_size(width, height, image->channels);
+    glCompressedTexImage2D(GL_TEXTURE_2D, i, format, width, height, 0, size, blocks);
+    blocks += size;
+    width = width > 1 ? width / 2 : 1;
+    height = height > 1 ? height / 2 : 1;
+  }
+  if (image->mipmaps && image->compressed_levels == 1)
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+}
+
+// Uploads a decoded image to level 0 of the texture bound to GL_TEXTURE_2D,
+// and its mip levels if it was meant to have them (left to glGenerateMipmap()
+// if they couldn't be built), and releases its pixels. Returns 0, uploading
+// nothing, if it failed to decode
+static inline int texloader_tex_image(texloader_image_t *image) {
+  GLenum format = texloader_format(image->channels);
+
+  if (image->pbo) {
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, image->pbo);
+    if (!glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER))
+      image->data = NULL; // contents lost while mapped
+    if (image->data && image->compressed_levels) {
+      texloader_tex_compressed(image, NULL);
+    } else if (image->data) {
+      glTexImage2D(GL_TEXTURE_2D, 0, format, image->width, image->height, 0, format,
+                   GL_UNSIGNED_BYTE, NULL);
+      if (image->mips)
+        mipmap_tex_levels(format, image->width, image->height, image->channels,
+                          (const unsigned char *) (uintptr_t) (image->mips - image->dest));
+    }
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    glDeleteBuffers(1, &image->pbo);
+    image->pbo = 0;
+  } else if (image->data && image->compressed_levels) {
+    texloader_tex_compressed(image, image->data);
+    free(image->data);
+  } else if (image->data) {
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glTexImage2D(GL_TEXTURE_2D, 0, format, image->width, image->height, 0, format,
+                 GL_UNSIGNED_BYTE, image->data);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    stbi_image_free(image->data);
+    if (image->mips) {
+      mipmap_tex_levels(format, image->width, image->height, image->channels, image->mips);
+      free(image->mips);
+    }
+  }
+
+  int ok = image->data != NULL;
+  if (ok && image->mipmaps && !image->mips && !image->compressed_levels)
+    glGenerateMipmap(GL_TEXTURE_2D);
+  image->data = image->dest = image->mips = NULL;
+  return ok;
+}
+
+// Next decoded image, in arrival order (its data is NULL if decoding failed).
+// Returns NULL once every submitted image has been handed out, or if none is
+// ready yet and wait is 0
+static inline texloader_image_t *texloader_pool_next(texloader_pool_t *pool, int wait) {
+  texloader_image_t *image = NULL;
+
+  pthread_mutex_lock(&pool->lock);
+  while (pool->pending && !pool->results && wait)
+    pthread_cond_wait(&pool->done, &pool->lock);
+  if (pool->pending) {
+    image = texloader_dequeue(&pool->results, &pool->results_tail);
+    if (image)
+      pool->pending--;
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return image;
+}
+
+// Stops the workers once the job queue is drained. Images not handed out by
+// texloader_pool_next() are left as they are, their pixels still allocated
+static inline void texloader_pool_destroy(texloader_pool_t *pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->quit = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->num_threads; i++)
+    pthread_join(pool->threads[i], NULL);
+
+  pthread_cond_destroy(&pool->done);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+}
+
+#endif // TEXLOADER_H